@@ -4,7 +4,8 @@ set(EIGEN3_DIR CACHE PATH "")
 
 find_path(EIGEN3_INCLUDE_DIR
           NAMES Eigen/Core
-          PATHS ${EIGEN3_DIR})
+          PATHS ${EIGEN3_DIR}
+          PATH_SUFFIXES eigen3)
 
 find_package_handle_standard_args(Eigen3 DEFAULT_MSG EIGEN3_INCLUDE_DIR)
 
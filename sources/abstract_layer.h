@@ -5,31 +5,324 @@
 #ifndef _ABSTRACT_LAYER_H_
 #define _ABSTRACT_LAYER_H_
 
+#include <memory>
+#include <vector>
+
 #include "common.h"
+#include "workspace.h"
+
+/**
+ * Analytic cost of a forward or backward pass of a layer: floating-point operations and bytes of the matrices
+ * read or written, counting each matrix once as if it passed through the cache only once
+ * レイヤーの順伝播または逆伝播の解析的なコスト: 浮動小数点演算の回数と読み書きする行列のバイト数.
+ * 各行列はキャッシュを1回だけ通るものとして1回だけ数える
+ */
+struct LayerCost {
+    double flops = 0.0;
+    double bytes = 0.0;
+};
+
+/**
+ * Activation state of a layer: the view of its input, its output, the gradient with respect to its input, and
+ * the scratch buffers of the layer type. Layers themselves hold only their configuration and parameters, and
+ * every pass writes to a state given to it (see "AbstractLayerT::make_state"), so that several threads can
+ * run the same layer at once, each with its own state.
+ * レイヤーの活性状態: 入力のビュー, 出力, 入力についての勾配, およびレイヤーの種類に応じた作業用のバッファ.
+ * レイヤー自体は設定とパラメータのみをもち, 各計算は与えられた状態に書き込む ("AbstractLayerT::make_state"
+ * を参照). これにより複数のスレッドがそれぞれの状態で同じレイヤーを同時に実行できる
+ */
+template <typename Scalar>
+struct LayerStateT : private Uncopyable {
+    using Buffer = BufferT<Scalar>;
+    using View = ViewT<Scalar>;
+
+    virtual ~LayerStateT() {
+    }
+
+    /**
+     * Append the buffers of the state to "list", so that they can be placed in a workspace arena. States with
+     * scratch buffers append them as well.
+     * 作業領域のアリーナに配置できるよう, 状態のバッファを"list"に追加する. 作業用のバッファをもつ状態は
+     * それも追加する
+     */
+    virtual void buffers(std::vector<Buffer *> &list) {
+        list.push_back(&output);
+        list.push_back(&dLdx);
+    }
+
+    // View of the input, which is usually the output of the previous layer and is not copied
+    // 入力のビュー. 入力は通常は前のレイヤーの出力であり, コピーはしない
+    View input;
+    Buffer output;
+    // Gradient with respect to the input, returned by "backward"
+    // 入力についての勾配. "backward"が返す
+    Buffer dLdx;
+    // Whether "forward" keeps what "backward" needs (see "AbstractLayerT::set_training")
+    // "forward"で"backward"に必要なものを保持するかどうか ("AbstractLayerT::set_training"を参照)
+    bool training = true;
+};
 
 /**
- * @brief: Base class for neural network layers.
+ * @brief: Base class for neural network layers. Each layer owns a state of its own, on which the passes
+ * without a state argument run (e.g., in training).
+ * ニューラルネットのレイヤーの基底クラス. 各レイヤーは自身の状態をもち, 状態を引数にとらない計算
+ * (学習時など) はその上で実行する
  */
-class AbstractLayer : private Uncopyable {
+template <typename Scalar>
+class AbstractLayerT : private Uncopyable {
+public:
+    using Matrix = MatrixT<Scalar>;
+    using MatrixMap = MatrixMapT<Scalar>;
+    using MatrixRef = MatrixRefT<Scalar>;
+    using Buffer = BufferT<Scalar>;
+    using View = ViewT<Scalar>;
+    using LayerState = LayerStateT<Scalar>;
+
 protected:
-    Matrix input_ = {};
-    Matrix output_ = {};
+    // Whether "backward" adds the parameter gradients to the current ones (see "set_accumulate")
+    // "backward"でパラメータの勾配を現在のものに足し込むかどうか ("set_accumulate"を参照)
+    bool accumulate_ = false;
+    // Whether "backward" computes the gradient with respect to the input (see "set_propagate")
+    // "backward"で入力についての勾配を計算するかどうか ("set_propagate"を参照)
+    bool propagate_ = true;
 
 public:
-    AbstractLayer() {
+    AbstractLayerT() {
     }
-    virtual ~AbstractLayer() {
+    virtual ~AbstractLayerT() {
     }
 
-    virtual const Matrix &forward(const Matrix &input) = 0;
-    virtual Matrix backward(const Matrix &error, double lr = 0.1, double momentum = 0.5) = 0;
+    /**
+     * New state for the passes of this layer. Layers with scratch buffers return states derived from
+     * "LayerStateT", which their passes cast back.
+     * このレイヤーの計算のための新しい状態. 作業用のバッファをもつレイヤーは"LayerStateT"の派生を返し,
+     * 計算の中でそれにキャストし直す
+     */
+    virtual std::unique_ptr<LayerState> make_state() const {
+        return std::unique_ptr<LayerState>(new LayerState());
+    }
+
+    /**
+     * Forward computation writing only to "state", which must be made by "make_state" of this layer. The
+     * layer is only read, hence threads with their own states can run it at once.
+     * "state"にのみ書き込む順伝搬. "state"はこのレイヤーの"make_state"で作ったものでなければならない.
+     * レイヤーは読まれるだけなので, それぞれの状態をもつスレッドが同時に実行できる
+     */
+    virtual const MatrixMap &forward(const MatrixRef &input, LayerState &state) const = 0;
+
+    /**
+     * Backward computation, which returns the gradient with respect to the input. Layers with parameters
+     * also compute the gradients with respect to them, which are applied by an optimizer. "state" must be
+     * the one of the last forward.
+     * 逆伝搬. 入力についての勾配を返す. パラメータをもつレイヤーはそれについての勾配も計算し, それは
+     * 最適化手法が適用する. "state"は直前の順伝搬のものでなければならない
+     */
+    virtual const MatrixMap &backward(const MatrixRef &error, LayerState &state) = 0;
+
+    /**
+     * Forward computation overwriting "input" with the output. Element-wise layers whose backward only needs
+     * the output (e.g., ReLU) override this to avoid a buffer for their output, and the network calls it
+     * when the previous layer does not need its own output in backward (see "needs_output").
+     * 出力で"input"を上書きする順伝搬. 逆伝搬に出力しか使わない要素ごとのレイヤー (ReLUなど) は出力用の
+     * バッファを省くためにこれをオーバーライドし, ネットワークは前のレイヤーが逆伝搬に自身の出力を
+     * 必要としない場合にこれを呼ぶ ("needs_output"を参照)
+     */
+    virtual const MatrixMap &forward_in_place(MatrixMap &input, LayerState &state) const {
+        return forward(input, state);
+    }
+    virtual bool in_place() const {
+        return false;
+    }
+
+    /**
+     * Refresh what the layer derives from its parameters (e.g., packed kernels), which the passes only read.
+     * Passes on the own state call this first, since an optimizer may have updated the parameters since the
+     * last one, while passes on other states rely on the network to call this once (see "NetworkT::prepare").
+     * レイヤーがパラメータから導出するもの (並べ替えたカーネルなど) を更新する. 計算はそれを読むだけである.
+     * 前回から最適化手法がパラメータを更新しているかもしれないので, 自身の状態での計算は最初にこれを呼ぶ.
+     * 他の状態での計算はネットワークが一度呼ぶことを前提とする ("NetworkT::prepare"を参照)
+     */
+    virtual void prepare() {
+    }
 
-    inline const Matrix &input() const {
-        return input_;
+    // Passes on the own state of the layer
+    // レイヤー自身の状態での計算
+    const MatrixMap &forward(const MatrixRef &input) {
+        prepare();
+        return forward(input, state());
     }
-    inline const Matrix &output() const {
-        return output_;
+    const MatrixMap &backward(const MatrixRef &error) {
+        return backward(error, state());
+    }
+    const MatrixMap &forward_in_place(MatrixMap &input) {
+        prepare();
+        return forward_in_place(input, state());
+    }
+
+    /**
+     * Whether backward reads the output, which the next layer must not overwrite then.
+     * 逆伝搬で出力を読むかどうか. その場合, 次のレイヤーは出力を上書きしてはならない
+     */
+    virtual bool needs_output() const {
+        return false;
+    }
+
+    /**
+     * Shape of the input the layer takes, which is any shape for element-wise layers. The network checks it
+     * against the output of the previous layer only once, when it is compiled (see "Shape::accepts").
+     * レイヤーが受け取る入力の形状. 要素ごとのレイヤーでは任意の形状である. ネットワークはコンパイル時に
+     * 一度だけ, 前のレイヤーの出力と照合する ("Shape::accepts"を参照)
+     */
+    virtual Shape input_shape() const {
+        return Shape();
+    }
+
+    /**
+     * Shape of the output for an input of "input"
+     * 入力の形状が"input"のときの出力の形状
+     */
+    virtual Shape output_shape(const Shape &input) const {
+        return input;
     }
+
+    /**
+     * Select the computation method for the shapes of the layer, for training or only for inference. The
+     * network calls this once when it is compiled, and layers with a single method do nothing.
+     * レイヤーの形状に合った計算方法を, 学習用または推論専用として選ぶ. ネットワークがコンパイル時に一度だけ
+     * 呼び, 計算方法が1つしかないレイヤーは何もしない
+     */
+    virtual void select_kernel(bool training) {
+    }
+
+    /**
+     * Fused layer computing this layer, which is "layers[i]", and some of the layers following it in a single
+     * pass. The number of the fused layers including this one is set to "n_fused". Layers which have no fused
+     * versions return nullptr.
+     * このレイヤー ("layers[i]") とそれに続くいくつかのレイヤーを1回で計算する融合したレイヤー. このレイヤーを
+     * 含めて融合したレイヤーの数を"n_fused"に設定する. 融合版のないレイヤーはnullptrを返す
+     */
+    virtual std::shared_ptr<AbstractLayerT> fuse(const std::vector<std::shared_ptr<AbstractLayerT>> &layers, int i,
+                                                 int &n_fused) const {
+        n_fused = 1;
+        return nullptr;
+    }
+
+    /**
+     * Switch the own state between training and inference modes. In inference mode, layers skip the state
+     * kept only for backward (e.g., positions of maxima in max pooling), and "backward" must not be called.
+     * 自身の状態を学習モードと推論モードで切り替える. 推論モードでは, レイヤーは逆伝播のためだけに保持する
+     * 状態 (最大値プーリングの最大値の位置など) を省き, "backward"は呼んではならない
+     */
+    void set_training(bool training) {
+        state().training = training;
+    }
+    bool training() const {
+        return state().training;
+    }
+
+    /**
+     * Switch whether "backward" adds the gradients of the parameters to the current ones instead of
+     * overwriting them, so that the gradients of several micro-batches sum up to those of their whole batch.
+     * "backward"がパラメータの勾配を上書きせずに現在のものに足し込むかどうかを切り替える. これにより
+     * 複数のマイクロバッチの勾配の和がそれらを合わせたバッチの勾配となる
+     */
+    void set_accumulate(bool accumulate) {
+        accumulate_ = accumulate;
+    }
+    bool accumulate() const {
+        return accumulate_;
+    }
+
+    /**
+     * Switch whether "backward" computes the gradient with respect to the input. The network turns it off for
+     * its first layer with parameters, whose input gradient is never used, so that it costs neither time nor
+     * a buffer. "backward" then returns an empty gradient.
+     * "backward"で入力についての勾配を計算するかどうかを切り替える. ネットワークは入力の勾配が使われない
+     * 最初のパラメータをもつレイヤーでこれを無効にするので, その計算時間もバッファも不要になる. その場合
+     * "backward"は空の勾配を返す
+     */
+    void set_propagate(bool propagate) {
+        propagate_ = propagate;
+    }
+    bool propagate() const {
+        return propagate_;
+    }
+
+    /**
+     * Name of the layer type for reports (e.g., the profiler)
+     * 報告 (プロファイラなど) のためのレイヤーの種類の名前
+     */
+    virtual const char *name() const {
+        return "Layer";
+    }
+
+    /**
+     * Cost of the last forward or "backward" pass on the own state computed from the shapes of its input and
+     * output. The default is that of an element-wise layer, which reads the input (and the output gradient)
+     * and writes the output (or the input gradient) with an operation per element.
+     * 自身の状態での直前の順伝播または逆伝播 ("backward") のコストを入出力の形状から求める. 既定では要素ごとの
+     * レイヤーのコストとする. すなわち入力 (と出力の勾配) を読み, 要素毎に1回の演算で出力 (または入力の
+     * 勾配) を書く
+     */
+    virtual LayerCost cost(bool backward) const {
+        const double n_input = (double)input().size();
+        const double n_output = (double)output().size();
+        LayerCost cost;
+        cost.flops = backward ? n_input : n_output;
+        cost.bytes = (backward ? n_input + 2.0 * n_output : n_input + n_output) * sizeof(Scalar);
+        return cost;
+    }
+
+    /**
+     * Append the parameters, their gradients computed by "backward", and their names to "list". Names are
+     * unique within the layer. Layers without parameters append nothing.
+     * パラメータと"backward"で計算したその勾配, およびその名前を"list"に追加する. 名前はレイヤー内で一意で
+     * ある. パラメータのないレイヤーは何も追加しない
+     */
+    virtual void parameters(std::vector<NamedParameterT<Scalar>> &list) {
+    }
+
+    inline const View &input() const {
+        return state().input;
+    }
+    inline const MatrixMap &output() const {
+        return state().output;
+    }
+    inline MatrixMap &output() {
+        return state().output;
+    }
+
+    /**
+     * Append the buffers of the own state to "list", so that the network can place them in its workspace
+     * arena
+     * ネットワークが作業領域のアリーナに配置できるよう, 自身の状態のバッファを"list"に追加する
+     */
+    void buffers(std::vector<Buffer *> &list) {
+        state().buffers(list);
+    }
+
+    /**
+     * Own state of the layer. Since "make_state" is virtual, the non-const accessor makes it on the first use,
+     * and the network makes it for each layer it takes. The const accessors, which several threads may call
+     * at once, only read it.
+     * レイヤー自身の状態. "make_state"は仮想関数なので, 非constのアクセサが最初に使うときに作り, ネットワークは
+     * 受け取った各レイヤーについて作る. 複数のスレッドが同時に呼びうるconstのアクセサは読むだけである
+     */
+    LayerState &state() {
+        if (!state_) {
+            state_ = make_state();
+        }
+        return *state_;
+    }
+    const LayerState &state() const {
+        Assertion(state_ != nullptr, "own state of the layer is not made yet!!");
+        return *state_;
+    }
+
+private:
+    std::unique_ptr<LayerState> state_ = nullptr;
 };
 
+using AbstractLayer = AbstractLayerT<ScalarType>;
+
 #endif  // _ABSTRACT_LAYER_H_
@@ -5,40 +5,111 @@
 #ifndef _ACTIVATION_H_
 #define _ACTIVATION_H_
 
+#include <cmath>
+
 #include "abstract_layer.h"
 
+/**
+ * Element-wise activation applied at the end of fused layers
+ * ZC[̍ŌɓKpvfƂ̊֐
+ */
+enum class Activation {
+    Identity,
+    ReLU,
+    Sigmoid,
+};
+
+template <typename Scalar>
+inline Scalar activate(Activation activation, Scalar x) {
+    switch (activation) {
+    case Activation::ReLU:
+        return x > (Scalar)0.0 ? x : (Scalar)0.0;
+    case Activation::Sigmoid:
+        return (Scalar)1.0 / ((Scalar)1.0 + std::exp(-x));
+    default:
+        return x;
+    }
+}
+
+/**
+ * Derivative of the activation, which is computed from the output "y" as in "ReLUT" and "SigmoidT"
+ * ֐̔. "ReLUT""SigmoidT"Ɠlɏo"y"vZ
+ */
+template <typename Scalar>
+inline Scalar activation_slope(Activation activation, Scalar y) {
+    switch (activation) {
+    case Activation::ReLU:
+        return y > (Scalar)0.0 ? (Scalar)1.0 : (Scalar)0.0;
+    case Activation::Sigmoid:
+        return y * ((Scalar)1.0 - y);
+    default:
+        return (Scalar)1.0;
+    }
+}
+
 /**
  * ReLU activation function
  * ReLU ֐
  */
-class ReLU : public AbstractLayer {
+template <typename Scalar>
+class ReLUT : public AbstractLayerT<Scalar> {
 public:
+    using Matrix = MatrixT<Scalar>;
+    using MatrixMap = MatrixMapT<Scalar>;
+    using MatrixRef = MatrixRefT<Scalar>;
+    using LayerState = LayerStateT<Scalar>;
+    using AbstractLayerT<Scalar>::forward;
+    using AbstractLayerT<Scalar>::backward;
+    using AbstractLayerT<Scalar>::forward_in_place;
+
     // Public methods
-    ReLU()
-        : AbstractLayer() {
+    ReLUT()
+        : AbstractLayerT<Scalar>() {
+    }
+
+    virtual ~ReLUT() {
+    }
+
+    const char *name() const override {
+        return "ReLU";
+    }
+
+    const MatrixMap &forward(const MatrixRef &input, LayerState &state) const override {
+        state.input.bind(input);
+        state.output = input.cwiseMax(0.0);
+        return state.output;
+    }
+
+    const MatrixMap &forward_in_place(MatrixMap &input, LayerState &state) const override {
+        state.input.bind(input);
+        input = input.cwiseMax(0.0);
+        state.output.share(input);
+        return state.output;
     }
 
-    virtual ~ReLU() {
+    bool in_place() const override {
+        return true;
     }
 
-    const Matrix &forward(const Matrix &input) override {
-        input_ = input;
-        output_ = input.cwiseMax(0.0);
-        return output_;
+    bool needs_output() const override {
+        return true;
     }
 
-    Matrix backward(const Matrix &dLdy, double lr = 0.1, double momentum = 0.5) override {
-        Matrix dLdx(input_.rows(), input_.cols());
-        for (int b = 0; b < input_.rows(); b++) {
-            for (int i = 0; i < input_.cols(); i++) {
-                if (input_(b, i) >= 0.0) {
-                    dLdx(b, i) = dLdy(b, i);
+    // The gradient is taken from the output, which is positive exactly where the input is, so that it is
+    // also available when the input has been overwritten in place.
+    // z͏o͂狁߂. o͓͂͂Ɠʒuł̂ݐȂ̂, ͂̏ŏ㏑ꂽꍇɂg
+    const MatrixMap &backward(const MatrixRef &dLdy, LayerState &state) override {
+        state.dLdx.resize(state.output.rows(), state.output.cols());
+        for (int b = 0; b < state.output.rows(); b++) {
+            for (int i = 0; i < state.output.cols(); i++) {
+                if (state.output(b, i) > 0.0) {
+                    state.dLdx(b, i) = dLdy(b, i);
                 } else {
-                    dLdx(b, i) = 0.0;
+                    state.dLdx(b, i) = 0.0;
                 }
             }
         }
-        return dLdx;
+        return state.dLdx;
     }
 };
 
@@ -46,25 +117,55 @@ public:
  * Sigmoid activation function
  * VOCh֐
  */
-class Sigmoid : public AbstractLayer {
+template <typename Scalar>
+class SigmoidT : public AbstractLayerT<Scalar> {
 public:
+    using Matrix = MatrixT<Scalar>;
+    using MatrixMap = MatrixMapT<Scalar>;
+    using MatrixRef = MatrixRefT<Scalar>;
+    using LayerState = LayerStateT<Scalar>;
+    using AbstractLayerT<Scalar>::forward;
+    using AbstractLayerT<Scalar>::backward;
+    using AbstractLayerT<Scalar>::forward_in_place;
+
     // Public methods
-    Sigmoid()
-        : AbstractLayer() {
+    SigmoidT()
+        : AbstractLayerT<Scalar>() {
+    }
+
+    virtual ~SigmoidT() {
+    }
+
+    const char *name() const override {
+        return "Sigmoid";
+    }
+
+    const MatrixMap &forward(const MatrixRef &input, LayerState &state) const override {
+        state.input.bind(input);
+        state.output.resize(input.rows(), input.cols());
+        state.output.array() = (Scalar)1.0 / ((Scalar)1.0 + (-input).array().exp());
+        return state.output;
+    }
+
+    const MatrixMap &forward_in_place(MatrixMap &input, LayerState &state) const override {
+        state.input.bind(input);
+        input.array() = (Scalar)1.0 / ((Scalar)1.0 + (-input).array().exp());
+        state.output.share(input);
+        return state.output;
     }
 
-    virtual ~Sigmoid() {
+    bool in_place() const override {
+        return true;
     }
 
-    const Matrix &forward(const Matrix &input) override {
-        input_ = input;
-        output_ = 1.0 / (1.0 + (-input).array().exp());
-        return output_;
+    bool needs_output() const override {
+        return true;
     }
 
-    Matrix backward(const Matrix &dLdy, double lr = 0.1, double momentum = 0.5) override {
-        const Matrix dydx = output_.array() * (1.0 - output_.array());
-        return dLdy.cwiseProduct(dydx);
+    const MatrixMap &backward(const MatrixRef &dLdy, LayerState &state) override {
+        state.dLdx.resize(dLdy.rows(), dLdy.cols());
+        state.dLdx.array() = dLdy.array() * state.output.array() * ((Scalar)1.0 - state.output.array());
+        return state.dLdx;
     }
 };
 
@@ -72,50 +173,77 @@ public:
  * Softmax activation function (row-wise operation)
  * \tg}bNX֐ (sƂɓKp)
  */
-class Softmax : public AbstractLayer {
+template <typename Scalar>
+class SoftmaxT : public AbstractLayerT<Scalar> {
 public:
+    using Matrix = MatrixT<Scalar>;
+    using MatrixMap = MatrixMapT<Scalar>;
+    using MatrixRef = MatrixRefT<Scalar>;
+    using LayerState = LayerStateT<Scalar>;
+    using AbstractLayerT<Scalar>::forward;
+    using AbstractLayerT<Scalar>::backward;
+
     // Public methods
-    Softmax() {
+    SoftmaxT() {
     }
 
-    virtual ~Softmax() {
+    virtual ~SoftmaxT() {
     }
 
-    const Matrix &forward(const Matrix &input) override {
+    const char *name() const override {
+        return "Softmax";
+    }
+
+    // Backward multiplies the output gradient of each sample with the full Jacobian of the softmax
+    // t`dł͊eTv̏o͂̌zɃ\tg}bNX̃RrsŜ|
+    LayerCost cost(bool backward) const override {
+        LayerCost cost = AbstractLayerT<Scalar>::cost(backward);
+        if (backward) {
+            cost.flops = 2.0 * this->output().size() * this->output().cols();
+        }
+        return cost;
+    }
+
+    const MatrixMap &forward(const MatrixRef &input, LayerState &state) const override {
         const int dims = (int)input.cols();
-        input_ = input;
+        state.input.bind(input);
 
         // To increase numerical precision, inputs are divided by their max value
         // lvZ̐xコ邽߂ɁA͂̒l̍őlŗ\ߊZĂ
-        const Matrix cwiseMax = input.rowwise().maxCoeff().replicate(1, dims);
-        const Matrix normalized = input.cwiseQuotient(cwiseMax);
-        const Matrix numer = normalized.array().exp().matrix();
-        const Matrix denom = numer.rowwise().sum().replicate(1, dims);
-        output_ = numer.cwiseQuotient(denom);
-        return output_;
+        state.output.resize(input.rows(), dims);
+        for (int b = 0; b < input.rows(); b++) {
+            const Scalar maxval = input.row(b).maxCoeff();
+            state.output.row(b).array() = (input.row(b).array() / maxval).exp();
+            state.output.row(b) /= state.output.row(b).sum();
+        }
+        return state.output;
     }
 
-    Matrix backward(const Matrix &dLdy, double lr = 0.1, double momentum = 0.5) override {
+    bool needs_output() const override {
+        return true;
+    }
+
+    const MatrixMap &backward(const MatrixRef &dLdy, LayerState &state) override {
         const int batchsize = (int)dLdy.rows();
         const int dims = (int)dLdy.cols();
 
-        Matrix dLdx(batchsize, dims);
+        state.dLdx.resize(batchsize, dims);
         for (int b = 0; b < batchsize; b++) {
             for (int i = 0; i < dims; i++) {
-                dLdx(b, i) = 0.0;
+                state.dLdx(b, i) = 0.0;
                 for (int j = 0; j < dims; j++) {
                     double m;
                     if (i == j) {
-                        m = output_(b, i) * (1.0 - output_(b, j));
+                        m = state.output(b, i) * (1.0 - state.output(b, j));
                     } else {
-                        m = -output_(b, i) * output_(b, j);
+                        m = -state.output(b, i) * state.output(b, j);
                     }
-                    dLdx(b, i) += dLdy(b, j) * m;
+                    state.dLdx(b, i) += dLdy(b, j) * m;
                 }
             }
         }
 
-        return dLdx;
+        return state.dLdx;
     }
 };
 
@@ -123,51 +251,97 @@ public:
  * Log-softmax activation function (row-wise operation)
  * ΐ\tg}bNX֐ (sƂɓKp)
  */
-class LogSoftmax : public AbstractLayer {
+template <typename Scalar>
+class LogSoftmaxT : public AbstractLayerT<Scalar> {
 public:
+    using Matrix = MatrixT<Scalar>;
+    using MatrixMap = MatrixMapT<Scalar>;
+    using MatrixRef = MatrixRefT<Scalar>;
+    using LayerState = LayerStateT<Scalar>;
+    using AbstractLayerT<Scalar>::forward;
+    using AbstractLayerT<Scalar>::backward;
+
     // Public methods
-    LogSoftmax() {
+    LogSoftmaxT() {
     }
 
-    virtual ~LogSoftmax() {
+    virtual ~LogSoftmaxT() {
     }
 
-    const Matrix &forward(const Matrix &input) override {
+    const char *name() const override {
+        return "LogSoftmax";
+    }
+
+    // Backward multiplies the output gradient of each sample with the full Jacobian of the softmax
+    // t`dł͊eTv̏o͂̌zɃ\tg}bNX̃RrsŜ|
+    LayerCost cost(bool backward) const override {
+        LayerCost cost = AbstractLayerT<Scalar>::cost(backward);
+        if (backward) {
+            cost.flops = 2.0 * this->output().size() * this->output().cols();
+        }
+        return cost;
+    }
+
+    const MatrixMap &forward(const MatrixRef &input, LayerState &state) const override {
         const int dims = (int)input.cols();
-        input_ = input;
+        state.input.bind(input);
 
         // To avoid loss of trailing digits, inputs are subtracted by their max value
         // 񗎂덷h߂ɁA͂̒l̍őlŗ\߈ZĂ
-        const Matrix cwiseMax = input.rowwise().maxCoeff().replicate(1, dims);
-        const Matrix diff = input - cwiseMax;
-        const Matrix sumexpDiff = diff.array().exp().matrix().rowwise().sum();
-        const Matrix logsumexp = sumexpDiff.array().log().matrix().replicate(1, dims) + cwiseMax;
-        output_ = input - logsumexp;
-        return output_;
+        state.output.resize(input.rows(), dims);
+        for (int b = 0; b < input.rows(); b++) {
+            const Scalar maxval = input.row(b).maxCoeff();
+            const Scalar logsumexp = std::log((input.row(b).array() - maxval).exp().sum()) + maxval;
+            state.output.row(b).array() = input.row(b).array() - logsumexp;
+        }
+        return state.output;
     }
 
-    Matrix backward(const Matrix &dLdy, double lr = 0.1, double momentum = 0.5) override {
+    bool needs_output() const override {
+        return true;
+    }
+
+    const MatrixMap &backward(const MatrixRef &dLdy, LayerState &state) override {
         const int batchsize = (int)dLdy.rows();
         const int dims = (int)dLdy.cols();
 
-        Matrix dLdx(batchsize, dims);
+        state.dLdx.resize(batchsize, dims);
         for (int b = 0; b < batchsize; b++) {
             for (int i = 0; i < dims; i++) {
-                dLdx(b, i) = 0.0;
+                state.dLdx(b, i) = 0.0;
                 for (int j = 0; j < dims; j++) {
                     double m;
                     if (i == j) {
-                        m = 1.0 - exp(output_(b, i));
+                        m = 1.0 - exp(state.output(b, i));
                     } else {
-                        m = -exp(output_(b, i));
+                        m = -exp(state.output(b, i));
                     }
-                    dLdx(b, i) += dLdy(b, j) * m;
+                    state.dLdx(b, i) += dLdy(b, j) * m;
                 }
             }
         }
 
-        return dLdx;
+        return state.dLdx;
     }
 };
 
+using ReLU = ReLUT<ScalarType>;
+using Sigmoid = SigmoidT<ScalarType>;
+using Softmax = SoftmaxT<ScalarType>;
+using LogSoftmax = LogSoftmaxT<ScalarType>;
+
+/**
+ * Activation computed by "layer", or "Activation::Identity" if it is not an activation layer to be fused
+ * "layer"vZ銈֐. Z̑ΏۂƂȂ銈֐̃C[łȂꍇ"Activation::Identity"
+ */
+template <typename Scalar>
+inline Activation activation_of(const AbstractLayerT<Scalar> *layer) {
+    if (dynamic_cast<const ReLUT<Scalar> *>(layer)) {
+        return Activation::ReLU;
+    } else if (dynamic_cast<const SigmoidT<Scalar> *>(layer)) {
+        return Activation::Sigmoid;
+    }
+    return Activation::Identity;
+}
+
 #endif  // _ACTIVATION_H_
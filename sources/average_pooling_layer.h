@@ -7,117 +7,161 @@
 
 #include <vector>
 
-#include "openmp.h"
+#include "parallel.h"
 #include "random.h"
 #include "abstract_layer.h"
 
-class AveragePoolingLayer : public AbstractLayer {
+template <typename Scalar>
+class AveragePoolingLayerT : public AbstractLayerT<Scalar> {
 public:
+    using Matrix = MatrixT<Scalar>;
+    using MatrixMap = MatrixMapT<Scalar>;
+    using MatrixRef = MatrixRefT<Scalar>;
+    using LayerState = LayerStateT<Scalar>;
+    using AbstractLayerT<Scalar>::forward;
+    using AbstractLayerT<Scalar>::backward;
+
     // Public methods
-    AveragePoolingLayer(Size input_size, Size pool_size, int n_channels)
-        : AbstractLayer()
+    AveragePoolingLayerT(Size input_size, Size pool_size, int n_channels)
+        : AveragePoolingLayerT(input_size, pool_size, n_channels, pool_size) {
+    }
+
+    AveragePoolingLayerT(Size input_size, Size pool_size, int n_channels, Size stride)
+        : AbstractLayerT<Scalar>()
         , input_size_(input_size)
         , pool_size_(pool_size)
+        , stride_(stride)
         , output_size_()
         , n_channels_(n_channels) {
-        Assertion(input_size_.rows % pool_size_.rows == 0 && input_size_.cols % pool_size_.cols == 0,
-                  "input size and pool size are not compatible!!");
+        Assertion(pool_size_.rows <= input_size_.rows && pool_size_.cols <= input_size_.cols,
+                  "pool size is larger than input size!!");
+        Assertion(stride_.rows > 0 && stride_.cols > 0, "stride must be positive!!");
+
+        // Pixels at the bottom/right which do not fill a whole window are dropped
+        // 窓全体を満たさない下端/右端の画素は使われない
+        output_size_.rows = (input_size_.rows - pool_size_.rows) / stride_.rows + 1;
+        output_size_.cols = (input_size_.cols - pool_size_.cols) / stride_.cols + 1;
+    }
 
-        output_size_.rows = input_size_.rows / pool_size_.rows;
-        output_size_.cols = input_size_.cols / pool_size_.cols;
+    virtual ~AveragePoolingLayerT() {
+    }
 
-        // Initialize bipartite graph between input and output
-        // 入出力画素の接続を表す二部グラフの初期化
-        edges_o2i.resize(output_size_.total() * n_channels);
-        initialize();
+    const char *name() const override {
+        return "AveragePooling";
     }
 
-    virtual ~AveragePoolingLayer() {
+    // Both directions take an addition per pixel of each window and a division per window. Forward reads the
+    // input and writes the output, while backward reads the output gradient, zeroes "dLdx" in a pass of its
+    // own, and adds the gradients of the windows to it.
+    // 両方向とも窓の画素毎に1回加算し, 窓毎に1回除算する. 順伝播は入力を読んで出力を書き, 逆伝播は出力の
+    // 勾配を読み, "dLdx"を別の走査でゼロにしてから窓の勾配を足し込む
+    LayerCost cost(bool backward) const override {
+        const double n_input = (double)this->input().size();
+        const double n_output = (double)this->output().size();
+        LayerCost cost;
+        cost.flops = n_output * (pool_size_.total() + 1.0);
+        cost.bytes = (backward ? n_output + 2.0 * n_input : n_input + n_output) * sizeof(Scalar);
+        return cost;
     }
 
-    const Matrix &forward(const Matrix &input) override {
+    Shape input_shape() const override {
+        return Shape(n_channels_, input_size_);
+    }
+    Shape output_shape(const Shape &input) const override {
+        return Shape(n_channels_, output_size_);
+    }
+
+    const MatrixMap &forward(const MatrixRef &input, LayerState &state) const override {
         const int batchsize = (int)input.rows();
-        const int n_output = output_size_.total() * n_channels_;
-
-        input_ = input;
-        output_ = Matrix::Zero(batchsize, n_output);
-        OMP_PARALLEL_FOR(int b = 0; b < batchsize; b++) {
-            for (int o = 0; o < n_output; o++) {
-                double accum = 0.0;
-                for (int e = 0; e < edges_o2i[o].size(); e++) {
-                    Edge &edge = edges_o2i[o][e];
-                    accum += input(b, edge.to);
+        const int n_pixels = output_size_.total();
+
+        state.input.bind(input);
+        state.output.resize(batchsize, n_pixels * n_channels_);
+
+        // Parallelize over (sample, channel) tiles in a single parallel loop
+        // (サンプル, チャンネル) のタイルについて1つの並列ループで並列化する
+        parallel_for(0, batchsize * n_channels_, [&](int tile) {
+            const int b = tile / n_channels_;
+            const int c = tile % n_channels_;
+            for (int p = 0; p < n_pixels; p++) {
+                const int origin = window_origin(c, p);
+                Scalar accum = 0.0;
+                for (int dy = 0; dy < pool_size_.rows; dy++) {
+                    for (int dx = 0; dx < pool_size_.cols; dx++) {
+                        accum += input(b, origin + dy * input_size_.cols + dx);
+                    }
                 }
-                output_(b, o) = accum / pool_size_.total();
+                state.output(b, c * n_pixels + p) = accum / pool_size_.total();
             }
-        }
+        });
 
-        return output_;
+        return state.output;
     }
 
-    Matrix backward(const Matrix &dLdy, double lr = 0.1, double momentum = 0.5) override {
+    const MatrixMap &backward(const MatrixRef &dLdy, LayerState &state) override {
         const int batchsize = (int)dLdy.rows();
         const int n_input = input_size_.total() * n_channels_;
-        const int n_output = output_size_.total() * n_channels_;
-
-        Matrix dLdx = Matrix::Zero(batchsize, n_input);
-        OMP_PARALLEL_FOR(int b = 0; b < batchsize; b++) {
-            for (int o = 0; o < n_output; o++) {
-                for (int e = 0; e < edges_o2i[o].size(); e++) {
-                    Edge &edge = edges_o2i[o][e];
-                    OMP_ATOMIC(dLdx(b, edge.to) += dLdy(b, o) / pool_size_.total());
+        const int n_pixels = output_size_.total();
+
+        // Overlapping windows of a tile are written only by the thread processing the tile,
+        // hence no atomics are needed
+        // 重なり合う窓もタイル内ではそのタイルを処理するスレッドのみが書き込むので, アトミック操作は不要
+        state.dLdx.resize(batchsize, n_input);
+        state.dLdx.setZero();
+        parallel_for(0, batchsize * n_channels_, [&](int tile) {
+            const int b = tile / n_channels_;
+            const int c = tile % n_channels_;
+            for (int p = 0; p < n_pixels; p++) {
+                const int origin = window_origin(c, p);
+                const Scalar delta = dLdy(b, c * n_pixels + p) / pool_size_.total();
+                for (int dy = 0; dy < pool_size_.rows; dy++) {
+                    for (int dx = 0; dx < pool_size_.cols; dx++) {
+                        state.dLdx(b, origin + dy * input_size_.cols + dx) += delta;
+                    }
                 }
             }
-        }
+        });
 
-        return dLdx;
+        return state.dLdx;
     }
 
-private:
-    // Private internal classes
-    struct Edge {
-        int to = 0;
-
-        Edge(int to_)
-            : to(to_) {
-        }
-    };
-
-    // Private methods
-    void initialize() {
-        for (int f = 0; f < n_channels_; f++) {
-            for (int yout = 0; yout < output_size_.rows; yout++) {
-                for (int xout = 0; xout < output_size_.cols; xout++) {
-                    initialize_edges(f, yout, xout);
-                }
-            }
-        }
+    Size input_size() const {
+        return input_size_;
     }
-
-    void initialize_edges(int f, int yout, int xout) {
-        for (int dy = 0; dy < pool_size_.rows; dy++) {
-            for (int dx = 0; dx < pool_size_.cols; dx++) {
-                int yin = yout * pool_size_.rows + dy;
-                int xin = xout * pool_size_.cols + dx;
-
-                int input_index = f * input_size_.total() + (yin * input_size_.cols + xin);
-                int output_index = f * output_size_.total() + (yout * output_size_.cols + xout);
-                add_edge(input_index, output_index);
-            }
-        }
+    Size pool_size() const {
+        return pool_size_;
+    }
+    Size stride() const {
+        return stride_;
+    }
+    Size output_size() const {
+        return output_size_;
     }
+    int channels() const {
+        return n_channels_;
+    }
+
+private:
+    // Private methods
 
-    void add_edge(int in, int out) {
-        edges_o2i[out].emplace_back(in);
+    /**
+     * Input index of the top-left pixel of the window for output pixel "p" in channel "c"
+     * チャンネル"c"の出力画素"p"に対応する窓の左上の入力画素の番号
+     */
+    int window_origin(int c, int p) const {
+        const int yin = (p / output_size_.cols) * stride_.rows;
+        const int xin = (p % output_size_.cols) * stride_.cols;
+        return c * input_size_.total() + yin * input_size_.cols + xin;
     }
 
     // Private parameters
     Size input_size_ = {};
     Size pool_size_{};
+    Size stride_ = {};
     Size output_size_ = {};
     int n_channels_ = 0;
-
-    std::vector<std::vector<Edge>> edges_o2i = {};
 };
 
+using AveragePoolingLayer = AveragePoolingLayerT<ScalarType>;
+
 #endif  // _AVERAGE_POOLING_LAYER_H_
@@ -0,0 +1,203 @@
+#ifdef _MSC_VER
+#pragma once
+#endif
+
+#ifndef _BATCH_LOADER_H_
+#define _BATCH_LOADER_H_
+
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <condition_variable>
+
+#include "common.h"
+#include "mnist.h"
+#include "random.h"
+
+/**
+ * Loader which assembles shuffled batches of a dataset on background threads, so that batch assembly is off
+ * the critical path of training. Batches are written to a bounded ring of buffers allocated once, and are
+ * taken in order by "next". The time "next" waits for a batch that is not ready yet is reported as the stall.
+ * データセットのシャッフルしたバッチをバックグラウンドのスレッドで組み立てるローダー. これによりバッチの
+ * 組み立ては学習のクリティカルパスから外れる. バッチは一度だけ確保したバッファのリングに書き込み,
+ * "next"で順に取り出す. まだ準備できていないバッチを"next"が待つ時間をストールとして報告する
+ */
+template <typename Scalar>
+class BatchLoaderT : private Uncopyable {
+public:
+    using Matrix = MatrixT<Scalar>;
+
+    struct Batch {
+        Matrix data;
+        Matrix labels;
+        // Number of samples, which is less than the batch size only for the last batch of an epoch
+        // サンプル数. エポックの最後のバッチのみバッチサイズより小さくなる
+        int size = 0;
+        int epoch = 0;
+        int index = 0;
+    };
+
+    /**
+     * Start "n_workers" threads preparing up to "n_buffers" batches ahead for "epochs" epochs. With "n_shards"
+     * shards, only samples "shard + i * n_shards" are loaded, and every shard has the same number of samples.
+     * "epochs"エポック分のバッチを最大"n_buffers"個先まで準備する"n_workers"個のスレッドを開始する.
+     * "n_shards"個に分割する場合はサンプル"shard + i * n_shards"のみを読み込み, 各部分のサンプル数は等しい
+     */
+    BatchLoaderT(const IdxDataset &dataset, int batchsize, int epochs, int n_buffers = 4, int n_workers = 1,
+                 int shard = 0, int n_shards = 1)
+        : dataset_(dataset)
+        , batchsize_(batchsize)
+        , shard_(shard)
+        , n_shards_(n_shards)
+        , rng_(next_random_stream().split(shard)) {
+        Assertion(batchsize > 0 && n_buffers > 0 && n_workers > 0, "invalid loader parameters!!");
+        Assertion(0 <= shard && shard < n_shards, "invalid shard!!");
+
+        n_data_ = dataset.size() / n_shards;
+        n_batches_ = (n_data_ + batchsize - 1) / batchsize;
+        n_total_ = n_batches_ * epochs;
+
+        // Workers are at most "n_buffers" batches ahead of the trainer. With no more buffers than batches in
+        // an epoch, only two consecutive epochs are in flight, whose orders of samples are double-buffered.
+        // ワーカーは学習より最大"n_buffers"バッチ先行する. バッファ数が1エポックのバッチ数以下であれば,
+        // 処理中のエポックは連続する2つのみなので, それらのサンプルの順序をダブルバッファにする
+        n_buffers = std::min(n_buffers, n_batches_);
+        slots_.resize(n_buffers);
+        for (auto &slot : slots_) {
+            slot.data.resize(batchsize, dataset.n_features());
+            slot.labels.resize(batchsize, dataset.n_classes());
+        }
+        ready_.assign(n_buffers, false);
+        for (auto &indices : indices_) {
+            indices.resize(n_data_);
+        }
+        scratch_.resize(n_data_);
+
+        for (int i = 0; i < n_workers; i++) {
+            workers_.emplace_back(&BatchLoaderT::work, this);
+        }
+    }
+
+    ~BatchLoaderT() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        free_.notify_all();
+        for (auto &worker : workers_) {
+            worker.join();
+        }
+    }
+
+    /**
+     * Release the batch returned last time and take the next one, waiting until it is ready
+     * 前回返したバッチを解放し, 次のバッチが準備できるまで待って取り出す
+     */
+    const Batch &next() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (taken_) {
+            ready_[n_released_ % slots_.size()] = false;
+            n_released_ += 1;
+            taken_ = false;
+            free_.notify_all();
+        }
+        Assertion(n_released_ < n_total_, "no more batches!!");
+
+        const int slot = n_released_ % (int)slots_.size();
+        if (!ready_[slot]) {
+            const auto start = std::chrono::steady_clock::now();
+            ready_cv_.wait(lock, [&] { return (bool)ready_[slot]; });
+            stall_seconds_ += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+        taken_ = true;
+        return slots_[slot];
+    }
+
+    int n_batches() const {
+        return n_batches_;
+    }
+
+    double stall_seconds() const {
+        return stall_seconds_;
+    }
+
+private:
+    void work() {
+        for (;;) {
+            int seq;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                free_.wait(lock, [&] {
+                    return stop_ || n_claimed_ >= n_total_ || n_claimed_ - n_released_ < (int)slots_.size();
+                });
+                if (stop_ || n_claimed_ >= n_total_) {
+                    return;
+                }
+
+                seq = n_claimed_++;
+                if (seq % n_batches_ == 0) {
+                    shuffle(indices_[(seq / n_batches_) % 2], seq / n_batches_);
+                }
+            }
+
+            const int epoch = seq / n_batches_;
+            const int index = seq % n_batches_;
+            const int b0 = index * batchsize_;
+            Batch &batch = slots_[seq % slots_.size()];
+            batch.size = std::min(batchsize_, n_data_ - b0);
+            batch.epoch = epoch;
+            batch.index = index;
+            dataset_.gather(&indices_[epoch % 2][b0], batch.size, batch.data, batch.labels);
+
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                ready_[seq % slots_.size()] = true;
+            }
+            ready_cv_.notify_one();
+        }
+    }
+
+    // Each epoch is shuffled in parallel with its own stream, so that the order depends only on the seed
+    // 各エポックは専用の乱数列で並列にシャッフルするので, 順序はシードのみで決まる
+    void shuffle(std::vector<int> &indices, int epoch) {
+        const int n_data = (int)indices.size();
+        for (int i = 0; i < n_data; i++) {
+            indices[i] = shard_ + i * n_shards_;
+        }
+        parallel_shuffle(indices.data(), n_data, rng_.split(epoch), scratch_);
+    }
+
+    const IdxDataset &dataset_;
+    int batchsize_;
+    int shard_ = 0;
+    int n_shards_ = 1;
+    int n_data_ = 0;
+    int n_batches_ = 0;
+    int n_total_ = 0;
+
+    RandomStream rng_;
+
+    std::vector<Batch> slots_;
+    std::vector<int> indices_[2];
+    std::vector<int> scratch_;
+    std::vector<std::thread> workers_;
+
+    // Shared state guarded by "mutex_". Batch "seq" goes to slot "seq % slots_.size()".
+    // "mutex_"で保護する共有状態. バッチ"seq"はスロット"seq % slots_.size()"に入る
+    std::mutex mutex_;
+    std::condition_variable free_;
+    std::condition_variable ready_cv_;
+    std::vector<char> ready_;
+    int n_claimed_ = 0;
+    int n_released_ = 0;
+    bool taken_ = false;
+    bool stop_ = false;
+
+    double stall_seconds_ = 0.0;
+};
+
+using BatchLoader = BatchLoaderT<ScalarType>;
+
+#endif  // _BATCH_LOADER_H_
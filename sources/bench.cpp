@@ -0,0 +1,477 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "educnn.h"
+
+/**
+ * Benchmark suite of the layers, the losses and end-to-end training of the networks in "main.cpp". Each
+ * benchmark is swept over batch sizes, channels, spatial sizes and numbers of threads on synthetic data, and
+ * the results are written to JSON, which can be compared with a stored baseline to flag regressions.
+ * レイヤー, 損失関数, および"main.cpp"のネットワークの学習全体のベンチマーク. 各ベンチマークは合成データで
+ * バッチサイズ, チャンネル数, 空間的な大きさ, スレッド数を変えて測り, 結果はJSONに書き出す. 保存した
+ * ベースラインと比較して性能の低下を検出できる
+ */
+
+struct BenchOptions {
+    // Results written in JSON, and baseline to compare them with (empty for none of them)
+    // 結果を書き出すJSONと, 比較するベースライン (空の場合はどちらも行わない)
+    std::string output_file;
+    std::string baseline_file;
+    // Slowdown relative to the baseline flagged as a regression
+    // ベースラインに対して性能の低下とみなす遅れの割合
+    double threshold = 0.1;
+    // Minimum time of each repeat and number of repeats, whose median is taken
+    // 各試行の最小時間と試行回数. その中央値をとる
+    double min_seconds = 0.05;
+    int repeats = 5;
+    // Benchmarks whose names contain "filter" are run (all if empty)
+    // 名前が"filter"を含むベンチマークを実行する (空の場合は全て)
+    std::string filter;
+    // Sweep only the largest batch sizes and the ends of the thread counts
+    // 最大のバッチサイズとスレッド数の両端のみを測る
+    bool quick = false;
+    bool float32 = false;
+    int max_threads = parallel_thread_count();
+};
+
+struct BenchResult {
+    std::string name;
+    int batchsize = 0;
+    int threads = 0;
+    double seconds = 0.0;
+    LayerCost cost;
+};
+
+class BenchSuite : private Uncopyable {
+public:
+    explicit BenchSuite(const BenchOptions &options)
+        : options_(options) {
+    }
+
+    bool enabled(const std::string &name) const {
+        return options_.filter.empty() || name.find(options_.filter) != std::string::npos;
+    }
+
+    /**
+     * Median seconds per call of "function" over the repeats. The number of calls in a repeat is doubled until
+     * it takes the minimum time, after a warm-up call which also grows the buffers.
+     * 試行にわたる"function"の1回あたりの秒数の中央値. 1回の試行での呼び出し回数は, バッファの拡張も兼ねた
+     * 予備の呼び出しの後, 最小時間に達するまで倍にする
+     */
+    template <typename Function>
+    double measure(Function &&function) const {
+        function();
+
+        Timer timer;
+        int calls = 1;
+        for (;;) {
+            timer.start();
+            for (int i = 0; i < calls; i++) {
+                function();
+            }
+            if (timer.stop() >= options_.min_seconds || calls >= (1 << 24)) {
+                break;
+            }
+            calls *= 2;
+        }
+
+        std::vector<double> seconds(options_.repeats);
+        for (int r = 0; r < options_.repeats; r++) {
+            timer.start();
+            for (int i = 0; i < calls; i++) {
+                function();
+            }
+            seconds[r] = timer.stop() / calls;
+        }
+        std::sort(seconds.begin(), seconds.end());
+        return seconds[seconds.size() / 2];
+    }
+
+    void add(const std::string &name, int batchsize, int threads, double seconds, const LayerCost &cost) {
+        BenchResult result;
+        result.name = name;
+        result.batchsize = batchsize;
+        result.threads = threads;
+        result.seconds = seconds;
+        result.cost = cost;
+        results_.push_back(result);
+        printf("%-52s %12.2f %14.1f %9.2f %8.2f\n", name.c_str(), seconds * 1.0e6, batchsize / seconds,
+               cost.flops / seconds * 1.0e-9, cost.bytes / seconds * 1.0e-9);
+        fflush(stdout);
+    }
+
+    std::vector<int> batchsizes(const std::vector<int> &sizes) const {
+        return options_.quick ? std::vector<int>(1, sizes.back()) : sizes;
+    }
+
+    /**
+     * Powers of two up to the maximum number of threads, which is always included
+     * 最大スレッド数までの2のべき. 最大スレッド数は常に含める
+     */
+    std::vector<int> thread_counts() const {
+        std::vector<int> counts;
+        for (int t = 1; t < options_.max_threads; t *= 2) {
+            if (!options_.quick || t == 1) {
+                counts.push_back(t);
+            }
+        }
+        counts.push_back(options_.max_threads);
+        return counts;
+    }
+
+    /**
+     * Write the results in JSON with a benchmark per line, which "compare" reads back
+     * 結果を1行に1つのベンチマークのJSONで書き出す. "compare"はこれを読み戻す
+     */
+    bool save(const std::string &filename, const char *precision) const {
+        FILE *fp = fopen(filename.c_str(), "w");
+        if (fp == nullptr) {
+            std::cerr << "Failed to open benchmark results: " << filename << std::endl;
+            return false;
+        }
+
+        bool ok = fprintf(fp, "{\"precision\": \"%s\", \"benchmarks\": [\n", precision) > 0;
+        for (size_t i = 0; i < results_.size() && ok; i++) {
+            const BenchResult &r = results_[i];
+            ok = fprintf(fp,
+                         "{\"name\": \"%s\", \"batchsize\": %d, \"threads\": %d, \"seconds\": %.9e, "
+                         "\"samples_per_sec\": %.3f, \"gflops\": %.4f, \"gbytes_per_sec\": %.4f}%s\n",
+                         r.name.c_str(), r.batchsize, r.threads, r.seconds, r.batchsize / r.seconds,
+                         r.cost.flops / r.seconds * 1.0e-9, r.cost.bytes / r.seconds * 1.0e-9,
+                         i + 1 < results_.size() ? "," : "") > 0;
+        }
+        ok = ok && fprintf(fp, "]}\n") > 0;
+        ok = (fclose(fp) == 0) && ok;
+        if (!ok) {
+            std::cerr << "Failed to write benchmark results: " << filename << std::endl;
+        }
+        return ok;
+    }
+
+    /**
+     * Compare the results with a baseline written by "save", and return the number of failures, which are
+     * benchmarks slower than the baseline by more than the threshold, and benchmarks of the baseline missing
+     * from the results (e.g., removed or renamed ones) unless the filter skips them. Returns -1 if the
+     * baseline cannot be read or was measured with a precision other than "precision".
+     * 結果を"save"で書き出したベースラインと比較し, 失敗の数を返す. 失敗はベースラインより閾値を超えて遅い
+     * ベンチマークと, フィルタで除いたものを除き, ベースラインにあるが結果にないベンチマーク (削除や改名した
+     * ものなど) である. ベースラインを読めないか, "precision"以外の精度で測ったものである場合は-1を返す
+     */
+    int compare(const std::string &filename, const char *precision) const {
+        FILE *fp = fopen(filename.c_str(), "r");
+        if (fp == nullptr) {
+            std::cerr << "Failed to open baseline: " << filename << std::endl;
+            return -1;
+        }
+
+        std::map<std::string, double> baseline;
+        std::string baseline_precision;
+        char line[1024];
+        while (fgets(line, sizeof(line), fp)) {
+            const char *key = strstr(line, "\"precision\": \"");
+            if (key) {
+                key += strlen("\"precision\": \"");
+                const char *end = strchr(key, '"');
+                if (end) {
+                    baseline_precision = std::string(key, end);
+                }
+            }
+            const char *name = strstr(line, "\"name\": \"");
+            const char *seconds = strstr(line, "\"seconds\": ");
+            if (name && seconds) {
+                name += strlen("\"name\": \"");
+                const char *end = strchr(name, '"');
+                if (end) {
+                    baseline[std::string(name, end)] = atof(seconds + strlen("\"seconds\": "));
+                }
+            }
+        }
+        fclose(fp);
+        if (baseline_precision != precision) {
+            std::cerr << "Failed to compare with baseline: it is measured in \""
+                      << (baseline_precision.empty() ? "unknown" : baseline_precision) << "\", not in \"" << precision
+                      << "\"" << std::endl;
+            return -1;
+        }
+
+        printf("\n%-52s %14s %14s %9s\n", "benchmark", "baseline [us]", "current [us]", "change");
+        int n_regressions = 0;
+        for (const auto &r : results_) {
+            const auto it = baseline.find(r.name);
+            if (it == baseline.end() || it->second <= 0.0) {
+                printf("%-52s %14s %14.2f %9s\n", r.name.c_str(), "-", r.seconds * 1.0e6, "new");
+                continue;
+            }
+            const double change = r.seconds / it->second - 1.0;
+            const bool regression = change > options_.threshold;
+            n_regressions += regression ? 1 : 0;
+            printf("%-52s %14.2f %14.2f %+8.1f%%%s\n", r.name.c_str(), it->second * 1.0e6, r.seconds * 1.0e6,
+                   100.0 * change, regression ? "  REGRESSION" : "");
+        }
+
+        // Benchmarks of the baseline which did not run, which would otherwise pass silently
+        // 実行されなかったベースラインのベンチマーク. 報告しなければ黙って通ってしまう
+        int n_missing = 0;
+        for (const auto &entry : baseline) {
+            const bool found = std::any_of(results_.begin(), results_.end(),
+                                           [&](const BenchResult &r) { return r.name == entry.first; });
+            if (!found && enabled(entry.first)) {
+                printf("%-52s %14.2f %14s %9s  MISSING\n", entry.first.c_str(), entry.second * 1.0e6, "-", "-");
+                n_missing++;
+            }
+        }
+        printf("Regressions: %d (threshold: +%.1f%%), missing: %d\n", n_regressions, 100.0 * options_.threshold,
+               n_missing);
+        return n_regressions + n_missing;
+    }
+
+private:
+    const BenchOptions &options_;
+    std::vector<BenchResult> results_;
+};
+
+/**
+ * Benchmark the forward and backward passes of "layer" with inputs of "n_inputs" features
+ * 特徴量"n_inputs"個の入力で"layer"の順伝播と逆伝播を測る
+ */
+template <typename Scalar>
+void bench_layer(BenchSuite &suite, const std::string &name, AbstractLayerT<Scalar> &layer, int batchsize,
+                 int n_inputs) {
+    using Matrix = MatrixT<Scalar>;
+    if (!suite.enabled(name)) {
+        return;
+    }
+
+    const Matrix input = Matrix::Random(batchsize, n_inputs);
+    const auto &output = layer.forward(input);
+    const Matrix dLdy = Matrix::Random(output.rows(), output.cols());
+    for (int threads : suite.thread_counts()) {
+        set_parallel_thread_count(threads);
+        const std::string suffix = "/b" + std::to_string(batchsize) + "/t" + std::to_string(threads);
+        const double forward = suite.measure([&] { layer.forward(input); });
+        suite.add(name + "/forward" + suffix, batchsize, threads, forward, layer.cost(false));
+        const double backward = suite.measure([&] { layer.backward(dLdy); });
+        suite.add(name + "/backward" + suffix, batchsize, threads, backward, layer.cost(true));
+    }
+}
+
+/**
+ * Benchmark the forward and backward passes of "criterion" with predictions of "n_classes" classes
+ * "n_classes"クラスの予測に対して"criterion"の順伝播と逆伝播を測る
+ */
+template <typename Scalar>
+void bench_loss(BenchSuite &suite, const std::string &name, AbstractLossT<Scalar> &criterion, int batchsize,
+                int n_classes) {
+    using Matrix = MatrixT<Scalar>;
+    if (!suite.enabled(name)) {
+        return;
+    }
+
+    // Probabilities and one-hot targets, so that both losses are finite
+    // 両方の損失が有限となるよう, 確率とone-hotの正解を用いる
+    const Matrix pred = (Matrix::Random(batchsize, n_classes).array() + (Scalar)1.5).matrix() / (Scalar)n_classes;
+    Matrix target = Matrix::Zero(batchsize, n_classes);
+    for (int b = 0; b < batchsize; b++) {
+        target(b, b % n_classes) = (Scalar)1.0;
+    }
+
+    const std::string suffix = "/b" + std::to_string(batchsize) + "/t1";
+    const double forward = suite.measure([&] { criterion.forward(pred, target); });
+    suite.add(name + "/forward" + suffix, batchsize, 1, forward, criterion.cost(false));
+    const double backward = suite.measure([&] { criterion.backward(); });
+    suite.add(name + "/backward" + suffix, batchsize, 1, backward, criterion.cost(true));
+}
+
+/**
+ * Benchmark training steps (forward, loss, backward and an SGD update) of the network of "builder", compiled
+ * as in "main.cpp", whose throughput is in samples per second
+ * "builder"のネットワークを"main.cpp"と同様にコンパイルし, その学習ステップ (順伝播, 損失, 逆伝播, SGDの更新)
+ * を測る. スループットは1秒あたりのサンプル数
+ */
+template <typename Scalar>
+void bench_training(BenchSuite &suite, const std::string &name, const NetworkBuilderT<Scalar> &builder, bool fuse,
+                    int batchsize) {
+    using Matrix = MatrixT<Scalar>;
+    if (!suite.enabled(name)) {
+        return;
+    }
+
+    CompileOptions compile_options;
+    compile_options.fuse = fuse;
+    auto network_ptr = builder.build(compile_options);
+    if (!network_ptr) {
+        exit(1);
+    }
+    NetworkT<Scalar> &network = *network_ptr;
+    NLLLossT<Scalar> criterion;
+    const int n_inputs = network.n_inputs();
+    const int n_classes = network.n_outputs();
+    network.plan(batchsize, n_inputs, &criterion);
+    MomentumSGDT<Scalar> optimizer(1.0e-3, 0.1);
+    optimizer.attach(network.flat_parameters());
+
+    const Matrix data = (Matrix::Random(batchsize, n_inputs).array() + (Scalar)1.0) / (Scalar)2.0;
+    Matrix labels = Matrix::Zero(batchsize, n_classes);
+    for (int b = 0; b < batchsize; b++) {
+        labels(b, b % n_classes) = (Scalar)1.0;
+    }
+
+    auto step = [&] {
+        const auto &output = network.forward(data);
+        criterion.forward(output, labels);
+        network.backward(criterion.backward());
+        optimizer.step();
+    };
+    for (int threads : suite.thread_counts()) {
+        set_parallel_thread_count(threads);
+        const double seconds = suite.measure(step);
+        LayerCost cost;
+        for (const auto &layer : network.layers()) {
+            for (bool backward : { false, true }) {
+                const LayerCost pass = layer->cost(backward);
+                cost.flops += pass.flops;
+                cost.bytes += pass.bytes;
+            }
+        }
+        const std::string suffix = "/b" + std::to_string(batchsize) + "/t" + std::to_string(threads);
+        suite.add(name + suffix, batchsize, threads, seconds, cost);
+    }
+}
+
+template <typename Scalar>
+void run_benchmarks(BenchSuite &suite) {
+    printf("%-52s %12s %14s %9s %8s\n", "benchmark", "time [us]", "samples/sec", "GFLOP/s", "GB/s");
+
+    // Convolutions of the CNN (spatial size, input channels and output channels)
+    // CNNの畳み込み (空間的な大きさ, 入力チャンネル数, 出力チャンネル数)
+    const int conv_shapes[][3] = { { 28, 1, 6 }, { 12, 6, 16 } };
+    for (const auto &shape : conv_shapes) {
+        const std::string tag = "/s" + std::to_string(shape[0]) + "/c" + std::to_string(shape[1]) + "-" +
+                                std::to_string(shape[2]);
+        for (int batchsize : suite.batchsizes({ 16, 64 })) {
+            const int n_inputs = shape[0] * shape[0] * shape[1];
+            ConvolutionLayerT<Scalar> im2col(Size(shape[0], shape[0]), Size(5, 5), shape[1], shape[2]);
+            bench_layer(suite, "conv_im2col" + tag, im2col, batchsize, n_inputs);
+            ConvolutionLayerT<Scalar> direct(Size(shape[0], shape[0]), Size(5, 5), shape[1], shape[2],
+                                             ConvolutionMethod::Direct);
+            bench_layer(suite, "conv_direct" + tag, direct, batchsize, n_inputs);
+        }
+    }
+
+    // Poolings of the CNN (spatial size and channels)
+    // CNNのプーリング (空間的な大きさとチャンネル数)
+    const int pool_shapes[][2] = { { 24, 6 }, { 8, 16 } };
+    for (const auto &shape : pool_shapes) {
+        const std::string tag = "/s" + std::to_string(shape[0]) + "/c" + std::to_string(shape[1]);
+        for (int batchsize : suite.batchsizes({ 16, 64 })) {
+            const int n_inputs = shape[0] * shape[0] * shape[1];
+            MaxPoolingLayerT<Scalar> max_pool(Size(shape[0], shape[0]), Size(2, 2), shape[1]);
+            bench_layer(suite, "max_pool" + tag, max_pool, batchsize, n_inputs);
+            AveragePoolingLayerT<Scalar> avg_pool(Size(shape[0], shape[0]), Size(2, 2), shape[1]);
+            bench_layer(suite, "avg_pool" + tag, avg_pool, batchsize, n_inputs);
+        }
+    }
+
+    // Fully connected layers of the MLP and the CNN (inputs and outputs)
+    // MLPとCNNの全結合層 (入力数と出力数)
+    const int fc_shapes[][2] = { { 784, 300 }, { 300, 10 }, { 256, 84 } };
+    for (const auto &shape : fc_shapes) {
+        const std::string tag = "/" + std::to_string(shape[0]) + "-" + std::to_string(shape[1]);
+        for (int batchsize : suite.batchsizes({ 16, 64, 256 })) {
+            FullyConnectedLayerT<Scalar> fc(shape[0], shape[1]);
+            bench_layer(suite, "fc" + tag, fc, batchsize, shape[0]);
+        }
+    }
+
+    // Activations over the features of a hidden layer, and softmaxes over the classes
+    // 隠れ層の特徴量に対する活性化関数と, クラスに対するソフトマックス
+    for (int batchsize : suite.batchsizes({ 16, 64, 256 })) {
+        ReLUT<Scalar> relu;
+        bench_layer(suite, "relu/f3456", relu, batchsize, 3456);
+        SigmoidT<Scalar> sigmoid;
+        bench_layer(suite, "sigmoid/f300", sigmoid, batchsize, 300);
+        SoftmaxT<Scalar> softmax;
+        bench_layer(suite, "softmax/f10", softmax, batchsize, 10);
+        LogSoftmaxT<Scalar> log_softmax;
+        bench_layer(suite, "log_softmax/f10", log_softmax, batchsize, 10);
+    }
+
+    // Losses, which are single-threaded
+    // 損失関数. シングルスレッドで動く
+    for (int batchsize : suite.batchsizes({ 64, 256 })) {
+        NLLLossT<Scalar> nll;
+        bench_loss(suite, "nll_loss/f10", nll, batchsize, 10);
+        CrossEntropyLossT<Scalar> cross_entropy;
+        bench_loss(suite, "cross_entropy_loss/f10", cross_entropy, batchsize, 10);
+    }
+
+    // Training steps of the networks of "main.cpp"
+    // "main.cpp"のネットワークの学習ステップ
+    for (int batchsize : suite.batchsizes({ 64, 256 })) {
+        bench_training(suite, "train_mlp", mlp_builder<Scalar>(), false, batchsize);
+        bench_training(suite, "train_cnn", cnn_builder<Scalar>(), false, batchsize);
+        bench_training(suite, "train_cnn_fused", cnn_builder<Scalar>(), true, batchsize);
+    }
+}
+
+int main(int argc, char **argv) {
+    BenchOptions options;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            options.output_file = argv[++i];
+        } else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+            options.baseline_file = argv[++i];
+        } else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc) {
+            options.threshold = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--min-time") == 0 && i + 1 < argc) {
+            options.min_seconds = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--repeats") == 0 && i + 1 < argc) {
+            options.repeats = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            options.filter = argv[++i];
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            options.max_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--quick") == 0) {
+            options.quick = true;
+        } else if (strcmp(argv[i], "--float32") == 0) {
+            options.float32 = true;
+        } else {
+            fprintf(stderr, "Unknown flag \"%s\" is specified!\n", argv[i]);
+            exit(1);
+        }
+    }
+    if (options.repeats <= 0 || options.max_threads <= 0) {
+        fprintf(stderr, "Repeats and threads must be positive!\n");
+        exit(1);
+    }
+
+    const char *precision = options.float32 ? "float32" : "float64";
+    printf("Precision: %s, threads: up to %d\n", precision, options.max_threads);
+    BenchSuite suite(options);
+    if (options.float32) {
+        run_benchmarks<float>(suite);
+    } else {
+        run_benchmarks<double>(suite);
+    }
+
+    if (!options.output_file.empty() && !suite.save(options.output_file, precision)) {
+        exit(1);
+    }
+
+    // Regressions against the baseline, its missing benchmarks and a different precision fail the run, so that
+    // it can gate upgrades
+    // ベースラインに対する性能の低下, ベースラインのベンチマークの欠落, 精度の違いは実行を失敗させるので,
+    // 更新の可否の判断に使える
+    if (!options.baseline_file.empty()) {
+        const int n_failures = suite.compare(options.baseline_file, precision);
+        if (n_failures != 0) {
+            exit(1);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,384 @@
+#ifdef _MSC_VER
+#pragma once
+#endif
+
+#ifndef _CHECKPOINT_H_
+#define _CHECKPOINT_H_
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <type_traits>
+
+#if defined(_WIN32) || defined(__WIN32__)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "common.h"
+#include "workspace.h"
+#include "mapped_file.h"
+
+// -----------------------------------------------------------------------------
+// Checkpoint file format
+// -----------------------------------------------------------------------------
+//
+// A checkpoint is a 64-byte header, a table of 64-byte tensor entries, and the tensor data, each of which
+// starts at a 64-byte aligned offset from the beginning of the file. Tensors are stored in column-major order
+// and in the byte order of the host, so that a memory-mapped file can be used as it is.
+// チェックポイントは64バイトのヘッダ, 64バイトのテンソルのエントリの表, テンソルのデータからなり, 各データは
+// ファイルの先頭から64バイト境界のオフセットに置く. テンソルは列優先かつホストのバイト順で保存するので,
+// メモリマップしたファイルをそのまま使うことができる
+
+static const char CHECKPOINT_MAGIC[8] = { 'E', 'D', 'U', 'C', 'N', 'N', 'C', 'K' };
+static const uint32_t CHECKPOINT_VERSION = 1;
+static const uint32_t CHECKPOINT_BYTE_ORDER = 0x01020304;
+static const uint64_t CHECKPOINT_ALIGN = 64;
+
+enum class CheckpointType : uint32_t {
+    Float32 = 1,
+    Float64 = 2,
+};
+
+struct CheckpointHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t n_tensors;
+    uint32_t reserved0;
+    uint64_t file_size;
+    uint8_t reserved[32];
+};
+
+struct CheckpointEntry {
+    // Index of the layer among the layers with parameters
+    // パラメータをもつレイヤーの中でのインデックス
+    uint32_t layer;
+    uint32_t type;
+    uint64_t rows;
+    uint64_t cols;
+    uint64_t offset;
+    char name[16];
+    uint8_t reserved[16];
+};
+
+static_assert(sizeof(CheckpointHeader) == 64, "checkpoint header must be 64 bytes!!");
+static_assert(sizeof(CheckpointEntry) == 64, "checkpoint entry must be 64 bytes!!");
+
+template <typename Scalar>
+inline CheckpointType checkpoint_type() {
+    static_assert(std::is_same<Scalar, float>::value || std::is_same<Scalar, double>::value,
+                  "only float and double tensors can be saved!!");
+    return std::is_same<Scalar, float>::value ? CheckpointType::Float32 : CheckpointType::Float64;
+}
+
+// -----------------------------------------------------------------------------
+// Writer
+// -----------------------------------------------------------------------------
+
+/**
+ * Writer of a checkpoint. The tensors of each layer (its parameters and the optimizer state for them) are
+ * added by "write", and the network calls "next_layer" after each layer. Layers without parameters do not
+ * take an index, so that a network and its fused version share the same checkpoint. Tensors are not copied
+ * and must stay alive until "save".
+ * チェックポイントの書き込み. 各レイヤーのテンソル (パラメータとそれに対する最適化手法の状態) を"write"で
+ * 追加し, ネットワークは各レイヤーの後に"next_layer"を呼ぶ. パラメータのないレイヤーはインデックスをとらない
+ * ので, ネットワークとその融合版は同じチェックポイントを共有できる. テンソルはコピーしないので, "save"まで
+ * 存在しなければならない
+ */
+class CheckpointWriter : private Uncopyable {
+public:
+    template <typename Scalar>
+    void write(const char *name, const Eigen::Map<MatrixT<Scalar>> &tensor) {
+        Assertion(std::strlen(name) < sizeof(CheckpointEntry::name), "tensor name is too long!!");
+
+        Tensor t;
+        std::memset(&t.entry, 0, sizeof(CheckpointEntry));
+        t.entry.layer = layer_;
+        t.entry.type = (uint32_t)checkpoint_type<Scalar>();
+        t.entry.rows = (uint64_t)tensor.rows();
+        t.entry.cols = (uint64_t)tensor.cols();
+        std::strcpy(t.entry.name, name);
+        t.data = tensor.data();
+        t.bytes = (size_t)tensor.size() * sizeof(Scalar);
+        tensors_.push_back(t);
+    }
+
+    void next_layer() {
+        if (!tensors_.empty() && tensors_.back().entry.layer == layer_) {
+            layer_ += 1;
+        }
+    }
+
+    /**
+     * Write the checkpoint to "filename" atomically: the file is written and flushed under a temporary name,
+     * and then renamed, so that readers see either the old or the new checkpoint and never a partial one.
+     * チェックポイントを"filename"にアトミックに書き込む: ファイルは一時的な名前で書き込んでフラッシュした後に
+     * 名前を変えるので, 読み込む側には古いか新しいチェックポイントのみが見え, 書きかけのものは見えない
+     */
+    bool save(const std::string &filename) {
+        CheckpointHeader header;
+        std::memset(&header, 0, sizeof(CheckpointHeader));
+        std::memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+        header.version = CHECKPOINT_VERSION;
+        header.byte_order = CHECKPOINT_BYTE_ORDER;
+        header.n_tensors = (uint32_t)tensors_.size();
+
+        uint64_t offset = sizeof(CheckpointHeader) + tensors_.size() * sizeof(CheckpointEntry);
+        for (auto &t : tensors_) {
+            offset = aligned(offset);
+            t.entry.offset = offset;
+            offset += t.bytes;
+        }
+        header.file_size = offset;
+
+        const std::string temp_file = filename + ".tmp";
+        FILE *fp = fopen(temp_file.c_str(), "wb");
+        if (fp == nullptr) {
+            std::cerr << "Failed to open checkpoint: " << temp_file << std::endl;
+            return false;
+        }
+
+        bool ok = fwrite(&header, sizeof(CheckpointHeader), 1, fp) == 1;
+        for (const auto &t : tensors_) {
+            ok = ok && fwrite(&t.entry, sizeof(CheckpointEntry), 1, fp) == 1;
+        }
+
+        const char padding[CHECKPOINT_ALIGN] = {};
+        uint64_t position = sizeof(CheckpointHeader) + tensors_.size() * sizeof(CheckpointEntry);
+        for (const auto &t : tensors_) {
+            ok = ok && fwrite(padding, 1, t.entry.offset - position, fp) == t.entry.offset - position;
+            ok = ok && fwrite(t.data, 1, t.bytes, fp) == t.bytes;
+            position = t.entry.offset + t.bytes;
+        }
+
+        ok = ok && fflush(fp) == 0;
+#if defined(_WIN32) || defined(__WIN32__)
+        ok = ok && _commit(_fileno(fp)) == 0;
+#else
+        ok = ok && fsync(fileno(fp)) == 0;
+#endif
+        ok = (fclose(fp) == 0) && ok;
+
+#if defined(_WIN32) || defined(__WIN32__)
+        // "rename" does not replace an existing file on Windows
+        // Windowsでは"rename"は既存のファイルを置き換えない
+        ok = ok && MoveFileExA(temp_file.c_str(), filename.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+        ok = ok && std::rename(temp_file.c_str(), filename.c_str()) == 0;
+#endif
+        if (!ok) {
+            std::remove(temp_file.c_str());
+            std::cerr << "Failed to write checkpoint: " << filename << std::endl;
+        }
+        return ok;
+    }
+
+private:
+    struct Tensor {
+        CheckpointEntry entry;
+        const void *data;
+        size_t bytes;
+    };
+
+    static uint64_t aligned(uint64_t offset) {
+        return (offset + CHECKPOINT_ALIGN - 1) / CHECKPOINT_ALIGN * CHECKPOINT_ALIGN;
+    }
+
+    uint32_t layer_ = 0;
+    std::vector<Tensor> tensors_;
+};
+
+// -----------------------------------------------------------------------------
+// Reader
+// -----------------------------------------------------------------------------
+
+/**
+ * Memory-mapped checkpoint. Tensors are read by "load" in the same order of the layers as they were written. In
+ * place, parameters use the tensors in the mapped file directly, without parsing nor copying them. The pages
+ * are mapped copy-on-write, so that the parameters can still be updated without changing the file.
+ * メモリマップしたチェックポイント. レイヤーは書き込んだ時と同じ順に"load"でテンソルを読む. その場
+ * ("in place") の場合, パラメータはマップしたファイル内のテンソルを解析もコピーもせずに直接使う. ページは
+ * コピーオンライトでマップするので, ファイルを変えずにパラメータを更新することもできる
+ */
+class Checkpoint : private Uncopyable {
+public:
+    /**
+     * Map "filename" and validate its header. Returns false if the file cannot be mapped or is invalid. Errors
+     * in the file are reported rather than asserted, since a corrupt file is a recoverable input error and must
+     * not abort the process.
+     * "filename"をマップしてヘッダを検証する. マップできない, または不正なファイルの場合はfalseを返す. 壊れた
+     * ファイルは回復可能な入力の誤りでありプロセスを中断すべきではないので, ファイルの誤りは表明ではなく報告する
+     */
+    bool open(const std::string &filename, bool in_place = true) {
+        in_place_ = in_place;
+        layer_ = 0;
+        used_ = false;
+        ok_ = true;
+
+        auto file = std::make_shared<MappedFile>();
+        if (!file->open(filename, true)) {
+            std::cerr << "Failed to open checkpoint: " << filename << std::endl;
+            return false;
+        }
+
+        if (file->size() < sizeof(CheckpointHeader)) {
+            return fail("checkpoint is truncated");
+        }
+        const auto *header = (const CheckpointHeader *)file->data();
+        if (std::memcmp(header->magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) != 0) {
+            return fail("invalid magic number of checkpoint");
+        }
+        if (header->version != CHECKPOINT_VERSION || header->byte_order != CHECKPOINT_BYTE_ORDER) {
+            return fail("unsupported version or byte order of checkpoint");
+        }
+        const uint64_t table_end = sizeof(CheckpointHeader) + (uint64_t)header->n_tensors * sizeof(CheckpointEntry);
+        if (header->file_size != file->size() || table_end > file->size()) {
+            return fail("checkpoint is truncated");
+        }
+
+        entries_ = (const CheckpointEntry *)(file->data() + sizeof(CheckpointHeader));
+        n_entries_ = (int)header->n_tensors;
+        n_layers_ = 0;
+        for (int i = 0; i < n_entries_; i++) {
+            const CheckpointEntry &e = entries_[i];
+            if (e.type != (uint32_t)CheckpointType::Float32 && e.type != (uint32_t)CheckpointType::Float64) {
+                return fail("unknown tensor type in checkpoint");
+            }
+
+            // Sizes are compared by divisions, so that crafted sizes cannot wrap around past the check
+            // 細工された大きさで桁あふれして検査をすり抜けないよう, 大きさは除算で比較する
+            const uint64_t limit = file->size();
+            const uint64_t scalar_bytes = e.type == (uint32_t)CheckpointType::Float32 ? 4 : 8;
+            if ((e.cols != 0 && e.rows > limit / e.cols) || e.rows * e.cols > limit / scalar_bytes) {
+                return fail("invalid tensor entry in checkpoint");
+            }
+            const uint64_t bytes = e.rows * e.cols * scalar_bytes;
+            if (e.offset % CHECKPOINT_ALIGN != 0 || e.offset < table_end || e.offset > limit ||
+                bytes > limit - e.offset || e.layer >= header->n_tensors || e.name[sizeof(e.name) - 1] != '\0') {
+                return fail("invalid tensor entry in checkpoint");
+            }
+            n_layers_ = std::max(n_layers_, (int)e.layer + 1);
+        }
+
+        file_ = file;
+        return true;
+    }
+
+    /**
+     * Read tensor "name" of the current layer to "param", whose shape must be the same. Missing tensors are
+     * errors unless they are "optional", for which false is returned.
+     * 現在のレイヤーのテンソル"name"を"param"に読む. 形状は同じでなければならない. ない場合は"optional"で
+     * なければエラーとし, "optional"であればfalseを返す
+     */
+    template <typename Scalar>
+    bool load(const char *name, ParameterT<Scalar> &param, bool optional = false) {
+        const CheckpointEntry *e = find(name, param.rows(), param.cols(), optional);
+        if (e == nullptr) {
+            return false;
+        }
+
+        if (in_place_ && e->type == (uint32_t)checkpoint_type<Scalar>()) {
+            param.bind((Scalar *)(file_->writable_data() + e->offset), param.rows(), param.cols(), file_);
+            return true;
+        }
+        copy(*e, param);
+        return true;
+    }
+
+    /**
+     * Read tensor "name" of the current layer by copying it to "tensor" (e.g., a slice of a flat buffer),
+     * whose storage is kept. Missing tensors are handled as in "load".
+     * 現在のレイヤーのテンソル"name"を"tensor" (平坦なバッファの一部など) にコピーして読む. "tensor"の領域は
+     * そのままである. ない場合は"load"と同様に扱う
+     */
+    template <typename Scalar>
+    bool read(const char *name, Eigen::Map<MatrixT<Scalar>> tensor, bool optional = false) {
+        const CheckpointEntry *e = find(name, tensor.rows(), tensor.cols(), optional);
+        if (e == nullptr) {
+            return false;
+        }
+        copy(*e, tensor);
+        return true;
+    }
+
+    void next_layer() {
+        if (used_) {
+            layer_ += 1;
+            used_ = false;
+        }
+    }
+
+    /**
+     * Check that the layers read all the layers in the checkpoint and no error occurred
+     * レイヤーがチェックポイントの全てのレイヤーを読み, エラーが起こらなかったことを確認する
+     */
+    bool finish() {
+        if (ok_ && (int)layer_ != n_layers_) {
+            fail("numbers of layers with parameters are different in checkpoint and network");
+        }
+        return ok_;
+    }
+
+private:
+    /**
+     * Entry of tensor "name" of the current layer, which must be a "rows x cols" matrix
+     * 現在のレイヤーのテンソル"name"のエントリ. "rows x cols"の行列でなければならない
+     */
+    const CheckpointEntry *find(const char *name, Eigen::Index rows, Eigen::Index cols, bool optional) {
+        used_ = true;
+        const CheckpointEntry *e = nullptr;
+        for (int i = 0; i < n_entries_ && e == nullptr; i++) {
+            if (entries_[i].layer == layer_ && std::strcmp(entries_[i].name, name) == 0) {
+                e = &entries_[i];
+            }
+        }
+
+        if (e == nullptr) {
+            if (!optional) {
+                fail(std::string("tensor \"") + name + "\" is missing in checkpoint");
+            }
+            return nullptr;
+        }
+        if ((Eigen::Index)e->rows != rows || (Eigen::Index)e->cols != cols) {
+            fail(std::string("shape of tensor \"") + name + "\" is different in checkpoint");
+            return nullptr;
+        }
+        return e;
+    }
+
+    template <typename Derived>
+    void copy(const CheckpointEntry &e, Eigen::MatrixBase<Derived> &dst) const {
+        using Scalar = typename Derived::Scalar;
+        const uint8_t *data = file_->data() + e.offset;
+        if (e.type == (uint32_t)CheckpointType::Float32) {
+            dst = Eigen::Map<const MatrixT<float>>((const float *)data, dst.rows(), dst.cols()).template cast<Scalar>();
+        } else {
+            dst = Eigen::Map<const MatrixT<double>>((const double *)data, dst.rows(), dst.cols())
+                      .template cast<Scalar>();
+        }
+    }
+
+    bool fail(const std::string &message) {
+        std::cerr << "Failed to load checkpoint: " << message << std::endl;
+        ok_ = false;
+        return false;
+    }
+
+    std::shared_ptr<MappedFile> file_ = nullptr;
+    const CheckpointEntry *entries_ = nullptr;
+    int n_entries_ = 0;
+    int n_layers_ = 0;
+    bool in_place_ = true;
+
+    uint32_t layer_ = 0;
+    bool used_ = false;
+    bool ok_ = true;
+};
+
+#endif  // _CHECKPOINT_H_
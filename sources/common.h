@@ -9,12 +9,33 @@
 #include <cmath>
 #include <cassert>
 
+// GEMM of Eigen packs blocks of the operands to buffers on the stack if they are smaller than this limit and
+// on the heap otherwise. The limit is raised from 128 KB so that the products in the layers never allocate.
+// MSVC keeps the default because its threads have only 1 MB of stack.
+// Eigenの行列積はオペランドのブロックを, この上限より小さければスタック, そうでなければヒープ上のバッファに
+// 詰める. レイヤー内の行列積がメモリを確保しないよう, 上限を128 KBから引き上げる.
+// MSVCのスレッドのスタックは1 MBしかないので既定値のままとする
+#if !defined(EIGEN_STACK_ALLOCATION_LIMIT) && !defined(_MSC_VER)
+#define EIGEN_STACK_ALLOCATION_LIMIT (1024 * 1024)
+#endif
+
 #include <Eigen/Core>
 
-// Declare a matrix type using Eigen
-// Eigenを用いた行列タイプの宣言
+// Declare a matrix type using Eigen. Layers are templated on the scalar type, and "Matrix" is the default one.
+// Eigenを用いた行列タイプの宣言. レイヤーはスカラー型についてテンプレート化されており, "Matrix"はその既定の型
+template <typename Scalar>
+using MatrixT = Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic>;
 using ScalarType = double;
-using Matrix = Eigen::Matrix<ScalarType, Eigen::Dynamic, Eigen::Dynamic>;
+using Matrix = MatrixT<ScalarType>;
+
+// Non-owning views of matrices. Layers take inputs as "MatrixRefT", which binds to both matrices and views
+// without copies, and return their outputs as "MatrixMapT" views of their buffers.
+// 行列の所有権をもたないビュー. レイヤーは入力を"MatrixRefT"として受け取り (行列とビューのどちらもコピー
+// せずに渡せる), 出力は自身のバッファのビューである"MatrixMapT"として返す
+template <typename Scalar>
+using MatrixMapT = Eigen::Map<MatrixT<Scalar>>;
+template <typename Scalar>
+using MatrixRefT = Eigen::Ref<const MatrixT<Scalar>>;
 
 // Predefined constants
 // 事前定義の定数
@@ -37,6 +58,45 @@ struct Size {
     int cols = 0;
 };
 
+/**
+ * Shape of the features of a sample, which are "channels" channels of "size" pixels each. Fully connected
+ * layers regard their features as the channels of a single pixel, which is called flat. A shape without
+ * channels stands for any shape.
+ * サンプルの特徴量の形状. それぞれ"size"画素の"channels"チャンネルからなる. 全結合層は特徴量を1画素の
+ * チャンネルとみなし, これを平坦と呼ぶ. チャンネルのない形状は任意の形状を表す
+ */
+struct Shape {
+    Shape() = default;
+    explicit Shape(int channels_, Size size_ = Size(1, 1))
+        : channels(channels_)
+        , size(size_) {
+    }
+
+    int total() const {
+        return channels * size.total();
+    }
+    bool flat() const {
+        return size.rows == 1 && size.cols == 1;
+    }
+    bool any() const {
+        return channels == 0;
+    }
+
+    /**
+     * Whether a layer taking this shape can read features of "input", which must have the same shape, or the
+     * same number of features if either of them is flat
+     * この形状をとるレイヤーが"input"の特徴量を読めるかどうか. 形状が同じであるか, どちらかが平坦であれば
+     * 特徴量の数が同じでなければならない
+     */
+    bool accepts(const Shape &input) const {
+        const bool same = channels == input.channels && size.rows == input.size.rows && size.cols == input.size.cols;
+        return any() || same || ((flat() || input.flat()) && total() == input.total());
+    }
+
+    int channels = 0;
+    Size size = Size(1, 1);
+};
+
 /**
  * The uncopyable interface class to forbid copy and assignment in the derived class.
  * 継承先クラスをコピー不可にするためのインターフェース
@@ -54,8 +114,9 @@ public:
  * Calculate accuracy
  * 精度計算の関数
  */
-inline double accuracy(const Matrix &m1, const Matrix &m2) {
-    Matrix::Index i1, i2;
+template <typename Derived1, typename Derived2>
+inline double accuracy(const Eigen::MatrixBase<Derived1> &m1, const Eigen::MatrixBase<Derived2> &m2) {
+    Eigen::Index i1, i2;
     double ret = 0.0;
     for (int i = 0; i < m1.rows(); i++) {
         m1.row(i).maxCoeff(&i1);
@@ -5,29 +5,74 @@
 #ifndef _CONVOLUTION_LAYER_H_
 #define _CONVOLUTION_LAYER_H_
 
+#include <cstdint>
+#include <memory>
 #include <vector>
 
-#include "openmp.h"
+#include "parallel.h"
 #include "random.h"
+#include "activation.h"
 #include "abstract_layer.h"
+#include "max_pooling_layer.h"
+#include "direct_convolution.h"
 
-class ConvolutionLayer : public AbstractLayer {
+/**
+ * Computation method for the convolution layer
+ * 畳み込み層の計算方法
+ */
+enum class ConvolutionMethod {
+    // Multiply-add along the bipartite graph of pixels (reference)
+    // 画素の二部グラフに沿った積和 (参照実装)
+    EdgeGraph,
+    // Lower patches to columns and compute with GEMM
+    // パッチを列に展開して行列積で計算
+    Im2col,
+    // Vectorized direct convolution over channel-blocked outputs (backward is computed with GEMM)
+    // チャンネルをブロック化した出力に対するベクトル化された直接畳み込み (逆伝播は行列積で計算)
+    Direct,
+};
+
+/**
+ * Convolution layer. As with "FullyConnectedLayerT", the gradients of the parameters are applied by an optimizer.
+ * 畳み込み層. "FullyConnectedLayerT"と同様に, パラメータの勾配は最適化手法が適用する
+ */
+template <typename Scalar>
+class ConvolutionLayerT : public AbstractLayerT<Scalar> {
 public:
+    using Matrix = MatrixT<Scalar>;
+    using Parameter = ParameterT<Scalar>;
+    using MatrixMap = MatrixMapT<Scalar>;
+    using MatrixRef = MatrixRefT<Scalar>;
+    using Buffer = BufferT<Scalar>;
+    using View = ViewT<Scalar>;
+    using LayerState = LayerStateT<Scalar>;
+    using AbstractLayerT<Scalar>::forward;
+    using AbstractLayerT<Scalar>::backward;
+    using AbstractLayerT<Scalar>::accumulate_;
+    using AbstractLayerT<Scalar>::propagate_;
+
     // Public methods
-    ConvolutionLayer(Size input_size, Size kernel_size, int in_channels, int out_channels)
-        : AbstractLayer()
+    ConvolutionLayerT(Size input_size, Size kernel_size, int in_channels, int out_channels,
+                      ConvolutionMethod method = ConvolutionMethod::Im2col)
+        : AbstractLayerT<Scalar>()
         , input_size_(input_size)
         , kernel_size_(kernel_size)
         , output_size_()
         , in_channels(in_channels)
-        , out_channels(out_channels) {
+        , out_channels(out_channels)
+        , method_(method) {
         output_size_.rows = input_size_.rows - kernel_size_.rows + 1;
         output_size_.cols = input_size_.cols - kernel_size_.cols + 1;
 
-        W.resize(in_channels * out_channels);
-        b.resize(out_channels);
-        dW.resize(in_channels * out_channels);
-        db.resize(out_channels);
+        // Kernels are stored as rows of a single matrix. Each row corresponds to an output channel,
+        // and its columns are ordered as (input channel, ky, kx).
+        // カーネルは一つの行列の各行として保持する. 各行が出力チャンネルに対応し,
+        // 列は (入力チャンネル, ky, kx) の順に並ぶ
+        const int n_weights = in_channels * kernel_size_.total();
+        W = Matrix::Zero(out_channels, n_weights);
+        b = Matrix::Zero(1, out_channels);
+        dW = Matrix::Zero(out_channels, n_weights);
+        db = Matrix::Zero(1, out_channels);
 
         // X. Glorot's standard deviation for parameter initialization
         // X. Glorotによるパラメータ初期化のための標準偏差
@@ -35,103 +80,509 @@ public:
         const int n_output = output_size_.total() * out_channels;
         const double xg_stddev = sqrt(2.0 / (n_input + n_output));
 
-        // Parameter initialization
-        // パラメータの初期化
-        Random &rng = Random::getInstance();
-        for (int k = 0; k < in_channels * out_channels; k++) {
-            W[k] = Matrix(kernel_size_.rows, kernel_size_.cols);
-            dW[k] = Matrix(kernel_size.rows, kernel_size_.cols);
-            for (int i = 0; i < kernel_size_.rows; i++) {
-                for (int j = 0; j < kernel_size_.cols; j++) {
-                    W[k](i, j) = rng.normal() * xg_stddev;
-                    dW[k](i, j) = 0.0;
-                }
+        // Parameter initialization with a random stream of the layer, which is filled in parallel
+        // パラメータの初期化. レイヤーの乱数列で並列に埋める
+        next_random_stream().fill_normal(W.data(), W.size());
+        W *= (Scalar)xg_stddev;
+
+        set_method(method_);
+    }
+
+    virtual ~ConvolutionLayerT() {
+    }
+
+    const char *name() const override {
+        return "Convolution";
+    }
+
+    // Forward is a GEMM of the patches with the kernels, and backward is two GEMMs for the patch gradients
+    // and "dW". Patches are counted as computed on the fly, since they are lowered chunk by chunk in cache.
+    // 順伝播はパッチとカーネルの行列積1回, 逆伝播はパッチの勾配と"dW"の行列積2回. パッチはキャッシュ内で
+    // チャンク毎に展開するので, その場で計算するものとして数える
+    LayerCost cost(bool backward) const override {
+        const View &input = this->input();
+        const MatrixMap &output = this->output();
+        const double batchsize = (double)input.rows();
+        const double n_outputs = batchsize * output_size_.total() * out_channels;
+        const double gemm = 2.0 * n_outputs * W.cols();
+        const double n_params = (double)W.size() + b.size();
+        const double n_gemms = propagate_ ? 2.0 : 1.0;
+        LayerCost cost;
+        if (backward) {
+            cost.flops = n_gemms * gemm + n_outputs;
+            cost.bytes = (n_gemms * input.size() + output.size() + 2.0 * n_params) * sizeof(Scalar);
+        } else {
+            cost.flops = gemm + n_outputs;
+            cost.bytes = ((double)input.size() + output.size() + n_params) * sizeof(Scalar);
+        }
+        return cost;
+    }
+
+    Shape input_shape() const override {
+        return Shape(in_channels, input_size_);
+    }
+    Shape output_shape(const Shape &input) const override {
+        return Shape(out_channels, output_size_);
+    }
+
+    /**
+     * The direct convolution outruns im2col in forward when its loops are unrolled for the kernel size (3x3 or
+     * 5x5). Its backward still lowers the patches with im2col, and without the patches cached by the forward
+     * pass, so that in training it is selected only with several input channels, where the forward dominates.
+     * The reference method is left as it is.
+     * 直接畳み込みはループがカーネルの大きさ (3x3または5x5) について展開される場合, 順伝播でim2colより速い.
+     * 逆伝播はim2colでパッチを展開し, しかも順伝播でキャッシュしたパッチを使えないので, 学習では順伝播が
+     * 支配的な入力チャンネルが複数の場合にのみ選ぶ. 参照実装はそのままにする
+     */
+    void select_kernel(bool training) override {
+        if (method_ == ConvolutionMethod::EdgeGraph) {
+            return;
+        }
+        const bool unrolled = (kernel_size_.rows == 3 && kernel_size_.cols == 3) ||
+                              (kernel_size_.rows == 5 && kernel_size_.cols == 5);
+        const bool direct = unrolled && (!training || in_channels > 1);
+        set_method(direct ? ConvolutionMethod::Direct : ConvolutionMethod::Im2col);
+    }
+
+    /**
+     * Switch the computation method, which must be done before the first pass
+     * 計算方法を切り替える. 最初の計算の前に行うこと
+     */
+    void set_method(ConvolutionMethod method) {
+        method_ = method;
+
+        // Initialize bipartite graph between input and output (only for the reference method)
+        // 入出力画素の接続を表す二部グラフの初期化 (参照実装のみで使用)
+        edges_o2i.clear();
+        if (method_ == ConvolutionMethod::EdgeGraph) {
+            edges_o2i.resize(output_size_.total() * out_channels);
+            initialize();
+        }
+
+        // Select a direct convolution kernel for the instruction set of the CPU
+        // CPUの命令セットに対応した直接畳み込みのカーネルを選ぶ
+        if (method_ == ConvolutionMethod::Direct) {
+            direct_shape_.input_size = input_size_;
+            direct_shape_.kernel_size = kernel_size_;
+            direct_shape_.output_size = output_size_;
+            direct_shape_.in_channels = in_channels;
+            direct_lanes_ = direct_conv_lanes<Scalar>(simd_level());
+            direct_kernel_ = direct_conv_kernel<Scalar>(simd_level(), kernel_size_);
+        }
+        prepare();
+    }
+
+    /**
+     * Pack the kernels and the biases in the channel-blocked layout of the direct convolution, which all the
+     * states share read-only. Padded channels are filled with zeros.
+     * カーネルとバイアスを直接畳み込みのチャンネルをブロック化した配置に並べ替える. 全ての状態がこれを
+     * 読み取り専用で共有する. 余ったチャンネルは0で埋める
+     */
+    void prepare() override {
+        if (method_ != ConvolutionMethod::Direct) {
+            w_packed_.clear();
+            b_packed_.clear();
+            return;
+        }
+        const int L = direct_lanes_;
+        const int n_blocks = (out_channels + L - 1) / L;
+        const int block_weights = (int)W.cols() * L;
+        w_packed_.assign(n_blocks * block_weights, (Scalar)0);
+        b_packed_.assign(n_blocks * L, (Scalar)0);
+        for (int o = 0; o < out_channels; o++) {
+            const int k = o / L;
+            const int v = o % L;
+            for (int i = 0; i < W.cols(); i++) {
+                w_packed_[k * block_weights + i * L + v] = W(o, i);
             }
+            b_packed_[k * L + v] = b(0, o);
         }
+    }
 
-        for (int k = 0; k < out_channels; k++) {
-            b[k] = 0.0;
-            db[k] = 0.0;
+    std::unique_ptr<LayerState> make_state() const override {
+        return std::unique_ptr<LayerState>(new State());
+    }
+
+    const MatrixMap &forward(const MatrixRef &input, LayerState &state) const override {
+        State &s = static_cast<State &>(state);
+        s.input.bind(input);
+        if (method_ == ConvolutionMethod::Im2col) {
+            s.output.resize(input.rows(), output_size_.total() * out_channels);
+            forward_im2col(input, s);
+        } else if (method_ == ConvolutionMethod::Direct) {
+            forward_direct(input, s);
+        } else {
+            forward_edges(input, s);
         }
+        return s.output;
+    }
 
-        // Initialize bipartite graph between input and output
-        // 入出力画素の接続を表す二部グラフの初期化
-        edges_o2i.resize(output_size_.total() * out_channels);
-        initialize();
+    const MatrixMap &backward(const MatrixRef &dLdy, LayerState &state) override {
+        State &s = static_cast<State &>(state);
+        const int batchsize = (int)dLdy.rows();
+        const int n_input = input_size_.total() * in_channels;
+        const int n_tasks = parallel_task_count(batchsize);
+
+        // Each task owns a range of samples, and hence rows of "dLdx", and accumulates parameter gradients
+        // to its own column block of the partial buffers, which are summed up at the end.
+        // 各タスクはサンプルの範囲 (すなわち"dLdx"の行) を担当し, パラメータの勾配は部分和のバッファの
+        // 各自の列ブロックに足し込む. ブロックは最後に足し合わせる
+        if (propagate_) {
+            s.dLdx.resize(batchsize, n_input);
+            s.dLdx.setZero();
+        }
+        s.partial_dW.resize(W.rows(), W.cols() * n_tasks);
+        s.partial_dW.setZero();
+        s.partial_db.resize(1, out_channels * n_tasks);
+        s.partial_db.setZero();
+        if (method_ == ConvolutionMethod::Im2col || method_ == ConvolutionMethod::Direct) {
+            backward_im2col(dLdy, n_tasks, s);
+        } else {
+            backward_edges(dLdy, n_tasks, s);
+        }
+        tree_reduce(s.partial_dW, n_tasks);
+        tree_reduce(s.partial_db, n_tasks);
+        if (accumulate_) {
+            dW += s.partial_dW.leftCols(W.cols());
+            db += s.partial_db.leftCols(out_channels);
+        } else {
+            dW = s.partial_dW.leftCols(W.cols());
+            db = s.partial_db.leftCols(out_channels);
+        }
+        return s.dLdx;
     }
 
-    virtual ~ConvolutionLayer() {
+    void parameters(std::vector<NamedParameterT<Scalar>> &list) override {
+        list.push_back({ "W", &W, &dW });
+        list.push_back({ "b", &b, &db });
     }
 
-    const Matrix &forward(const Matrix &input) override {
-        const int batchsize = (int)input.rows();
-        const int n_output = output_size_.total() * out_channels;
+    std::shared_ptr<AbstractLayerT<Scalar>> fuse(const std::vector<std::shared_ptr<AbstractLayerT<Scalar>>> &layers,
+                                                 int i, int &n_fused) const override;
 
-        input_ = input;
-        output_ = Matrix::Zero(batchsize, n_output);
-        for (int b = 0; b < batchsize; b++) {
-            OMP_PARALLEL_FOR(int o = 0; o < n_output; o++) {
-                double accum = 0.0;
-                for (int e = 0; e < edges_o2i[o].size(); e++) {
-                    Edge &edge = edges_o2i[o][e];
-                    accum += input(b, edge.to) * W[edge.kernel_id](edge.ky, edge.kx);
-                }
-                const int out_ch = o / output_size_.total();
-                output_(b, o) = accum + this->b[out_ch];
+    ConvolutionMethod method() const {
+        return method_;
+    }
+
+    const Parameter &weights() const {
+        return W;
+    }
+    const Parameter &bias() const {
+        return b;
+    }
+    Size input_size() const {
+        return input_size_;
+    }
+    Size kernel_size() const {
+        return kernel_size_;
+    }
+    Size output_size() const {
+        return output_size_;
+    }
+    int input_channels() const {
+        return in_channels;
+    }
+    int output_channels() const {
+        return out_channels;
+    }
+
+protected:
+    /**
+     * State with the scratch buffers of the convolution
+     * 畳み込みの作業用のバッファをもつ状態
+     */
+    struct State : public LayerState {
+        void buffers(std::vector<Buffer *> &list) override {
+            LayerState::buffers(list);
+            list.push_back(&cols);
+            list.push_back(&tiles);
+            list.push_back(&patch_grads);
+            list.push_back(&partial_dW);
+            list.push_back(&partial_db);
+            list.push_back(&samples);
+            list.push_back(&blocks);
+        }
+
+        // Scratch buffers with a column per task: patches (the last chunk of each task is kept for
+        // "backward"), output tiles or their gradients, and patch gradients
+        // タスク毎に1列をもつ作業用のバッファ: パッチ (各タスクの最後のチャンクは"backward"のために保持する),
+        // 出力のタイルまたはその勾配, パッチの勾配
+        Buffer cols;
+        Buffer tiles;
+        Buffer patch_grads;
+
+        // Per-task parameter gradients, stored side by side as column blocks
+        // タスク毎のパラメータの勾配. 列ブロックとして並べて保持する
+        Buffer partial_dW;
+        Buffer partial_db;
+
+        // Scratch buffers of the direct convolution with a column per task: a sample in the planar layout, and
+        // its output in the channel-blocked layout
+        // タスク毎に1列をもつ直接畳み込みの作業用のバッファ: 平面の配置の1サンプルと, チャンネルをブロック化
+        // した配置のその出力
+        Buffer samples;
+        Buffer blocks;
+    };
+
+    /**
+     * Take over the configuration and the parameters of "layer" (used by the fused layer)
+     * "layer"の設定とパラメータを引き継ぐ (融合したレイヤーで使用)
+     */
+    explicit ConvolutionLayerT(const ConvolutionLayerT &layer)
+        : AbstractLayerT<Scalar>()
+        , input_size_(layer.input_size_)
+        , kernel_size_(layer.kernel_size_)
+        , output_size_(layer.output_size_)
+        , in_channels(layer.in_channels)
+        , out_channels(layer.out_channels)
+        , method_(layer.method_)
+        , im2col_chunk_(layer.im2col_chunk_)
+        , W(layer.W)
+        , b(layer.b)
+        , dW(layer.dW)
+        , db(layer.db) {
+        Assertion(method_ == ConvolutionMethod::Im2col, "only im2col convolution can be taken over!!");
+    }
+
+    /**
+     * Store the output tile of "n" samples from "b0", whose row index is "p * n + b" (see "im2col"), to the
+     * layer output. Fused layers override this to apply pooling and activation to the tile in cache.
+     * "b0"から"n"サンプルの出力のタイル (行番号は"p * n + b", "im2col"を参照) をレイヤーの出力に格納する.
+     * 融合したレイヤーはこれをオーバーライドし, キャッシュ上のタイルにプーリングと活性化関数を適用する
+     */
+    virtual void store_tile(const MatrixMap &tile, int b0, int n, State &s) const {
+        const int n_pixels = output_size_.total();
+        for (int o = 0; o < out_channels; o++) {
+            for (int p = 0; p < n_pixels; p++) {
+                s.output.col(o * n_pixels + p).segment(b0, n) = tile.col(o).segment(p * n, n);
             }
         }
+    }
 
-        return output_;
+    /**
+     * Inverse of "store_tile", which gathers the gradient of the output tile from "dLdy"
+     * "store_tile"の逆で, 出力のタイルの勾配を"dLdy"から集める
+     */
+    virtual void load_tile_gradient(const MatrixRef &dLdy, int b0, int n, MatrixMap &delta, const State &s) const {
+        const int n_pixels = output_size_.total();
+        for (int o = 0; o < out_channels; o++) {
+            for (int p = 0; p < n_pixels; p++) {
+                delta.col(o).segment(p * n, n) = dLdy.col(o * n_pixels + p).segment(b0, n);
+            }
+        }
     }
 
-    Matrix backward(const Matrix &dLdy, double lr = 0.1, double momentum = 0.5) override {
+    void forward_edges(const MatrixRef &input, State &s) const {
+        const int batchsize = (int)input.rows();
+        const int n_pixels = output_size_.total();
+
+        // Parallelize over (sample, output channel) tiles in a single parallel loop
+        // (サンプル, 出力チャンネル) のタイルについて1つの並列ループで並列化する
+        s.output.resize(batchsize, n_pixels * out_channels);
+        parallel_for(0, batchsize * out_channels, [&](int tile) {
+            const int b = tile / out_channels;
+            const int out_ch = tile % out_channels;
+            for (int o = out_ch * n_pixels; o < (out_ch + 1) * n_pixels; o++) {
+                Scalar accum = 0.0;
+                for (int e = 0; e < (int)edges_o2i[o].size(); e++) {
+                    const Edge &edge = edges_o2i[o][e];
+                    accum += input(b, edge.to) * W(out_ch, edge.weight_id);
+                }
+                s.output(b, o) = accum + this->b(0, out_ch);
+            }
+        });
+    }
+
+    void backward_edges(const MatrixRef &dLdy, int n_tasks, State &s) {
         const int batchsize = (int)dLdy.rows();
-        const int n_input = input_size_.total() * in_channels;
         const int n_output = output_size_.total() * out_channels;
+        const int n_weights = (int)W.cols();
 
-        Matrix dLdx = Matrix::Zero(batchsize, n_input);
-        for (int b = 0; b < batchsize; b++) {
-            OMP_PARALLEL_FOR(int o = 0; o < n_output; o++) {
-                for (int e = 0; e < edges_o2i[o].size(); e++) {
-                    Edge &edge = edges_o2i[o][e];
-                    OMP_ATOMIC(dLdx(b, edge.to) += dLdy(b, o) * W[edge.kernel_id](edge.ky, edge.kx));
+        parallel_for(0, n_tasks, [&](int t) {
+            const TaskRange range = task_range(t, n_tasks, batchsize);
+            for (int b = range.begin; b < range.end; b++) {
+                for (int o = 0; o < n_output; o++) {
+                    const int out_ch = o / output_size_.total();
+                    for (int e = 0; e < (int)edges_o2i[o].size(); e++) {
+                        const Edge &edge = edges_o2i[o][e];
+                        if (propagate_) {
+                            s.dLdx(b, edge.to) += dLdy(b, o) * W(out_ch, edge.weight_id);
+                        }
+                        s.partial_dW(out_ch, t * n_weights + edge.weight_id) += dLdy(b, o) * s.input(b, edge.to);
+                    }
+                    s.partial_db(0, t * out_channels + out_ch) += dLdy(b, o);
                 }
             }
-        }
+        });
+    }
 
-        std::vector<Matrix> current_dW(in_channels * out_channels, Matrix::Zero(kernel_size_.rows, kernel_size_.cols));
-        std::vector<double> current_db(out_channels, 0.0);
-        for (int b = 0; b < batchsize; b++) {
-            OMP_PARALLEL_FOR(int o = 0; o < n_output; o++) {
-                for (int e = 0; e < edges_o2i[o].size(); e++) {
-                    Edge &edge = edges_o2i[o][e];
-                    OMP_ATOMIC(current_dW[edge.kernel_id](edge.ky, edge.kx) += dLdy(b, o) * input_(b, edge.to));
+    /**
+     * The batch is processed in chunks of samples. In a chunk of "n" samples, the row index of the patch matrix
+     * is "p * n + b" for output pixel "p" and sample "b", and the column index is "(c, ky, kx)". Since Eigen
+     * matrices are column-major, a column of the input matrix and a column of the output matrix are then copied
+     * as contiguous segments, and the output of GEMM has exactly the same memory layout as the layer output.
+     * バッチはサンプルのチャンク毎に処理する. "n"サンプルのチャンクでは, パッチ行列の行番号は出力画素"p"と
+     * サンプル"b"に対して"p * n + b", 列番号は"(c, ky, kx)"となる. Eigenの行列は列優先なので,
+     * 入出力行列の列は連続した区間としてコピーでき, 行列積の結果もレイヤーの出力と同じメモリ配置になる.
+     */
+    void im2col(const MatrixRef &input, int b0, int n, MatrixMap &cols) const {
+        for (int k = 0; k < (int)W.cols(); k++) {
+            const int c = k / kernel_size_.total();
+            const int ky = (k % kernel_size_.total()) / kernel_size_.cols;
+            const int kx = k % kernel_size_.cols;
+            for (int y = 0; y < output_size_.rows; y++) {
+                for (int x = 0; x < output_size_.cols; x++) {
+                    const int p = y * output_size_.cols + x;
+                    const int i = c * input_size_.total() + (y + ky) * input_size_.cols + (x + kx);
+                    cols.col(k).segment(p * n, n) = input.col(i).segment(b0, n);
                 }
-
-                const int out_ch = o / output_size_.total();
-                OMP_ATOMIC(current_db[out_ch] += dLdy(b, o));
             }
         }
+    }
 
-        OMP_PARALLEL_FOR(int k = 0; k < in_channels * out_channels; k++) {
-            for (int i = 0; i < kernel_size_.rows; i++) {
-                for (int j = 0; j < kernel_size_.cols; j++) {
-                    dW[k](i, j) = momentum * dW[k](i, j) + lr * current_dW[k](i, j);
-                    W[k](i, j) -= dW[k](i, j);
+    /**
+     * Inverse of "im2col" which accumulates patch gradients to the input gradient.
+     * "im2col"の逆演算. パッチの勾配を入力の勾配に足し込む
+     */
+    void col2im(const MatrixMap &cols, int b0, int n, MatrixMap &dLdx) const {
+        for (int k = 0; k < (int)W.cols(); k++) {
+            const int c = k / kernel_size_.total();
+            const int ky = (k % kernel_size_.total()) / kernel_size_.cols;
+            const int kx = k % kernel_size_.cols;
+            for (int y = 0; y < output_size_.rows; y++) {
+                for (int x = 0; x < output_size_.cols; x++) {
+                    const int p = y * output_size_.cols + x;
+                    const int i = c * input_size_.total() + (y + ky) * input_size_.cols + (x + kx);
+                    dLdx.col(i).segment(b0, n) += cols.col(k).segment(p * n, n);
                 }
             }
         }
+    }
 
-        OMP_PARALLEL_FOR(int k = 0; k < out_channels; k++) {
-            db[k] = momentum * db[k] + lr * current_db[k];
-            b[k] -= db[k];
-        }
+    /**
+     * The batch is split into one range of samples per thread. Each thread runs "im2col" and
+     * single-threaded GEMMs on its own range, so that only one parallel region is opened per call.
+     * バッチはスレッド毎のサンプルの範囲に分割する. 各スレッドは担当範囲について"im2col"と
+     * シングルスレッドの行列積を実行するので, 並列領域は1回の呼び出しにつき1つだけ作られる
+     */
+    void forward_im2col(const MatrixRef &input, State &s) const {
+        const int batchsize = (int)input.rows();
+        const int n_pixels = output_size_.total();
+        const int n_tasks = parallel_task_count(batchsize);
+        const int chunk_rows = im2col_chunk_rows(batchsize, n_tasks);
 
-        return dLdx;
+        s.cols.resize(chunk_rows * W.cols(), n_tasks);
+        s.tiles.resize(chunk_rows * out_channels, n_tasks);
+        parallel_for(0, n_tasks, [&](int t) {
+            const TaskRange range = task_range(t, n_tasks, batchsize);
+            for (int b0 = range.begin; b0 < range.end; b0 += im2col_chunk_) {
+                const int n = std::min(im2col_chunk_, range.end - b0);
+                MatrixMap cols(s.cols.col(t).data(), n_pixels * n, W.cols());
+                MatrixMap result(s.tiles.col(t).data(), n_pixels * n, out_channels);
+                im2col(input, b0, n, cols);
+
+                // (pixels x samples, channels) = (pixels x samples, kernel) * (kernel, channels)
+                result.noalias() = cols * W.transpose();
+                result.rowwise() += b.row(0);
+                store_tile(result, b0, n, s);
+            }
+        });
+    }
+
+    void backward_im2col(const MatrixRef &dLdy, int n_tasks, State &s) {
+        const int batchsize = (int)dLdy.rows();
+        const int n_pixels = output_size_.total();
+        const int chunk_rows = im2col_chunk_rows(batchsize, n_tasks);
+
+        // The tiles of the forward pass are no longer needed and are reused for the output gradients
+        // 順伝播のタイルはもう使わないので, 出力の勾配に再利用する
+        s.tiles.resize(chunk_rows * out_channels, n_tasks);
+        s.patch_grads.resize(chunk_rows * W.cols(), n_tasks);
+        parallel_for(0, n_tasks, [&](int t) {
+            const TaskRange range = task_range(t, n_tasks, batchsize);
+            auto partial_dW = s.partial_dW.middleCols(t * W.cols(), W.cols());
+            auto partial_db = s.partial_db.middleCols(t * out_channels, out_channels);
+            for (int b0 = range.begin; b0 < range.end; b0 += im2col_chunk_) {
+                const int n = std::min(im2col_chunk_, range.end - b0);
+                MatrixMap delta(s.tiles.col(t).data(), n_pixels * n, out_channels);
+                MatrixMap cols(s.patch_grads.col(t).data(), n_pixels * n, W.cols());
+                load_tile_gradient(dLdy, b0, n, delta, s);
+
+                // Patches are cached only for the last chunk of each task in "forward" to bound the memory
+                // usage. The others are recomputed here.
+                // メモリ使用量を抑えるため, "forward"ではパッチを各タスクの最後のチャンク分のみ保持し,
+                // 他はここで再計算する
+                const bool cached = method_ == ConvolutionMethod::Im2col && b0 + n == range.end &&
+                                    s.cols.rows() == chunk_rows * W.cols() && s.cols.cols() == n_tasks;
+                if (!cached) {
+                    im2col(s.input, b0, n, cols);
+                }
+                const MatrixMap patches(cached ? s.cols.col(t).data() : cols.data(), n_pixels * n, W.cols());
+                partial_dW.noalias() += delta.transpose() * patches;
+                partial_db += delta.colwise().sum();
+
+                if (propagate_) {
+                    cols.noalias() = delta * W;
+                    col2im(cols, b0, n, s.dLdx);
+                }
+            }
+        });
+    }
+
+    /**
+     * Rows of the patch matrix for a chunk. Each task has a slice (column) of this size in the scratch buffers.
+     * チャンクのパッチ行列の行数. 各タスクは作業用のバッファにこの大きさの区間 (列) をもつ
+     */
+    int im2col_chunk_rows(int batchsize, int n_tasks) const {
+        return output_size_.total() * std::min(im2col_chunk_, (batchsize + n_tasks - 1) / n_tasks);
+    }
+
+    void forward_direct(const MatrixRef &input, State &s) const {
+        const int batchsize = (int)input.rows();
+        const int n_input = input_size_.total() * in_channels;
+        const int n_pixels = output_size_.total();
+        const int L = direct_lanes_;
+        const int n_blocks = (out_channels + L - 1) / L;
+        const int block_weights = (int)W.cols() * L;
+        Assertion(w_packed_.size() == (size_t)(n_blocks * block_weights), "kernels are not packed!!");
+
+        // Each task copies its samples one by one to a contiguous buffer, convolves them block by block,
+        // and finally unpacks the blocked output. Activations between layers are batch-major, so that a sample
+        // is strided in the input and the output, and the copies keep the kernels on contiguous memory. Buffers
+        // are indexed by tasks rather than threads, since a thread may run several tasks in turn by stealing them.
+        // 各タスクは担当するサンプルを1つずつ連続したバッファにコピーしてブロック毎に畳み込み, 最後に出力を
+        // 元の配置に戻す. レイヤー間の活性値はバッチ方向が連続なので入出力の1サンプルは飛び飛びに並び,
+        // コピーによりカーネルは連続したメモリを読み書きする. スレッドは盗んだタスクを順に実行しうるので,
+        // バッファはスレッドではなくタスクで割り当てる
+        const int n_tasks = parallel_task_count(batchsize);
+        s.samples.resize(n_input, n_tasks);
+        s.blocks.resize(n_blocks * n_pixels * L, n_tasks);
+
+        s.output.resize(batchsize, n_pixels * out_channels);
+        parallel_for(0, n_tasks, [&](int t) {
+            Scalar *in = s.samples.col(t).data();
+            Scalar *out = s.blocks.col(t).data();
+            const TaskRange range = task_range(t, n_tasks, batchsize);
+            for (int b = range.begin; b < range.end; b++) {
+                for (int i = 0; i < n_input; i++) {
+                    in[i] = input(b, i);
+                }
+
+                for (int k = 0; k < n_blocks; k++) {
+                    direct_kernel_(in, &w_packed_[k * block_weights], &b_packed_[k * L], out + k * n_pixels * L,
+                                   direct_shape_);
+                }
+
+                for (int o = 0; o < out_channels; o++) {
+                    const Scalar *block = out + (o / L) * n_pixels * L + (o % L);
+                    for (int p = 0; p < n_pixels; p++) {
+                        s.output(b, o * n_pixels + p) = block[p * L];
+                    }
+                }
+            }
+        });
     }
 
-private:
-    // Private methods
     void initialize() {
         for (int fin = 0; fin < in_channels; fin++) {
             for (int fout = 0; fout < out_channels; fout++) {
@@ -152,28 +603,24 @@ private:
 
                 int input_index = fin * input_size_.total() + (yin * input_size_.cols + xin);
                 int output_index = fout * output_size_.total() + (yout * output_size_.cols + xout);
-                int kernel_index = fout * in_channels + fin;
-                add_edge(input_index, output_index, kernel_index, dy, dx);
+                int weight_index = fin * kernel_size_.total() + (dy * kernel_size_.cols + dx);
+                add_edge(input_index, output_index, weight_index);
             }
         }
     }
 
-    void add_edge(int input_id, int output_id, int kernel_id, int ky, int kx) {
-        edges_o2i[output_id].emplace_back(input_id, kernel_id, ky, kx);
+    void add_edge(int input_id, int output_id, int weight_id) {
+        edges_o2i[output_id].emplace_back(input_id, weight_id);
     }
 
     // Private internal classes
     struct Edge {
         int to = 0;
-        int kernel_id = 0;
-        int ky = 0;
-        int kx = 0;
+        int weight_id = 0;
 
-        Edge(int to_, int kernel_id_, int ky_, int kx_)
+        Edge(int to_, int weight_id_)
             : to(to_)
-            , kernel_id(kernel_id_)
-            , ky(ky_)
-            , kx(kx_) {
+            , weight_id(weight_id_) {
         }
     };
 
@@ -182,13 +629,254 @@ private:
     Size output_size_ = {};
     int in_channels = 0;
     int out_channels = 0;
+    ConvolutionMethod method_ = ConvolutionMethod::Im2col;
+
+    // Kernel and its configuration for the direct convolution
+    // 直接畳み込みのカーネルとその設定
+    DirectConvKernelT<Scalar> direct_kernel_ = nullptr;
+    DirectConvShape direct_shape_ = {};
+    int direct_lanes_ = 0;
+    // Kernels and biases packed by "prepare", which are shared by all the states
+    // "prepare"で並べ替えたカーネルとバイアス. 全ての状態で共有する
+    std::vector<Scalar> w_packed_ = {};
+    std::vector<Scalar> b_packed_ = {};
+
+    // Number of samples lowered to the patch matrix at once
+    // 一度にパッチ行列に展開するサンプル数
+    int im2col_chunk_ = 64;
 
     std::vector<std::vector<Edge>> edges_o2i = {};
 
-    std::vector<Matrix> W = {};
-    std::vector<double> b = {};
-    std::vector<Matrix> dW = {};
-    std::vector<double> db = {};
+    Parameter W = {};
+    Parameter b = {};
+    // Parameter gradients of the last batch, summed up over the tasks
+    // 直前のバッチに対するパラメータの勾配. タスクについて足し合わせたもの
+    Parameter dW = {};
+    Parameter db = {};
 };
 
+using ConvolutionLayer = ConvolutionLayerT<ScalarType>;
+
+/**
+ * Convolution layer fused with the following max pooling and/or activation. They are applied to each output
+ * tile of the im2col GEMM while the tile is still in cache, and the gradient is scattered back to the tile
+ * through them in backward, so that the output of the convolution itself is never written to memory.
+ * 後に続く最大値プーリングや活性化関数と融合した畳み込み層. これらはim2colの行列積の出力のタイルが
+ * キャッシュにあるうちに適用し, 逆伝播では勾配をこれらを通してタイルに戻すので, 畳み込み自体の出力は
+ * メモリに書き出されない
+ */
+template <typename Scalar>
+class FusedConvolutionLayerT : public ConvolutionLayerT<Scalar> {
+public:
+    using Base = ConvolutionLayerT<Scalar>;
+    using MatrixMap = MatrixMapT<Scalar>;
+    using MatrixRef = MatrixRefT<Scalar>;
+    using Pooling = MaxPoolingLayerT<Scalar>;
+    using LayerState = LayerStateT<Scalar>;
+    using Base::forward;
+    using Base::backward;
+    using Base::output_size_;
+    using Base::out_channels;
+
+    FusedConvolutionLayerT(const Base &layer, const std::shared_ptr<Pooling> &pooling, Activation activation)
+        : Base(layer)
+        , pooling_(pooling)
+        , activation_(activation) {
+        if (pooling_) {
+            Assertion(pooling_->input_size().rows == output_size_.rows &&
+                          pooling_->input_size().cols == output_size_.cols && pooling_->channels() == out_channels,
+                      "pooling does not match the output of convolution!!");
+        }
+    }
+
+    const char *name() const override {
+        return "FusedConvolution";
+    }
+
+    Shape output_shape(const Shape &input) const override {
+        return Shape(out_channels, pooling_ ? pooling_->output_size() : output_size_);
+    }
+
+    // The pooling and the activation are applied to the tiles of the im2col GEMM, which is thus kept
+    // プーリングと活性化関数はim2colの行列積のタイルに適用するので, im2colのままとする
+    void select_kernel(bool training) override {
+    }
+
+    std::unique_ptr<LayerState> make_state() const override {
+        return std::unique_ptr<LayerState>(new State());
+    }
+
+    const MatrixMap &forward(const MatrixRef &input, LayerState &state) const override {
+        State &s = static_cast<State &>(state);
+        const int batchsize = (int)input.rows();
+        const int n_pixels = pooling_ ? pooling_->output_size().total() : output_size_.total();
+
+        s.input.bind(input);
+        s.output.resize(batchsize, n_pixels * out_channels);
+        if (pooling_ && s.training) {
+            s.argmax.resize((size_t)batchsize * n_pixels * out_channels);
+        }
+        this->forward_im2col(input, s);
+        return s.output;
+    }
+
+    bool needs_output() const override {
+        return activation_ != Activation::Identity;
+    }
+
+    std::shared_ptr<AbstractLayerT<Scalar>> fuse(const std::vector<std::shared_ptr<AbstractLayerT<Scalar>>> &layers,
+                                                 int i, int &n_fused) const override {
+        n_fused = 1;
+        return nullptr;
+    }
+
+    const std::shared_ptr<Pooling> &pooling() const {
+        return pooling_;
+    }
+    Activation activation() const {
+        return activation_;
+    }
+
+protected:
+    // State of the convolution with the offsets of the maxima in the windows, as in "MaxPoolingLayerT"
+    // 畳み込みの状態に窓内の最大値の位置を加えたもの. "MaxPoolingLayerT"と同様
+    struct State : public Base::State {
+        std::vector<uint8_t> argmax = {};
+    };
+
+    /**
+     * Pooling follows "MaxPoolingLayerT" and the activation is applied to the maxima, so that the result
+     * is exactly the same as that of the separate layers.
+     * プーリングは"MaxPoolingLayerT"と同じ方法で行い, 活性化関数は最大値に適用するので,
+     * 結果は個別のレイヤーと全く同じになる
+     */
+    void store_tile(const MatrixMap &tile, int b0, int n, typename Base::State &state) const override {
+        State &s = static_cast<State &>(state);
+        const int n_pixels = output_size_.total();
+        if (!pooling_) {
+            for (int o = 0; o < out_channels; o++) {
+                for (int p = 0; p < n_pixels; p++) {
+                    for (int i = 0; i < n; i++) {
+                        s.output(b0 + i, o * n_pixels + p) = activate(activation_, tile(p * n + i, o));
+                    }
+                }
+            }
+            return;
+        }
+
+        const Size pool_size = pooling_->pool_size();
+        const int n_pooled = pooling_->output_size().total();
+        const int n_output = n_pooled * out_channels;
+        for (int o = 0; o < out_channels; o++) {
+            for (int q = 0; q < n_pooled; q++) {
+                const int origin = window_origin(q);
+                for (int i = 0; i < n; i++) {
+                    Scalar maxval = (Scalar)-INFTY;
+                    int active_offset = 0;
+                    for (int dy = 0; dy < pool_size.rows; dy++) {
+                        for (int dx = 0; dx < pool_size.cols; dx++) {
+                            const Scalar value = tile((origin + dy * output_size_.cols + dx) * n + i, o);
+                            if (maxval < value) {
+                                maxval = value;
+                                active_offset = dy * pool_size.cols + dx;
+                            }
+                        }
+                    }
+
+                    s.output(b0 + i, o * n_pooled + q) = activate(activation_, maxval);
+                    if (s.training) {
+                        s.argmax[(size_t)(b0 + i) * n_output + o * n_pooled + q] = (uint8_t)active_offset;
+                    }
+                }
+            }
+        }
+    }
+
+    void load_tile_gradient(const MatrixRef &dLdy, int b0, int n, MatrixMap &delta,
+                            const typename Base::State &state) const override {
+        const State &s = static_cast<const State &>(state);
+        const int n_pixels = output_size_.total();
+        if (!pooling_) {
+            for (int o = 0; o < out_channels; o++) {
+                for (int p = 0; p < n_pixels; p++) {
+                    const int j = o * n_pixels + p;
+                    for (int i = 0; i < n; i++) {
+                        delta(p * n + i, o) = dLdy(b0 + i, j) * activation_slope(activation_, s.output(b0 + i, j));
+                    }
+                }
+            }
+            return;
+        }
+
+        // Only the maximum of each window receives the gradient
+        // 各窓の最大値のみが勾配を受け取る
+        const int pool_cols = pooling_->pool_size().cols;
+        const int n_pooled = pooling_->output_size().total();
+        const int n_output = n_pooled * out_channels;
+        delta.setZero();
+        for (int o = 0; o < out_channels; o++) {
+            for (int q = 0; q < n_pooled; q++) {
+                const int origin = window_origin(q);
+                const int j = o * n_pooled + q;
+                for (int i = 0; i < n; i++) {
+                    const int offset = s.argmax[(size_t)(b0 + i) * n_output + j];
+                    const int p = origin + (offset / pool_cols) * output_size_.cols + offset % pool_cols;
+                    delta(p * n + i, o) += dLdy(b0 + i, j) * activation_slope(activation_, s.output(b0 + i, j));
+                }
+            }
+        }
+    }
+
+private:
+    /**
+     * Convolution output pixel at the top-left of the window for pooled pixel "q"
+     * プーリング後の画素"q"に対応する窓の左上の畳み込みの出力画素
+     */
+    int window_origin(int q) const {
+        const int y = (q / pooling_->output_size().cols) * pooling_->stride().rows;
+        const int x = (q % pooling_->output_size().cols) * pooling_->stride().cols;
+        return y * output_size_.cols + x;
+    }
+
+    std::shared_ptr<Pooling> pooling_ = nullptr;
+    Activation activation_ = Activation::Identity;
+};
+
+using FusedConvolutionLayer = FusedConvolutionLayerT<ScalarType>;
+
+template <typename Scalar>
+std::shared_ptr<AbstractLayerT<Scalar>> ConvolutionLayerT<Scalar>::fuse(
+    const std::vector<std::shared_ptr<AbstractLayerT<Scalar>>> &layers, int i, int &n_fused) const {
+    n_fused = 1;
+    if (method_ != ConvolutionMethod::Im2col) {
+        return nullptr;
+    }
+
+    // Max pooling over the output and an activation, each of which is optional
+    // 出力に対する最大値プーリングと活性化関数. それぞれ省略できる
+    const int n_layers = (int)layers.size();
+    int j = i + 1;
+    std::shared_ptr<MaxPoolingLayerT<Scalar>> pooling = nullptr;
+    if (j < n_layers) {
+        pooling = std::dynamic_pointer_cast<MaxPoolingLayerT<Scalar>>(layers[j]);
+        if (pooling && pooling->input_size().rows == output_size_.rows &&
+            pooling->input_size().cols == output_size_.cols && pooling->channels() == out_channels) {
+            j++;
+        } else {
+            pooling = nullptr;
+        }
+    }
+
+    const Activation activation = j < n_layers ? activation_of(layers[j].get()) : Activation::Identity;
+    if (activation != Activation::Identity) {
+        j++;
+    }
+
+    if (j == i + 1) {
+        return nullptr;
+    }
+    n_fused = j - i;
+    return std::make_shared<FusedConvolutionLayerT<Scalar>>(*this, pooling, activation);
+}
+
 #endif  // _CONVOLUTION_LAYER_H_
@@ -0,0 +1,198 @@
+#ifdef _MSC_VER
+#pragma once
+#endif
+
+#ifndef _DATA_PARALLEL_H_
+#define _DATA_PARALLEL_H_
+
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include <functional>
+
+#include "common.h"
+#include "losses.h"
+#include "network.h"
+#include "parallel.h"
+
+/**
+ * Synchronous data-parallel trainer. Each batch is split into slices over "K" replicas of a network, which
+ * share the parameters of the first replica. The replicas run forward and backward on their slices in
+ * parallel, then the parameter gradients are summed up by an all-reduce, and the optimizer applies a single
+ * update to the shared parameters. Since the losses are sums over samples, the summed gradients are
+ * those of the whole batch. The slices and the order of the sums depend only on "K", so that the results are
+ * bit-reproducible for a fixed number of replicas.
+ * 同期型のデータ並列の学習器. 各バッチはネットワークの"K"個のレプリカにスライスとして分割する. レプリカは
+ * 最初のレプリカのパラメータを共有する. レプリカは各自のスライスの順伝播と逆伝播を並列に行い,
+ * パラメータの勾配をall-reduceで足し合わせて, 最適化手法が共有するパラメータを1回だけ更新する. 損失はサンプルの和
+ * なので, 足し合わせた勾配はバッチ全体の勾配となる. スライスと和の順序は"K"のみで決まるので, レプリカの
+ * 数を固定すれば結果はビット単位で再現する
+ */
+template <typename Scalar>
+class DataParallelTrainerT : private Uncopyable {
+public:
+    using Matrix = MatrixT<Scalar>;
+    using MatrixMap = MatrixMapT<Scalar>;
+    using MatrixRef = MatrixRefT<Scalar>;
+    using Network = NetworkT<Scalar>;
+    using Loss = AbstractLossT<Scalar>;
+    using Optimizer = AbstractOptimizerT<Scalar>;
+
+    struct StepResult {
+        double loss = 0.0;
+        double accuracy = 0.0;
+    };
+
+    /**
+     * Create "n_replicas" replicas with "make_network" and their loss functions with "make_loss", whose
+     * parameters are updated by "optimizer". The networks must have the same architecture.
+     * "make_network"で"n_replicas"個のレプリカを, "make_loss"でそれらの損失関数を作る. パラメータは
+     * "optimizer"が更新する. ネットワークの構造は同じでなければならない
+     */
+    DataParallelTrainerT(int n_replicas, const std::function<std::shared_ptr<Network>()> &make_network,
+                         const std::function<std::shared_ptr<Loss>()> &make_loss, Optimizer &optimizer)
+        : optimizer_(optimizer) {
+        Assertion(n_replicas > 0, "number of replicas must be positive!!");
+        for (int k = 0; k < n_replicas; k++) {
+            replicas_.push_back(make_network());
+            criteria_.push_back(make_loss());
+        }
+        gradients_.resize(n_replicas);
+        loss_sums_.resize(n_replicas);
+        correct_.resize(n_replicas);
+    }
+
+    /**
+     * Plan the workspaces of the replicas for batches of up to "max_batchsize" samples, let the replicas share
+     * the parameters of the first one, and attach the optimizer to them. Returns the total size of the arenas
+     * in bytes.
+     * 最大"max_batchsize"サンプルのバッチに対してレプリカの作業領域を計画し, レプリカに最初のレプリカの
+     * パラメータを共有させて, 最適化手法をそれに結び付ける. アリーナの合計のバイト数を返す
+     */
+    size_t plan(int max_batchsize, int n_inputs) {
+        const int slice = slice_size(max_batchsize);
+        size_t bytes = 0;
+        for (int k = 0; k < n_replicas(); k++) {
+            bytes += replicas_[k]->plan(slice, n_inputs, criteria_[k].get());
+            gradients_[k] = replicas_[k]->flat_parameters().gradients->data();
+        }
+
+        std::vector<NamedParameterT<Scalar>> shared, params;
+        replicas_[0]->parameters(shared);
+        for (int k = 1; k < n_replicas(); k++) {
+            params.clear();
+            replicas_[k]->parameters(params);
+            Assertion(params.size() == shared.size(), "replicas must have the same architecture!!");
+            for (size_t i = 0; i < params.size(); i++) {
+                params[i].value->share(*shared[i].value);
+            }
+        }
+        optimizer_.attach(replicas_[0]->flat_parameters());
+        return bytes;
+    }
+
+    /**
+     * Train with a batch of "data" and one-hot "labels", and return the mean loss and the accuracy
+     * "data"とone-hotの"labels"のバッチで学習し, 平均の損失と精度を返す
+     */
+    StepResult step(const MatrixRef &data, const MatrixRef &labels) {
+        const int batchsize = (int)data.rows();
+        const int slice = slice_size(batchsize);
+        const int n_active = (batchsize + slice - 1) / slice;
+
+        auto run = [&](int k) {
+            const int b0 = k * slice;
+            const int n = std::min(slice, batchsize - b0);
+            const auto &output = replicas_[k]->forward(data.middleRows(b0, n));
+            loss_sums_[k] = criteria_[k]->forward(output, labels.middleRows(b0, n)).sum();
+            correct_[k] = accuracy(output, labels.middleRows(b0, n)) * n / 100.0;
+            replicas_[k]->backward(criteria_[k]->backward());
+        };
+
+        // A single replica runs the network as usual with the parallelism inside the layers. Otherwise, each
+        // replica runs as a task of the thread pool, whose layers run single-threaded. The limit of threads
+        // applies only to the thread running the task while the replica runs.
+        // レプリカが1つであれば, レイヤー内の並列化を用いて通常通りネットワークを実行する. そうでなければ
+        // 各レプリカはスレッドプールのタスクとして動き, そのレイヤーはシングルスレッドで動く. スレッド数の
+        // 上限はレプリカの実行中にそのタスクを実行するスレッドにのみ適用される
+        if (n_active == 1) {
+            run(0);
+        } else {
+            parallel_for(0, n_active, [&](int k) {
+                ScopedThreadLimit limit(1);
+                run(k);
+            });
+            all_reduce(n_active);
+        }
+        optimizer_.step();
+
+        StepResult result;
+        for (int k = 0; k < n_active; k++) {
+            result.loss += loss_sums_[k];
+            result.accuracy += correct_[k];
+        }
+        result.loss /= batchsize;
+        result.accuracy *= 100.0 / batchsize;
+        return result;
+    }
+
+    /**
+     * First replica, which holds the shared parameters (e.g., for evaluation and checkpoints)
+     * 共有するパラメータをもつ最初のレプリカ (評価やチェックポイントなどに用いる)
+     */
+    Network &network() {
+        return *replicas_[0];
+    }
+
+    int n_replicas() const {
+        return (int)replicas_.size();
+    }
+
+private:
+    int slice_size(int batchsize) const {
+        return std::max(1, (batchsize + n_replicas() - 1) / n_replicas());
+    }
+
+    /**
+     * Sum up the flat gradients of the first "n" replicas into those of the first replica. The gradients are
+     * split into chunks of cache lines, and each thread reduces its chunks over the replicas with a pairwise
+     * tree while the chunk stays in cache, instead of sweeping the whole gradients once per level of the tree.
+     * 最初の"n"個のレプリカの平坦な勾配を最初のレプリカの勾配に足し合わせる. 勾配はキャッシュラインからなる
+     * チャンクに分割し, 各スレッドは担当するチャンクがキャッシュにあるうちにレプリカについて二分木で集約する.
+     * これにより木の段毎に勾配全体を走査することを避ける
+     */
+    void all_reduce(int n) {
+        const Eigen::Index size = replicas_[0]->flat_parameters().size();
+        const int n_chunks = (int)((size + chunk_size - 1) / chunk_size);
+        parallel_for(0, n_chunks, [&](int c) {
+            const Eigen::Index begin = (Eigen::Index)c * chunk_size;
+            const int chunk = (int)std::min((Eigen::Index)chunk_size, size - begin);
+            for (int stride = 1; stride < n; stride *= 2) {
+                for (int k = 0; k + stride < n; k += 2 * stride) {
+                    Scalar *dst = gradients_[k] + begin;
+                    const Scalar *src = gradients_[k + stride] + begin;
+                    for (int j = 0; j < chunk; j++) {
+                        dst[j] += src[j];
+                    }
+                }
+            }
+        });
+    }
+
+    // Number of elements reduced at once by a thread, which is a multiple of cache lines
+    // スレッドが一度に集約する要素数. キャッシュラインの倍数
+    static const int chunk_size = 2048;
+
+    std::vector<std::shared_ptr<Network>> replicas_;
+    std::vector<std::shared_ptr<Loss>> criteria_;
+    Optimizer &optimizer_;
+    // Flat gradients of the replicas
+    // レプリカの平坦な勾配
+    std::vector<Scalar *> gradients_;
+    std::vector<double> loss_sums_;
+    std::vector<double> correct_;
+};
+
+using DataParallelTrainer = DataParallelTrainerT<ScalarType>;
+
+#endif  // _DATA_PARALLEL_H_
@@ -0,0 +1,351 @@
+#ifdef _MSC_VER
+#pragma once
+#endif
+
+#ifndef _DIRECT_CONVOLUTION_H_
+#define _DIRECT_CONVOLUTION_H_
+
+#include "common.h"
+#include "simd.h"
+
+/**
+ * Shape of a direct convolution for one sample
+ * 1サンプル分の直接畳み込みの形状
+ */
+struct DirectConvShape {
+    Size input_size = {};
+    Size kernel_size = {};
+    Size output_size = {};
+    int in_channels = 0;
+};
+
+/**
+ * Direct convolution kernel for one block of output channels of one sample, in "double" or "float".
+ *   in: input pixels, laid out as [in_channels][rows][cols]
+ *   w: kernels, laid out as [in_channels][ky][kx][lanes]
+ *   bias: biases, laid out as [lanes]
+ *   out: output pixels, laid out as [rows][cols][lanes] (channel-blocked layout)
+ * 1サンプルの出力チャンネル1ブロック分を計算する直接畳み込みのカーネル ("double"または"float").
+ *   in: 入力画素. [入力チャンネル][行][列]の順に並ぶ
+ *   w: カーネル. [入力チャンネル][ky][kx][レーン]の順に並ぶ
+ *   bias: バイアス. [レーン]の順に並ぶ
+ *   out: 出力画素. [行][列][レーン]の順に並ぶ (チャンネルをブロック化した配置)
+ */
+template <typename T>
+using DirectConvKernelT = void (*)(const T *in, const T *w, const T *bias, T *out, const DirectConvShape &shape);
+
+// Number of output pixels in a row which are kept in registers at once
+// 一度にレジスタ上に保持する, 行方向に並んだ出力画素の数
+static const int DIRECT_CONV_TILE = 8;
+
+// -----------------------------------------------------------------------------
+// Scalar fallback
+// -----------------------------------------------------------------------------
+
+/**
+ * Lanes of the scalar fallback, which are as many as those of AVX2 so that the compiler may vectorize them
+ * スカラー実装のレーン数. コンパイラがベクトル化できるよう, AVX2のレーン数と同じにする
+ */
+template <typename T>
+struct DirectConvScalarLanes {
+    static const int value = 32 / (int)sizeof(T);
+};
+
+template <typename T, int KH, int KW, int TX>
+inline void direct_conv_tile_scalar(const T *in, const T *w, const T *bias, T *out, const DirectConvShape &s) {
+    const int L = DirectConvScalarLanes<T>::value;
+    const int kh = KH > 0 ? KH : s.kernel_size.rows;
+    const int kw = KW > 0 ? KW : s.kernel_size.cols;
+
+    T acc[TX][L];
+    for (int t = 0; t < TX; t++) {
+        for (int v = 0; v < L; v++) {
+            acc[t][v] = bias[v];
+        }
+    }
+
+    for (int c = 0; c < s.in_channels; c++) {
+        const T *ic = in + c * s.input_size.total();
+        const T *wc = w + c * kh * kw * L;
+        for (int ky = 0; ky < kh; ky++) {
+            for (int kx = 0; kx < kw; kx++) {
+                const T *wv = wc + (ky * kw + kx) * L;
+                const T *iv = ic + ky * s.input_size.cols + kx;
+                for (int t = 0; t < TX; t++) {
+                    for (int v = 0; v < L; v++) {
+                        acc[t][v] += iv[t] * wv[v];
+                    }
+                }
+            }
+        }
+    }
+
+    for (int t = 0; t < TX; t++) {
+        for (int v = 0; v < L; v++) {
+            out[t * L + v] = acc[t][v];
+        }
+    }
+}
+
+template <typename T, int KH, int KW>
+void direct_conv_scalar(const T *in, const T *w, const T *bias, T *out, const DirectConvShape &s) {
+    const int L = DirectConvScalarLanes<T>::value;
+    const int TX = DIRECT_CONV_TILE;
+    for (int y = 0; y < s.output_size.rows; y++) {
+        const T *iy = in + y * s.input_size.cols;
+        T *oy = out + y * s.output_size.cols * L;
+        int x = 0;
+        for (; x + TX <= s.output_size.cols; x += TX) {
+            direct_conv_tile_scalar<T, KH, KW, TX>(iy + x, w, bias, oy + x * L, s);
+        }
+        for (; x < s.output_size.cols; x++) {
+            direct_conv_tile_scalar<T, KH, KW, 1>(iy + x, w, bias, oy + x * L, s);
+        }
+    }
+}
+
+#if defined(SIMD_X86)
+
+// -----------------------------------------------------------------------------
+// AVX2 (4 doubles or 8 floats of output channels in a ymm register)
+// -----------------------------------------------------------------------------
+
+/**
+ * Vector operations of AVX2 for each scalar type
+ * スカラー型毎のAVX2のベクトル演算
+ */
+template <typename T>
+struct DirectConvAvx2;
+
+template <>
+struct DirectConvAvx2<double> {
+    using Vector = __m256d;
+    static const int lanes = 4;
+
+    SIMD_TARGET_AVX2 static inline Vector load(const double *p) {
+        return _mm256_loadu_pd(p);
+    }
+    SIMD_TARGET_AVX2 static inline Vector broadcast(const double *p) {
+        return _mm256_broadcast_sd(p);
+    }
+    SIMD_TARGET_AVX2 static inline Vector fmadd(Vector a, Vector b, Vector c) {
+        return _mm256_fmadd_pd(a, b, c);
+    }
+    SIMD_TARGET_AVX2 static inline void store(double *p, Vector v) {
+        _mm256_storeu_pd(p, v);
+    }
+};
+
+template <>
+struct DirectConvAvx2<float> {
+    using Vector = __m256;
+    static const int lanes = 8;
+
+    SIMD_TARGET_AVX2 static inline Vector load(const float *p) {
+        return _mm256_loadu_ps(p);
+    }
+    SIMD_TARGET_AVX2 static inline Vector broadcast(const float *p) {
+        return _mm256_broadcast_ss(p);
+    }
+    SIMD_TARGET_AVX2 static inline Vector fmadd(Vector a, Vector b, Vector c) {
+        return _mm256_fmadd_ps(a, b, c);
+    }
+    SIMD_TARGET_AVX2 static inline void store(float *p, Vector v) {
+        _mm256_storeu_ps(p, v);
+    }
+};
+
+template <typename T, int KH, int KW, int TX>
+SIMD_TARGET_AVX2 inline void direct_conv_tile_avx2(const T *in, const T *w, const T *bias, T *out,
+                                                   const DirectConvShape &s) {
+    using Ops = DirectConvAvx2<T>;
+    const int L = Ops::lanes;
+    const int kh = KH > 0 ? KH : s.kernel_size.rows;
+    const int kw = KW > 0 ? KW : s.kernel_size.cols;
+
+    typename Ops::Vector acc[TX];
+    const typename Ops::Vector b = Ops::load(bias);
+    for (int t = 0; t < TX; t++) {
+        acc[t] = b;
+    }
+
+    for (int c = 0; c < s.in_channels; c++) {
+        const T *ic = in + c * s.input_size.total();
+        const T *wc = w + c * kh * kw * L;
+        for (int ky = 0; ky < kh; ky++) {
+            for (int kx = 0; kx < kw; kx++) {
+                const typename Ops::Vector wv = Ops::load(wc + (ky * kw + kx) * L);
+                const T *iv = ic + ky * s.input_size.cols + kx;
+                for (int t = 0; t < TX; t++) {
+                    acc[t] = Ops::fmadd(Ops::broadcast(iv + t), wv, acc[t]);
+                }
+            }
+        }
+    }
+
+    for (int t = 0; t < TX; t++) {
+        Ops::store(out + t * L, acc[t]);
+    }
+}
+
+template <typename T, int KH, int KW>
+SIMD_TARGET_AVX2 void direct_conv_avx2(const T *in, const T *w, const T *bias, T *out, const DirectConvShape &s) {
+    const int L = DirectConvAvx2<T>::lanes;
+    const int TX = DIRECT_CONV_TILE;
+    for (int y = 0; y < s.output_size.rows; y++) {
+        const T *iy = in + y * s.input_size.cols;
+        T *oy = out + y * s.output_size.cols * L;
+        int x = 0;
+        for (; x + TX <= s.output_size.cols; x += TX) {
+            direct_conv_tile_avx2<T, KH, KW, TX>(iy + x, w, bias, oy + x * L, s);
+        }
+        for (; x < s.output_size.cols; x++) {
+            direct_conv_tile_avx2<T, KH, KW, 1>(iy + x, w, bias, oy + x * L, s);
+        }
+    }
+}
+
+// -----------------------------------------------------------------------------
+// AVX-512 (8 doubles or 16 floats of output channels in a zmm register)
+// -----------------------------------------------------------------------------
+
+/**
+ * Vector operations of AVX-512 for each scalar type
+ * スカラー型毎のAVX-512のベクトル演算
+ */
+template <typename T>
+struct DirectConvAvx512;
+
+template <>
+struct DirectConvAvx512<double> {
+    using Vector = __m512d;
+    static const int lanes = 8;
+
+    SIMD_TARGET_AVX512 static inline Vector load(const double *p) {
+        return _mm512_loadu_pd(p);
+    }
+    SIMD_TARGET_AVX512 static inline Vector broadcast(const double *p) {
+        return _mm512_set1_pd(*p);
+    }
+    SIMD_TARGET_AVX512 static inline Vector fmadd(Vector a, Vector b, Vector c) {
+        return _mm512_fmadd_pd(a, b, c);
+    }
+    SIMD_TARGET_AVX512 static inline void store(double *p, Vector v) {
+        _mm512_storeu_pd(p, v);
+    }
+};
+
+template <>
+struct DirectConvAvx512<float> {
+    using Vector = __m512;
+    static const int lanes = 16;
+
+    SIMD_TARGET_AVX512 static inline Vector load(const float *p) {
+        return _mm512_loadu_ps(p);
+    }
+    SIMD_TARGET_AVX512 static inline Vector broadcast(const float *p) {
+        return _mm512_set1_ps(*p);
+    }
+    SIMD_TARGET_AVX512 static inline Vector fmadd(Vector a, Vector b, Vector c) {
+        return _mm512_fmadd_ps(a, b, c);
+    }
+    SIMD_TARGET_AVX512 static inline void store(float *p, Vector v) {
+        _mm512_storeu_ps(p, v);
+    }
+};
+
+template <typename T, int KH, int KW, int TX>
+SIMD_TARGET_AVX512 inline void direct_conv_tile_avx512(const T *in, const T *w, const T *bias, T *out,
+                                                       const DirectConvShape &s) {
+    using Ops = DirectConvAvx512<T>;
+    const int L = Ops::lanes;
+    const int kh = KH > 0 ? KH : s.kernel_size.rows;
+    const int kw = KW > 0 ? KW : s.kernel_size.cols;
+
+    typename Ops::Vector acc[TX];
+    const typename Ops::Vector b = Ops::load(bias);
+    for (int t = 0; t < TX; t++) {
+        acc[t] = b;
+    }
+
+    for (int c = 0; c < s.in_channels; c++) {
+        const T *ic = in + c * s.input_size.total();
+        const T *wc = w + c * kh * kw * L;
+        for (int ky = 0; ky < kh; ky++) {
+            for (int kx = 0; kx < kw; kx++) {
+                const typename Ops::Vector wv = Ops::load(wc + (ky * kw + kx) * L);
+                const T *iv = ic + ky * s.input_size.cols + kx;
+                for (int t = 0; t < TX; t++) {
+                    acc[t] = Ops::fmadd(Ops::broadcast(iv + t), wv, acc[t]);
+                }
+            }
+        }
+    }
+
+    for (int t = 0; t < TX; t++) {
+        Ops::store(out + t * L, acc[t]);
+    }
+}
+
+template <typename T, int KH, int KW>
+SIMD_TARGET_AVX512 void direct_conv_avx512(const T *in, const T *w, const T *bias, T *out,
+                                           const DirectConvShape &s) {
+    const int L = DirectConvAvx512<T>::lanes;
+    const int TX = DIRECT_CONV_TILE;
+    for (int y = 0; y < s.output_size.rows; y++) {
+        const T *iy = in + y * s.input_size.cols;
+        T *oy = out + y * s.output_size.cols * L;
+        int x = 0;
+        for (; x + TX <= s.output_size.cols; x += TX) {
+            direct_conv_tile_avx512<T, KH, KW, TX>(iy + x, w, bias, oy + x * L, s);
+        }
+        for (; x < s.output_size.cols; x++) {
+            direct_conv_tile_avx512<T, KH, KW, 1>(iy + x, w, bias, oy + x * L, s);
+        }
+    }
+}
+
+#endif  // SIMD_X86
+
+// -----------------------------------------------------------------------------
+// Runtime dispatch
+// -----------------------------------------------------------------------------
+
+/**
+ * Number of output channels in a block for the instruction set and the scalar type
+ * 命令セットとスカラー型に対応する, 1ブロック中の出力チャンネル数
+ */
+template <typename T>
+inline int direct_conv_lanes(SimdLevel level) {
+#if defined(SIMD_X86)
+    if (level == SimdLevel::AVX512) {
+        return DirectConvAvx512<T>::lanes;
+    }
+    if (level == SimdLevel::AVX2) {
+        return DirectConvAvx2<T>::lanes;
+    }
+#endif
+    return DirectConvScalarLanes<T>::value;
+}
+
+/**
+ * Select a kernel for the instruction set. Kernel loops are fully unrolled for 3x3 and 5x5 kernels.
+ * 命令セットに対応するカーネルを選ぶ. 3x3と5x5のカーネルではループが完全に展開される
+ */
+template <typename T>
+inline DirectConvKernelT<T> direct_conv_kernel(SimdLevel level, Size kernel_size) {
+    const bool is_3x3 = kernel_size.rows == 3 && kernel_size.cols == 3;
+    const bool is_5x5 = kernel_size.rows == 5 && kernel_size.cols == 5;
+#if defined(SIMD_X86)
+    if (level == SimdLevel::AVX512) {
+        return is_5x5 ? direct_conv_avx512<T, 5, 5>
+                      : is_3x3 ? direct_conv_avx512<T, 3, 3> : direct_conv_avx512<T, 0, 0>;
+    }
+    if (level == SimdLevel::AVX2) {
+        return is_5x5 ? direct_conv_avx2<T, 5, 5> : is_3x3 ? direct_conv_avx2<T, 3, 3> : direct_conv_avx2<T, 0, 0>;
+    }
+#endif
+    return is_5x5 ? direct_conv_scalar<T, 5, 5> : is_3x3 ? direct_conv_scalar<T, 3, 3> : direct_conv_scalar<T, 0, 0>;
+}
+
+#endif  // _DIRECT_CONVOLUTION_H_
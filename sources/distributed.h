@@ -0,0 +1,274 @@
+#ifdef _MSC_VER
+#pragma once
+#endif
+
+#ifndef _DISTRIBUTED_H_
+#define _DISTRIBUTED_H_
+
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <iostream>
+#include <algorithm>
+#include <condition_variable>
+
+#include "common.h"
+#include "losses.h"
+#include "network.h"
+#include "parallel.h"
+#include "transport.h"
+
+/**
+ * Sum up the "n" elements of "data" over all the ranks of "transport" with a ring all-reduce. The elements
+ * are split into one segment per rank. In the reduce-scatter phase, the partial sums of the segments go
+ * around the ring, and each rank ends up with the total of one segment, which goes around the ring again in
+ * the all-gather phase. Each rank sends and receives "2 (N - 1) / N" of the data regardless of the number of
+ * ranks "N". Segments are exchanged in messages, which are received into "scratch" of
+ * "AbstractTransport::message_bytes". The order of the sums depends only on the number of ranks, and all the
+ * ranks get identical results. Returns false if the connection is lost.
+ * "data"の"n"個の要素を"transport"の全ランクについてリングall-reduceで足し合わせる. 要素はランク毎の区間に
+ * 分割する. reduce-scatterの段階では区間の部分和がリングを回り, 各ランクは1つの区間の合計を得る. それが
+ * all-gatherの段階で再びリングを回る. 各ランクの送受信量はランク数"N"によらずデータの"2 (N - 1) / N"である.
+ * 区間はメッセージ単位でやり取りし, "AbstractTransport::message_bytes"の"scratch"に受け取る. 和の順序は
+ * ランク数のみで決まり, 全ランクが同一の結果を得る. 接続が失われた場合はfalseを返す
+ */
+template <typename Scalar>
+bool ring_all_reduce(AbstractTransport &transport, Scalar *data, int n, Scalar *scratch) {
+    const int n_ranks = transport.n_ranks();
+    const int rank = transport.rank();
+    const int piece = (int)(AbstractTransport::message_bytes / sizeof(Scalar));
+    auto segment = [&](int s) { return task_range((s % n_ranks + n_ranks) % n_ranks, n_ranks, n); };
+
+    for (int phase = 0; phase < 2; phase++) {
+        const bool reduce = phase == 0;
+        for (int t = 0; t < n_ranks - 1; t++) {
+            // Rank "r" sends segment "r - t" and receives segment "r - t - 1" when reducing, and sends the
+            // totals of segment "r + 1 - t" and receives segment "r - t" when gathering
+            // ランク"r"はreduceでは区間"r - t"を送って区間"r - t - 1"を受け取り, gatherでは区間"r + 1 - t"の
+            // 合計を送って区間"r - t"を受け取る
+            const TaskRange out = segment(reduce ? rank - t : rank + 1 - t);
+            const TaskRange in = segment(reduce ? rank - t - 1 : rank - t);
+            for (int offset = 0; offset < std::max(out.size(), in.size()); offset += piece) {
+                const int n_out = std::min(piece, out.size() - offset);
+                if (n_out > 0 && !transport.send(data + out.begin + offset, n_out * sizeof(Scalar))) {
+                    return false;
+                }
+
+                const int n_in = std::min(piece, in.size() - offset);
+                if (n_in <= 0) {
+                    continue;
+                }
+                Scalar *dst = data + in.begin + offset;
+                if (!transport.recv(reduce ? scratch : dst, n_in * sizeof(Scalar))) {
+                    return false;
+                }
+                if (reduce) {
+                    for (int i = 0; i < n_in; i++) {
+                        dst[i] += scratch[i];
+                    }
+                }
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * Copy the "n" elements of "data" on rank 0 to all the other ranks, which pass the messages on along the ring
+ * ランク0の"data"の"n"個の要素を他の全ランクにコピーする. メッセージはリングに沿って受け渡す
+ */
+template <typename Scalar>
+bool ring_broadcast(AbstractTransport &transport, Scalar *data, int n) {
+    const int piece = (int)(AbstractTransport::message_bytes / sizeof(Scalar));
+    for (int offset = 0; offset < n; offset += piece) {
+        const size_t bytes = std::min(piece, n - offset) * sizeof(Scalar);
+        if (transport.rank() != 0 && !transport.recv(data + offset, bytes)) {
+            return false;
+        }
+        if (transport.next_rank() != 0 && !transport.send(data + offset, bytes)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Data-parallel trainer over processes, each of which trains a replica of the network on its own shard of
+ * the data and is connected to the others by "transport". Every step, the parameter gradients are summed up
+ * over the ranks with ring all-reduces, so that the optimizers of all the replicas apply the same update,
+ * which is that of the batch of all the ranks. The gradients of each layer are a contiguous range of the flat
+ * gradient buffer, whose all-reduce runs on a communication thread as soon as "Network::backward" has computed
+ * them, which overlaps with the backward computation of the preceding layers.
+ * プロセス間のデータ並列の学習器. 各プロセスはデータの担当部分でネットワークのレプリカを学習し,
+ * "transport"で他のプロセスと結ばれる. 各ステップでパラメータの勾配をリングall-reduceで全ランクについて
+ * 足し合わせるので, 全レプリカの最適化手法は全ランクのバッチに対する同一の更新を行う. 各レイヤーの勾配は
+ * 平坦な勾配のバッファの連続した範囲であり, そのall-reduceは"Network::backward"がそれを計算し次第通信
+ * スレッドで行うので, 前のレイヤーの逆伝播の計算と重なる
+ */
+template <typename Scalar>
+class DistributedTrainerT : private Uncopyable {
+public:
+    using Matrix = MatrixT<Scalar>;
+    using MatrixMap = MatrixMapT<Scalar>;
+    using MatrixRef = MatrixRefT<Scalar>;
+
+    struct StepResult {
+        double loss = 0.0;
+        double accuracy = 0.0;
+    };
+
+    DistributedTrainerT(NetworkT<Scalar> &network, AbstractLossT<Scalar> &criterion,
+                        AbstractOptimizerT<Scalar> &optimizer, AbstractTransport &transport)
+        : network_(network)
+        , criterion_(criterion)
+        , optimizer_(optimizer)
+        , transport_(transport) {
+    }
+
+    ~DistributedTrainerT() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        pushed_cv_.notify_all();
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+    }
+
+    /**
+     * Plan the workspace of the network, copy the parameters of rank 0 to all the ranks, attach the optimizer
+     * to them, and start the communication thread. Returns the size of the arena in bytes.
+     * ネットワークの作業領域を計画し, ランク0のパラメータを全ランクにコピーし, 最適化手法をそれに結び付けて,
+     * 通信スレッドを開始する. アリーナのバイト数を返す
+     */
+    size_t plan(int max_batchsize, int n_inputs) {
+        const size_t bytes = network_.plan(max_batchsize, n_inputs, &criterion_);
+        const FlatParametersT<Scalar> &flat = network_.flat_parameters();
+        if (!ring_broadcast(transport_, flat.values->data(), (int)flat.size())) {
+            std::cerr << "Failed to broadcast parameters" << std::endl;
+            exit(1);
+        }
+        optimizer_.attach(flat);
+
+        // Range of the flat gradients of each layer, which is empty for the layers without parameters
+        // 各レイヤーの平坦な勾配の範囲. パラメータのないレイヤーでは空である
+        const int n_layers = (int)network_.layers().size();
+        buckets_.assign(n_layers, TaskRange());
+        std::vector<NamedParameterT<Scalar>> params;
+        for (int i = 0; i < n_layers; i++) {
+            params.clear();
+            network_.layers()[i]->parameters(params);
+            if (!params.empty()) {
+                buckets_[i].begin = (int)flat.offset(*params.front().value);
+                buckets_[i].end = (int)(flat.offset(*params.back().value) + params.back().value->size());
+            }
+        }
+        gradients_ = flat.gradients->data();
+        queue_.resize(n_layers);
+        scratch_.resize(AbstractTransport::message_bytes / sizeof(Scalar));
+
+        thread_ = std::thread(&DistributedTrainerT::communicate, this);
+        return bytes;
+    }
+
+    /**
+     * Train with the local batch of "data" and one-hot "labels", and return its mean loss and accuracy
+     * ローカルなバッチ"data"とone-hotの"labels"で学習し, その平均の損失と精度を返す
+     */
+    StepResult step(const MatrixRef &data, const MatrixRef &labels) {
+        StepResult result;
+        const auto &output = network_.forward(data);
+        result.loss = criterion_.forward(output, labels).mean();
+        result.accuracy = accuracy(output, labels);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            n_pushed_ = 0;
+            n_done_ = 0;
+        }
+        network_.backward(criterion_.backward(), [&](int i) {
+            if (buckets_[i].size() > 0) {
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    queue_[n_pushed_++] = i;
+                }
+                pushed_cv_.notify_one();
+            }
+        });
+
+        // Wait for the all-reduces still running after backward, which is the communication not overlapped
+        // 逆伝播の後もまだ実行中のall-reduceを待つ. これが重ならなかった通信である
+        {
+            const auto start = std::chrono::steady_clock::now();
+            std::unique_lock<std::mutex> lock(mutex_);
+            done_cv_.wait(lock, [&] { return n_done_ == n_pushed_; });
+            wait_seconds_ += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            if (failed_) {
+                std::cerr << "Failed to all-reduce gradients" << std::endl;
+                exit(1);
+            }
+        }
+        optimizer_.step();
+        return result;
+    }
+
+    //! Time waiting for the communication after backward
+    double wait_seconds() const {
+        return wait_seconds_;
+    }
+
+private:
+    void communicate() {
+        for (;;) {
+            int layer;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                pushed_cv_.wait(lock, [&] { return stop_ || n_done_ < n_pushed_; });
+                if (stop_) {
+                    return;
+                }
+                layer = queue_[n_done_];
+            }
+
+            const TaskRange &bucket = buckets_[layer];
+            const bool ok = ring_all_reduce(transport_, gradients_ + bucket.begin, bucket.size(), scratch_.data());
+
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                failed_ = failed_ || !ok;
+                n_done_ += 1;
+            }
+            done_cv_.notify_one();
+        }
+    }
+
+    NetworkT<Scalar> &network_;
+    AbstractLossT<Scalar> &criterion_;
+    AbstractOptimizerT<Scalar> &optimizer_;
+    AbstractTransport &transport_;
+
+    // Flat gradients, the range of each layer in them, and the layers queued for the all-reduce in the order
+    // of "backward"
+    // 平坦な勾配, その中の各レイヤーの範囲, "backward"の順にall-reduceを待つレイヤー
+    Scalar *gradients_ = nullptr;
+    std::vector<TaskRange> buckets_;
+    std::vector<int> queue_;
+    std::vector<Scalar> scratch_;
+
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable pushed_cv_;
+    std::condition_variable done_cv_;
+    int n_pushed_ = 0;
+    int n_done_ = 0;
+    bool failed_ = false;
+    bool stop_ = false;
+
+    double wait_seconds_ = 0.0;
+};
+
+using DistributedTrainer = DistributedTrainerT<ScalarType>;
+
+#endif  // _DISTRIBUTED_H_
@@ -6,12 +6,23 @@
 #define _EDUCNN_H_
 
 #include "timer.h"
+#include "profiler.h"
 #include "mnist.h"
 #include "network.h"
+#include "network_builder.h"
+#include "models.h"
+#include "optimizer.h"
+#include "evaluator.h"
+#include "batch_loader.h"
+#include "idx_stream.h"
+#include "gradient_accumulation.h"
+#include "data_parallel.h"
+#include "distributed.h"
 #include "losses.h"
 #include "convolution_layer.h"
 #include "max_pooling_layer.h"
 #include "average_pooling_layer.h"
 #include "fully_connected_layer.h"
+#include "quantized_network.h"
 
 #endif  // _EDUCNN_H_
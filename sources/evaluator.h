@@ -0,0 +1,120 @@
+#ifdef _MSC_VER
+#pragma once
+#endif
+
+#ifndef _EVALUATOR_H_
+#define _EVALUATOR_H_
+
+#include <cstdio>
+#include <algorithm>
+
+#include "common.h"
+#include "mnist.h"
+#include "network.h"
+
+/**
+ * Evaluation of a classifier accumulated chunk by chunk: the confusion matrix, whose rows are the true classes
+ * and columns are the predicted classes, and the accuracy.
+ * チャンク毎に集計する分類器の評価: 行が正解のクラス, 列が予測したクラスである混同行列と精度
+ */
+class Evaluator {
+public:
+    explicit Evaluator(int n_classes)
+        : confusion_(Eigen::MatrixXi::Zero(n_classes, n_classes)) {
+    }
+
+    /**
+     * Add predictions "pred" and one-hot labels "labels" of a chunk. Classes are taken as in "accuracy".
+     * チャンクの予測"pred"とone-hotの正解"labels"を追加する. クラスは"accuracy"と同様に決める
+     */
+    template <typename Derived1, typename Derived2>
+    void add(const Eigen::MatrixBase<Derived1> &pred, const Eigen::MatrixBase<Derived2> &labels) {
+        Assertion(pred.rows() == labels.rows(), "number of predictions and labels are different!!");
+        Assertion(pred.cols() == confusion_.cols() && labels.cols() == confusion_.rows(),
+                  "number of classes is different!!");
+
+        Eigen::Index i_true, i_pred;
+        for (Eigen::Index b = 0; b < pred.rows(); b++) {
+            labels.row(b).maxCoeff(&i_true);
+            pred.row(b).maxCoeff(&i_pred);
+            confusion_(i_true, i_pred) += 1;
+        }
+    }
+
+    int count() const {
+        return confusion_.sum();
+    }
+
+    double accuracy() const {
+        const int n = count();
+        return n > 0 ? 100.0 * confusion_.trace() / n : 0.0;
+    }
+
+    const Eigen::MatrixXi &confusion() const {
+        return confusion_;
+    }
+
+    void print_confusion() const {
+        const int n_classes = (int)confusion_.rows();
+        printf("Confusion matrix (row: true, column: predicted)\n");
+        printf("     ");
+        for (int j = 0; j < n_classes; j++) {
+            printf(" %6d", j);
+        }
+        printf("\n");
+        for (int i = 0; i < n_classes; i++) {
+            printf("%4d:", i);
+            for (int j = 0; j < n_classes; j++) {
+                printf(" %6d", confusion_(i, j));
+            }
+            printf("\n");
+        }
+    }
+
+private:
+    Eigen::MatrixXi confusion_;
+};
+
+/**
+ * Evaluate "network" for "data" and one-hot "labels", which are streamed through "NetworkT::predict" in chunks
+ * of "chunk_size" samples. Only a chunk of predictions is alive at once.
+ * "data"とone-hotの"labels"に対して"network"を評価する. データは"NetworkT::predict"により"chunk_size"
+ * サンプルのチャンク毎に流すので, 同時に存在する予測は1チャンク分のみ
+ */
+template <typename Scalar>
+Evaluator evaluate(NetworkT<Scalar> &network, const typename NetworkT<Scalar>::MatrixRef &data,
+                   const typename NetworkT<Scalar>::MatrixRef &labels, int chunk_size = 0) {
+    Assertion(data.rows() == labels.rows(), "number of data and labels are different!!");
+
+    Evaluator evaluator((int)labels.cols());
+    network.predict(data, chunk_size, [&](int b0, const typename NetworkT<Scalar>::MatrixMap &output) {
+        evaluator.add(output, labels.middleRows(b0, output.rows()));
+    });
+    return evaluator;
+}
+
+/**
+ * Evaluate "network" for a memory-mapped dataset. Only a chunk of samples is converted at once, into a buffer
+ * reused over the chunks.
+ * メモリマップしたデータセットに対して"network"を評価する. 一度に変換するのは1チャンク分のサンプルのみで,
+ * 変換先のバッファはチャンク間で再利用する
+ */
+template <typename Scalar>
+Evaluator evaluate(NetworkT<Scalar> &network, const IdxDataset &dataset, int chunk_size = 0) {
+    const int n_samples = dataset.size();
+    if (chunk_size <= 0) {
+        chunk_size = network.planned_batchsize() > 0 ? network.planned_batchsize() : n_samples;
+    }
+
+    Evaluator evaluator(dataset.n_classes());
+    MatrixT<Scalar> data, labels;
+    const typename NetworkT<Scalar>::InferenceMode inference(network);
+    for (int b0 = 0; b0 < n_samples; b0 += chunk_size) {
+        const int n = std::min(chunk_size, n_samples - b0);
+        dataset.slice(b0, n, data, labels);
+        evaluator.add(network.forward(data.topRows(n)), labels.topRows(n));
+    }
+    return evaluator;
+}
+
+#endif  // _EVALUATOR_H_
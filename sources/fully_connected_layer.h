@@ -5,19 +5,38 @@
 #ifndef _FULLY_CONNECTED_LAYER_H_
 #define _FULLY_CONNECTED_LAYER_H_
 
+#include "parallel.h"
 #include "random.h"
 #include "activation.h"
 #include "abstract_layer.h"
 
-class FullyConnectedLayer : public AbstractLayer {
+/**
+ * Fully connected layer. The layer only computes the gradients of its parameters, which are applied by an
+ * optimizer (see "optimizer.h").
+ * 全結合層. レイヤーはパラメータの勾配を計算するだけで, それは最適化手法が適用する ("optimizer.h"を参照)
+ */
+template <typename Scalar>
+class FullyConnectedLayerT : public AbstractLayerT<Scalar> {
 public:
+    using Matrix = MatrixT<Scalar>;
+    using Parameter = ParameterT<Scalar>;
+    using MatrixMap = MatrixMapT<Scalar>;
+    using MatrixRef = MatrixRefT<Scalar>;
+    using Buffer = BufferT<Scalar>;
+    using View = ViewT<Scalar>;
+    using LayerState = LayerStateT<Scalar>;
+    using AbstractLayerT<Scalar>::forward;
+    using AbstractLayerT<Scalar>::backward;
+    using AbstractLayerT<Scalar>::accumulate_;
+    using AbstractLayerT<Scalar>::propagate_;
+
     // Public methods
-    FullyConnectedLayer()
-        : AbstractLayer() {
+    FullyConnectedLayerT()
+        : AbstractLayerT<Scalar>() {
     }
 
-    FullyConnectedLayer(int input_size, int output_size)
-        : AbstractLayer()
+    FullyConnectedLayerT(int input_size, int output_size)
+        : AbstractLayerT<Scalar>()
         , input_size_(input_size)
         , output_size_(output_size)
         , W(output_size, input_size)
@@ -28,62 +47,253 @@ public:
         // X. Glorotによるパラメータ初期化のための標準偏差
         const double xg_stddev = sqrt(2.0 / (input_size_ + output_size_));
 
-        // Parameter initialization
-        // パラメータの初期化
-        Random &rng = Random::getInstance();
-        for (int i = 0; i < output_size; i++) {
-            for (int j = 0; j < input_size; j++) {
-                W(i, j) = rng.normal() * xg_stddev;
-                dW(i, j) = 0.0;
-            }
-            b(0, i) = 0.0;
-            db(0, i) = 0.0;
+        // Parameter initialization with a random stream of the layer, which is filled in parallel
+        // パラメータの初期化. レイヤーの乱数列で並列に埋める
+        next_random_stream().fill_normal(W.data(), W.size());
+        W *= (Scalar)xg_stddev;
+        dW.setZero();
+        b.setZero();
+        db.setZero();
+    }
+
+    virtual ~FullyConnectedLayerT() {
+    }
+
+    const char *name() const override {
+        return "FullyConnected";
+    }
+
+    // Forward is a GEMM with the weights, and backward is two GEMMs for "dLdx" and "dW" (only the latter
+    // without propagation)
+    // 順伝播は重みとの行列積1回, 逆伝播は"dLdx"と"dW"の行列積2回 (勾配を伝播しない場合は後者のみ)
+    LayerCost cost(bool backward) const override {
+        const View &input = this->input();
+        const MatrixMap &output = this->output();
+        const double batchsize = (double)input.rows();
+        const double gemm = 2.0 * batchsize * input_size_ * output_size_;
+        const double n_params = (double)W.size() + b.size();
+        const double n_gemms = propagate_ ? 2.0 : 1.0;
+        LayerCost cost;
+        if (backward) {
+            cost.flops = n_gemms * gemm + batchsize * output_size_;
+            cost.bytes = (n_gemms * input.size() + output.size() + 2.0 * n_params) * sizeof(Scalar);
+        } else {
+            cost.flops = gemm + batchsize * output_size_;
+            cost.bytes = ((double)input.size() + output.size() + n_params) * sizeof(Scalar);
         }
+        return cost;
     }
 
-    virtual ~FullyConnectedLayer() {
+    Shape input_shape() const override {
+        return Shape(input_size_);
+    }
+    Shape output_shape(const Shape &input) const override {
+        return Shape(output_size_);
     }
 
-    const Matrix &forward(const Matrix &input) override {
+    const MatrixMap &forward(const MatrixRef &input, LayerState &state) const override {
         // Simple linear operation (y = Wx + b)
         // 単純な線形演算 (y = Wx + b)
         const int batchsize = (int)input.rows();
-        input_ = input;
-        output_ = input * W.transpose() + b.replicate(batchsize, 1);
-        return output_;
+        state.input.bind(input);
+        state.output.resize(batchsize, output_size_);
+
+        // Each task multiplies its own range of samples with a single-threaded GEMM. Unlike the multi-threaded
+        // GEMM of Eigen, which allocates a shared packing buffer on every call, this does not touch the heap.
+        // 各タスクは担当するサンプルの範囲をシングルスレッドの行列積で計算する. 呼び出し毎に共有のパッキング用
+        // バッファを確保するEigenのマルチスレッドの行列積と異なり, ヒープを使わない
+        const int n_tasks = parallel_task_count(batchsize);
+        parallel_for(0, n_tasks, [&](int t) {
+            const TaskRange range = task_range(t, n_tasks, batchsize);
+            auto output = state.output.middleRows(range.begin, range.size());
+            output.noalias() = input.middleRows(range.begin, range.size()) * W.transpose();
+            output.rowwise() += b.row(0);
+        });
+        return state.output;
     }
 
-    Matrix backward(const Matrix &dLdy, double lr = 0.1, double momentum = 0.5) override {
+    const MatrixMap &backward(const MatrixRef &dLdy, LayerState &state) override {
         // Assum x and y are input and output of this layer, hence back-prop transforms dLdy to dLdx.
         // xとyがこのレイヤーの入出力だと仮定. 誤差逆伝播のためにdLdyをdLdxに変換する
         const int batchsize = (int)dLdy.rows();
-        const Matrix dLdx = dLdy * W;
+        if (propagate_) {
+            state.dLdx.resize(batchsize, input_size_);
+        }
+        if (accumulate_) {
+            db += dLdy.colwise().sum();
+        } else {
+            db = dLdy.colwise().sum();
+        }
+
+        // "dLdx" is split by samples and "dW" is split by output units, so that no reduction is needed
+        // "dLdx"はサンプル毎, "dW"は出力ユニット毎に分割するので, 集約は不要
+        const int n_tasks = parallel_task_count(std::max(batchsize, output_size_));
+        parallel_for(0, n_tasks, [&](int t) {
+            if (propagate_) {
+                const TaskRange samples = task_range(t, n_tasks, batchsize);
+                state.dLdx.middleRows(samples.begin, samples.size()).noalias() =
+                    dLdy.middleRows(samples.begin, samples.size()) * W;
+            }
 
-        // Momentum SGD
-        // 慣性つき確率的最急降下法
-        const Matrix current_dW = dLdy.transpose() * input_;
-        const Matrix current_db = dLdy.colwise().sum();
-        dW = momentum * dW + lr * current_dW;
-        db = momentum * db + lr * current_db;
+            const TaskRange units = task_range(t, n_tasks, output_size_);
+            auto dW_units = dW.middleRows(units.begin, units.size());
+            if (accumulate_) {
+                dW_units.noalias() += dLdy.middleCols(units.begin, units.size()).transpose() * state.input;
+            } else {
+                dW_units.noalias() = dLdy.middleCols(units.begin, units.size()).transpose() * state.input;
+            }
+        });
+        return state.dLdx;
+    }
 
-        // Update parameters
-        // パラメータの更新
-        W -= dW;
-        b -= db;
+    void parameters(std::vector<NamedParameterT<Scalar>> &list) override {
+        list.push_back({ "W", &W, &dW });
+        list.push_back({ "b", &b, &db });
+    }
 
-        return dLdx;
+    std::shared_ptr<AbstractLayerT<Scalar>> fuse(const std::vector<std::shared_ptr<AbstractLayerT<Scalar>>> &layers,
+                                                 int i, int &n_fused) const override;
+
+    const Parameter &weights() const {
+        return W;
+    }
+    const Parameter &bias() const {
+        return b;
     }
 
-private:
-    // Private parameters
+protected:
+    /**
+     * Take over the configuration and the parameters of "layer" (used by the fused layer)
+     * "layer"の設定とパラメータを引き継ぐ (融合したレイヤーで使用)
+     */
+    explicit FullyConnectedLayerT(const FullyConnectedLayerT &layer)
+        : AbstractLayerT<Scalar>()
+        , input_size_(layer.input_size_)
+        , output_size_(layer.output_size_)
+        , W(layer.W)
+        , b(layer.b)
+        , dW(layer.dW)
+        , db(layer.db) {
+    }
+
+    // Protected parameters
     int input_size_ = 0;
     int output_size_ = 0;
 
-    Matrix W = {};
-    Matrix b = {};
-    Matrix dW = {};
-    Matrix db = {};
+    Parameter W = {};
+    Parameter b = {};
+    // Parameter gradients of the last batch
+    // 直前のバッチに対するパラメータの勾配
+    Parameter dW = {};
+    Parameter db = {};
+
+};  // class FullyConnectedLayerT
+
+using FullyConnectedLayer = FullyConnectedLayerT<ScalarType>;
+
+/**
+ * Fully connected layer fused with the following activation. The activation is applied to each block of
+ * the output right after its GEMM while the block is still in cache, and its gradient is applied before
+ * the GEMMs of the backward pass, so that the output of the linear part is never written to memory.
+ * 後に続く活性化関数と融合した全結合層. 活性化関数は出力の各ブロックの行列積の直後, ブロックがキャッシュに
+ * あるうちに適用し, その勾配は逆伝播の行列積の前に適用するので, 線形部分の出力はメモリに書き出されない
+ */
+template <typename Scalar>
+class FusedFullyConnectedLayerT : public FullyConnectedLayerT<Scalar> {
+public:
+    using Base = FullyConnectedLayerT<Scalar>;
+    using MatrixMap = MatrixMapT<Scalar>;
+    using MatrixRef = MatrixRefT<Scalar>;
+    using Buffer = BufferT<Scalar>;
+    using LayerState = LayerStateT<Scalar>;
+    using Base::forward;
+    using Base::backward;
+    using Base::output_size_;
+    using Base::W;
+    using Base::b;
+
+    FusedFullyConnectedLayerT(const Base &layer, Activation activation)
+        : Base(layer)
+        , activation_(activation) {
+    }
+
+    const char *name() const override {
+        return "FusedFullyConnected";
+    }
+
+    std::unique_ptr<LayerState> make_state() const override {
+        return std::unique_ptr<LayerState>(new State());
+    }
+
+    const MatrixMap &forward(const MatrixRef &input, LayerState &state) const override {
+        const int batchsize = (int)input.rows();
+        state.input.bind(input);
+        state.output.resize(batchsize, output_size_);
+
+        const int n_tasks = parallel_task_count(batchsize);
+        parallel_for(0, n_tasks, [&](int t) {
+            const TaskRange range = task_range(t, n_tasks, batchsize);
+            auto output = state.output.middleRows(range.begin, range.size());
+            output.noalias() = input.middleRows(range.begin, range.size()) * W.transpose();
+            output.rowwise() += b.row(0);
+            output = output.unaryExpr([this](Scalar x) { return activate(activation_, x); });
+        });
+        return state.output;
+    }
+
+    const MatrixMap &backward(const MatrixRef &dLdy, LayerState &state) override {
+        // Gradient with respect to the output of the linear part
+        // 線形部分の出力についての勾配
+        Buffer &dLdz = static_cast<State &>(state).dLdz;
+        dLdz = dLdy.cwiseProduct(state.output.unaryExpr([this](Scalar y) {
+            return activation_slope(activation_, y);
+        }));
+        return Base::backward(dLdz, state);
+    }
+
+    bool needs_output() const override {
+        return true;
+    }
+
+    std::shared_ptr<AbstractLayerT<Scalar>> fuse(const std::vector<std::shared_ptr<AbstractLayerT<Scalar>>> &layers,
+                                                 int i, int &n_fused) const override {
+        n_fused = 1;
+        return nullptr;
+    }
+
+    Activation activation() const {
+        return activation_;
+    }
+
+private:
+    // State with the gradient of the linear part
+    // 線形部分の勾配をもつ状態
+    struct State : public LayerState {
+        void buffers(std::vector<Buffer *> &list) override {
+            LayerState::buffers(list);
+            list.push_back(&dLdz);
+        }
+
+        Buffer dLdz;
+    };
+
+    Activation activation_ = Activation::Identity;
+};
+
+using FusedFullyConnectedLayer = FusedFullyConnectedLayerT<ScalarType>;
+
+template <typename Scalar>
+std::shared_ptr<AbstractLayerT<Scalar>> FullyConnectedLayerT<Scalar>::fuse(
+    const std::vector<std::shared_ptr<AbstractLayerT<Scalar>>> &layers, int i, int &n_fused) const {
+    n_fused = 1;
+    const int n_layers = (int)layers.size();
+    const Activation activation = i + 1 < n_layers ? activation_of(layers[i + 1].get()) : Activation::Identity;
+    if (activation == Activation::Identity) {
+        return nullptr;
+    }
 
-};  // class FullyConnectedLayer
+    n_fused = 2;
+    return std::make_shared<FusedFullyConnectedLayerT<Scalar>>(*this, activation);
+}
 
 #endif  // _FULLY_CONNECTED_LAYER_H_
@@ -0,0 +1,130 @@
+#ifdef _MSC_VER
+#pragma once
+#endif
+
+#ifndef _GRADIENT_ACCUMULATION_H_
+#define _GRADIENT_ACCUMULATION_H_
+
+#include <iostream>
+#include <algorithm>
+
+#include "common.h"
+#include "losses.h"
+#include "network.h"
+#include "parallel.h"
+
+/**
+ * Trainer with gradient accumulation. Each batch runs through the network as several micro-batches, whose
+ * parameter gradients are summed up by the layers, and the optimizer applies a single update after the last
+ * one. Since the losses are sums over samples, the summed gradients are those of the whole batch, while the
+ * workspace only needs to hold a micro-batch. The size of the micro-batches is chosen in "plan" to fit a
+ * memory budget.
+ * 勾配を累積する学習器. 各バッチは複数のマイクロバッチとしてネットワークを通し, パラメータの勾配は
+ * レイヤーが足し合わせて, 最適化手法は最後のマイクロバッチの後に1回だけ更新する. 損失はサンプルの和
+ * なので, 足し合わせた勾配はバッチ全体の勾配となる一方, 作業領域は1つのマイクロバッチの分だけで済む.
+ * マイクロバッチの大きさはメモリの予算に収まるよう"plan"で選ぶ
+ */
+template <typename Scalar>
+class GradientAccumulationTrainerT : private Uncopyable {
+public:
+    using Matrix = MatrixT<Scalar>;
+    using MatrixMap = MatrixMapT<Scalar>;
+    using MatrixRef = MatrixRefT<Scalar>;
+
+    struct StepResult {
+        double loss = 0.0;
+        double accuracy = 0.0;
+    };
+
+    /**
+     * Train "network" with "criterion" and "optimizer", keeping the workspace within "budget_bytes"
+     * "network"を"criterion"と"optimizer"で学習する. 作業領域は"budget_bytes"以内に収める
+     */
+    GradientAccumulationTrainerT(NetworkT<Scalar> &network, AbstractLossT<Scalar> &criterion,
+                                 AbstractOptimizerT<Scalar> &optimizer, size_t budget_bytes)
+        : network_(network)
+        , criterion_(criterion)
+        , optimizer_(optimizer)
+        , budget_bytes_(budget_bytes) {
+    }
+
+    /**
+     * Choose the size of the micro-batches for batches of up to "max_batchsize" samples, plan the workspace
+     * for it, and attach the optimizer to the parameters. The workspace is linear in the number of samples
+     * once there are at least as many samples as threads, so that its fixed and per-sample parts are
+     * measured with dry runs of one and two samples per thread. The final plan forgets the sizes of these
+     * dry runs, and the micro-batches shrink until the arena fits the budget, since the estimate does not
+     * hold for fewer samples than threads. Exits with a message if even a single sample does not fit.
+     * Returns the size of the arena in bytes.
+     * 最大"max_batchsize"サンプルのバッチに対するマイクロバッチの大きさを選び, その作業領域を計画して,
+     * 最適化手法をパラメータに結び付ける. サンプル数がスレッド数以上であれば作業領域はサンプル数に
+     * 比例するので, その固定部分とサンプル毎の部分はスレッド毎に1および2サンプルでの試行で測る.
+     * 最後の計画はこれらの試行の大きさを忘れる. サンプル数がスレッド数より少ないと見積もりは成り立たない
+     * ので, アリーナが予算に収まるまでマイクロバッチを小さくする. 1サンプルでも収まらない場合はメッセージ
+     * とともに終了する. アリーナのバイト数を返す
+     */
+    size_t plan(int max_batchsize, int n_inputs) {
+        const int n_threads = parallel_thread_count();
+        const size_t bytes1 = network_.plan(n_threads, n_inputs, &criterion_);
+        const size_t bytes2 = network_.plan(2 * n_threads, n_inputs, &criterion_);
+        const size_t per_sample = std::max<size_t>(1, (bytes2 - bytes1 + n_threads - 1) / n_threads);
+        const size_t fixed = bytes1 - std::min(bytes1, per_sample * (n_threads - 1));
+
+        const size_t fitting = budget_bytes_ > fixed ? (budget_bytes_ - fixed) / per_sample : 0;
+        micro_batchsize_ = (int)std::max<size_t>(1, std::min<size_t>(fitting, max_batchsize));
+        size_t bytes = network_.plan(micro_batchsize_, n_inputs, &criterion_);
+        while (bytes > budget_bytes_ && micro_batchsize_ > 1) {
+            const size_t excess = (bytes - budget_bytes_ + per_sample - 1) / per_sample;
+            micro_batchsize_ = (int)std::max<size_t>(1, (size_t)micro_batchsize_ - excess);
+            bytes = network_.plan(micro_batchsize_, n_inputs, &criterion_);
+        }
+        if (bytes > budget_bytes_) {
+            std::cerr << "Failed to fit the workspace in the memory budget: a single sample needs " << bytes
+                      << " bytes, but the budget is " << budget_bytes_ << " bytes" << std::endl;
+            exit(1);
+        }
+        optimizer_.attach(network_.flat_parameters());
+        return bytes;
+    }
+
+    /**
+     * Train with a batch of "data" and one-hot "labels", and return the mean loss and the accuracy
+     * "data"とone-hotの"labels"のバッチで学習し, 平均の損失と精度を返す
+     */
+    StepResult step(const MatrixRef &data, const MatrixRef &labels) {
+        const int batchsize = (int)data.rows();
+        StepResult result;
+        for (int b0 = 0; b0 < batchsize; b0 += micro_batchsize_) {
+            const int n = std::min(micro_batchsize_, batchsize - b0);
+            const auto &output = network_.forward(data.middleRows(b0, n));
+            result.loss += criterion_.forward(output, labels.middleRows(b0, n)).sum();
+            result.accuracy += accuracy(output, labels.middleRows(b0, n)) * n / 100.0;
+
+            // The first micro-batch overwrites the gradients of the previous batch
+            // 最初のマイクロバッチは前のバッチの勾配を上書きする
+            network_.set_accumulate(b0 > 0);
+            network_.backward(criterion_.backward());
+        }
+        network_.set_accumulate(false);
+        optimizer_.step();
+
+        result.loss /= batchsize;
+        result.accuracy *= 100.0 / batchsize;
+        return result;
+    }
+
+    int micro_batchsize() const {
+        return micro_batchsize_;
+    }
+
+private:
+    NetworkT<Scalar> &network_;
+    AbstractLossT<Scalar> &criterion_;
+    AbstractOptimizerT<Scalar> &optimizer_;
+    size_t budget_bytes_ = 0;
+    int micro_batchsize_ = 1;
+};
+
+using GradientAccumulationTrainer = GradientAccumulationTrainerT<ScalarType>;
+
+#endif  // _GRADIENT_ACCUMULATION_H_
@@ -0,0 +1,379 @@
+#ifdef _MSC_VER
+#pragma once
+#endif
+
+#ifndef _IDX_STREAM_H_
+#define _IDX_STREAM_H_
+
+#include <cstdint>
+#include <cstring>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <condition_variable>
+
+#include "common.h"
+#include "mnist.h"
+#include "random.h"
+
+/**
+ * Pair of IDX image and label files, which is a shard of a dataset
+ * IDXの画像ファイルとラベルファイルの組. データセットのシャードとなる
+ */
+struct IdxShard {
+    std::string image_file;
+    std::string label_file;
+};
+
+/**
+ * Out-of-core reader of IDX datasets. Shards are read sequentially in large chunks by background threads, one
+ * shard per thread at a time, and the samples are drawn in random order from a bounded shuffle buffer. The
+ * memory usage is set by the sizes of the shuffle buffer and the chunks, and not by the size of the dataset.
+ * IDXデータセットのアウトオブコアのリーダー. シャードはバックグラウンドのスレッドがそれぞれ1つずつ大きな
+ * チャンク単位で順に読み, サンプルは大きさに上限のあるシャッフルバッファからランダムな順に取り出す.
+ * メモリ使用量はシャッフルバッファとチャンクの大きさで決まり, データセットの大きさにはよらない
+ */
+class IdxStream : private Uncopyable {
+public:
+    enum { n_classes = 10 };
+
+    /**
+     * Open "shards", which are read by "n_readers" threads in chunks of "chunk_size" samples. The shuffle buffer
+     * holds "buffer_size" samples.
+     * "shards"を開く. シャードは"n_readers"個のスレッドが"chunk_size"サンプルのチャンク毎に読む.
+     * シャッフルバッファは"buffer_size"サンプルを保持する
+     */
+    IdxStream(const std::vector<IdxShard> &shards, int buffer_size, int chunk_size = 1024, int n_readers = 1)
+        : buffer_size_(buffer_size)
+        , chunk_size_(chunk_size)
+        , rng_(next_random_stream()) {
+        Assertion(!shards.empty(), "no shards are given!!");
+        Assertion(buffer_size > 0 && chunk_size > 0 && n_readers > 0, "invalid stream parameters!!");
+
+        // Files are kept open, so that no allocation is needed to read them again in later epochs
+        // 後のエポックで再び読む際に確保が要らないよう, ファイルは開いたままにする
+        for (const auto &s : shards) {
+            shards_.emplace_back(new Shard(s));
+            Assertion(shards_.back()->n_pixels == shards_[0]->n_pixels, "image sizes of shards are different!!");
+            n_samples_ += shards_.back()->n_samples;
+        }
+        n_pixels_ = shards_[0]->n_pixels;
+
+        buffer_pixels_.resize((size_t)buffer_size * n_pixels_);
+        buffer_labels_.resize(buffer_size);
+
+        // Two chunks per reader, so that a reader fills one while the other is consumed
+        // リーダー毎に2つのチャンク. 一方を消費する間にリーダーはもう一方を埋める
+        const int n_chunks = 2 * n_readers;
+        chunks_.resize(n_chunks);
+        for (int c = 0; c < n_chunks; c++) {
+            chunks_[c].pixels.resize((size_t)chunk_size * n_pixels_);
+            chunks_[c].labels.resize(chunk_size);
+            free_.push_back(c);
+        }
+        ready_.resize(n_chunks);
+        shard_order_.resize(shards_.size());
+
+        for (int i = 0; i < n_readers; i++) {
+            readers_.emplace_back(&IdxStream::read, this);
+        }
+    }
+
+    ~IdxStream() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        reader_cv_.notify_all();
+        free_cv_.notify_all();
+        for (auto &reader : readers_) {
+            reader.join();
+        }
+    }
+
+    /**
+     * Draw up to "batchsize" samples to the first rows of "images" and "labels", and return the number of them.
+     * At the end of an epoch, 0 is returned, and the next call starts a new epoch.
+     * 最大"batchsize"個のサンプルを"images"と"labels"の先頭の行に取り出し, その数を返す. エポックの
+     * 終わりには0を返し, 次の呼び出しで新しいエポックを開始する
+     */
+    template <typename Scalar>
+    int next_batch(int batchsize, MatrixT<Scalar> &images, MatrixT<Scalar> &labels) {
+        if (!in_epoch_) {
+            start_epoch();
+        }
+
+        // Keep the shuffle buffer full while the epoch has more samples
+        // エポックにサンプルが残っている間はシャッフルバッファを満杯に保つ
+        while (n_buffered_ < buffer_size_ && take(n_buffered_)) {
+            n_buffered_ += 1;
+        }
+
+        const int n = std::min(batchsize, n_buffered_);
+        if (n == 0) {
+            in_epoch_ = false;
+            return 0;
+        }
+
+        if ((int)batch_labels_.size() < n) {
+            batch_pixels_.resize((size_t)n * n_pixels_);
+            batch_labels_.resize(n);
+        }
+
+        // Each drawn sample is replaced with the next one in the stream, or with the last one in the buffer
+        // after the stream ends. Draws are numbered through the epochs of the random stream.
+        // 取り出したサンプルはストリームの次のサンプル, ストリームの終了後はバッファの最後のサンプルで置き換える.
+        // 取り出しは乱数列上でエポックを通して番号付ける
+        for (int b = 0; b < n; b++) {
+            const int k = (int)rng_.below(n_draws_++, (uint32_t)n_buffered_);
+            std::memcpy(&batch_pixels_[(size_t)b * n_pixels_], &buffer_pixels_[(size_t)k * n_pixels_], n_pixels_);
+            batch_labels_[b] = buffer_labels_[k];
+            if (!take(k)) {
+                n_buffered_ -= 1;
+                std::memcpy(&buffer_pixels_[(size_t)k * n_pixels_], &buffer_pixels_[(size_t)n_buffered_ * n_pixels_],
+                            n_pixels_);
+                buffer_labels_[k] = buffer_labels_[n_buffered_];
+            }
+        }
+
+        normalize_pixels(n, n_pixels_, images, [&](int b) { return &batch_pixels_[(size_t)b * n_pixels_]; });
+        one_hot_labels(n, n_classes, labels, [&](int b) { return (int)batch_labels_[b]; });
+        return n;
+    }
+
+    //! Total number of samples in the shards
+    int size() const {
+        return (int)std::min<long long>(n_samples_, INT_MAX);
+    }
+    int n_features() const {
+        return n_pixels_;
+    }
+
+    //! Bytes of the buffers, which bound the memory usage
+    size_t buffer_bytes() const {
+        return buffer_pixels_.size() + buffer_labels_.size() +
+               chunks_.size() * (size_t)chunk_size_ * (n_pixels_ + 1) + batch_pixels_.size() + batch_labels_.size();
+    }
+
+    //! Time the consumer waited for chunks being read
+    double stall_seconds() const {
+        return stall_seconds_;
+    }
+
+private:
+    struct Shard {
+        explicit Shard(const IdxShard &shard)
+            : images(shard.image_file, std::ios::in | std::ios::binary)
+            , labels(shard.label_file, std::ios::in | std::ios::binary) {
+            if (!images.is_open()) {
+                std::cerr << "Failed to open data: " << shard.image_file << std::endl;
+                exit(1);
+            }
+            if (!labels.is_open()) {
+                std::cerr << "Failed to open labels: " << shard.label_file << std::endl;
+                exit(1);
+            }
+
+            uint8_t header[16];
+            images.read((char *)header, 16);
+            Assertion(images.good() && parse_bigendian(header) == 2051, "Invalid magic number!");
+            n_samples = parse_bigendian(header + 4);
+            n_pixels = parse_bigendian(header + 8) * parse_bigendian(header + 12);
+
+            labels.read((char *)header, 8);
+            Assertion(labels.good() && parse_bigendian(header) == 2049, "Invalid magic number!");
+            Assertion((int)parse_bigendian(header + 4) == n_samples, "Numbers of images and labels are different!");
+        }
+
+        std::ifstream images;
+        std::ifstream labels;
+        int n_samples = 0;
+        int n_pixels = 0;
+    };
+
+    struct Chunk {
+        std::vector<uint8_t> pixels;
+        std::vector<uint8_t> labels;
+        int size = 0;
+    };
+
+    void start_epoch() {
+        for (int i = 0; i < (int)shard_order_.size(); i++) {
+            shard_order_[i] = i;
+        }
+
+        const RandomStream order = rng_.split(epoch_);
+        for (int i = (int)shard_order_.size() - 1; i > 0; i--) {
+            std::swap(shard_order_[i], shard_order_[order.below((uint64_t)i, (uint32_t)(i + 1))]);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            next_shard_ = 0;
+            n_running_ = (int)readers_.size();
+            epoch_ += 1;
+        }
+        reader_cv_.notify_all();
+        in_epoch_ = true;
+    }
+
+    /**
+     * Move the next sample of the stream to slot "k" of the shuffle buffer. Returns false at the end of the epoch.
+     * ストリームの次のサンプルをシャッフルバッファのスロット"k"に移す. エポックの終わりにはfalseを返す
+     */
+    bool take(int k) {
+        if (current_ < 0 || cursor_ == chunks_[current_].size) {
+            if (!next_chunk()) {
+                return false;
+            }
+        }
+
+        const Chunk &chunk = chunks_[current_];
+        std::memcpy(&buffer_pixels_[(size_t)k * n_pixels_], &chunk.pixels[(size_t)cursor_ * n_pixels_], n_pixels_);
+        buffer_labels_[k] = chunk.labels[cursor_];
+        cursor_ += 1;
+        return true;
+    }
+
+    bool next_chunk() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (current_ >= 0) {
+            free_.push_back(current_);
+            current_ = -1;
+            free_cv_.notify_one();
+        }
+
+        if (n_ready_ == 0 && n_running_ > 0) {
+            const auto start = std::chrono::steady_clock::now();
+            consumer_cv_.wait(lock, [&] { return n_ready_ > 0 || n_running_ == 0; });
+            stall_seconds_ += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+        if (n_ready_ == 0) {
+            return false;
+        }
+
+        current_ = ready_[ready_head_];
+        ready_head_ = (ready_head_ + 1) % (int)ready_.size();
+        n_ready_ -= 1;
+        cursor_ = 0;
+        return true;
+    }
+
+    void read() {
+        int epoch = 0;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                reader_cv_.wait(lock, [&] { return stop_ || epoch_ > epoch; });
+                if (stop_) {
+                    return;
+                }
+                epoch = epoch_;
+            }
+
+            for (;;) {
+                int s;
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    if (next_shard_ == (int)shard_order_.size()) {
+                        break;
+                    }
+                    s = shard_order_[next_shard_++];
+                }
+
+                if (!read_shard(*shards_[s])) {
+                    return;
+                }
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                n_running_ -= 1;
+            }
+            consumer_cv_.notify_one();
+        }
+    }
+
+    bool read_shard(Shard &shard) {
+        shard.images.clear();
+        shard.labels.clear();
+        shard.images.seekg(16);
+        shard.labels.seekg(8);
+
+        for (int i0 = 0; i0 < shard.n_samples; i0 += chunk_size_) {
+            int c;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                free_cv_.wait(lock, [&] { return stop_ || !free_.empty(); });
+                if (stop_) {
+                    return false;
+                }
+                c = free_.back();
+                free_.pop_back();
+            }
+
+            Chunk &chunk = chunks_[c];
+            chunk.size = std::min(chunk_size_, shard.n_samples - i0);
+            shard.images.read((char *)chunk.pixels.data(), (std::streamsize)chunk.size * n_pixels_);
+            shard.labels.read((char *)chunk.labels.data(), chunk.size);
+            Assertion(shard.images.good() && shard.labels.good(), "Failed to read a shard!");
+
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                ready_[(ready_head_ + n_ready_) % (int)ready_.size()] = c;
+                n_ready_ += 1;
+            }
+            consumer_cv_.notify_one();
+        }
+        return true;
+    }
+
+    std::vector<std::unique_ptr<Shard>> shards_;
+    long long n_samples_ = 0;
+    int n_pixels_ = 0;
+    int buffer_size_;
+    int chunk_size_;
+
+    // Shuffle buffer and the batch drawn from it, owned by the consumer
+    // シャッフルバッファとそこから取り出したバッチ. 消費側が所有する
+    std::vector<uint8_t> buffer_pixels_;
+    std::vector<uint8_t> buffer_labels_;
+    std::vector<uint8_t> batch_pixels_;
+    std::vector<uint8_t> batch_labels_;
+    int n_buffered_ = 0;
+    bool in_epoch_ = false;
+    RandomStream rng_;
+    uint64_t n_draws_ = 0;
+    int current_ = -1;
+    int cursor_ = 0;
+    double stall_seconds_ = 0.0;
+
+    // Chunks and the state shared with the readers, guarded by "mutex_"
+    // チャンクとリーダーとの共有状態. "mutex_"で保護する
+    std::vector<Chunk> chunks_;
+    std::vector<std::thread> readers_;
+    std::mutex mutex_;
+    // Readers wait for the next epoch on "reader_cv_" and for a free chunk on "free_cv_", and the consumer
+    // waits for a ready chunk on "consumer_cv_"
+    // リーダーは次のエポックを"reader_cv_"で, 空いたチャンクを"free_cv_"で待ち, 消費者は準備のできた
+    // チャンクを"consumer_cv_"で待つ
+    std::condition_variable reader_cv_;
+    std::condition_variable free_cv_;
+    std::condition_variable consumer_cv_;
+    std::vector<int> free_;
+    std::vector<int> ready_;
+    int ready_head_ = 0;
+    int n_ready_ = 0;
+    std::vector<int> shard_order_;
+    int next_shard_ = 0;
+    int n_running_ = 0;
+    int epoch_ = 0;
+    bool stop_ = false;
+};
+
+#endif  // _IDX_STREAM_H_
@@ -0,0 +1,304 @@
+#ifdef _MSC_VER
+#pragma once
+#endif
+
+#ifndef _INFERENCE_SERVER_H_
+#define _INFERENCE_SERVER_H_
+
+#include <cmath>
+#include <cstdint>
+#include <mutex>
+#include <chrono>
+#include <thread>
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <condition_variable>
+
+#include "common.h"
+#include "mnist.h"
+#include "network.h"
+
+/**
+ * Latencies of the recent requests and counts of the served requests and batches, from which the percentiles
+ * of the latency and the throughput are reported. Only the latest "window" latencies are kept, so that a
+ * long-running server uses a fixed amount of memory.
+ * 最近のリクエストのレイテンシと, 処理したリクエストとバッチの数. これらからレイテンシの百分位数と
+ * スループットを報告する. 長時間動くサーバーのメモリ使用量が一定になるよう, 最新の"window"個の
+ * レイテンシのみを保持する
+ */
+class LatencyStats : private Uncopyable {
+public:
+    struct Summary {
+        long long n_requests = 0;
+        long long n_batches = 0;
+        double mean_batchsize = 0.0;
+        // Latencies in microseconds
+        // マイクロ秒単位のレイテンシ
+        double p50 = 0.0;
+        double p99 = 0.0;
+        double max = 0.0;
+        // Requests per second since the last reset
+        // 最後のリセットからの1秒あたりのリクエスト数
+        double throughput = 0.0;
+    };
+
+    explicit LatencyStats(int window = 65536)
+        : latencies_((size_t)std::max(1, window)) {
+        reset();
+    }
+
+    void reset() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        n_requests_ = 0;
+        n_batches_ = 0;
+        start_ = std::chrono::steady_clock::now();
+    }
+
+    // Record a batch of "n" requests with their latencies in microseconds
+    // "n"個のリクエストからなるバッチをマイクロ秒単位のレイテンシとともに記録する
+    void record(const double *latencies, int n) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (int i = 0; i < n; i++) {
+            latencies_[(size_t)(n_requests_++ % (long long)latencies_.size())] = latencies[i];
+        }
+        n_batches_++;
+    }
+
+    Summary summary() const {
+        Summary s;
+        std::vector<double> sorted;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            s.n_requests = n_requests_;
+            s.n_batches = n_batches_;
+            const double seconds =
+                std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count();
+            s.throughput = seconds > 0.0 ? n_requests_ / seconds : 0.0;
+            sorted.assign(latencies_.begin(),
+                          latencies_.begin() + std::min((long long)latencies_.size(), n_requests_));
+        }
+        if (sorted.empty()) {
+            return s;
+        }
+
+        std::sort(sorted.begin(), sorted.end());
+        s.mean_batchsize = (double)s.n_requests / s.n_batches;
+        s.p50 = percentile(sorted, 0.50);
+        s.p99 = percentile(sorted, 0.99);
+        s.max = sorted.back();
+        return s;
+    }
+
+    // Nearest-rank percentile of sorted values
+    // ソート済みの値の最近順位法による百分位数
+    static double percentile(const std::vector<double> &sorted, double p) {
+        const size_t rank = (size_t)std::ceil(p * sorted.size());
+        return sorted[std::min(sorted.size(), std::max((size_t)1, rank)) - 1];
+    }
+
+private:
+    mutable std::mutex mutex_;
+    std::vector<double> latencies_;
+    long long n_requests_ = 0;
+    long long n_batches_ = 0;
+    std::chrono::steady_clock::time_point start_;
+};
+
+/**
+ * Dynamic batcher serving inference requests with a single network. Requests from any number of threads are
+ * queued, and "n_workers" worker threads take them in batches of up to "max_batchsize", waiting at most
+ * "max_wait_us" microseconds after the oldest queued request for the batch to fill up. Each batch runs in a
+ * single forward, so that requests share the GEMMs of the layers instead of running them one sample at a
+ * time. The workers share the parameters of the network, each with its own execution context for the
+ * maximum batch size, hence batches do not allocate. When the queue holds "max_queued" requests, further ones
+ * are rejected rather than letting the latency grow without a bound.
+ * 1つのネットワークで推論リクエストを処理する動的バッチャ. 任意の数のスレッドからのリクエストをキューに
+ * 入れ, "n_workers"個のワーカースレッドが最大"max_batchsize"個のバッチとして取り出す. バッチが埋まるのは
+ * 最も古いリクエストから最大"max_wait_us"マイクロ秒まで待つ. 各バッチは1回の順伝播で計算するので,
+ * リクエストは1サンプルずつではなくレイヤーの行列積を共有する. ワーカーはネットワークのパラメータを共有し,
+ * それぞれが最大のバッチサイズの実行コンテキストをもつので, バッチ毎のメモリ確保はない. キューに
+ * "max_queued"個のリクエストがあれば, レイテンシが際限なく伸びないよう以降のリクエストは拒否する
+ */
+template <typename Scalar>
+class DynamicBatcherT : private Uncopyable {
+public:
+    using Matrix = MatrixT<Scalar>;
+    using MatrixMap = MatrixMapT<Scalar>;
+    using Clock = std::chrono::steady_clock;
+
+    DynamicBatcherT(const NetworkT<Scalar> &network, int n_features, int max_batchsize, int max_wait_us,
+                    int n_workers = 1, int max_queued = 4096)
+        : network_(network)
+        , n_features_(n_features)
+        , max_batchsize_(std::max(1, max_batchsize))
+        , max_wait_(std::chrono::microseconds(std::max(0, max_wait_us)))
+        , max_queued_(std::max(max_batchsize_, max_queued))
+        , queue_((size_t)max_queued_) {
+        for (int i = 0; i < std::max(1, n_workers); i++) {
+            std::unique_ptr<Worker> worker(new Worker());
+            worker->context = network_.make_context(max_batchsize_, n_features_);
+            worker->input.resize(max_batchsize_, n_features_);
+            worker->batch.resize((size_t)max_batchsize_);
+            worker->latencies.resize((size_t)max_batchsize_);
+            workers_.push_back(std::move(worker));
+        }
+        Assertion(network_.n_inputs() == n_features_, "network is not compiled for the features!!");
+        n_outputs_ = network_.n_outputs();
+        for (auto &worker : workers_) {
+            worker->thread = std::thread(&DynamicBatcherT::work, this, std::ref(*worker));
+        }
+    }
+
+    ~DynamicBatcherT() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        arrived_.notify_all();
+        for (auto &worker : workers_) {
+            worker->thread.join();
+        }
+    }
+
+    /**
+     * Classify an image of "n_features" pixels, blocking until its batch has run, and write the outputs of the
+     * network (log-probabilities) to "output" of "n_outputs()" values. Returns false if the queue is full.
+     * "n_features"画素の画像を分類し, そのバッチが計算されるまで待って, ネットワークの出力 (対数確率) を
+     * "n_outputs()"個の値からなる"output"に書き込む. キューが一杯であればfalseを返す
+     */
+    bool infer(const uint8_t *pixels, Scalar *output) {
+        Request request;
+        request.pixels = pixels;
+        request.output = output;
+        request.arrival = Clock::now();
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (n_queued_ == max_queued_ || stop_) {
+            return false;
+        }
+        queue_[(head_ + n_queued_++) % max_queued_] = &request;
+        if (n_queued_ == 1 || n_queued_ == max_batchsize_) {
+            arrived_.notify_one();
+        }
+        request.finished.wait(lock, [&] { return request.done; });
+        return true;
+    }
+
+    int n_outputs() const {
+        return n_outputs_;
+    }
+    int max_batchsize() const {
+        return max_batchsize_;
+    }
+    int n_workers() const {
+        return (int)workers_.size();
+    }
+    // Bytes of the buffers of each worker, while the parameters are shared by all of them
+    // 各ワーカーのバッファのバイト数. パラメータは全ワーカーで共有する
+    size_t context_bytes() const {
+        return workers_[0]->context->bytes();
+    }
+    LatencyStats &stats() {
+        return stats_;
+    }
+
+private:
+    // Request waiting on the stack of its caller
+    // 呼び出し元のスタック上で待つリクエスト
+    struct Request {
+        const uint8_t *pixels = nullptr;
+        Scalar *output = nullptr;
+        Clock::time_point arrival;
+        bool done = false;
+        std::condition_variable finished;
+    };
+
+    // Worker with its own execution context, the input of its running batch and the latencies of its requests
+    // 自身の実行コンテキスト, 実行中のバッチの入力とリクエストのレイテンシをもつワーカー
+    struct Worker {
+        std::unique_ptr<ExecutionContextT<Scalar>> context;
+        Matrix input;
+        std::vector<Request *> batch;
+        std::vector<double> latencies;
+        std::thread thread;
+    };
+
+    void work(Worker &worker) {
+        for (;;) {
+            // Wait for the first request, and then for the batch to fill up until the deadline
+            // 最初のリクエストを待ち, その後は締め切りまでバッチが埋まるのを待つ
+            std::unique_lock<std::mutex> lock(mutex_);
+            arrived_.wait(lock, [this] { return stop_ || n_queued_ > 0; });
+            if (stop_ && n_queued_ == 0) {
+                return;
+            }
+            const Clock::time_point deadline = queue_[head_]->arrival + max_wait_;
+            arrived_.wait_until(lock, deadline, [this] { return stop_ || n_queued_ >= max_batchsize_; });
+
+            // Another worker may have taken the batch meanwhile, and the rest is left to an idle worker
+            // その間に他のワーカーがバッチを取り出していることがある. 残りは手の空いたワーカーに任せる
+            const int n = std::min(n_queued_, max_batchsize_);
+            for (int k = 0; k < n; k++) {
+                worker.batch[k] = queue_[(head_ + k) % max_queued_];
+            }
+            head_ = (head_ + n) % max_queued_;
+            n_queued_ -= n;
+            if (n_queued_ > 0) {
+                arrived_.notify_one();
+            }
+            lock.unlock();
+
+            if (n > 0) {
+                run_batch(worker, n);
+            }
+        }
+    }
+
+    void run_batch(Worker &worker, int n) {
+        const std::vector<Request *> &batch = worker.batch;
+        normalize_pixels(n, n_features_, worker.input, [&](int k) { return batch[k]->pixels; });
+        const MatrixMap &output = network_.forward(worker.input.topRows(n), *worker.context);
+
+        const Clock::time_point now = Clock::now();
+        for (int k = 0; k < n; k++) {
+            for (int j = 0; j < n_outputs_; j++) {
+                batch[k]->output[j] = output(k, j);
+            }
+            worker.latencies[k] = std::chrono::duration<double, std::micro>(now - batch[k]->arrival).count();
+        }
+        stats_.record(worker.latencies.data(), n);
+
+        // Requests are released under the lock, since they are destroyed as soon as their callers see "done"
+        // 呼び出し元が"done"を見るとリクエストは直ちに破棄されるので, ロックを取って解放する
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (int k = 0; k < n; k++) {
+            batch[k]->done = true;
+            batch[k]->finished.notify_one();
+        }
+    }
+
+    const NetworkT<Scalar> &network_;
+    int n_features_ = 0;
+    int n_outputs_ = 0;
+    int max_batchsize_ = 1;
+    Clock::duration max_wait_;
+
+    // Ring buffer of the queued requests
+    // キューに入ったリクエストのリングバッファ
+    std::mutex mutex_;
+    std::condition_variable arrived_;
+    int max_queued_ = 0;
+    std::vector<Request *> queue_;
+    int head_ = 0;
+    int n_queued_ = 0;
+    bool stop_ = false;
+
+    std::vector<std::unique_ptr<Worker>> workers_;
+    LatencyStats stats_;
+};
+
+using DynamicBatcher = DynamicBatcherT<ScalarType>;
+
+#endif  // _INFERENCE_SERVER_H_
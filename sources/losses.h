@@ -5,45 +5,96 @@
 #ifndef _LOSSES_H_
 #define _LOSSES_H_
 
+#include <vector>
+
 #include "common.h"
+#include "workspace.h"
+#include "abstract_layer.h"
 
 /**
  * Base class for loss functions.
  * 덷֐̂߂̊NX
  */
-class AbstractLoss : private Uncopyable {
+template <typename Scalar>
+class AbstractLossT : private Uncopyable {
 public:
-    AbstractLoss() = default;
-    virtual ~AbstractLoss() = default;
+    using Matrix = MatrixT<Scalar>;
+    using MatrixMap = MatrixMapT<Scalar>;
+    using MatrixRef = MatrixRefT<Scalar>;
+    using Buffer = BufferT<Scalar>;
+    using View = ViewT<Scalar>;
+
+    AbstractLossT() = default;
+    virtual ~AbstractLossT() = default;
 
-    virtual const Matrix &forward(const Matrix &pred, const Matrix &real) = 0;
-    virtual Matrix backward() = 0;
+    virtual const MatrixMap &forward(const MatrixRef &pred, const MatrixRef &real) = 0;
+    virtual const MatrixMap &backward() = 0;
+
+    /**
+     * Cost of the last forward or "backward" pass (see "AbstractLayerT::cost"). Forward reads the prediction
+     * and the target and writes a loss per sample, while backward writes the gradient of the prediction.
+     * Ȍ`d܂͋t`d ("backward") ̃RXg ("AbstractLayerT::cost"Q). `d͗\Ɛ
+     * ǂŃTv̑, t`d͗\ɂĂ̌z
+     */
+    virtual LayerCost cost(bool backward) const = 0;
+
+    /**
+     * Append the buffers to "list" (see "AbstractLayerT::buffers")
+     * obt@"list"ɒǉ ("AbstractLayerT::buffers"Q)
+     */
+    virtual void buffers(std::vector<Buffer *> &list) {
+        list.push_back(&output_);
+        list.push_back(&dLdx_);
+    }
 
 protected:
-    Matrix input_ = {};
-    Matrix target_ = {};
-    Matrix output_ = {};
+    // Views of the prediction and the target, which must stay unchanged until "backward"
+    // \Ɛ̃r[. "backward"܂ł͕ύXĂ͂ȂȂ
+    View input_;
+    View target_;
+    Buffer output_;
+    Buffer dLdx_;
 };
 
 /**
  * Cross-entropy loss
  * Ggs[덷
  */
-class CrossEntropyLoss : public AbstractLoss {
+template <typename Scalar>
+class CrossEntropyLossT : public AbstractLossT<Scalar> {
 public:
-    CrossEntropyLoss() = default;
-    virtual ~CrossEntropyLoss() = default;
-
-    const Matrix &forward(const Matrix &input, const Matrix &target) override {
-        const Matrix prod = -target.cwiseProduct(input.array().log().matrix());
-        input_ = input;
-        target_ = target;
-        output_ = prod.rowwise().sum();
+    using Matrix = MatrixT<Scalar>;
+    using MatrixMap = MatrixMapT<Scalar>;
+    using MatrixRef = MatrixRefT<Scalar>;
+    using AbstractLossT<Scalar>::input_;
+    using AbstractLossT<Scalar>::target_;
+    using AbstractLossT<Scalar>::output_;
+    using AbstractLossT<Scalar>::dLdx_;
+
+    CrossEntropyLossT() = default;
+    virtual ~CrossEntropyLossT() = default;
+
+    const MatrixMap &forward(const MatrixRef &input, const MatrixRef &target) override {
+        input_.bind(input);
+        target_.bind(target);
+        output_ = -target.cwiseProduct(input.array().log().matrix()).rowwise().sum();
         return output_;
     }
 
-    Matrix backward() override {
-        return -target_.cwiseQuotient(input_);
+    const MatrixMap &backward() override {
+        dLdx_ = -target_.cwiseQuotient(input_);
+        return dLdx_;
+    }
+
+    // Forward takes a logarithm, a product and a sum per element, and backward a quotient of the target by
+    // the prediction
+    // `d͗vfɑΐ, , a, t`d̗͐\ɂ鏤vZ
+    LayerCost cost(bool backward) const override {
+        const double n_elements = (double)input_.size();
+        LayerCost cost;
+        cost.flops = backward ? n_elements : 3.0 * n_elements;
+        cost.bytes = (backward ? 3.0 * n_elements : 2.0 * n_elements + input_.rows()) * sizeof(Scalar);
+        return cost;
     }
 };
 
@@ -51,22 +102,46 @@ public:
  * Negative log likelihood for log-softmax activation
  * ΐ\tg}bNXŊꂽo͂ɑ΂镉lΐޓx֐
  */
-class NLLLoss : public AbstractLoss {
+template <typename Scalar>
+class NLLLossT : public AbstractLossT<Scalar> {
 public:
-    NLLLoss() = default;
-    virtual ~NLLLoss() = default;
-
-    const Matrix &forward(const Matrix &input, const Matrix &target) override {
-        const Matrix prod = -target.cwiseProduct(input);
-        input_ = input;
-        target_ = target;
-        output_ = prod.rowwise().sum();
+    using Matrix = MatrixT<Scalar>;
+    using MatrixMap = MatrixMapT<Scalar>;
+    using MatrixRef = MatrixRefT<Scalar>;
+    using AbstractLossT<Scalar>::input_;
+    using AbstractLossT<Scalar>::target_;
+    using AbstractLossT<Scalar>::output_;
+    using AbstractLossT<Scalar>::dLdx_;
+
+    NLLLossT() = default;
+    virtual ~NLLLossT() = default;
+
+    const MatrixMap &forward(const MatrixRef &input, const MatrixRef &target) override {
+        input_.bind(input);
+        target_.bind(target);
+        output_ = -target.cwiseProduct(input).rowwise().sum();
         return output_;
     }
 
-    Matrix backward() override {
-        return -target_;
+    const MatrixMap &backward() override {
+        dLdx_ = -target_;
+        return dLdx_;
+    }
+
+    // Forward takes a product and a sum per element, and backward only negates the target without reading the
+    // prediction
+    // `d͗vfɐςƘavZ, t`d͗\ǂ܂ɐ̕𔽓]邾ł
+    LayerCost cost(bool backward) const override {
+        const double n_elements = (double)input_.size();
+        LayerCost cost;
+        cost.flops = backward ? n_elements : 2.0 * n_elements;
+        cost.bytes = (backward ? 2.0 * n_elements : 2.0 * n_elements + input_.rows()) * sizeof(Scalar);
+        return cost;
     }
 };
 
+using AbstractLoss = AbstractLossT<ScalarType>;
+using CrossEntropyLoss = CrossEntropyLossT<ScalarType>;
+using NLLLoss = NLLLossT<ScalarType>;
+
 #endif  // _LOSSES_H_
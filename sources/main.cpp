@@ -1,110 +1,634 @@
 #include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <chrono>
 #include <memory>
+#include <new>
+#include <string>
 
 #include "educnn.h"
 
+// Count heap allocations, so that the training loop can check that its steps allocate nothing. With glibc,
+// "malloc" itself is replaced so that allocations inside Eigen are counted too. Otherwise, only "operator new"
+// is counted.
+// 学習ループの各ステップが何も確保しないことを確認できるよう, ヒープ確保を数える. glibcの場合は
+// Eigen内部の確保も数えられるよう"malloc"自体を置き換える. そうでない場合は"operator new"のみを数える
+#if defined(__GLIBC__)
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+void *__libc_valloc(size_t size);
+void *__libc_pvalloc(size_t size);
+
+void *malloc(size_t size) {
+    count_heap_allocation();
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+    count_heap_allocation();
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    count_heap_allocation();
+    return __libc_realloc(ptr, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size) {
+    // As glibc does, the alignment must be a power of two multiple of "sizeof(void *)"
+    // glibcと同様に, アラインメントは"sizeof(void *)"の2の冪倍でなければならない
+    if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0 || alignment == 0) {
+        return EINVAL;
+    }
+    count_heap_allocation();
+    void *result = __libc_memalign(alignment, size);
+    if (!result) {
+        return ENOMEM;
+    }
+    *ptr = result;
+    return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    count_heap_allocation();
+    return __libc_memalign(alignment, size);
+}
+
+void *memalign(size_t alignment, size_t size) {
+    count_heap_allocation();
+    return __libc_memalign(alignment, size);
+}
+
+void *valloc(size_t size) {
+    count_heap_allocation();
+    return __libc_valloc(size);
+}
+
+void *pvalloc(size_t size) {
+    count_heap_allocation();
+    return __libc_pvalloc(size);
+}
+}
+#else
+void *operator new(size_t size) {
+    count_heap_allocation();
+    if (void *ptr = std::malloc(size == 0 ? 1 : size)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void *operator new[](size_t size) {
+    return ::operator new(size);
+}
+
+void operator delete(void *ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept {
+    std::free(ptr);
+}
+#endif
+
 enum { MLP_NETWORK_TYPE = 0, CNN_NETWORK_TYPE, NETWORK_TYPE_COUNT };
+enum { FLOAT64_PRECISION = 0, FLOAT32_PRECISION, MIXED_PRECISION, PRECISION_COUNT };
 
-int main(int argc, char **argv) {
+static const char *precision_names[PRECISION_COUNT] = { "float64", "float32", "mixed" };
+
+struct Options {
     int net_type = MLP_NETWORK_TYPE;
-    if (argc > 1) {
-        if (strcmp(argv[1], "--mlp") == 0) {
-            net_type = MLP_NETWORK_TYPE;
-        } else if (strcmp(argv[1], "--cnn") == 0) {
-            net_type = CNN_NETWORK_TYPE;
-        } else {
-            fprintf(stderr, "Unknown flag \"%s\" is specified!", argv[1]);
-            exit(1);
-        }
+    bool fuse = false;
+    bool quantize = false;
+    bool stream = false;
+    // Checkpoint saved after every epoch, and checkpoint loaded instead of training
+    // エポック毎に保存するチェックポイントと, 学習の代わりに読み込むチェックポイント
+    std::string checkpoint_file;
+    std::string load_file;
+    // Number of replicas for data-parallel training (0 to train a single network)
+    // データ並列の学習のレプリカ数 (0の場合は単一のネットワークで学習する)
+    int replicas = 0;
+    // Rank of this process and number of processes for data-parallel training over processes, connected by
+    // "transport" ("shm" or "tcp") at "port" (also the key of shared memory)
+    // プロセス間のデータ並列の学習におけるこのプロセスのランクとプロセス数. プロセスは"port"
+    // (共有メモリのキーも兼ねる) の"transport" ("shm"または"tcp") で結ぶ
+    int rank = 0;
+    int n_ranks = 1;
+    std::string transport = "shm";
+    int port = 29500;
+    // Optimizer ("sgd", "nesterov", "adam" or "adamw")
+    // 最適化手法 ("sgd", "nesterov", "adam"または"adamw")
+    std::string optimizer = "sgd";
+    // Batch size, and memory budget of the workspace in MB, within which each batch runs as micro-batches
+    // accumulating their gradients (0 to run each batch at once)
+    // バッチサイズと作業領域のメモリの予算 (MB). 各バッチは予算内に収まるマイクロバッチに分けて勾配を
+    // 累積する (0の場合は各バッチを一度に計算する)
+    int batchsize = 64;
+    double memory_budget = 0.0;
+    // Chrome trace written by the per-layer profiler of the training steps (empty not to profile)
+    // 学習ステップのレイヤー毎のプロファイラが書き出すChromeのトレース (空の場合はプロファイルしない)
+    std::string profile_file;
+};
+
+struct TrainResult {
+    double epoch_seconds = 0.0;
+    double accuracy = 0.0;
+};
+
+/**
+ * Quantize the trained network and report the accuracy drop and the speedup of int8 inference on the test set.
+ * The first images of the training data are used for calibration.
+ * 学習済みネットワークを量子化し, テストデータに対するint8推論での精度の低下と高速化を報告する.
+ * 学習データの先頭の画像を校正に用いる
+ */
+template <typename Scalar>
+void evaluate_quantized(NetworkT<Scalar> &network, const IdxDataset &train_set, const IdxDataset &test_set) {
+    using Matrix = MatrixT<Scalar>;
+
+    const int n_calibration = std::min(1000, train_set.size());
+    Matrix calibration_data, calibration_labels;
+    train_set.slice(0, n_calibration, calibration_data, calibration_labels);
+    QuantizedNetworkT<Scalar> quantized(network, calibration_data);
+
+    Matrix test_data, test_labels;
+    test_set.slice(0, test_set.size(), test_data, test_labels);
+
+    Timer timer;
+    timer.start();
+    const Matrix pred = network.predict(test_data);
+    const double float_seconds = timer.stop();
+
+    timer.start();
+    const Matrix quantized_pred = quantized.predict(test_data);
+    const double int8_seconds = timer.stop();
+
+    const double float_acc = accuracy(pred, test_labels);
+    const double int8_acc = accuracy(quantized_pred, test_labels);
+    printf("Quantized layers: %d\n", quantized.quantized_layer_count());
+    printf("Acc (%s): %6.2f %% (%.3f sec)\n", sizeof(Scalar) == sizeof(float) ? "float32" : "float64", float_acc,
+           float_seconds);
+    printf("Acc (int8):    %6.2f %% (%.3f sec)\n", int8_acc, int8_seconds);
+    printf("Accuracy drop: %.2f %%, speedup: %.2fx\n", float_acc - int8_acc, float_seconds / int8_seconds);
+}
+
+/**
+ * Compiled network of "options.net_type", whose chains of layers such as convolution, max pooling and ReLU are
+ * fused with "options.fuse". The number of the fused layers is set to "n_fused".
+ * "options.net_type"のコンパイルしたネットワーク. "options.fuse"の場合は畳み込み, 最大値プーリング, ReLUなどの
+ * レイヤーの連なりを融合する. 融合したレイヤーの数を"n_fused"に設定する
+ */
+template <typename Scalar>
+std::shared_ptr<NetworkT<Scalar>> make_network(const Options &options, int *n_fused = nullptr) {
+    CompileOptions compile_options;
+    compile_options.fuse = options.fuse;
+    auto network = (options.net_type == CNN_NETWORK_TYPE ? cnn_builder<Scalar>() : mlp_builder<Scalar>())
+                       .build(compile_options);
+    if (!network) {
+        exit(1);
     }
+    if (n_fused) {
+        *n_fused = network->fused_layer_count();
+    }
+    return network;
+}
+
+/**
+ * Optimizer of "options.optimizer" updating the parameters in "Scalar" with master weights in "Master"
+ * "options.optimizer"の最適化手法. "Scalar"型のパラメータを"Master"型のマスターの重みで更新する
+ */
+template <typename Scalar, typename Master>
+std::unique_ptr<AbstractOptimizerT<Scalar>> make_optimizer(const Options &options) {
+    const double eta = 1.0e-2;    // step size of SGD
+    const double momentum = 0.1;  // momentum
+    const double alpha = 1.0e-3;  // step size of Adam
+    const double decay = 1.0e-2;  // weight decay of AdamW
+    if (options.optimizer == "nesterov") {
+        return std::unique_ptr<AbstractOptimizerT<Scalar>>(new MomentumSGDT<Scalar, Master>(eta, momentum, true));
+    } else if (options.optimizer == "adam") {
+        return std::unique_ptr<AbstractOptimizerT<Scalar>>(new AdamT<Scalar, Master>(alpha));
+    } else if (options.optimizer == "adamw") {
+        return std::unique_ptr<AbstractOptimizerT<Scalar>>(new AdamT<Scalar, Master>(alpha, decay, true));
+    }
+    return std::unique_ptr<AbstractOptimizerT<Scalar>>(new MomentumSGDT<Scalar, Master>(eta, momentum));
+}
+
+/**
+ * Train the network with activations in "Scalar" and master weights in "Master", and evaluate it.
+ * 活性値を"Scalar"型, マスターの重みを"Master"型として学習し, 評価する
+ */
+template <typename Scalar, typename Master>
+TrainResult train_and_test(const Options &options) {
+    using Matrix = MatrixT<Scalar>;
 
     // Parameters
     const int epochs = 6;
-    const int batchsize = 64;
-    const double eta = 1.0e-2;    // step size
-    const double momentum = 0.1;  // momentum
+    const int batchsize = options.batchsize;
 
-    // Train data
-    Matrix train_data = mnist::train_images();
-    Matrix train_labels = mnist::train_labels();
-
-    std::vector<std::shared_ptr<AbstractLayer>> layers;
-    if (net_type == MLP_NETWORK_TYPE) {
-        // MLP
-        layers.emplace_back(new FullyConnectedLayer(784, 300));
-        layers.emplace_back(new Sigmoid());
-        layers.emplace_back(new FullyConnectedLayer(300, 10));
-        layers.emplace_back(new LogSoftmax());
-        printf("Network: MLP\n");
-    } else if (net_type == CNN_NETWORK_TYPE) {
-        // CNN
-        layers.emplace_back(new ConvolutionLayer(Size(28, 28), Size(5, 5), 1, 6));
-        layers.emplace_back(new MaxPoolingLayer(Size(24, 24), Size(2, 2), 6));
-        layers.emplace_back(new ReLU());
-        layers.emplace_back(new ConvolutionLayer(Size(12, 12), Size(5, 5), 6, 16));
-        layers.emplace_back(new MaxPoolingLayer(Size(8, 8), Size(2, 2), 16));
-        layers.emplace_back(new ReLU());
-        layers.emplace_back(new FullyConnectedLayer(4 * 4 * 16, 84));
-        layers.emplace_back(new ReLU());
-        layers.emplace_back(new FullyConnectedLayer(84, 10));
-        layers.emplace_back(new LogSoftmax());
-        printf("Network: CNN\n");
-    }
-    Network network(layers);
+    // Train data, which is memory-mapped and converted batch by batch
+    // 学習データ. メモリマップし, バッチ毎に変換する
+    const IdxDataset train_set = mnist::train_set();
+
+    // Optimizer updating the parameters with their gradients
+    // パラメータをその勾配で更新する最適化手法
+    const auto optimizer = make_optimizer<Scalar, Master>(options);
+
+    // Network, and replicas of it for data-parallel training
+    // ネットワークと, データ並列の学習のためのそのレプリカ
+    std::unique_ptr<DataParallelTrainerT<Scalar>> trainer;
+    std::shared_ptr<NetworkT<Scalar>> network_ptr;
+    int n_fused = 0;
+    if (options.replicas > 0) {
+        trainer.reset(new DataParallelTrainerT<Scalar>(
+            options.replicas, [&] { return make_network<Scalar>(options, &n_fused); },
+            [] { return std::make_shared<NLLLossT<Scalar>>(); }, *optimizer));
+    } else {
+        network_ptr = make_network<Scalar>(options, &n_fused);
+    }
+    NetworkT<Scalar> &network = trainer ? trainer->network() : *network_ptr;
+    printf("Network: %s\n", options.net_type == CNN_NETWORK_TYPE ? "CNN" : "MLP");
+    printf("Optimizer: %s\n", options.optimizer.c_str());
+    if (options.fuse) {
+        printf("Fused layers: %d\n", n_fused);
+    }
+    if (trainer) {
+        printf("Replicas: %d\n", trainer->n_replicas());
+    }
 
     // Loss function
-    auto criterion = std::make_shared<NLLLoss>();
+    auto criterion = std::make_shared<NLLLossT<Scalar>>();
 
-    // Shuffle data indices
-    Random &rng = Random::getInstance();
-    const int n_data = (int)train_data.rows();
+    // Trainer running each batch as micro-batches within the memory budget
+    // 各バッチをメモリの予算内のマイクロバッチとして計算する学習器
+    std::unique_ptr<GradientAccumulationTrainerT<Scalar>> accumulation;
+    if (options.memory_budget > 0.0) {
+        const size_t budget_bytes = (size_t)(options.memory_budget * 1024.0 * 1024.0);
+        accumulation.reset(new GradientAccumulationTrainerT<Scalar>(network, *criterion, *optimizer, budget_bytes));
+    }
 
-    Timer timer;
-    timer.start();
-    for (int e = 0; e < epochs; e++) {
-        // Shuffle data indices
-        std::vector<int> indices(n_data);
-        for (int i = 0; i < n_data; i++) {
-            indices[i] = i;
+    // Processes of data-parallel training, each of which trains on its own shard of the training data
+    // データ並列に学習するプロセス. 各プロセスは学習データの担当部分で学習する
+    std::unique_ptr<AbstractTransport> transport;
+    std::unique_ptr<DistributedTrainerT<Scalar>> distributed;
+    if (options.n_ranks > 1) {
+#if defined(EDUCNN_HAS_TRANSPORT)
+        if (options.transport == "tcp") {
+            transport.reset(new SocketTransport(options.rank, options.n_ranks, options.port));
+        } else {
+            transport.reset(new SharedMemoryTransport(options.rank, options.n_ranks, std::to_string(options.port)));
         }
+        distributed.reset(new DistributedTrainerT<Scalar>(network, *criterion, *optimizer, *transport));
+        printf("Rank: %d / %d (%s)\n", options.rank, options.n_ranks, options.transport.c_str());
+#else
+        fprintf(stderr, "Multi-process training is not supported on this platform!\n");
+        exit(1);
+#endif
+    }
+
+    // Place all the buffers for the batch size in a single arena
+    // バッチサイズに対する全てのバッファを1つのアリーナに配置する
+    const size_t arena_bytes = trainer        ? trainer->plan(batchsize, train_set.n_features())
+                               : distributed  ? distributed->plan(batchsize, train_set.n_features())
+                               : accumulation ? accumulation->plan(batchsize, train_set.n_features())
+                                              : network.plan(batchsize, train_set.n_features(), criterion.get());
+    printf("Workspace: %.2f MB\n", arena_bytes / (1024.0 * 1024.0));
+    if (accumulation) {
+        printf("Micro-batch: %d / %d\n", accumulation->micro_batchsize(), batchsize);
+    }
 
-        for (int i = 0; i < n_data; i++) {
-            const int k = rng.nextInt(i, n_data - 1);
-            std::swap(indices[i], indices[k]);
+    TrainResult result;
+    if (!options.load_file.empty()) {
+        // Use the parameters of a checkpoint in place instead of training. The file is only mapped, and the
+        // parameters are read from it on demand.
+        // 学習する代わりにチェックポイントのパラメータをその場で使う. ファイルはマップするのみで,
+        // パラメータは必要に応じてそこから読まれる
+        const auto start = std::chrono::steady_clock::now();
+        if (!network.load(options.load_file)) {
+            exit(1);
+        }
+        const auto end = std::chrono::steady_clock::now();
+        printf("Checkpoint loaded: %.3f ms\n", std::chrono::duration<double, std::milli>(end - start).count());
+    } else {
+        // Move the parameters to flat buffers, which the optimizer updates in a single pass (the trainers have
+        // already done it in planning)
+        // パラメータを平坦なバッファに移し, 最適化手法はそれを1回で更新する (学習器は計画時に済ませている)
+        if (!trainer && !distributed && !accumulation) {
+            optimizer->attach(network.flat_parameters());
         }
 
-        // Train with each batch
-        const int n_batches = (n_data + batchsize - 1) / batchsize;
-        ProgressBar pbar(n_batches);
-        for (int j = 0; j < n_batches; j++) {
-            // Construct a batch of data
-            const int B = std::min(batchsize, n_data - j * batchsize);
-            Matrix batch_data(B, train_data.cols());
-            Matrix batch_labels(B, train_labels.cols());
-            for (int b = 0; b < B; b++) {
-                batch_data.row(b) = train_data.row(indices[j * batchsize + b]);
-                batch_labels.row(b) = train_labels.row(indices[j * batchsize + b]);
-            }
+        // Profile the layers in the training steps after planning, so that the dry run is left out
+        // 試行を除くよう, 計画の後に学習ステップでのレイヤーをプロファイルする
+        std::unique_ptr<Profiler> profiler;
+        if (!options.profile_file.empty()) {
+            profiler.reset(new Profiler());
+            network.set_profiler(profiler.get());
+        }
 
-            // Process
-            const Matrix &output = network.forward(batch_data);
-            const Matrix &losses = criterion->forward(output, batch_labels);
-            const double mean_loss = losses.mean();
-            const double mean_acc = accuracy(output, batch_labels);
+        // Heap allocations in the training steps, which should be zero after planning
+        // 学習ステップでのヒープ確保の回数. 計画後は0になるはず
+        long long step_allocations = 0;
 
-            network.backward(criterion->backward(), eta, momentum);
+        // Train with a batch of "B" samples
+        // "B"サンプルのバッチで学習する
+        auto train_step = [&](const Matrix &data, const Matrix &labels, int B, int e, ProgressBar &pbar) {
+            const long long allocations = heap_allocation_count();
+            double mean_loss, mean_acc;
+            if (trainer) {
+                const auto step = trainer->step(data.topRows(B), labels.topRows(B));
+                mean_loss = step.loss;
+                mean_acc = step.accuracy;
+            } else if (distributed) {
+                const auto step = distributed->step(data.topRows(B), labels.topRows(B));
+                mean_loss = step.loss;
+                mean_acc = step.accuracy;
+            } else if (accumulation) {
+                const auto step = accumulation->step(data.topRows(B), labels.topRows(B));
+                mean_loss = step.loss;
+                mean_acc = step.accuracy;
+            } else {
+                const auto &output = network.forward(data.topRows(B));
+                const auto &losses = criterion->forward(output, labels.topRows(B));
+                mean_loss = losses.mean();
+                mean_acc = accuracy(output, labels.topRows(B));
+                network.backward(criterion->backward());
+                optimizer->step();
+            }
+            step_allocations += heap_allocation_count() - allocations;
             pbar.setDescription("#%d: loss=%6.3f, acc=%6.3f", e + 1, mean_loss, mean_acc);
             pbar.step();
+        };
+
+        // Save a checkpoint with the optimizer state after every epoch, which is written atomically so that a
+        // crash never leaves a broken one
+        // エポック毎に最適化手法の状態とともにチェックポイントを保存する. アトミックに書き込むので, 異常終了
+        // しても壊れたものは残らない
+        auto save_checkpoint = [&]() {
+            if (!options.checkpoint_file.empty() && options.rank == 0 &&
+                !network.save(options.checkpoint_file, optimizer.get())) {
+                exit(1);
+            }
+        };
+
+        Timer timer;
+        if (options.stream) {
+            // Stream the training data from the file through a shuffle buffer of "shuffle_size" samples, as for
+            // datasets that do not fit in memory
+            // メモリに収まらないデータセットと同様に, 学習データをファイルから"shuffle_size"サンプルの
+            // シャッフルバッファを通して流す
+            const int shuffle_size = 10000;
+            IdxStream reader({{train_image_file, train_label_file}}, shuffle_size);
+            Matrix batch_data(batchsize, reader.n_features());
+            Matrix batch_labels(batchsize, IdxStream::n_classes);
+            const int n_batches = (train_set.size() + batchsize - 1) / batchsize;
+
+            timer.start();
+            for (int e = 0; e < epochs; e++) {
+                ProgressBar pbar(n_batches);
+                int B;
+                while ((B = reader.next_batch(batchsize, batch_data, batch_labels)) > 0) {
+                    train_step(batch_data, batch_labels, B, e, pbar);
+                }
+                save_checkpoint();
+            }
+            printf("Stream buffers: %.2f MB, stall: %.3f sec\n", reader.buffer_bytes() / (1024.0 * 1024.0),
+                   reader.stall_seconds());
+        } else {
+            // Batches are shuffled and assembled ahead on a background thread
+            // バッチはバックグラウンドのスレッドで先にシャッフルして組み立てる
+            BatchLoaderT<Scalar> loader(train_set, batchsize, epochs, 4, 1, options.rank, options.n_ranks);
+
+            timer.start();
+            for (int e = 0; e < epochs; e++) {
+                ProgressBar pbar(loader.n_batches());
+                for (int j = 0; j < loader.n_batches(); j++) {
+                    const auto &batch = loader.next();
+                    train_step(batch.data, batch.labels, batch.size, e, pbar);
+                }
+                save_checkpoint();
+            }
+            printf("Loader stall: %.3f sec\n", loader.stall_seconds());
+        }
+
+        const double seconds = timer.stop();
+        result.epoch_seconds = seconds / epochs;
+        printf("Time: %.2f sec\n", seconds);
+        printf("Heap allocations in training steps: %lld\n", step_allocations);
+        if (distributed) {
+            printf("Communication wait: %.3f sec\n", distributed->wait_seconds());
+        }
+        if (profiler) {
+            network.set_profiler(nullptr);
+            profiler->print_summary();
+            if (!profiler->save_trace(options.profile_file)) {
+                exit(1);
+            }
         }
     }
 
-    printf("Time: %.2f sec\n", timer.stop());
+    // All the ranks have the same parameters, so that only rank 0 tests them
+    // 全ランクのパラメータは同じなので, ランク0のみがテストする
+    if (options.rank != 0) {
+        return result;
+    }
 
     // Test
-    Matrix test_data = mnist::test_images();
-    Matrix test_labels = mnist::test_labels();
+    const IdxDataset test_set = mnist::test_set();
+
+    // Stream the test data in chunks of the (micro-)batch size, which bounds the memory usage
+    // テストデータは (マイクロ) バッチサイズのチャンク毎に流すので, メモリ使用量が抑えられる
+    const int chunk_size = accumulation ? accumulation->micro_batchsize() : batchsize;
+    const Evaluator evaluation = evaluate(network, test_set, chunk_size);
+    result.accuracy = evaluation.accuracy();
+    printf("Acc: %6.2f %%\n", result.accuracy);
+    evaluation.print_confusion();
+
+    if (options.quantize) {
+        evaluate_quantized(network, train_set, test_set);
+    }
+    return result;
+}
+
+/**
+ * Benchmark the throughput of data-parallel training of the CNN from 1 to "max_threads" threads, with one
+ * replica per thread
+ * 1から"max_threads"スレッドまで, スレッド毎に1つのレプリカでCNNをデータ並列に学習するスループットを測る
+ */
+template <typename Scalar, typename Master>
+void benchmark_scaling(Options options, int max_threads = 64) {
+    const int batchsize = 256;
+    const int n_steps = 20;
+    options.net_type = CNN_NETWORK_TYPE;
+
+    const IdxDataset train_set = mnist::train_set();
+    MatrixT<Scalar> data, labels;
+    train_set.slice(0, batchsize, data, labels);
+
+    const int default_threads = parallel_thread_count();
+    printf("\n%-8s %16s %10s %12s\n", "threads", "samples [1/sec]", "speedup", "efficiency");
+    double base_throughput = 0.0;
+    for (int K = 1; K <= max_threads; K *= 2) {
+        set_parallel_thread_count(K);
+        const auto optimizer = make_optimizer<Scalar, Master>(options);
+        DataParallelTrainerT<Scalar> trainer(
+            K, [&] { return make_network<Scalar>(options); }, [] { return std::make_shared<NLLLossT<Scalar>>(); },
+            *optimizer);
+        trainer.plan(batchsize, train_set.n_features());
+        trainer.step(data, labels);
+
+        Timer timer;
+        timer.start();
+        for (int i = 0; i < n_steps; i++) {
+            trainer.step(data, labels);
+        }
+        const double throughput = n_steps * batchsize / timer.stop();
+        if (K == 1) {
+            base_throughput = throughput;
+        }
+        const double speedup = throughput / base_throughput;
+        printf("%-8d %16.1f %9.2fx %11.1f%%\n", K, throughput, speedup, 100.0 * speedup / K);
+    }
+    set_parallel_thread_count(default_threads);
+}
+
+TrainResult train_and_test(int precision, const Options &options) {
+    printf("Precision: %s\n", precision_names[precision]);
+    if (precision == FLOAT32_PRECISION) {
+        return train_and_test<float, float>(options);
+    } else if (precision == MIXED_PRECISION) {
+        return train_and_test<float, double>(options);
+    }
+    return train_and_test<double, double>(options);
+}
+
+int main(int argc, char **argv) {
+    Options options;
+    int precision = FLOAT64_PRECISION;
+    bool compare_precisions = false;
+    bool scaling = false;
+    int threads = 0;
+    long long seed = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--mlp") == 0) {
+            options.net_type = MLP_NETWORK_TYPE;
+        } else if (strcmp(argv[i], "--cnn") == 0) {
+            options.net_type = CNN_NETWORK_TYPE;
+        } else if (strcmp(argv[i], "--float64") == 0) {
+            precision = FLOAT64_PRECISION;
+        } else if (strcmp(argv[i], "--float32") == 0) {
+            precision = FLOAT32_PRECISION;
+        } else if (strcmp(argv[i], "--mixed") == 0) {
+            precision = MIXED_PRECISION;
+        } else if (strcmp(argv[i], "--compare-precisions") == 0) {
+            compare_precisions = true;
+        } else if (strcmp(argv[i], "--fuse") == 0) {
+            options.fuse = true;
+        } else if (strcmp(argv[i], "--quantize") == 0) {
+            options.quantize = true;
+        } else if (strcmp(argv[i], "--stream") == 0) {
+            options.stream = true;
+        } else if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc) {
+            options.checkpoint_file = argv[++i];
+        } else if (strcmp(argv[i], "--load") == 0 && i + 1 < argc) {
+            options.load_file = argv[++i];
+        } else if (strcmp(argv[i], "--replicas") == 0 && i + 1 < argc) {
+            options.replicas = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--ranks") == 0 && i + 1 < argc) {
+            options.n_ranks = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--rank") == 0 && i + 1 < argc) {
+            options.rank = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--transport") == 0 && i + 1 < argc) {
+            options.transport = argv[++i];
+        } else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            options.port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--optimizer") == 0 && i + 1 < argc) {
+            options.optimizer = argv[++i];
+        } else if (strcmp(argv[i], "--batchsize") == 0 && i + 1 < argc) {
+            options.batchsize = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--memory-budget") == 0 && i + 1 < argc) {
+            options.memory_budget = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+            options.profile_file = argv[++i];
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = atoll(argv[++i]);
+        } else if (strcmp(argv[i], "--scaling") == 0) {
+            scaling = true;
+        } else {
+            fprintf(stderr, "Unknown flag \"%s\" is specified!", argv[i]);
+            exit(1);
+        }
+    }
 
-    Matrix pred = network.forward(test_data);
-    const double acc = accuracy(pred, test_labels);
-    printf("Acc: %6.2f %%\n", acc);
+    if (options.n_ranks > 1 && (options.replicas > 0 || options.stream || !options.load_file.empty())) {
+        fprintf(stderr, "--ranks cannot be used with --replicas, --stream nor --load!\n");
+        exit(1);
+    }
+    if (options.memory_budget > 0.0 && (options.replicas > 0 || options.n_ranks > 1)) {
+        fprintf(stderr, "--memory-budget cannot be used with --replicas nor --ranks!\n");
+        exit(1);
+    }
+    if (!options.profile_file.empty() && options.replicas > 0) {
+        fprintf(stderr, "--profile cannot be used with --replicas!\n");
+        exit(1);
+    }
+    if (options.batchsize <= 0) {
+        fprintf(stderr, "Batch size must be positive!\n");
+        exit(1);
+    }
+    if (options.optimizer != "sgd" && options.optimizer != "nesterov" && options.optimizer != "adam" &&
+        options.optimizer != "adamw") {
+        fprintf(stderr, "Unknown optimizer \"%s\" is specified!\n", options.optimizer.c_str());
+        exit(1);
+    }
+    if (options.rank < 0 || options.rank >= options.n_ranks) {
+        fprintf(stderr, "Rank %d is out of %d ranks!\n", options.rank, options.n_ranks);
+        exit(1);
+    }
+    if (threads < 0) {
+        fprintf(stderr, "Number of threads must be positive!\n");
+        exit(1);
+    }
+
+    // Threads of the pool running the parallel loops (the hardware or "EDUCNN_NUM_THREADS" by default)
+    // 並列ループを実行するプールのスレッド数 (既定ではハードウェアまたは"EDUCNN_NUM_THREADS"の値)
+    if (threads > 0) {
+        set_parallel_thread_count(threads);
+    }
+
+    // Seed of the random streams of the initialization and the shuffles, which makes runs reproducible
+    // 初期化とシャッフルの乱数列のシード. 実行を再現可能にする
+    set_random_seed((uint64_t)seed);
+
+    if (scaling) {
+        printf("Precision: %s\n", precision_names[precision]);
+        if (precision == FLOAT32_PRECISION) {
+            benchmark_scaling<float, float>(options);
+        } else if (precision == MIXED_PRECISION) {
+            benchmark_scaling<float, double>(options);
+        } else {
+            benchmark_scaling<double, double>(options);
+        }
+        return 0;
+    }
+
+    if (!compare_precisions) {
+        train_and_test(precision, options);
+        return 0;
+    }
+
+    // Benchmark epoch time and test accuracy of each precision against the float64 baseline
+    // 各精度のエポック時間とテスト精度をfloat64の場合と比較する
+    TrainResult results[PRECISION_COUNT];
+    for (int p = 0; p < PRECISION_COUNT; p++) {
+        results[p] = train_and_test(p, options);
+    }
+
+    printf("\n%-10s %12s %10s %10s\n", "precision", "epoch [sec]", "speedup", "acc [%]");
+    for (int p = 0; p < PRECISION_COUNT; p++) {
+        printf("%-10s %12.2f %9.2fx %10.2f\n", precision_names[p], results[p].epoch_seconds,
+               results[FLOAT64_PRECISION].epoch_seconds / results[p].epoch_seconds, results[p].accuracy);
+    }
 }
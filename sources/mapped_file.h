@@ -0,0 +1,157 @@
+#ifdef _MSC_VER
+#pragma once
+#endif
+
+#ifndef _MAPPED_FILE_H_
+#define _MAPPED_FILE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+
+#if defined(_WIN32) || defined(__WIN32__)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+/**
+ * Read-only memory-mapped file. Pages are loaded by the OS only when they are touched, and are shared with
+ * the page cache instead of being copied to the heap.
+ * 読み出し専用のメモリマップトファイル. ページはアクセスされた時にのみOSが読み込み, ヒープにコピーされずに
+ * ページキャッシュと共有される
+ */
+class MappedFile {
+public:
+    MappedFile() = default;
+
+    explicit MappedFile(const std::string &filename, bool copy_on_write = false) {
+        open(filename, copy_on_write);
+    }
+
+    MappedFile(MappedFile &&other) {
+        swap(other);
+    }
+
+    MappedFile &operator=(MappedFile &&other) {
+        close();
+        swap(other);
+        return *this;
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile() {
+        close();
+    }
+
+    /**
+     * Map the whole of "filename". Returns false if the file cannot be opened or mapped. With "copy_on_write",
+     * the pages can be written, and written pages are copied privately without changing the file.
+     * "filename"全体をマップする. ファイルを開けない, またはマップできない場合はfalseを返す. "copy_on_write"の
+     * 場合はページに書き込むことができ, 書き込んだページはファイルを変えずに個別にコピーされる
+     */
+    bool open(const std::string &filename, bool copy_on_write = false) {
+        close();
+#if defined(_WIN32) || defined(__WIN32__)
+        HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                                  FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+            CloseHandle(file);
+            return false;
+        }
+
+        HANDLE mapping =
+            CreateFileMappingA(file, nullptr, copy_on_write ? PAGE_WRITECOPY : PAGE_READONLY, 0, 0, nullptr);
+        CloseHandle(file);
+        if (mapping == nullptr) {
+            return false;
+        }
+
+        void *data = MapViewOfFile(mapping, copy_on_write ? FILE_MAP_COPY : FILE_MAP_READ, 0, 0, 0);
+        CloseHandle(mapping);
+        if (data == nullptr) {
+            return false;
+        }
+        size_ = (size_t)size.QuadPart;
+#else
+        const int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            ::close(fd);
+            return false;
+        }
+
+        const int prot = copy_on_write ? PROT_READ | PROT_WRITE : PROT_READ;
+        void *data = mmap(nullptr, (size_t)st.st_size, prot, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (data == MAP_FAILED) {
+            return false;
+        }
+        size_ = (size_t)st.st_size;
+#endif
+        data_ = (uint8_t *)data;
+        copy_on_write_ = copy_on_write;
+        return true;
+    }
+
+    void close() {
+        if (data_ == nullptr) {
+            return;
+        }
+#if defined(_WIN32) || defined(__WIN32__)
+        UnmapViewOfFile(data_);
+#else
+        munmap((void *)data_, size_);
+#endif
+        data_ = nullptr;
+        size_ = 0;
+        copy_on_write_ = false;
+    }
+
+    const uint8_t *data() const {
+        return data_;
+    }
+    uint8_t *writable_data() {
+        return copy_on_write_ ? data_ : nullptr;
+    }
+    size_t size() const {
+        return size_;
+    }
+    bool is_open() const {
+        return data_ != nullptr;
+    }
+
+private:
+    void swap(MappedFile &other) {
+        std::swap(data_, other.data_);
+        std::swap(size_, other.size_);
+        std::swap(copy_on_write_, other.copy_on_write_);
+    }
+
+    uint8_t *data_ = nullptr;
+    size_t size_ = 0;
+    bool copy_on_write_ = false;
+};
+
+#endif  // _MAPPED_FILE_H_
@@ -5,134 +5,199 @@
 #ifndef _MAX_POOLING_LAYER_H_
 #define _MAX_POOLING_LAYER_H_
 
+#include <cstdint>
 #include <vector>
 
-#include "openmp.h"
+#include "parallel.h"
 #include "random.h"
 #include "abstract_layer.h"
 
-class MaxPoolingLayer : public AbstractLayer {
+template <typename Scalar>
+class MaxPoolingLayerT : public AbstractLayerT<Scalar> {
 public:
+    using Matrix = MatrixT<Scalar>;
+    using MatrixMap = MatrixMapT<Scalar>;
+    using MatrixRef = MatrixRefT<Scalar>;
+    using LayerState = LayerStateT<Scalar>;
+    using AbstractLayerT<Scalar>::forward;
+    using AbstractLayerT<Scalar>::backward;
+
     // Public methods
-    MaxPoolingLayer(Size input_size, Size pool_size, int n_channels)
-        : AbstractLayer()
+    MaxPoolingLayerT(Size input_size, Size pool_size, int n_channels)
+        : MaxPoolingLayerT(input_size, pool_size, n_channels, pool_size) {
+    }
+
+    MaxPoolingLayerT(Size input_size, Size pool_size, int n_channels, Size stride)
+        : AbstractLayerT<Scalar>()
         , input_size_(input_size)
         , pool_size_(pool_size)
+        , stride_(stride)
         , output_size_()
         , n_channels_(n_channels) {
-        Assertion(input_size_.rows % pool_size_.rows == 0 && input_size_.cols % pool_size_.cols == 0,
-                  "input size and pool size are not compatible!!");
+        Assertion(pool_size_.rows <= input_size_.rows && pool_size_.cols <= input_size_.cols,
+                  "pool size is larger than input size!!");
+        Assertion(stride_.rows > 0 && stride_.cols > 0, "stride must be positive!!");
+        Assertion(pool_size_.total() <= 256, "argmax in a pool must fit in uint8_t!!");
+
+        // Pixels at the bottom/right which do not fill a whole window are dropped
+        // 窓全体を満たさない下端/右端の画素は使われない
+        output_size_.rows = (input_size_.rows - pool_size_.rows) / stride_.rows + 1;
+        output_size_.cols = (input_size_.cols - pool_size_.cols) / stride_.cols + 1;
+    }
+
+    virtual ~MaxPoolingLayerT() {
+    }
 
-        output_size_.rows = input_size_.rows / pool_size_.rows;
-        output_size_.cols = input_size_.cols / pool_size_.cols;
+    const char *name() const override {
+        return "MaxPooling";
+    }
 
-        // Initialize bipartite graph between input and output
-        // 入出力画素の接続を表す二部グラフの初期化
-        edges_o2i.resize(output_size_.total() * n_channels);
-        initialize();
+    // Forward compares each pixel of the windows, reads the input and writes the output and, in training, the
+    // offsets of the maxima. Backward reads the output gradient and the offsets, zeroes "dLdx" in a pass of its
+    // own, and adds each output gradient to it.
+    // 順伝播は窓の各画素を比較し, 入力を読んで出力と (学習時は) 最大値の位置を書く. 逆伝播は出力の勾配と
+    // 最大値の位置を読み, "dLdx"を別の走査でゼロにしてから各出力の勾配を足し込む
+    LayerCost cost(bool backward) const override {
+        const double n_input = (double)this->input().size();
+        const double n_output = (double)this->output().size();
+        LayerCost cost;
+        if (backward) {
+            cost.flops = n_output;
+            cost.bytes = (n_output + 2.0 * n_input) * sizeof(Scalar) + n_output;
+        } else {
+            cost.flops = n_output * pool_size_.total();
+            cost.bytes = (n_input + n_output) * sizeof(Scalar) + (this->training() ? n_output : 0.0);
+        }
+        return cost;
     }
 
-    virtual ~MaxPoolingLayer() {
+    Shape input_shape() const override {
+        return Shape(n_channels_, input_size_);
+    }
+    Shape output_shape(const Shape &input) const override {
+        return Shape(n_channels_, output_size_);
     }
 
-    const Matrix &forward(const Matrix &input) override {
+    std::unique_ptr<LayerState> make_state() const override {
+        return std::unique_ptr<LayerState>(new State());
+    }
+
+    const MatrixMap &forward(const MatrixRef &input, LayerState &state) const override {
         const int batchsize = (int)input.rows();
-        const int n_output = output_size_.total() * n_channels_;
-
-        input_ = input;
-        output_ = Matrix::Zero(batchsize, n_output);
-
-        for (int b = 0; b < batchsize; b++) {
-            OMP_PARALLEL_FOR(int o = 0; o < n_output; o++) {
-                double maxval = -INFTY;
-                int active_index = 0;
-                for (int e = 0; e < edges_o2i[o].size(); e++) {
-                    Edge &edge = edges_o2i[o][e];
-                    if (maxval < input(b, edge.to)) {
-                        maxval = input(b, edge.to);
-                        active_index = e;
+        const int n_pixels = output_size_.total();
+        const int n_output = n_pixels * n_channels_;
+        std::vector<uint8_t> &argmax = static_cast<State &>(state).argmax;
+
+        state.input.bind(input);
+        state.output.resize(batchsize, n_output);
+        if (state.training) {
+            argmax.resize((size_t)batchsize * n_output);
+        }
+
+        // Parallelize over (sample, channel) tiles in a single parallel loop. The offset of the maximum
+        // in each window is saved so that "backward" does not need to search it again.
+        // (サンプル, チャンネル) のタイルについて1つの並列ループで並列化する.
+        // "backward"で再び探索しなくて済むように, 各窓内の最大値の位置を保存しておく
+        parallel_for(0, batchsize * n_channels_, [&](int tile) {
+            const int b = tile / n_channels_;
+            const int c = tile % n_channels_;
+            for (int p = 0; p < n_pixels; p++) {
+                const int o = c * n_pixels + p;
+                const int origin = window_origin(c, p);
+                Scalar maxval = (Scalar)-INFTY;
+                int active_offset = 0;
+                for (int dy = 0; dy < pool_size_.rows; dy++) {
+                    for (int dx = 0; dx < pool_size_.cols; dx++) {
+                        const Scalar value = input(b, origin + dy * input_size_.cols + dx);
+                        if (maxval < value) {
+                            maxval = value;
+                            active_offset = dy * pool_size_.cols + dx;
+                        }
                     }
                 }
 
-                Edge &active_e = edges_o2i[o][active_index];
-                output_(b, o) = input(b, active_e.to);
+                state.output(b, o) = maxval;
+                if (state.training) {
+                    argmax[(size_t)b * n_output + o] = (uint8_t)active_offset;
+                }
             }
-        }
+        });
 
-        return output_;
+        return state.output;
     }
 
-    Matrix backward(const Matrix &dLdy, double lr = 0.1, double momentum = 0.5) override {
+    const MatrixMap &backward(const MatrixRef &dLdy, LayerState &state) override {
         const int batchsize = (int)dLdy.rows();
         const int n_input = input_size_.total() * n_channels_;
-        const int n_output = output_size_.total() * n_channels_;
-        Matrix dLdx = Matrix::Zero(batchsize, n_input);
-        for (int b = 0; b < batchsize; b++) {
-            OMP_PARALLEL_FOR(int o = 0; o < n_output; o++) {
-                double maxval = -INFTY;
-                int active_index = 0;
-                for (int e = 0; e < edges_o2i[o].size(); e++) {
-                    Edge &edge = edges_o2i[o][e];
-                    if (maxval < input_(b, edge.to)) {
-                        maxval = input_(b, edge.to);
-                        active_index = e;
-                    }
-                }
-
-                Edge &active_e = edges_o2i[o][active_index];
-                OMP_ATOMIC(dLdx(b, active_e.to) += dLdy(b, o));
+        const int n_pixels = output_size_.total();
+        const int n_output = n_pixels * n_channels_;
+
+        // Overlapping windows of a tile are written only by the thread processing the tile,
+        // hence no atomics are needed
+        // 重なり合う窓もタイル内ではそのタイルを処理するスレッドのみが書き込むので, アトミック操作は不要
+        const std::vector<uint8_t> &argmax = static_cast<State &>(state).argmax;
+        state.dLdx.resize(batchsize, n_input);
+        state.dLdx.setZero();
+        parallel_for(0, batchsize * n_channels_, [&](int tile) {
+            const int b = tile / n_channels_;
+            const int c = tile % n_channels_;
+            for (int p = 0; p < n_pixels; p++) {
+                const int o = c * n_pixels + p;
+                const int offset = argmax[(size_t)b * n_output + o];
+                const int dy = offset / pool_size_.cols;
+                const int dx = offset % pool_size_.cols;
+                state.dLdx(b, window_origin(c, p) + dy * input_size_.cols + dx) += dLdy(b, o);
             }
-        }
+        });
 
-        return dLdx;
+        return state.dLdx;
     }
 
-private:
-    // Private methods
-    void initialize() {
-        for (int f = 0; f < n_channels_; f++) {
-            for (int yout = 0; yout < output_size_.rows; yout++) {
-                for (int xout = 0; xout < output_size_.cols; xout++) {
-                    initialize_edges(f, yout, xout);
-                }
-            }
-        }
+    Size input_size() const {
+        return input_size_;
     }
-
-    void initialize_edges(int f, int yout, int xout) {
-        for (int dy = 0; dy < pool_size_.rows; dy++) {
-            for (int dx = 0; dx < pool_size_.cols; dx++) {
-                int yin = yout * pool_size_.rows + dy;
-                int xin = xout * pool_size_.cols + dx;
-
-                int input_index = f * input_size_.total() + (yin * input_size_.cols + xin);
-                int output_index = f * output_size_.total() + (yout * output_size_.cols + xout);
-                add_edge(input_index, output_index);
-            }
-        }
+    Size pool_size() const {
+        return pool_size_;
     }
-
-    void add_edge(int in, int out) {
-        edges_o2i[out].emplace_back(in);
+    Size stride() const {
+        return stride_;
+    }
+    Size output_size() const {
+        return output_size_;
+    }
+    int channels() const {
+        return n_channels_;
     }
 
-    // Private internal classes
-    struct Edge {
-        int to = 0;
-
-        Edge(int to_)
-            : to(to_) {
-        }
+private:
+    // State with the offset "dy * pool_cols + dx" of the maximum in each window, stored as
+    // "argmax[b * n_output + o]"
+    // 各窓内の最大値の位置 "dy * pool_cols + dx" をもつ状態. "argmax[b * n_output + o]"として保持する
+    struct State : public LayerState {
+        std::vector<uint8_t> argmax = {};
     };
 
+    // Private methods
+
+    /**
+     * Input index of the top-left pixel of the window for output pixel "p" in channel "c"
+     * チャンネル"c"の出力画素"p"に対応する窓の左上の入力画素の番号
+     */
+    int window_origin(int c, int p) const {
+        const int yin = (p / output_size_.cols) * stride_.rows;
+        const int xin = (p % output_size_.cols) * stride_.cols;
+        return c * input_size_.total() + yin * input_size_.cols + xin;
+    }
+
     // Private parameters
     Size input_size_ = {};
     Size pool_size_{};
+    Size stride_ = {};
     Size output_size_ = {};
     int n_channels_ = 0;
 
-    std::vector<std::vector<Edge>> edges_o2i = {};
+};  // class MaxPoolingLayerT
 
-};  // class MaxPoolingLayer
+using MaxPoolingLayer = MaxPoolingLayerT<ScalarType>;
 
 #endif  // _MAX_POOLING_LAYER_H_
@@ -5,11 +5,16 @@
 #ifndef _MNIST_H_
 #define _MNIST_H_
 
+#include <cstdint>
+#include <cstdlib>
 #include <iostream>
-#include <fstream>
+#include <string>
+#include <algorithm>
 
 #include "common.h"
 #include "directories.h"
+#include "mapped_file.h"
+#include "pixel_kernels.h"
 
 // -----------------------------------------------------------------------------
 // MNIST utility function definitions
@@ -30,91 +35,283 @@ inline uint32_t parse_bigendian(uint8_t *buf) {
 }
 
 /**
- * Load image data
- * 画像データの読み込み
+ * Normalize the pixels of images "image(0), ..., image(n - 1)" to [0, 1], and write them to the first "n" rows of
+ * "out", which is resized only if it is too small.
+ * 画像"image(0), ..., image(n - 1)"の画素を[0, 1]に正規化し, "out"の先頭"n"行に書き込む. "out"は
+ * 小さすぎる場合のみリサイズする
  */
-inline Matrix load_images(const std::string &filename) {
-    std::ifstream reader(filename.c_str(), std::ios::in | std::ios::binary);
-    if (reader.fail()) {
-        std::cerr << "Failed to open data: " << filename << std::endl;
-        exit(1);
-    }
-
-    uint8_t temp[4];
-
-    // read magic number
-    // マジックナンバーの読み込み
-    reader.read((char *)temp, sizeof(char) * 4);
-    const int magic = parse_bigendian(temp);
-    Assertion(magic == 2051, "Invalid magic number!");
-
-    // read number of data
-    // データの数の読み込み
-    reader.read((char *)temp, sizeof(char) * 4);
-    const int n_image = parse_bigendian(temp);
-
-    // read image height (# of rows)
-    // 画像の高さ(行数)を読む
-    reader.read((char *)temp, sizeof(char) * 4);
-    const int rows = parse_bigendian(temp);
-
-    // read image width (# of columns)
-    // 画像の幅(列数)を読む
-    reader.read((char *)temp, sizeof(char) * 4);
-    const int cols = parse_bigendian(temp);
-
-    // read pixel values
-    // 画像の画素値を読む
-    uint8_t *buf = new uint8_t[rows * cols];
-    Matrix ret = Matrix::Zero(n_image, rows * cols);
-    for (int i = 0; i < n_image; i++) {
-        reader.read((char *)buf, sizeof(char) * rows * cols);
-        for (int j = 0; j < rows * cols; j++) {
-            ret(i, j) = buf[j] / 255.0;
+template <typename Scalar, typename ImageFunc>
+void normalize_pixels(int n, int n_pixels, MatrixT<Scalar> &out, const ImageFunc &image) {
+    if (out.rows() < n || out.cols() != n_pixels) {
+        out.resize(n, n_pixels);
+    }
+
+    // Normalized values of the scalar fallback are looked up from a table, whose entries are "pixel / 255.0"
+    // rounded to "Scalar"
+    // スカラー実装の正規化した値は表から引く. 表の値は"pixel / 255.0"を"Scalar"に丸めたもの
+    Scalar table[256];
+    for (int i = 0; i < 256; i++) {
+        table[i] = (Scalar)(i / 255.0);
+    }
+
+    // Samples are converted in blocks. For each pixel, the values of a block go to a contiguous segment of
+    // a column of "out" (column-major), while the rows of the block are read sequentially. The rows in whole
+    // groups of lanes are converted by the kernel of the instruction set, and the pixels it leaves and the
+    // other rows by the table.
+    // サンプルはブロック毎に変換する. 各画素について, ブロックの値は"out" (列優先) の列の連続した区間に
+    // 書き込まれ, ブロックの各行は順に読まれる. レーン数のグループに収まる行は命令セットのカーネルで
+    // 変換し, カーネルが残した画素とその他の行は表で変換する
+    static const PixelKernel<Scalar> kernel = pixel_kernel<Scalar>(simd_level());
+    const int block_size = PIXEL_BLOCK;
+    const Eigen::Index stride = out.outerStride();
+    for (int b0 = 0; b0 < n; b0 += block_size) {
+        const int m = std::min(block_size, n - b0);
+        const uint8_t *rows[block_size];
+        for (int k = 0; k < m; k++) {
+            rows[k] = image(b0 + k);
+        }
+
+        const int m_kernel = kernel ? m / PIXEL_LANES * PIXEL_LANES : 0;
+        const int j_kernel = m_kernel > 0 ? kernel(rows, m_kernel, n_pixels, out.data() + b0, stride) : 0;
+        Scalar *dst = out.data() + b0;
+        for (int j = 0; j < n_pixels; j++, dst += stride) {
+            for (int k = j < j_kernel ? m_kernel : 0; k < m; k++) {
+                dst[k] = table[rows[k][j]];
+            }
         }
     }
-    delete[] buf;
+}
 
-    reader.close();
+/**
+ * Write one-hot vectors of "label(0), ..., label(n - 1)" to the first "n" rows of "out"
+ * "label(0), ..., label(n - 1)"のone-hotベクトルを"out"の先頭"n"行に書き込む
+ */
+template <typename Scalar, typename LabelFunc>
+void one_hot_labels(int n, int n_classes, MatrixT<Scalar> &out, const LabelFunc &label) {
+    if (out.rows() < n || out.cols() != n_classes) {
+        out.resize(n, n_classes);
+    }
 
-    return ret;
+    out.topRows(n).setZero();
+    for (int k = 0; k < n; k++) {
+        const int digit = label(k);
+        Assertion(digit < n_classes, "Invalid label!");
+        out(k, digit) = 1.0;
+    }
 }
 
+}  // anonymous namespace
+
+// -----------------------------------------------------------------------------
+// IDX dataset definitions
+// -----------------------------------------------------------------------------
+
 /**
- * Load label data
- * ラベルデータの読み込み
+ * Images in an IDX file, which is memory-mapped and kept in uint8_t. Only the rows of the requested samples
+ * are converted to "Scalar", so that the resident memory is at most the file size.
+ * IDXファイルの画像. ファイルはメモリマップし, uint8_tのまま保持する. 要求されたサンプルの行のみを
+ * "Scalar"に変換するので, 常駐するメモリは高々ファイルの大きさとなる
  */
-inline Matrix load_labels(const std::string &filename) {
-    std::ifstream reader(filename.c_str(), std::ios::in | std::ios::binary);
-    if (reader.fail()) {
-        std::cerr << "Failed to open labels: " << filename << std::endl;
-        exit(1);
+class IdxImages {
+public:
+    explicit IdxImages(const std::string &filename) {
+        if (!file_.open(filename)) {
+            std::cerr << "Failed to open data: " << filename << std::endl;
+            exit(1);
+        }
+        Assertion(file_.size() >= 16, "Invalid file size!");
+
+        // Header: magic number, number of data, image height (# of rows) and image width (# of columns)
+        // ヘッダ: マジックナンバー, データの数, 画像の高さ(行数), 画像の幅(列数)
+        uint8_t temp[4];
+        std::copy(file_.data(), file_.data() + 4, temp);
+        const int magic = parse_bigendian(temp);
+        Assertion(magic == 2051, "Invalid magic number!");
+        std::copy(file_.data() + 4, file_.data() + 8, temp);
+        n_images_ = parse_bigendian(temp);
+        std::copy(file_.data() + 8, file_.data() + 12, temp);
+        rows_ = parse_bigendian(temp);
+        std::copy(file_.data() + 12, file_.data() + 16, temp);
+        cols_ = parse_bigendian(temp);
+        Assertion(file_.size() >= 16 + (size_t)n_images_ * rows_ * cols_, "Invalid file size!");
+    }
+
+    int size() const {
+        return n_images_;
+    }
+    int n_pixels() const {
+        return rows_ * cols_;
+    }
+
+    const uint8_t *image(int i) const {
+        return file_.data() + 16 + (size_t)i * n_pixels();
+    }
+
+    /**
+     * Convert images "indices[0], ..., indices[n - 1]" to the first "n" rows of "out", with pixel values
+     * normalized to [0, 1]. "out" is resized only if it is too small.
+     * 画像"indices[0], ..., indices[n - 1]"を, 画素値を[0, 1]に正規化して"out"の先頭"n"行に変換する.
+     * "out"は小さすぎる場合のみリサイズする
+     */
+    template <typename Scalar>
+    void gather(const int *indices, int n, MatrixT<Scalar> &out) const {
+        convert(n, out, [&](int k) { return indices[k]; });
+    }
+
+    /**
+     * Convert "n" images from "begin" as "gather"
+     * "begin"からの"n"枚の画像を"gather"と同様に変換する
+     */
+    template <typename Scalar>
+    void slice(int begin, int n, MatrixT<Scalar> &out) const {
+        convert(n, out, [&](int k) { return begin + k; });
+    }
+
+private:
+    template <typename Scalar, typename IndexFunc>
+    void convert(int n, MatrixT<Scalar> &out, const IndexFunc &index) const {
+        normalize_pixels(n, n_pixels(), out, [&](int k) {
+            const int i = index(k);
+            Assertion(0 <= i && i < n_images_, "Image index out of range!");
+            return image(i);
+        });
+    }
+
+    MappedFile file_;
+    int n_images_ = 0;
+    int rows_ = 0;
+    int cols_ = 0;
+};
+
+/**
+ * Labels in an IDX file, which is memory-mapped and converted to one-hot vectors only for the requested samples
+ * IDXファイルのラベル. ファイルはメモリマップし, 要求されたサンプルのみone-hotベクトルに変換する
+ */
+class IdxLabels {
+public:
+    enum { n_classes = 10 };
+
+    explicit IdxLabels(const std::string &filename) {
+        if (!file_.open(filename)) {
+            std::cerr << "Failed to open labels: " << filename << std::endl;
+            exit(1);
+        }
+        Assertion(file_.size() >= 8, "Invalid file size!");
+
+        // Header: magic number and number of labels
+        // ヘッダ: マジックナンバーとラベル数
+        uint8_t temp[4];
+        std::copy(file_.data(), file_.data() + 4, temp);
+        const int magic = parse_bigendian(temp);
+        Assertion(magic == 2049, "Invalid magic number!");
+        std::copy(file_.data() + 4, file_.data() + 8, temp);
+        n_labels_ = parse_bigendian(temp);
+        Assertion(file_.size() >= 8 + (size_t)n_labels_, "Invalid file size!");
+    }
+
+    int size() const {
+        return n_labels_;
+    }
+
+    int label(int i) const {
+        return file_.data()[8 + i];
+    }
+
+    template <typename Scalar>
+    void gather(const int *indices, int n, MatrixT<Scalar> &out) const {
+        convert(n, out, [&](int k) { return indices[k]; });
+    }
+
+    template <typename Scalar>
+    void slice(int begin, int n, MatrixT<Scalar> &out) const {
+        convert(n, out, [&](int k) { return begin + k; });
+    }
+
+private:
+    template <typename Scalar, typename IndexFunc>
+    void convert(int n, MatrixT<Scalar> &out, const IndexFunc &index) const {
+        one_hot_labels(n, n_classes, out, [&](int k) {
+            const int i = index(k);
+            Assertion(0 <= i && i < n_labels_, "Label index out of range!");
+            return label(i);
+        });
     }
 
-    uint8_t temp[4];
+    MappedFile file_;
+    int n_labels_ = 0;
+};
 
-    // read magic number
-    // マジックナンバーの読み込み
-    reader.read((char *)temp, sizeof(char) * 4);
-    const int magic = parse_bigendian(temp);
-    Assertion(magic == 2049, "Invalid magic number!");
+/**
+ * Pair of IDX images and labels
+ * IDXの画像とラベルの組
+ */
+class IdxDataset {
+public:
+    IdxDataset(const std::string &image_file, const std::string &label_file)
+        : images_(image_file)
+        , labels_(label_file) {
+        Assertion(images_.size() == labels_.size(), "Numbers of images and labels are different!");
+    }
 
-    // read number of labes
-    // ラベル数の読み込み
-    reader.read((char *)temp, sizeof(char) * 4);
-    const int n_data = parse_bigendian(temp);
+    int size() const {
+        return images_.size();
+    }
+    int n_features() const {
+        return images_.n_pixels();
+    }
+    int n_classes() const {
+        return IdxLabels::n_classes;
+    }
+
+    const IdxImages &images() const {
+        return images_;
+    }
+    const IdxLabels &labels() const {
+        return labels_;
+    }
+
+    /**
+     * Convert samples "indices[0], ..., indices[n - 1]" to the first "n" rows of "images" and "labels"
+     * サンプル"indices[0], ..., indices[n - 1]"を"images"と"labels"の先頭"n"行に変換する
+     */
+    template <typename Scalar>
+    void gather(const int *indices, int n, MatrixT<Scalar> &images, MatrixT<Scalar> &labels) const {
+        images_.gather(indices, n, images);
+        labels_.gather(indices, n, labels);
+    }
 
-    // read label index and convert it to one-hot vector
-    // ラベル番号を読み取ってone-hotベクトルに変換する
-    Matrix ret = Matrix::Zero(n_data, 10);
-    for (int i = 0; i < n_data; i++) {
-        char digit;
-        reader.read((char *)&digit, sizeof(char));
-        ret(i, digit) = 1.0;
+    template <typename Scalar>
+    void slice(int begin, int n, MatrixT<Scalar> &images, MatrixT<Scalar> &labels) const {
+        images_.slice(begin, n, images);
+        labels_.slice(begin, n, labels);
     }
 
-    reader.close();
+private:
+    IdxImages images_;
+    IdxLabels labels_;
+};
 
+namespace {
+
+/**
+ * Load image data
+ * 画像データの読み込み
+ */
+inline Matrix load_images(const std::string &filename) {
+    const IdxImages images(filename);
+    Matrix ret;
+    images.slice(0, images.size(), ret);
+    return ret;
+}
+
+/**
+ * Load label data
+ * ラベルデータの読み込み
+ */
+inline Matrix load_labels(const std::string &filename) {
+    const IdxLabels labels(filename);
+    Matrix ret;
+    labels.slice(0, labels.size(), ret);
     return ret;
 }
 
@@ -158,6 +355,18 @@ inline Matrix test_labels() {
     return load_labels(test_label_file);
 }
 
+/**
+ * Memory-mapped train and test datasets
+ * メモリマップした訓練用とテスト用のデータセット
+ */
+inline IdxDataset train_set() {
+    return IdxDataset(train_image_file, train_label_file);
+}
+
+inline IdxDataset test_set() {
+    return IdxDataset(test_image_file, test_label_file);
+}
+
 }  // namespace mnist
 
 #endif  // _MNIST_H_
@@ -0,0 +1,51 @@
+#ifdef _MSC_VER
+#pragma once
+#endif
+
+#ifndef _MODELS_H_
+#define _MODELS_H_
+
+#include <memory>
+#include <vector>
+
+#include "network_builder.h"
+
+/**
+ * Multi-layer perceptron for MNIST (784 -> 300 -> 10)
+ * MNIST用の多層パーセプトロン (784 -> 300 -> 10)
+ */
+template <typename Scalar>
+NetworkBuilderT<Scalar> mlp_builder() {
+    NetworkBuilderT<Scalar> builder(1, Size(28, 28));
+    builder.fully_connected(300).sigmoid();
+    builder.fully_connected(10).log_softmax();
+    return builder;
+}
+
+/**
+ * LeNet-like convolutional neural network for MNIST, whose sizes are inferred from the input
+ * MNIST用のLeNet風の畳み込みニューラルネット. 大きさは入力から推論する
+ */
+template <typename Scalar>
+NetworkBuilderT<Scalar> cnn_builder() {
+    NetworkBuilderT<Scalar> builder(1, Size(28, 28));
+    builder.convolution(Size(5, 5), 6).max_pooling(Size(2, 2)).relu();
+    builder.convolution(Size(5, 5), 16).max_pooling(Size(2, 2)).relu();
+    builder.fully_connected(84).relu();
+    builder.fully_connected(10).log_softmax();
+    return builder;
+}
+
+// Uncompiled layers of the networks above
+// 上のネットワークのコンパイルされていないレイヤー
+template <typename Scalar>
+std::vector<std::shared_ptr<AbstractLayerT<Scalar>>> mlp_layers() {
+    return mlp_builder<Scalar>().layers();
+}
+
+template <typename Scalar>
+std::vector<std::shared_ptr<AbstractLayerT<Scalar>>> cnn_layers() {
+    return cnn_builder<Scalar>().layers();
+}
+
+#endif  // _MODELS_H_
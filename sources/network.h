@@ -5,52 +5,624 @@
 #ifndef _NETWORK_H_
 #define _NETWORK_H_
 
+#include <memory>
+#include <string>
 #include <vector>
+#include <algorithm>
 
 #include "progress.h"
 #include "random.h"
 #include "losses.h"
+#include "workspace.h"
+#include "checkpoint.h"
+#include "optimizer.h"
+#include "profiler.h"
 #include "abstract_layer.h"
 
-class Network {
+template <typename Scalar>
+class NetworkT;
+
+/**
+ * Options of the passes run by "NetworkT::compile"
+ * "NetworkT::compile"で実行するパスの設定
+ */
+struct CompileOptions {
+    // Fuse chains of layers such as convolution, max pooling and ReLU (see "NetworkT::fuse")
+    // 畳み込み, 最大値プーリング, ReLUなどのレイヤーの連なりを融合する ("NetworkT::fuse"を参照)
+    bool fuse = false;
+    // Select the computation method of each layer for its shapes (see "AbstractLayerT::select_kernel")
+    // 各レイヤーの計算方法を形状に合わせて選ぶ ("AbstractLayerT::select_kernel"を参照)
+    bool select_kernels = true;
+    // Whether the network is trained, or only used for inference, which the methods are selected for
+    // ネットワークを学習するか, 推論にのみ使うか. 計算方法はこれに合わせて選ぶ
+    bool training = true;
+};
+
+/**
+ * Execution context of a network for inference, which owns the states of all its layers (see "LayerStateT").
+ * The buffers of the states are placed in a single arena for batches of up to "max_batchsize" samples.
+ * Passes on a context only read the network, so that several threads can run inference on a single copy of
+ * the parameters, each with its own context.
+ * 推論のためのネットワークの実行コンテキスト. 全レイヤーの状態 ("LayerStateT"を参照) をもつ. 状態の
+ * バッファは最大"max_batchsize"サンプルのバッチのために1つのアリーナに配置する. コンテキスト上の計算は
+ * ネットワークを読むだけなので, 複数のスレッドがそれぞれのコンテキストで1つのパラメータを共有して
+ * 推論できる
+ */
+template <typename Scalar>
+class ExecutionContextT : private Uncopyable {
+public:
+    int max_batchsize() const {
+        return max_batchsize_;
+    }
+
+    // Size of the arena in bytes
+    // アリーナのバイト数
+    size_t bytes() const {
+        return bytes_;
+    }
+
+private:
+    friend class NetworkT<Scalar>;
+
+    std::vector<std::unique_ptr<LayerStateT<Scalar>>> states_;
+    int max_batchsize_ = 0;
+    size_t bytes_ = 0;
+};
+
+template <typename Scalar>
+class NetworkT {
 public:
+    using Matrix = MatrixT<Scalar>;
+    using MatrixMap = MatrixMapT<Scalar>;
+    using MatrixRef = MatrixRefT<Scalar>;
+    using ExecutionContext = ExecutionContextT<Scalar>;
+
     // Public methods
-    Network()
+    NetworkT()
         : layers_() {
     }
 
-    Network(const std::vector<std::shared_ptr<AbstractLayer>> &layers)
+    NetworkT(const std::vector<std::shared_ptr<AbstractLayerT<Scalar>>> &layers)
         : layers_(layers) {
+        make_states();
     }
 
-    virtual ~Network() {
+    virtual ~NetworkT() {
     }
 
-    const Matrix &forward(const Matrix &input) {
+    /**
+     * Forward computation. Layers view the outputs of their previous layers without copies, and element-wise
+     * layers overwrite them in place unless the previous layers need them in backward. "input" is not
+     * overwritten but must stay unchanged until "backward".
+     * 順伝搬. 各レイヤーは前のレイヤーの出力をコピーせずに参照し, 要素ごとのレイヤーは前のレイヤーが
+     * 逆伝搬で必要としない限りそれをその場で上書きする. "input"は上書きされないが, "backward"までは
+     * 変更してはならない
+     */
+    const MatrixMap &forward(const MatrixRef &input) {
         const int n_layers = (int)layers_.size();
         for (int i = 0; i < n_layers; i++) {
+            const double begin = profiler_ ? profiler_->now() : 0.0;
             if (i == 0) {
                 layers_[i]->forward(input);
+            } else if (layers_[i]->in_place() && !layers_[i - 1]->needs_output()) {
+                layers_[i]->forward_in_place(layers_[i - 1]->output());
             } else {
                 layers_[i]->forward(layers_[i - 1]->output());
             }
+            if (profiler_) {
+                profiler_->record(i, false, begin, layers_[i]->cost(false));
+            }
         }
         return layers_[n_layers - 1]->output();
     }
 
-    void backward(const Matrix &delta, double eta, double lambda) {
+    /**
+     * Forward computation in inference mode on "context", which is made by "make_context" of this network.
+     * The network is only read, and element-wise layers always overwrite the outputs of their previous
+     * layers, since no layer needs its output for backward. The result is valid until the next call on the
+     * same context.
+     * "make_context"で作った"context"上の推論モードの順伝搬. ネットワークは読むだけで, どのレイヤーも逆伝搬の
+     * ために出力を必要としないので, 要素ごとのレイヤーは常に前のレイヤーの出力を上書きする. 結果は同じ
+     * コンテキストでの次の呼び出しまで有効である
+     */
+    const MatrixMap &forward(const MatrixRef &input, ExecutionContext &context) const {
+        Assertion(input.rows() <= context.max_batchsize(), "batch is larger than the execution context!!");
+        const auto &states = context.states_;
+        const int n_layers = (int)layers_.size();
+        for (int i = 0; i < n_layers; i++) {
+            if (i == 0) {
+                layers_[i]->forward(input, *states[i]);
+            } else if (layers_[i]->in_place()) {
+                layers_[i]->forward_in_place(states[i - 1]->output, *states[i]);
+            } else {
+                layers_[i]->forward(states[i - 1]->output, *states[i]);
+            }
+        }
+        return states[n_layers - 1]->output;
+    }
+
+    /**
+     * Execution context for inference over batches of up to "max_batchsize" samples with "n_inputs" features.
+     * As "plan", a dry run with the largest batch records the sizes of the buffers, which are then placed in
+     * a single arena. Contexts must not outlive the network, and the layers must not be replaced nor trained
+     * while contexts are used. Contexts share what the layers derive from their parameters, which is refreshed
+     * by "compile" and "load", and must be refreshed by "prepare" after the parameters are updated otherwise.
+     * 最大"max_batchsize"サンプル, 特徴量"n_inputs"個のバッチを推論するための実行コンテキスト. "plan"と
+     * 同様に最大のバッチで試行してバッファの大きさを記録し, それらを1つのアリーナに配置する. コンテキストは
+     * ネットワークより長く存在してはならず, コンテキストを使う間はレイヤーを置き換えたり学習したりしては
+     * ならない. コンテキストはレイヤーがパラメータから導出するものを共有する. それは"compile"と"load"で
+     * 更新されるが, それ以外でパラメータを更新した後は"prepare"で更新しなければならない
+     */
+    std::unique_ptr<ExecutionContext> make_context(int max_batchsize, int n_inputs) const {
+        std::unique_ptr<ExecutionContext> context(new ExecutionContext());
+        for (const auto &layer : layers_) {
+            context->states_.push_back(layer->make_state());
+            context->states_.back()->training = false;
+        }
+        context->max_batchsize_ = max_batchsize;
+        forward(Matrix::Zero(max_batchsize, n_inputs), *context);
+
+        std::vector<BufferT<Scalar> *> buffers;
+        for (const auto &state : context->states_) {
+            state->buffers(buffers);
+        }
+        context->bytes_ = place_in_arena(buffers);
+        return context;
+    }
+
+    /**
+     * Inference over "input" in chunks of the batch size of "context", which can run on several threads at
+     * once with their own contexts
+     * "input"を"context"のバッチサイズのチャンク毎に推論する. それぞれのコンテキストで複数のスレッドから
+     * 同時に実行できる
+     */
+    Matrix predict(const MatrixRef &input, ExecutionContext &context) const {
+        const int n_samples = (int)input.rows();
+        Matrix output;
+        for (int b0 = 0; b0 < n_samples; b0 += context.max_batchsize()) {
+            const int n = std::min(context.max_batchsize(), n_samples - b0);
+            const MatrixMap &chunk = forward(input.middleRows(b0, n), context);
+            if (output.rows() != n_samples) {
+                output.resize(n_samples, chunk.cols());
+            }
+            output.middleRows(b0, n) = chunk;
+        }
+        return output;
+    }
+
+    /**
+     * Inference over "input" in chunks of up to "chunk_size" samples (the planned batch size if 0), so that
+     * the memory usage depends only on the chunk size. Layers run in inference mode during the call and return
+     * to their previous mode afterwards. "callback(b0, output)" is called with the output for the samples from
+     * "b0" of each chunk, which is valid only during the callback.
+     * "input"を最大"chunk_size"サンプル (0の場合は計画したバッチサイズ) のチャンク毎に推論するので, メモリ
+     * 使用量はチャンクの大きさのみで決まる. 呼び出しの間レイヤーは推論モードで動作し, その後元のモードに
+     * 戻る. 各チャンクについて"b0"からのサンプルに対する出力を引数に"callback(b0, output)"を呼ぶ. 出力は
+     * コールバックの間のみ有効
+     */
+    template <typename Callback>
+    void predict(const MatrixRef &input, int chunk_size, Callback &&callback) {
+        const int n_samples = (int)input.rows();
+        if (chunk_size <= 0) {
+            chunk_size = max_batchsize_ > 0 ? max_batchsize_ : n_samples;
+        }
+
+        const InferenceMode inference(*this);
+        for (int b0 = 0; b0 < n_samples; b0 += chunk_size) {
+            const int n = std::min(chunk_size, n_samples - b0);
+            callback(b0, forward(input.middleRows(b0, n)));
+        }
+    }
+
+    Matrix predict(const MatrixRef &input, int chunk_size = 0) {
+        Matrix output;
+        predict(input, chunk_size, [&](int b0, const MatrixMap &chunk) {
+            if (output.rows() != input.rows()) {
+                output.resize(input.rows(), chunk.cols());
+            }
+            output.middleRows(b0, chunk.rows()) = chunk;
+        });
+        return output;
+    }
+
+    void set_training(bool training) {
+        for (const auto &layer : layers_) {
+            layer->set_training(training);
+        }
+    }
+
+    //! Whether any of the layers is in training mode
+    bool training() const {
+        for (const auto &layer : layers_) {
+            if (layer->training()) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * Switch the network to inference mode while the object is alive, and restore the previous mode afterwards,
+     * also when the scope is left by an exception
+     * オブジェクトが生きている間ネットワークを推論モードにし, その後 (例外でスコープを抜けた場合も) 元の
+     * モードに戻す
+     */
+    class InferenceMode : private Uncopyable {
+    public:
+        explicit InferenceMode(NetworkT &network)
+            : network_(network)
+            , training_(network.training()) {
+            network_.set_training(false);
+        }
+        ~InferenceMode() {
+            network_.set_training(training_);
+        }
+
+    private:
+        NetworkT &network_;
+        bool training_ = true;
+    };
+
+    /**
+     * Record the time and the cost of each pass of each layer to "profiler", or stop recording with nullptr.
+     * Call this after "fuse" (and after "plan" to leave out its dry run), since the layers are indexed by
+     * their positions.
+     * 各レイヤーの各計算の時間とコストを"profiler"に記録する. nullptrの場合は記録をやめる. レイヤーは位置で
+     * 区別するので, "fuse"の後 (試行を除くには"plan"の後) に呼ぶこと
+     */
+    void set_profiler(Profiler *profiler) {
+        profiler_ = profiler;
+        if (profiler_) {
+            std::vector<std::string> names;
+            for (const auto &layer : layers_) {
+                names.push_back(layer->name());
+            }
+            profiler_->reset(names);
+        }
+    }
+
+    /**
+     * Switch whether "backward" adds the gradients of the parameters to the current ones instead of
+     * overwriting them (see "AbstractLayerT::set_accumulate")
+     * "backward"がパラメータの勾配を上書きせずに現在のものに足し込むかどうかを切り替える
+     * ("AbstractLayerT::set_accumulate"を参照)
+     */
+    void set_accumulate(bool accumulate) {
+        for (const auto &layer : layers_) {
+            layer->set_accumulate(accumulate);
+        }
+    }
+
+    /**
+     * Backward computation, which leaves the gradients of the parameters to an optimizer (see "optimizer.h")
+     * 逆伝播. パラメータの勾配は最適化手法に任せる ("optimizer.h"を参照)
+     */
+    void backward(const MatrixRef &delta) {
+        backward(delta, [](int) {});
+    }
+
+    /**
+     * Backward computation calling "callback(i)" as soon as layer "i" has computed its gradients, from the
+     * last layer to the first (e.g., to start communicating the gradients while the other layers run)
+     * 逆伝播. レイヤー"i"が勾配を計算し次第"callback(i)"を最後のレイヤーから順に呼ぶ (他のレイヤーの
+     * 計算中に勾配の通信を始めるためなど)
+     */
+    template <typename Callback>
+    void backward(const MatrixRef &delta, Callback &&callback) {
+        const int n_layers = (int)layers_.size();
+
+        // Each layer returns a view of its own gradient buffer, which is passed on without copies
+        // 各レイヤーは自身の勾配のバッファのビューを返すので, それをコピーせずに次に渡す
+        const MatrixMap *current = nullptr;
+        for (int i = n_layers - 1; i >= 0; i--) {
+            // Layers before the first one with parameters have nothing to compute (see "compile")
+            // 最初のパラメータをもつレイヤーより前のレイヤーには計算するものがない ("compile"を参照)
+            if (i < first_trainable_) {
+                callback(i);
+                continue;
+            }
+            const double begin = profiler_ ? profiler_->now() : 0.0;
+            current = i == n_layers - 1 ? &layers_[i]->backward(delta) : &layers_[i]->backward(*current);
+            if (profiler_) {
+                profiler_->record(i, true, begin, layers_[i]->cost(true));
+            }
+            callback(i);
+        }
+    }
+
+    /**
+     * Append the parameters of all the layers, their gradients and their names to "list"
+     * 全レイヤーのパラメータとその勾配, 名前を"list"に追加する
+     */
+    void parameters(std::vector<NamedParameterT<Scalar>> &list) const {
+        for (const auto &layer : layers_) {
+            layer->parameters(list);
+        }
+    }
+
+    /**
+     * Flat buffers of the values and the gradients of all the parameters, to which the parameters are moved
+     * on the first call. Optimizers and all-reduces work on them in a single pass. Call this after "fuse",
+     * since fused layers take over copies of the parameters.
+     * 全パラメータの値と勾配の平坦なバッファ. 最初の呼び出しでパラメータをそこに移す. 最適化手法や
+     * all-reduceはこれを1回で走査する. 融合したレイヤーはパラメータのコピーを引き継ぐので, "fuse"の後に
+     * 呼ぶこと
+     */
+    const FlatParametersT<Scalar> &flat_parameters() {
+        if (!flat_.values) {
+            std::vector<NamedParameterT<Scalar>> params;
+            parameters(params);
+            flat_ = place_parameters(params);
+        }
+        return flat_;
+    }
+
+    /**
+     * Replace the chains of layers which have fused versions (e.g., convolution, max pooling and ReLU) with
+     * the fused layers, which take over the parameters. Call this before "plan". Returns the number of the
+     * fused layers.
+     * 融合版のあるレイヤーの連なり (畳み込み, 最大値プーリング, ReLUなど) を, パラメータを引き継いだ融合した
+     * レイヤーで置き換える. "plan"の前に呼ぶこと. 融合したレイヤーの数を返す
+     */
+    int fuse() {
+        Assertion(!flat_.values, "parameters are already placed in flat buffers!!");
         const int n_layers = (int)layers_.size();
+        std::vector<std::shared_ptr<AbstractLayerT<Scalar>>> layers;
+        int n_fused_layers = 0;
+        for (int i = 0; i < n_layers;) {
+            int n_fused = 1;
+            auto fused = layers_[i]->fuse(layers_, i, n_fused);
+            if (fused) {
+                layers.push_back(fused);
+                n_fused_layers++;
+                i += n_fused;
+            } else {
+                layers.push_back(layers_[i]);
+                i++;
+            }
+        }
+        layers_ = layers;
+        make_states();
+        return n_fused_layers;
+    }
+
+    /**
+     * Compile the network for inputs of "input" shape before the first batch, so that the steps do no shape
+     * work:
+     *   1. Validation: the input shape of each layer must match the output shape of its previous layer, in
+     *      channels and pixels unless either of them is flat (see "Shape::accepts").
+     *   2. Fusion of chains of layers (see "fuse") if "options.fuse".
+     *   3. Kernel selection: each layer selects its computation method for its shapes.
+     *   4. Dead gradients: the gradients with respect to the inputs of the first layer with parameters and of
+     *      the layers before it are never used, so that they are neither computed nor given buffers.
+     * The static memory plan follows with "plan", which then needs no shape checks either. Returns false
+     * with a message if the network is mis-sized.
+     * 最初のバッチの前に, 形状"input"の入力に対してネットワークをコンパイルする. これによりステップでは
+     * 形状に関する処理を行わない:
+     *   1. 検証: 各レイヤーの入力の形状は前のレイヤーの出力の形状と, どちらかが平坦でない限りチャンネルと
+     *      画素について一致しなければならない ("Shape::accepts"を参照)
+     *   2. "options.fuse"の場合はレイヤーの連なりの融合 ("fuse"を参照)
+     *   3. カーネルの選択: 各レイヤーが形状に合った計算方法を選ぶ
+     *   4. 不要な勾配: 最初のパラメータをもつレイヤーとそれより前のレイヤーの入力についての勾配は使われないので,
+     *      計算もバッファの確保もしない
+     * 続いて"plan"で静的なメモリ計画を立てる. これも形状の検査を必要としない. ネットワークの大きさが合わない
+     * 場合はメッセージとともにfalseを返す
+     */
+    bool compile(const Shape &input, const CompileOptions &options = CompileOptions()) {
+        Assertion(!flat_.values, "parameters are already placed in flat buffers!!");
+        Shape shape = input;
+        for (int i = 0; i < (int)layers_.size(); i++) {
+            const Shape expected = layers_[i]->input_shape();
+            if (!expected.accepts(shape)) {
+                std::cerr << "Failed to compile network: layer " << i << " (" << layers_[i]->name() << ") takes "
+                          << to_string(expected) << " features, but its input has " << to_string(shape)
+                          << std::endl;
+                return false;
+            }
+            shape = layers_[i]->output_shape(shape);
+        }
 
-        Matrix current = delta;
+        n_fused_ = options.fuse ? fuse() : 0;
+        if (options.select_kernels) {
+            for (const auto &layer : layers_) {
+                layer->select_kernel(options.training);
+            }
+        }
+
+        const int n_layers = (int)layers_.size();
+        std::vector<NamedParameterT<Scalar>> params;
+        first_trainable_ = n_layers;
         for (int i = n_layers - 1; i >= 0; i--) {
-            current = layers_[i]->backward(current, eta, lambda);
+            params.clear();
+            layers_[i]->parameters(params);
+            if (!params.empty()) {
+                first_trainable_ = i;
+            }
+        }
+        for (int i = 0; i < n_layers; i++) {
+            layers_[i]->set_propagate(i > first_trainable_);
+        }
+        prepare();
+
+        n_inputs_ = input.total();
+        n_outputs_ = shape.total();
+        return true;
+    }
+
+    // Compile the network for flat inputs of "n_inputs" features
+    // 特徴量"n_inputs"個の平坦な入力に対してネットワークをコンパイルする
+    bool compile(int n_inputs, const CompileOptions &options = CompileOptions()) {
+        return compile(Shape(n_inputs), options);
+    }
+
+    /**
+     * Plan the workspace for batches of up to "max_batchsize" samples with "n_inputs" features. A dry run
+     * with the largest batch records the sizes of all the activation, gradient and scratch buffers of the
+     * layers (and "criterion" if given), which are then placed in a single arena reused by the following
+     * steps. Sizes recorded by earlier plans are forgotten, so that planning again for a smaller batch
+     * shrinks the arena. The dry run does not change the parameters. Returns the size of the arena in bytes.
+     * 最大"max_batchsize"サンプル, 特徴量"n_inputs"個のバッチのための作業領域を計画する. 最大のバッチで
+     * 試行してレイヤー (与えられた場合は"criterion"も) の活性値, 勾配, 作業用のバッファの大きさを記録し,
+     * それらを以降のステップで再利用される1つのアリーナに配置する. それ以前の計画で記録した大きさは
+     * 忘れるので, より小さなバッチで計画し直すとアリーナは縮む. 試行はパラメータを変えない.
+     * アリーナのバイト数を返す
+     */
+    size_t plan(int max_batchsize, int n_inputs, AbstractLossT<Scalar> *criterion = nullptr) {
+        Assertion(n_inputs_ == 0 || n_inputs == n_inputs_, "input size differs from the compiled one!!");
+        std::vector<BufferT<Scalar> *> buffers;
+        for (const auto &layer : layers_) {
+            layer->buffers(buffers);
+        }
+        if (criterion) {
+            criterion->buffers(buffers);
+        }
+        for (auto buffer : buffers) {
+            buffer->reset_peak();
+        }
+
+        const Matrix input = Matrix::Zero(max_batchsize, n_inputs);
+        const MatrixMap &output = forward(input);
+        const Matrix delta = Matrix::Zero(output.rows(), output.cols());
+        if (criterion) {
+            criterion->forward(output, delta);
+            criterion->backward();
+        }
+        backward(delta);
+
+        max_batchsize_ = max_batchsize;
+        return place_in_arena(buffers);
+    }
+
+    /**
+     * Save the parameters of the layers to a checkpoint, which is written atomically. With "optimizer", its
+     * state is saved as well to resume training.
+     * レイヤーのパラメータをチェックポイントにアトミックに保存する. "optimizer"を与えた場合は学習を
+     * 再開できるようその状態も保存する
+     */
+    bool save(const std::string &filename, const AbstractOptimizerT<Scalar> *optimizer = nullptr) const {
+        Assertion(!optimizer || flat_.values, "optimizer state needs flat parameters!!");
+        CheckpointWriter writer;
+        std::vector<NamedParameterT<Scalar>> params;
+        for (const auto &layer : layers_) {
+            params.clear();
+            layer->parameters(params);
+            for (const auto &param : params) {
+                writer.write(param.name, *param.value);
+                if (optimizer) {
+                    optimizer->save(writer, param);
+                }
+            }
+            writer.next_layer();
+        }
+        return writer.save(filename);
+    }
+
+    /**
+     * Load the parameters of the layers from a checkpoint of the same architecture (fused or not), and the
+     * state of "optimizer" if given. In place, the parameters use the memory-mapped file directly, so that
+     * loading costs only mapping the file. Parameters in flat buffers are always copied.
+     * 同じ構造 (融合の有無は問わない) のチェックポイントからレイヤーのパラメータを, 与えた場合は"optimizer"の
+     * 状態も読み込む. その場 ("in_place") の場合, パラメータはメモリマップしたファイルを直接使うので, 読み込みは
+     * マップのみで済む. 平坦なバッファにあるパラメータは常にコピーする
+     */
+    bool load(const std::string &filename, bool in_place = true, AbstractOptimizerT<Scalar> *optimizer = nullptr) {
+        Assertion(!optimizer || flat_.values, "optimizer state needs flat parameters!!");
+        Checkpoint checkpoint;
+        if (!checkpoint.open(filename, in_place)) {
+            return false;
+        }
+
+        std::vector<NamedParameterT<Scalar>> params;
+        for (const auto &layer : layers_) {
+            params.clear();
+            layer->parameters(params);
+            for (const auto &param : params) {
+                if (flat_.values) {
+                    checkpoint.read(param.name, *param.value);
+                } else {
+                    checkpoint.load(param.name, *param.value);
+                }
+                if (optimizer) {
+                    optimizer->load(checkpoint, param);
+                }
+            }
+            checkpoint.next_layer();
+        }
+        prepare();
+        return checkpoint.finish();
+    }
+
+    /**
+     * Refresh what the layers derive from their parameters (see "AbstractLayerT::prepare"), which the passes
+     * on execution contexts share
+     * レイヤーがパラメータから導出するものを更新する ("AbstractLayerT::prepare"を参照). 実行コンテキストでの
+     * 計算はそれを共有する
+     */
+    void prepare() {
+        for (const auto &layer : layers_) {
+            layer->prepare();
         }
     }
 
+    const std::vector<std::shared_ptr<AbstractLayerT<Scalar>>> &layers() const {
+        return layers_;
+    }
+
+    int planned_batchsize() const {
+        return max_batchsize_;
+    }
+
+    // Numbers of the input and output features given to and inferred by "compile" (0 before it)
+    // "compile"に与えた入力と推論した出力の特徴量の数 (それより前は0)
+    int n_inputs() const {
+        return n_inputs_;
+    }
+    int n_outputs() const {
+        return n_outputs_;
+    }
+
+    // Number of the layers fused by "compile"
+    // "compile"で融合したレイヤーの数
+    int fused_layer_count() const {
+        return n_fused_;
+    }
+
 private:
+    // Shape as "channels x rows x cols" for messages
+    // メッセージのための"チャンネル x 行 x 列"の形式の形状
+    static std::string to_string(const Shape &shape) {
+        return std::to_string(shape.channels) + "x" + std::to_string(shape.size.rows) + "x" +
+               std::to_string(shape.size.cols);
+    }
+
+    // Make the own states of the layers before any pass, so that their const accessors never make them
+    // レイヤー自身の状態を計算の前に作る. これによりconstのアクセサがそれを作ることはない
+    void make_states() {
+        for (const auto &layer : layers_) {
+            layer->state();
+        }
+    }
+
     // Private parameters
-    std::vector<std::shared_ptr<AbstractLayer>> layers_;
+    std::vector<std::shared_ptr<AbstractLayerT<Scalar>>> layers_;
+    // Batch size given to "plan", which is the default chunk size of "predict"
+    // "plan"に与えたバッチサイズ. "predict"のチャンクの大きさの既定値
+    int max_batchsize_ = 0;
+    // Flat buffers of the parameters, which are empty until "flat_parameters" is called
+    // パラメータの平坦なバッファ. "flat_parameters"を呼ぶまでは空である
+    FlatParametersT<Scalar> flat_;
+    // Shapes given to and inferred by "compile", and the results of its passes
+    // "compile"に与えた形状と推論した形状, およびそのパスの結果
+    int n_inputs_ = 0;
+    int n_outputs_ = 0;
+    int n_fused_ = 0;
+    int first_trainable_ = 0;
+    // Profiler recording the passes of the layers, or nullptr
+    // レイヤーの計算を記録するプロファイラ. またはnullptr
+    Profiler *profiler_ = nullptr;
+
+};  // class NetworkT
 
-};  // class Network
+using Network = NetworkT<ScalarType>;
 
 #endif  // _NETWORK_H_
@@ -0,0 +1,219 @@
+#ifdef _MSC_VER
+#pragma once
+#endif
+
+#ifndef _NETWORK_BUILDER_H_
+#define _NETWORK_BUILDER_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "network.h"
+#include "activation.h"
+#include "convolution_layer.h"
+#include "max_pooling_layer.h"
+#include "average_pooling_layer.h"
+#include "fully_connected_layer.h"
+
+/**
+ * Builder of a network from the shape of its input and the hyperparameters of its layers. The shape is
+ * inferred layer by layer, so that no size is computed by hand, e.g.,
+ *   NetworkBuilder(1, Size(28, 28)).convolution(Size(5, 5), 6).max_pooling(Size(2, 2)).relu()
+ *       .fully_connected(10).log_softmax().build();
+ * Mis-sized layers (e.g., a kernel larger than its input) are not added, and "build" fails with the first
+ * such error.
+ * 入力の形状と各レイヤーのハイパーパラメータからネットワークを組み立てるビルダー. 形状をレイヤー毎に
+ * 推論するので, 大きさを手で計算する必要はない (上の例を参照). 大きさの合わないレイヤー (入力より大きな
+ * カーネルなど) は追加せず, "build"は最初のそのようなエラーで失敗する
+ */
+template <typename Scalar>
+class NetworkBuilderT {
+public:
+    using AbstractLayer = AbstractLayerT<Scalar>;
+
+    // Input with "channels" channels of "size" pixels each
+    // それぞれ"size"画素の"channels"チャンネルからなる入力
+    NetworkBuilderT(int channels, Size size)
+        : channels_(channels)
+        , size_(size) {
+        if (channels_ <= 0 || size_.rows <= 0 || size_.cols <= 0) {
+            fail("input shape must be positive");
+        }
+        input_ = Shape(channels_, size_);
+    }
+
+    // Convolution with "out_channels" kernels of "kernel_size" and no padding
+    // "kernel_size"のカーネル"out_channels"個による, パディングなしの畳み込み
+    NetworkBuilderT &convolution(Size kernel_size, int out_channels,
+                                 ConvolutionMethod method = ConvolutionMethod::Im2col) {
+        if (!fits(kernel_size, "kernel") || !positive(out_channels, "output channels")) {
+            return *this;
+        }
+        layers_.emplace_back(new ConvolutionLayerT<Scalar>(size_, kernel_size, channels_, out_channels, method));
+        channels_ = out_channels;
+        size_ = Size(size_.rows - kernel_size.rows + 1, size_.cols - kernel_size.cols + 1);
+        return *this;
+    }
+
+    // Max pooling over windows of "pool_size", which are not overlapped by default
+    // "pool_size"の窓についての最大値プーリング. 既定では窓は重ならない
+    NetworkBuilderT &max_pooling(Size pool_size) {
+        return max_pooling(pool_size, pool_size);
+    }
+    NetworkBuilderT &max_pooling(Size pool_size, Size stride) {
+        if (!fits(pool_size, "pool") || !positive(std::min(stride.rows, stride.cols), "stride")) {
+            return *this;
+        }
+        if (pool_size.total() > 256) {
+            fail("pool " + to_string(pool_size) + " is too large for the offsets of the maxima");
+            return *this;
+        }
+        layers_.emplace_back(new MaxPoolingLayerT<Scalar>(size_, pool_size, channels_, stride));
+        size_ = pooled_size(pool_size, stride);
+        return *this;
+    }
+
+    // Average pooling over windows of "pool_size", which are not overlapped by default
+    // "pool_size"の窓についての平均値プーリング. 既定では窓は重ならない
+    NetworkBuilderT &average_pooling(Size pool_size) {
+        return average_pooling(pool_size, pool_size);
+    }
+    NetworkBuilderT &average_pooling(Size pool_size, Size stride) {
+        if (!fits(pool_size, "pool") || !positive(std::min(stride.rows, stride.cols), "stride")) {
+            return *this;
+        }
+        layers_.emplace_back(new AveragePoolingLayerT<Scalar>(size_, pool_size, channels_, stride));
+        size_ = pooled_size(pool_size, stride);
+        return *this;
+    }
+
+    // Fully connected layer to "n_outputs" units, whose output is regarded as channels of a single pixel
+    // "n_outputs"ユニットへの全結合層. 出力は1画素のチャンネルとみなす
+    NetworkBuilderT &fully_connected(int n_outputs) {
+        if (!positive(n_outputs, "output units")) {
+            return *this;
+        }
+        layers_.emplace_back(new FullyConnectedLayerT<Scalar>(n_features(), n_outputs));
+        channels_ = n_outputs;
+        size_ = Size(1, 1);
+        return *this;
+    }
+
+    // Element-wise layers, which keep the shape
+    // 要素ごとのレイヤー. 形状は変わらない
+    NetworkBuilderT &relu() {
+        return add(std::make_shared<ReLUT<Scalar>>());
+    }
+    NetworkBuilderT &sigmoid() {
+        return add(std::make_shared<SigmoidT<Scalar>>());
+    }
+    NetworkBuilderT &softmax() {
+        return add(std::make_shared<SoftmaxT<Scalar>>());
+    }
+    NetworkBuilderT &log_softmax() {
+        return add(std::make_shared<LogSoftmaxT<Scalar>>());
+    }
+
+    /**
+     * Network of the layers compiled with "options" (see "NetworkT::compile"), or nullptr with a message if a
+     * layer did not fit its input
+     * "options"でコンパイルしたレイヤーからなるネットワーク ("NetworkT::compile"を参照). 入力に合わない
+     * レイヤーがあった場合はメッセージとともにnullptrを返す
+     */
+    std::shared_ptr<NetworkT<Scalar>> build(const CompileOptions &options = CompileOptions()) const {
+        if (!error_.empty()) {
+            std::cerr << "Failed to build network: " << error_ << std::endl;
+            return nullptr;
+        }
+        auto network = std::make_shared<NetworkT<Scalar>>(layers_);
+        if (!network->compile(input_, options)) {
+            return nullptr;
+        }
+        return network;
+    }
+
+    // Layers added so far, which are uncompiled
+    // これまでに追加した, コンパイルされていないレイヤー
+    const std::vector<std::shared_ptr<AbstractLayer>> &layers() const {
+        return layers_;
+    }
+
+    // Shape of the output of the last layer (the input if no layer is added)
+    // 最後のレイヤーの出力の形状 (レイヤーがなければ入力の形状)
+    int channels() const {
+        return channels_;
+    }
+    Size size() const {
+        return size_;
+    }
+    int n_features() const {
+        return channels_ * size_.total();
+    }
+    int n_inputs() const {
+        return input_.total();
+    }
+
+    // First error of the layers, which is empty if all of them fit
+    // レイヤーの最初のエラー. 全てのレイヤーが合っていれば空
+    const std::string &error() const {
+        return error_;
+    }
+
+private:
+    NetworkBuilderT &add(const std::shared_ptr<AbstractLayer> &layer) {
+        if (error_.empty()) {
+            layers_.push_back(layer);
+        }
+        return *this;
+    }
+
+    // Whether a window of "window_size" fits in the current input, recording an error otherwise
+    // "window_size"の窓が現在の入力に収まるかどうか. 収まらなければエラーを記録する
+    bool fits(Size window_size, const std::string &what) {
+        if (!error_.empty()) {
+            return false;
+        }
+        if (window_size.rows <= 0 || window_size.cols <= 0) {
+            fail(what + " size must be positive");
+            return false;
+        }
+        if (window_size.rows > size_.rows || window_size.cols > size_.cols) {
+            fail(what + " " + to_string(window_size) + " is larger than the input " + to_string(size_));
+            return false;
+        }
+        return true;
+    }
+
+    bool positive(int value, const std::string &what) {
+        if (error_.empty() && value <= 0) {
+            fail(what + " must be positive");
+        }
+        return error_.empty();
+    }
+
+    // As the pooling layers, pixels at the bottom/right which do not fill a whole window are dropped
+    // プーリング層と同様に, 窓全体を満たさない下端/右端の画素は使われない
+    Size pooled_size(Size pool_size, Size stride) const {
+        return Size((size_.rows - pool_size.rows) / stride.rows + 1, (size_.cols - pool_size.cols) / stride.cols + 1);
+    }
+
+    void fail(const std::string &message) {
+        error_ = "layer " + std::to_string(layers_.size()) + ": " + message;
+    }
+
+    static std::string to_string(Size size) {
+        return std::to_string(size.rows) + "x" + std::to_string(size.cols);
+    }
+
+    std::vector<std::shared_ptr<AbstractLayer>> layers_;
+    Shape input_ = {};
+    int channels_ = 0;
+    Size size_ = {};
+    std::string error_ = {};
+};
+
+using NetworkBuilder = NetworkBuilderT<ScalarType>;
+
+#endif  // _NETWORK_BUILDER_H_
@@ -0,0 +1,340 @@
+#ifdef _MSC_VER
+#pragma once
+#endif
+
+#ifndef _OPTIMIZER_H_
+#define _OPTIMIZER_H_
+
+#include <cmath>
+#include <string>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <type_traits>
+
+#include "common.h"
+#include "parallel.h"
+#include "workspace.h"
+#include "checkpoint.h"
+
+/**
+ * @brief: Base class for optimizers, which update the parameters of a network with their gradients. The
+ * parameters and the gradients are given as flat buffers (see "NetworkT::flat_parameters").
+ * 最適化手法の基底クラス. ネットワークのパラメータをその勾配で更新する. パラメータと勾配は平坦なバッファ
+ * として与える ("NetworkT::flat_parameters"を参照)
+ */
+template <typename Scalar>
+class AbstractOptimizerT : private Uncopyable {
+public:
+    using FlatParameters = FlatParametersT<Scalar>;
+    using NamedParameter = NamedParameterT<Scalar>;
+
+    explicit AbstractOptimizerT(double lr)
+        : lr_(lr) {
+    }
+    virtual ~AbstractOptimizerT() {
+    }
+
+    /**
+     * Update the parameters in "params", and reset the state of the optimizer
+     * "params"のパラメータを更新するようにし, 最適化手法の状態をリセットする
+     */
+    virtual void attach(const FlatParameters &params) = 0;
+
+    /**
+     * Update the parameters with the gradients computed by the last "backward"
+     * 直前の"backward"で計算した勾配でパラメータを更新する
+     */
+    virtual void step() = 0;
+
+    /**
+     * Write the state for "param" (e.g., momentum) to "writer" under names "<parameter>.<state>", and read it
+     * from "checkpoint". Missing state is reset, so that training can start from a checkpoint of parameters.
+     * "param"に対する状態 (慣性など) を"<パラメータ>.<状態>"の名前で"writer"に書き込み, "checkpoint"から
+     * 読み込む. ない状態はリセットするので, パラメータのみのチェックポイントから学習を始めることもできる
+     */
+    virtual void save(CheckpointWriter &writer, const NamedParameter &param) const = 0;
+    virtual void load(Checkpoint &checkpoint, const NamedParameter &param) = 0;
+
+    double learning_rate() const {
+        return lr_;
+    }
+    void set_learning_rate(double lr) {
+        lr_ = lr;
+    }
+
+protected:
+    double lr_ = 0.0;
+};
+
+/**
+ * Optimizer making a single fused pass over the flat buffers in each step. The buffers are split into blocks
+ * of cache lines, which are updated by the tasks in parallel. The state (e.g., momentum) is kept in flat
+ * buffers of the same layout as the parameters. When "Master" is wider than "Scalar" (mixed precision), the
+ * update is applied to a master copy of the parameters, which is then rounded to the parameters. The master
+ * copy is saved with the state, so that training resumes exactly.
+ * 各ステップで平坦なバッファを1回だけ走査する最適化手法. バッファはキャッシュラインのブロックに分割し,
+ * タスクが並列に更新する. 状態 (慣性など) はパラメータと同じ配置の平坦なバッファに保持する. "Master"が
+ * "Scalar"より広い型の場合 (混合精度), 更新はパラメータのマスターのコピーに適用し, それを丸めてパラメータと
+ * する. マスターのコピーは状態とともに保存するので, 学習は正確に再開できる
+ */
+template <typename Scalar, typename Master>
+class FlatOptimizerT : public AbstractOptimizerT<Scalar> {
+public:
+    using FlatParameters = FlatParametersT<Scalar>;
+    using NamedParameter = NamedParameterT<Scalar>;
+    using MasterVector = Eigen::Matrix<Master, Eigen::Dynamic, 1>;
+    using ArrayMap = Eigen::Map<Eigen::Array<Master, Eigen::Dynamic, 1>>;
+    using GradientMap = Eigen::Map<const Eigen::Array<Scalar, Eigen::Dynamic, 1>>;
+    // The cast is a reference to the map itself when "Scalar" is "Master", so that it is decayed to a copy
+    // "Scalar"と"Master"が同じ場合, キャストはマップ自身への参照となるので, コピーに変える
+    using Gradient = typename std::decay<decltype(std::declval<GradientMap>().template cast<Master>())>::type;
+
+    static const int block_size = 2048;
+
+    FlatOptimizerT(double lr, const std::vector<std::string> &state_names)
+        : AbstractOptimizerT<Scalar>(lr)
+        , state_names_(state_names)
+        , states_(state_names.size()) {
+    }
+
+    void attach(const FlatParameters &params) override {
+        params_ = params;
+        for (auto &state : states_) {
+            state = MasterVector::Zero(params_.size());
+        }
+        if (std::is_same<Scalar, Master>::value) {
+            weights_ = (Master *)(void *)params_.values->data();
+        } else {
+            master_ = params_.values->template cast<Master>();
+            weights_ = master_.data();
+        }
+        reset();
+    }
+
+    void step() override {
+        Assertion(params_.values, "optimizer is not attached!!");
+        begin_step();
+
+        const Eigen::Index size = params_.size();
+        const int n_blocks = (int)((size + block_size - 1) / block_size);
+        const int n_tasks = parallel_task_count(n_blocks);
+        parallel_for(0, n_tasks, [&](int t) {
+            const TaskRange range = task_range(t, n_tasks, n_blocks);
+            const Eigen::Index begin = (Eigen::Index)range.begin * block_size;
+            const Eigen::Index end = std::min((Eigen::Index)range.end * block_size, size);
+            if (begin < end) {
+                update(begin, end - begin);
+            }
+        });
+    }
+
+    void save(CheckpointWriter &writer, const NamedParameter &param) const override {
+        const Eigen::Index offset = params_.offset(*param.value);
+        for (size_t i = 0; i < states_.size(); i++) {
+            const std::string name = std::string(param.name) + "." + state_names_[i];
+            writer.write(name.c_str(), Eigen::Map<MatrixT<Master>>((Master *)states_[i].data() + offset,
+                                                                   param.value->rows(), param.value->cols()));
+        }
+        if (!std::is_same<Scalar, Master>::value) {
+            const std::string name = std::string(param.name) + ".master";
+            writer.write(name.c_str(), Eigen::Map<MatrixT<Master>>((Master *)master_.data() + offset,
+                                                                   param.value->rows(), param.value->cols()));
+        }
+    }
+
+    void load(Checkpoint &checkpoint, const NamedParameter &param) override {
+        const Eigen::Index offset = params_.offset(*param.value);
+        const Eigen::Index rows = param.value->rows();
+        const Eigen::Index cols = param.value->cols();
+        for (size_t i = 0; i < states_.size(); i++) {
+            const std::string name = std::string(param.name) + "." + state_names_[i];
+            Eigen::Map<MatrixT<Master>> state(states_[i].data() + offset, rows, cols);
+            if (!checkpoint.read(name.c_str(), state, true)) {
+                state.setZero();
+            }
+        }
+
+        // Without the saved master copy, it is taken again from the loaded parameter
+        // 保存したマスターのコピーがない場合は, 読み込んだパラメータから改めて作る
+        if (!std::is_same<Scalar, Master>::value) {
+            using Vector = typename FlatParameters::Vector;
+            const std::string name = std::string(param.name) + ".master";
+            Eigen::Map<MatrixT<Master>> master(master_.data() + offset, rows, cols);
+            if (!checkpoint.read(name.c_str(), master, true)) {
+                master_.segment(offset, rows * cols) =
+                    Eigen::Map<const Vector>(param.value->data(), rows * cols).template cast<Master>();
+            }
+        }
+    }
+
+protected:
+    /**
+     * Called when the optimizer is attached, and at the beginning of each step (e.g., to count steps)
+     * 最適化手法を結び付けた時, および各ステップの最初に呼ぶ (ステップを数えるためなど)
+     */
+    virtual void reset() {
+    }
+    virtual void begin_step() {
+    }
+
+    /**
+     * Update "n" elements of the parameters from "begin", which is called by the tasks in parallel
+     * "begin"からパラメータの"n"個の要素を更新する. タスクが並列に呼ぶ
+     */
+    virtual void update(Eigen::Index begin, Eigen::Index n) = 0;
+
+    // Views of "n" elements from "begin" of the gradients, the state "i", and the weights to be updated
+    // 勾配, 状態"i", 更新する重みの"begin"からの"n"個の要素のビュー
+    Gradient gradient(Eigen::Index begin, Eigen::Index n) const {
+        return GradientMap(params_.gradients->data() + begin, n).template cast<Master>();
+    }
+    ArrayMap state(int i, Eigen::Index begin, Eigen::Index n) {
+        return ArrayMap(states_[i].data() + begin, n);
+    }
+    ArrayMap weight(Eigen::Index begin, Eigen::Index n) {
+        return ArrayMap(weights_ + begin, n);
+    }
+
+    /**
+     * Subtract "delta" from the weights, and round them to the parameters in mixed precision
+     * 重みから"delta"を引き, 混合精度の場合はそれを丸めてパラメータとする
+     */
+    template <typename Derived>
+    void apply(Eigen::Index begin, Eigen::Index n, const Eigen::ArrayBase<Derived> &delta) {
+        weight(begin, n) -= delta;
+        if (!std::is_same<Scalar, Master>::value) {
+            params_.values->segment(begin, n) = weight(begin, n).matrix().template cast<Scalar>();
+        }
+    }
+
+    FlatParameters params_;
+    std::vector<std::string> state_names_;
+    std::vector<MasterVector> states_;
+    MasterVector master_ = {};
+    Master *weights_ = nullptr;
+};
+
+/**
+ * Momentum SGD: "v = momentum * v + lr * g" and "w -= v". The Nesterov variant applies the momentum to the
+ * gradient once more, as in "w -= momentum * v + lr * g".
+ * 慣性つき確率的最急降下法: "v = momentum * v + lr * g", "w -= v". Nesterov版は勾配にもう一度慣性を適用し,
+ * "w -= momentum * v + lr * g"とする
+ */
+template <typename Scalar, typename Master = Scalar>
+class MomentumSGDT : public FlatOptimizerT<Scalar, Master> {
+public:
+    MomentumSGDT(double lr, double momentum, bool nesterov = false)
+        : FlatOptimizerT<Scalar, Master>(lr, { "velocity" })
+        , momentum_(momentum)
+        , nesterov_(nesterov) {
+    }
+
+protected:
+    void update(Eigen::Index begin, Eigen::Index n) override {
+        const Master lr = (Master)this->lr_;
+        const Master momentum = (Master)momentum_;
+        auto v = this->state(0, begin, n);
+        v = momentum * v + lr * this->gradient(begin, n);
+        if (nesterov_) {
+            this->apply(begin, n, momentum * v + lr * this->gradient(begin, n));
+        } else {
+            this->apply(begin, n, v);
+        }
+    }
+
+private:
+    double momentum_ = 0.0;
+    bool nesterov_ = false;
+};
+
+/**
+ * Adam of D. P. Kingma and J. Ba. The weight decay is added to the gradient as L2 regularization, or with
+ * "decoupled", is applied to the weights directly, which is AdamW of I. Loshchilov and F. Hutter. The number
+ * of steps for the bias correction is saved with the state of each parameter.
+ * D. P. KingmaとJ. BaによるAdam. 重み減衰はL2正則化として勾配に加えるか, "decoupled"の場合は重みに直接
+ * 適用する. 後者はI. LoshchilovとF. HutterによるAdamWである. バイアス補正のためのステップ数は各パラメータの
+ * 状態とともに保存する
+ */
+template <typename Scalar, typename Master = Scalar>
+class AdamT : public FlatOptimizerT<Scalar, Master> {
+public:
+    using NamedParameter = NamedParameterT<Scalar>;
+
+    AdamT(double lr, double weight_decay = 0.0, bool decoupled = false, double beta1 = 0.9, double beta2 = 0.999,
+          double epsilon = 1.0e-8)
+        : FlatOptimizerT<Scalar, Master>(lr, { "m", "v" })
+        , weight_decay_(weight_decay)
+        , decoupled_(decoupled)
+        , beta1_(beta1)
+        , beta2_(beta2)
+        , epsilon_(epsilon)
+        , steps_(MatrixT<Master>::Zero(1, 1)) {
+    }
+
+    void save(CheckpointWriter &writer, const NamedParameter &param) const override {
+        FlatOptimizerT<Scalar, Master>::save(writer, param);
+        const std::string name = std::string(param.name) + ".step";
+        writer.write(name.c_str(), Eigen::Map<MatrixT<Master>>((Master *)steps_.data(), 1, 1));
+    }
+
+    void load(Checkpoint &checkpoint, const NamedParameter &param) override {
+        FlatOptimizerT<Scalar, Master>::load(checkpoint, param);
+        const std::string name = std::string(param.name) + ".step";
+        if (!checkpoint.read(name.c_str(), Eigen::Map<MatrixT<Master>>(steps_.data(), 1, 1), true)) {
+            steps_(0, 0) = 0;
+        }
+    }
+
+protected:
+    void reset() override {
+        steps_(0, 0) = 0;
+    }
+
+    void begin_step() override {
+        steps_(0, 0) += 1;
+        correction1_ = 1.0 - std::pow(beta1_, (double)steps_(0, 0));
+        correction2_ = 1.0 - std::pow(beta2_, (double)steps_(0, 0));
+    }
+
+    void update(Eigen::Index begin, Eigen::Index n) override {
+        const Master beta1 = (Master)beta1_;
+        const Master beta2 = (Master)beta2_;
+        const Master decay = (Master)weight_decay_;
+        const Master step = (Master)(this->lr_ / correction1_);
+        const Master scale = (Master)(1.0 / std::sqrt(correction2_));
+        const Master epsilon = (Master)epsilon_;
+        const Master lr_decay = (Master)(this->lr_ * weight_decay_);
+
+        auto m = this->state(0, begin, n);
+        auto v = this->state(1, begin, n);
+        auto w = this->weight(begin, n);
+        if (decoupled_) {
+            m = beta1 * m + (1 - beta1) * this->gradient(begin, n);
+            v = beta2 * v + (1 - beta2) * this->gradient(begin, n).square();
+            this->apply(begin, n, step * m / (v.sqrt() * scale + epsilon) + lr_decay * w);
+        } else {
+            m = beta1 * m + (1 - beta1) * (this->gradient(begin, n) + decay * w);
+            v = beta2 * v + (1 - beta2) * (this->gradient(begin, n) + decay * w).square();
+            this->apply(begin, n, step * m / (v.sqrt() * scale + epsilon));
+        }
+    }
+
+private:
+    double weight_decay_ = 0.0;
+    bool decoupled_ = false;
+    double beta1_ = 0.9;
+    double beta2_ = 0.999;
+    double epsilon_ = 1.0e-8;
+
+    // Number of steps as a tensor, so that it is saved in checkpoints
+    // チェックポイントに保存できるよう, ステップ数はテンソルとして保持する
+    MatrixT<Master> steps_;
+    double correction1_ = 1.0;
+    double correction2_ = 1.0;
+};
+
+using MomentumSGD = MomentumSGDT<ScalarType>;
+using Adam = AdamT<ScalarType>;
+
+#endif  // _OPTIMIZER_H_
@@ -0,0 +1,236 @@
+#ifdef _MSC_VER
+#pragma once
+#endif
+
+#ifndef _PARALLEL_H_
+#define _PARALLEL_H_
+
+#include <vector>
+#include <algorithm>
+#include <functional>
+
+#include "common.h"
+#include "thread_pool.h"
+
+/**
+ * Contiguous range [begin, end) of items processed by one task
+ * 1つのタスクが処理する連続した範囲 [begin, end)
+ */
+struct TaskRange {
+    int begin = 0;
+    int end = 0;
+
+    int size() const {
+        return end - begin;
+    }
+};
+
+// Chunks made per thread by "parallel_for", so that idle threads can steal the rest of a busy one
+// "parallel_for"がスレッド毎に作るチャンクの数. 手の空いたスレッドが忙しいスレッドの残りを盗めるようにする
+static const int PARALLEL_CHUNKS_PER_THREAD = 4;
+// Maximum number of partial results of "parallel_reduce"
+// "parallel_reduce"の部分結果の最大数
+static const int PARALLEL_MAX_REDUCE_CHUNKS = 64;
+
+/**
+ * Limit of the number of threads for the parallel loops started from the current thread (0 for no limit)
+ * 現在のスレッドから始める並列ループのスレッド数の上限 (0なら上限なし)
+ */
+inline int &parallel_thread_limit() {
+    static thread_local int limit = 0;
+    return limit;
+}
+
+/**
+ * Number of threads available to the parallel loops started from the current thread
+ * 現在のスレッドから始める並列ループが使えるスレッド数
+ */
+inline int parallel_thread_count() {
+    const int n_threads = ThreadPool::global().n_threads();
+    const int limit = parallel_thread_limit();
+    return limit > 0 ? std::min(limit, n_threads) : n_threads;
+}
+
+/**
+ * Set the number of threads of the shared pool, which must not be called while parallel loops are running.
+ * 共有するプールのスレッド数を設定する. 並列ループの実行中に呼んではならない
+ */
+inline void set_parallel_thread_count(int n_threads) {
+    ThreadPool::reset_global(n_threads);
+}
+
+/**
+ * Scope in which the parallel loops started from the current thread use at most "n_threads" threads, e.g.,
+ * to run the layers of a replica single-threaded while the replicas themselves run in parallel
+ * 現在のスレッドから始める並列ループが高々"n_threads"スレッドを使うスコープ. 例えば, レプリカ自体は
+ * 並列に動かしつつ, 各レプリカのレイヤーはシングルスレッドで動かすのに用いる
+ */
+class ScopedThreadLimit : private Uncopyable {
+public:
+    explicit ScopedThreadLimit(int n_threads)
+        : previous_(parallel_thread_limit()) {
+        parallel_thread_limit() = std::max(1, n_threads);
+    }
+
+    ~ScopedThreadLimit() {
+        parallel_thread_limit() = previous_;
+    }
+
+private:
+    int previous_ = 0;
+};
+
+/**
+ * Number of tasks to split "n_items" items, which is at most the number of threads.
+ * "n_items"個の要素を分割するタスクの数 (高々スレッド数)
+ */
+inline int parallel_task_count(int n_items) {
+    return std::max(1, std::min(n_items, parallel_thread_count()));
+}
+
+/**
+ * Range of items for the "task"-th task. The split depends only on the number of items and tasks,
+ * so that the results of a reduction do not depend on the scheduling of threads.
+ * "task"番目のタスクが処理する要素の範囲. 分割は要素数とタスク数のみで決まるので,
+ * 集約の結果はスレッドのスケジューリングに依存しない
+ */
+inline TaskRange task_range(int task, int n_tasks, int n_items) {
+    TaskRange range;
+    range.begin = (int)((long long)n_items * task / n_tasks);
+    range.end = (int)((long long)n_items * (task + 1) / n_tasks);
+    return range;
+}
+
+/**
+ * Number of chunks of at least "grain" items to split "n_items" items, which is at most "max_chunks"
+ * "n_items"個の要素を分割する, 少なくとも"grain"個の要素からなるチャンクの数 (高々"max_chunks")
+ */
+inline int parallel_chunk_count(int n_items, int grain, int max_chunks) {
+    grain = std::max(1, grain);
+    return std::max(1, std::min((n_items + grain - 1) / grain, max_chunks));
+}
+
+/**
+ * Call "function(i)" for each "i" in [begin, end) in parallel. The range is split into contiguous chunks of at
+ * least "grain" items, with a few chunks per thread so that idle threads can steal the rest of a busy one.
+ * A single chunk, or a single thread, runs inline without touching the pool.
+ * [begin, end)の各"i"について"function(i)"を並列に呼ぶ. 範囲は少なくとも"grain"個の要素からなる連続した
+ * チャンクに分割し, 手の空いたスレッドが忙しいスレッドの残りを盗めるよう, スレッド毎に数個のチャンクを作る.
+ * チャンクまたはスレッドが1つであれば, プールを使わずにその場で実行する
+ */
+template <typename Function>
+inline void parallel_for(int begin, int end, int grain, const Function &function) {
+    const int n_items = end - begin;
+    const int n_threads = parallel_thread_count();
+    const int n_chunks = parallel_chunk_count(n_items, grain, PARALLEL_CHUNKS_PER_THREAD * n_threads);
+    if (n_chunks == 1 || n_threads == 1) {
+        for (int i = begin; i < end; i++) {
+            function(i);
+        }
+        return;
+    }
+
+    struct Context {
+        const Function &function;
+        int begin;
+        int n_items;
+        int n_chunks;
+    } context = { function, begin, n_items, n_chunks };
+    ThreadPool::global().run(
+        [](const void *data, int chunk) {
+            const Context &context = *(const Context *)data;
+            const TaskRange range = task_range(chunk, context.n_chunks, context.n_items);
+            for (int i = context.begin + range.begin; i < context.begin + range.end; i++) {
+                context.function(i);
+            }
+        },
+        &context, n_chunks);
+}
+
+template <typename Function>
+inline void parallel_for(int begin, int end, const Function &function) {
+    parallel_for(begin, end, 1, function);
+}
+
+/**
+ * Reduce [begin, end) in parallel, where "map(b, e)" returns the partial result of [b, e) and "combine(x, y)"
+ * merges two of them. Partial results are combined from left to right in a fixed order, and the chunks depend
+ * only on the number of items, "grain" and the number of threads, so that the result is reproducible.
+ * [begin, end)を並列に集約する. "map(b, e)"は[b, e)の部分結果を返し, "combine(x, y)"は2つを併合する.
+ * 部分結果は固定の順序で左から併合し, チャンクは要素数, "grain", スレッド数のみで決まるので, 結果は再現する
+ */
+template <typename T, typename Map, typename Combine>
+inline T parallel_reduce(int begin, int end, int grain, const T &identity, const Map &map, const Combine &combine) {
+    const int n_items = end - begin;
+    const int n_chunks = parallel_chunk_count(n_items, grain,
+                                              std::min(PARALLEL_MAX_REDUCE_CHUNKS, parallel_thread_count()));
+    T partials[PARALLEL_MAX_REDUCE_CHUNKS];
+    parallel_for(0, n_chunks, [&](int chunk) {
+        const TaskRange range = task_range(chunk, n_chunks, n_items);
+        partials[chunk] = map(begin + range.begin, begin + range.end);
+    });
+
+    T result = identity;
+    for (int chunk = 0; chunk < n_chunks; chunk++) {
+        result = combine(result, partials[chunk]);
+    }
+    return result;
+}
+
+/**
+ * Group of independent tasks which run on the pool and are waited for together. Each task is stored as a
+ * "std::function", hence task groups are meant for coarse tasks outside the training steps.
+ * プール上で動き, まとめて待つ独立したタスクのグループ. 各タスクは"std::function"として保持するので,
+ * タスクグループは学習ステップの外の粒度の粗いタスク向けである
+ */
+class TaskGroup : private Uncopyable {
+public:
+    TaskGroup() = default;
+
+    ~TaskGroup() {
+        wait();
+    }
+
+    /**
+     * Add a task, which starts at the next "wait"
+     * タスクを追加する. 次の"wait"で実行を始める
+     */
+    void run(const std::function<void()> &task) {
+        tasks_.push_back(task);
+    }
+
+    /**
+     * Run the tasks added so far in parallel and wait for all of them
+     * これまでに追加したタスクを並列に実行し, その全てを待つ
+     */
+    void wait() {
+        if (!tasks_.empty()) {
+            parallel_for(0, (int)tasks_.size(), [this](int i) { tasks_[i](); });
+            tasks_.clear();
+        }
+    }
+
+private:
+    std::vector<std::function<void()>> tasks_;
+};
+
+/**
+ * Sum up "n" per-task partial results, which are stored side by side as column blocks of "partials",
+ * into the first block with a pairwise tree, whose order is fixed for a given number of tasks.
+ * "partials"の列ブロックとして並べたタスク毎の"n"個の部分和を, 二分木に沿って最初のブロックに足し合わせる.
+ * 足す順序はタスク数に対して固定
+ */
+template <typename Derived>
+inline void tree_reduce(Eigen::MatrixBase<Derived> &partials, int n) {
+    const int cols = (int)partials.cols() / n;
+    for (int stride = 1; stride < n; stride *= 2) {
+        parallel_for(0, (n - 1) / (2 * stride) + 1, [&](int pair) {
+            const int i = pair * 2 * stride;
+            if (i + stride < n) {
+                partials.middleCols(i * cols, cols) += partials.middleCols((i + stride) * cols, cols);
+            }
+        });
+    }
+}
+
+#endif  // _PARALLEL_H_
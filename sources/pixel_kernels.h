@@ -0,0 +1,194 @@
+#ifdef _MSC_VER
+#pragma once
+#endif
+
+#ifndef _PIXEL_KERNELS_H_
+#define _PIXEL_KERNELS_H_
+
+#include <cstdint>
+
+#include "common.h"
+#include "simd.h"
+
+/**
+ * Kernel normalizing the pixels of "n_rows" images to [0, 1] as "pixel / 255", where "n_rows" is a multiple of
+ * "PIXEL_LANES" up to "PIXEL_BLOCK".
+ *   rows: pixels of the images, each of which is contiguous
+ *   n_pixels: number of pixels of an image
+ *   dst: output, where the values of pixel "j" of the images are contiguous from "dst + j * stride"
+ * Kernels convert chunks of pixels from the first one, and return the number of pixels converted, which the
+ * caller converts the rest from. The values are multiplied by the reciprocal of 255 and corrected by
+ * its residual with FMA, which is the same as the division (and the scalar table) for every pixel in both
+ * precisions, while a multiplication alone is not.
+ * "n_rows"枚の画像の画素を"pixel / 255"として[0, 1]に正規化するカーネル. "n_rows"は"PIXEL_BLOCK"以下の
+ * "PIXEL_LANES"の倍数.
+ *   rows: 画像の画素. それぞれ連続している
+ *   n_pixels: 1枚の画像の画素数
+ *   dst: 出力. 画像の画素"j"の値は"dst + j * stride"から連続して並ぶ
+ * カーネルは先頭から画素のチャンク毎に変換し, 変換した画素数を返す. 残りは呼び出し側が変換する. 値は255の逆数を
+ * 掛けてからFMAで残差を補正する. これはどちらの精度でも全ての画素について除算 (およびスカラー実装の表) と
+ * 一致するが, 乗算のみでは一致しない
+ */
+template <typename Scalar>
+using PixelKernel = int (*)(const uint8_t *const *rows, int n_rows, int n_pixels, Scalar *dst,
+                            Eigen::Index stride);
+
+// Number of images transposed at once, which are the lanes of an AVX2 float vector
+// 一度に転置する画像の枚数. AVX2のfloatのベクトルのレーン数である
+static const int PIXEL_LANES = 8;
+
+// Number of images in a block, whose values of a pixel span whole cache lines of the (column-major) output
+// ブロック中の画像の枚数. 画素毎のブロックの値は (列優先の) 出力のキャッシュラインいくつか分となる
+static const int PIXEL_BLOCK = 64;
+
+#if defined(SIMD_X86)
+
+// -----------------------------------------------------------------------------
+// AVX2
+// -----------------------------------------------------------------------------
+
+/**
+ * Transpose 8 pixels from "j" of the 8 images, so that the 8 bytes of pixel "j + t" are the lower (even "t")
+ * or upper (odd "t") half of "cols[t / 2]"
+ * 8枚の画像の"j"からの8画素を転置する. 画素"j + t"の8バイトは"cols[t / 2]"の下位 ("t"が偶数) または
+ * 上位 ("t"が奇数) の半分となる
+ */
+SIMD_TARGET_AVX2 inline void transpose_pixels_8x8(const uint8_t *const *rows, int j, __m128i cols[4]) {
+    __m128i r[8];
+    for (int k = 0; k < 8; k++) {
+        r[k] = _mm_loadl_epi64((const __m128i *)(rows[k] + j));
+    }
+    const __m128i a0 = _mm_unpacklo_epi8(r[0], r[1]);
+    const __m128i a1 = _mm_unpacklo_epi8(r[2], r[3]);
+    const __m128i a2 = _mm_unpacklo_epi8(r[4], r[5]);
+    const __m128i a3 = _mm_unpacklo_epi8(r[6], r[7]);
+    const __m128i b0 = _mm_unpacklo_epi16(a0, a1);
+    const __m128i b1 = _mm_unpackhi_epi16(a0, a1);
+    const __m128i b2 = _mm_unpacklo_epi16(a2, a3);
+    const __m128i b3 = _mm_unpackhi_epi16(a2, a3);
+    cols[0] = _mm_unpacklo_epi32(b0, b2);
+    cols[1] = _mm_unpackhi_epi32(b0, b2);
+    cols[2] = _mm_unpacklo_epi32(b1, b3);
+    cols[3] = _mm_unpackhi_epi32(b1, b3);
+}
+
+// 8 bytes of pixel "j + t" transposed by "transpose_pixels_8x8" in the lower half
+// "transpose_pixels_8x8"で転置した画素"j + t"の8バイトを下位の半分に置く
+SIMD_TARGET_AVX2 inline __m128i transposed_pixel(const __m128i cols[4], int t) {
+    return (t % 2 == 0) ? cols[t / 2] : _mm_unpackhi_epi64(cols[t / 2], cols[t / 2]);
+}
+
+// "x / 255" by the reciprocal and the residual
+// 逆数と残差による"x / 255"
+SIMD_TARGET_AVX2 inline __m256 divide_by_255(__m256 x) {
+    const __m256 d = _mm256_set1_ps(255.0f);
+    const __m256 r = _mm256_set1_ps(1.0f / 255.0f);
+    const __m256 q = _mm256_mul_ps(x, r);
+    return _mm256_fmadd_ps(_mm256_fnmadd_ps(q, d, x), r, q);
+}
+SIMD_TARGET_AVX2 inline __m256d divide_by_255(__m256d x) {
+    const __m256d d = _mm256_set1_pd(255.0);
+    const __m256d r = _mm256_set1_pd(1.0 / 255.0);
+    const __m256d q = _mm256_mul_pd(x, r);
+    return _mm256_fmadd_pd(_mm256_fnmadd_pd(q, d, x), r, q);
+}
+/**
+ * For each chunk of 8 pixels, the images are transposed in groups of "PIXEL_LANES", and then the values of each
+ * pixel are written group by group, so that the writes to a column of the output are contiguous.
+ * 8画素のチャンク毎に, 画像を"PIXEL_LANES"枚のグループ毎に転置してから, 各画素の値をグループ毎に書き込む.
+ * これにより出力の列への書き込みは連続する
+ */
+SIMD_TARGET_AVX2 inline int normalize_pixels_avx2(const uint8_t *const *rows, int n_rows, int n_pixels,
+                                                  float *dst, Eigen::Index stride) {
+    const int n_groups = n_rows / PIXEL_LANES;
+    int j = 0;
+    for (; j + 8 <= n_pixels; j += 8) {
+        __m128i cols[PIXEL_BLOCK / PIXEL_LANES][4];
+        for (int g = 0; g < n_groups; g++) {
+            transpose_pixels_8x8(rows + g * PIXEL_LANES, j, cols[g]);
+        }
+        for (int t = 0; t < 8; t++) {
+            float *column = dst + (j + t) * stride;
+            for (int g = 0; g < n_groups; g++) {
+                const __m256 values = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(transposed_pixel(cols[g], t)));
+                _mm256_storeu_ps(column + g * PIXEL_LANES, divide_by_255(values));
+            }
+        }
+    }
+    return j;
+}
+
+SIMD_TARGET_AVX2 inline int normalize_pixels_avx2(const uint8_t *const *rows, int n_rows, int n_pixels,
+                                                  double *dst, Eigen::Index stride) {
+    const int n_groups = n_rows / PIXEL_LANES;
+    int j = 0;
+    for (; j + 8 <= n_pixels; j += 8) {
+        __m128i cols[PIXEL_BLOCK / PIXEL_LANES][4];
+        for (int g = 0; g < n_groups; g++) {
+            transpose_pixels_8x8(rows + g * PIXEL_LANES, j, cols[g]);
+        }
+        for (int t = 0; t < 8; t++) {
+            double *column = dst + (j + t) * stride;
+            for (int g = 0; g < n_groups; g++) {
+                const __m128i bytes = transposed_pixel(cols[g], t);
+                const __m256d lo = _mm256_cvtepi32_pd(_mm_cvtepu8_epi32(bytes));
+                const __m256d hi = _mm256_cvtepi32_pd(_mm_cvtepu8_epi32(_mm_srli_si128(bytes, 4)));
+                _mm256_storeu_pd(column + g * PIXEL_LANES, divide_by_255(lo));
+                _mm256_storeu_pd(column + g * PIXEL_LANES + 4, divide_by_255(hi));
+            }
+        }
+    }
+    return j;
+}
+
+#endif  // SIMD_X86
+
+// -----------------------------------------------------------------------------
+// Runtime dispatch
+// -----------------------------------------------------------------------------
+
+/**
+ * Select a kernel for the instruction set, or nullptr for the scalar fallback (or scalar types without kernels).
+ * AVX-512 uses the AVX2 kernels, since the conversion is bound by the writes to the output, and 512-bit vectors
+ * for the groups of doubles were slower than the pairs of 256-bit vectors.
+ * 命令セットに対応するカーネルを選ぶ. スカラー実装 (またはカーネルのないスカラー型) の場合はnullptr.
+ * 変換は出力への書き込みで律速されるので, AVX-512ではAVX2のカーネルを使う. doubleのグループに512ビットの
+ * ベクトルを使うと256ビットのベクトル2本より遅かった
+ */
+template <typename Scalar>
+struct PixelKernels {
+    static PixelKernel<Scalar> select(SimdLevel) {
+        return nullptr;
+    }
+};
+
+template <>
+struct PixelKernels<float> {
+    static PixelKernel<float> select(SimdLevel level) {
+#if defined(SIMD_X86)
+        if (level == SimdLevel::AVX512 || level == SimdLevel::AVX2) {
+            return normalize_pixels_avx2;
+        }
+#endif
+        return nullptr;
+    }
+};
+
+template <>
+struct PixelKernels<double> {
+    static PixelKernel<double> select(SimdLevel level) {
+#if defined(SIMD_X86)
+        if (level == SimdLevel::AVX512 || level == SimdLevel::AVX2) {
+            return normalize_pixels_avx2;
+        }
+#endif
+        return nullptr;
+    }
+};
+
+template <typename Scalar>
+inline PixelKernel<Scalar> pixel_kernel(SimdLevel level) {
+    return PixelKernels<Scalar>::select(level);
+}
+
+#endif  // _PIXEL_KERNELS_H_
@@ -0,0 +1,182 @@
+#ifdef _MSC_VER
+#pragma once
+#endif
+
+#ifndef _PROFILER_H_
+#define _PROFILER_H_
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <algorithm>
+
+#include "common.h"
+#include "timer.h"
+#include "abstract_layer.h"
+
+/**
+ * Per-layer profiler of forward and backward passes. A network with a profiler (see
+ * "NetworkT::set_profiler") records the time of each pass of each layer on a monotonic clock together with its
+ * analytic cost (see "AbstractLayerT::cost"), from which the achieved GFLOP/s and GB/s are reported. Passes
+ * are also kept as events for a Chrome trace up to the capacity reserved in advance, so that recording never
+ * allocates. Networks without a profiler only test a null pointer per layer.
+ * 順伝播と逆伝播のレイヤー毎のプロファイラ. プロファイラをもつネットワーク ("NetworkT::set_profiler"を参照)
+ * は, 各レイヤーの各計算の時間を単調な時計で, その解析的なコスト ("AbstractLayerT::cost"を参照) とともに
+ * 記録し, そこから達成したGFLOP/sとGB/sを報告する. 各計算は予め確保した容量までChromeのトレースのための
+ * イベントとしても保持するので, 記録でメモリを確保することはない. プロファイラのないネットワークは
+ * レイヤー毎にヌルポインタを調べるのみである
+ */
+class Profiler : private Uncopyable {
+public:
+    // Pass of a layer recorded as an event of the trace, whose times are in seconds from the creation
+    // トレースのイベントとして記録するレイヤーの計算. 時刻は生成時からの秒数
+    struct Event {
+        int layer = 0;
+        bool backward = false;
+        double begin = 0.0;
+        double end = 0.0;
+        LayerCost cost;
+    };
+
+    // Totals of the passes of a layer in each direction (0: forward, 1: backward)
+    // レイヤーの各方向 (0: 順伝播, 1: 逆伝播) の計算の合計
+    struct LayerStats {
+        std::string name;
+        long long calls[2] = { 0, 0 };
+        double seconds[2] = { 0.0, 0.0 };
+        LayerCost cost[2];
+    };
+
+    /**
+     * Profiler keeping up to "max_events" events for the trace
+     * トレースのためのイベントを最大"max_events"個保持するプロファイラ
+     */
+    explicit Profiler(size_t max_events = 65536)
+        : origin_(tick()) {
+        events_.reserve(max_events);
+    }
+
+    /**
+     * Start profiling layers named "names", discarding what has been recorded
+     * 名前が"names"であるレイヤーのプロファイルを始める. 記録済みのものは破棄する
+     */
+    void reset(const std::vector<std::string> &names) {
+        stats_.assign(names.size(), LayerStats());
+        for (size_t i = 0; i < names.size(); i++) {
+            stats_[i].name = names[i];
+        }
+        events_.clear();
+        n_dropped_ = 0;
+        origin_ = tick();
+    }
+
+    /**
+     * Seconds from the creation (or the last "reset")
+     * 生成時 (または直前の"reset") からの秒数
+     */
+    double now() const {
+        return to_duration(origin_, tick());
+    }
+
+    /**
+     * Record a pass of "layer" which began at "begin" (a value of "now") and has just finished
+     * "begin" ("now"の値) に始まり今終わった"layer"の計算を記録する
+     */
+    void record(int layer, bool backward, double begin, const LayerCost &cost) {
+        Event event;
+        event.layer = layer;
+        event.backward = backward;
+        event.begin = begin;
+        event.end = now();
+        event.cost = cost;
+
+        LayerStats &stats = stats_[layer];
+        stats.calls[backward]++;
+        stats.seconds[backward] += event.end - event.begin;
+        stats.cost[backward].flops += cost.flops;
+        stats.cost[backward].bytes += cost.bytes;
+
+        if (events_.size() < events_.capacity()) {
+            events_.push_back(event);
+        } else {
+            n_dropped_++;
+        }
+    }
+
+    /**
+     * Print a table of the time, the share of the total time and the achieved GFLOP/s and GB/s of each pass
+     * of each layer
+     * 各レイヤーの各計算の時間, 合計時間に対する割合, 達成したGFLOP/sとGB/sの表を出力する
+     */
+    void print_summary() const {
+        static const char *passes[2] = { "forward", "backward" };
+        double total = 0.0;
+        for (const auto &stats : stats_) {
+            total += stats.seconds[0] + stats.seconds[1];
+        }
+
+        printf("\n%-3s %-20s %-9s %8s %11s %10s %7s %9s %8s\n", "#", "layer", "pass", "calls", "total [ms]",
+               "mean [us]", "share", "GFLOP/s", "GB/s");
+        for (size_t i = 0; i < stats_.size(); i++) {
+            const LayerStats &stats = stats_[i];
+            for (int d = 0; d < 2; d++) {
+                if (stats.calls[d] == 0) {
+                    continue;
+                }
+                const double seconds = std::max(stats.seconds[d], 1.0e-12);
+                printf("%-3d %-20s %-9s %8lld %11.2f %10.2f %6.1f%% %9.2f %8.2f\n", (int)i, stats.name.c_str(),
+                       passes[d], stats.calls[d], stats.seconds[d] * 1.0e3, stats.seconds[d] * 1.0e6 / stats.calls[d],
+                       total > 0.0 ? 100.0 * stats.seconds[d] / total : 0.0, stats.cost[d].flops / seconds * 1.0e-9,
+                       stats.cost[d].bytes / seconds * 1.0e-9);
+            }
+        }
+        printf("Total: %.2f ms in layers\n", total * 1.0e3);
+        if (n_dropped_ > 0) {
+            printf("Trace events dropped: %lld (capacity: %d)\n", n_dropped_, (int)events_.capacity());
+        }
+    }
+
+    /**
+     * Write the events in the Chrome trace event format, which can be opened with "chrome://tracing" or
+     * Perfetto. Passes are complete events on a single thread, whose arguments are their costs.
+     * イベントをChromeのトレースイベント形式で書き出す. "chrome://tracing"やPerfettoで開ける.
+     * 計算は1つのスレッド上の完了イベントとし, その引数にコストを付ける
+     */
+    bool save_trace(const std::string &filename) const {
+        FILE *fp = fopen(filename.c_str(), "w");
+        if (fp == nullptr) {
+            std::cerr << "Failed to open trace: " << filename << std::endl;
+            return false;
+        }
+
+        bool ok = fprintf(fp, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n") > 0;
+        for (size_t i = 0; i < events_.size() && ok; i++) {
+            const Event &event = events_[i];
+            ok = fprintf(fp,
+                         "{\"name\": \"%d %s\", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, "
+                         "\"pid\": 0, \"tid\": 0, \"args\": {\"flops\": %.0f, \"bytes\": %.0f}}%s\n",
+                         event.layer, stats_[event.layer].name.c_str(), event.backward ? "backward" : "forward",
+                         event.begin * 1.0e6, (event.end - event.begin) * 1.0e6, event.cost.flops, event.cost.bytes,
+                         i + 1 < events_.size() ? "," : "") > 0;
+        }
+        ok = ok && fprintf(fp, "]}\n") > 0;
+        ok = (fclose(fp) == 0) && ok;
+        if (!ok) {
+            std::cerr << "Failed to write trace: " << filename << std::endl;
+        }
+        return ok;
+    }
+
+    const std::vector<LayerStats> &stats() const {
+        return stats_;
+    }
+
+private:
+    time_type origin_;
+    std::vector<LayerStats> stats_;
+    std::vector<Event> events_;
+    long long n_dropped_ = 0;
+};
+
+#endif  // _PROFILER_H_
@@ -0,0 +1,314 @@
+#ifdef _MSC_VER
+#pragma once
+#endif
+
+#ifndef _QUANTIZED_KERNELS_H_
+#define _QUANTIZED_KERNELS_H_
+
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+
+#include "common.h"
+#include "simd.h"
+
+/**
+ * GEMM kernel which multiplies "m" rows of uint8 activations with int8 kernels of all the output channels.
+ * Rows are not copied to a patch matrix. Instead, "k" runs over "n_groups" groups of 4 consecutive bytes
+ * which start at "offsets[g]" from the beginning "a + rows[i]" of each row, so that a convolution reads the
+ * patches from its input image directly.
+ *   a, rows: activations. The groups of row "i" are read from "a + rows[i] + offsets[g]"
+ *   w: kernels, laid out as [n_out / 8][n_groups][8][4]
+ *   c: int32 results, laid out as [m][ldc] for the first "n_out" columns
+ * "n_out" must be a multiple of "QUANTIZED_N_ALIGN". Activations must be in [0, 127] so that the pairwise sums
+ * of "maddubs" never saturate.
+ * "m"行のuint8の活性値と全出力チャンネルのint8のカーネルとの積を計算する行列積のカーネル. 行はパッチ行列に
+ * コピーしない. 代わりに"k"は連続する4バイトの"n_groups"個の組を走り, 組は各行の先頭"a + rows[i]"から
+ * "offsets[g]"の位置に始まる. これにより畳み込みは入力画像から直接パッチを読む.
+ *   a, rows: 活性値. 行"i"の組は"a + rows[i] + offsets[g]"から読む
+ *   w: カーネル. [出力チャンネル / 8][n_groups][8][4]の順に並ぶ
+ *   c: int32の結果. 最初の"n_out"列が[m][ldc]の順に並ぶ
+ * "n_out"は"QUANTIZED_N_ALIGN"の倍数でなければならない. "maddubs"の隣接する積の和が飽和しないよう,
+ * 活性値は[0, 127]の範囲でなければならない
+ */
+using QuantizedGemmKernel = void (*)(const uint8_t *a, const int32_t *rows, int m, const int32_t *offsets,
+                                     int n_groups, const int8_t *w, int n_out, int32_t *c, int ldc);
+
+/**
+ * Kernel which converts "m" rows of int32 results of "n" output channels to uint8 as
+ *   y = multipliers[o] * (c[i][o] - corrections[o]) + bias[o]
+ *   q[i][o] = clamp((int)(y * inv_scale + zero_point + 0.5), 0, 127)
+ * where "c" and "q" are laid out as [m][n] and "n" is a multiple of "QUANTIZED_N_ALIGN". Both products are fused
+ * with the additions, so that all the kernels give exactly the same results.
+ * "n"出力チャンネルの"m"行のint32の結果を次のようにuint8に変換するカーネル.
+ *   y = multipliers[o] * (c[i][o] - corrections[o]) + bias[o]
+ *   q[i][o] = clamp((int)(y * inv_scale + zero_point + 0.5), 0, 127)
+ * "c"と"q"は[m][n]の順に並び, "n"は"QUANTIZED_N_ALIGN"の倍数である. どのカーネルも全く同じ結果を返すよう,
+ * 積はいずれも和と融合して計算する
+ */
+using QuantizedRequantizeKernel = void (*)(const int32_t *c, int m, int n, const int32_t *corrections,
+                                           const float *multipliers, const float *bias, float inv_scale,
+                                           int zero_point, uint8_t *q);
+
+// Output channels in a vector of int32 accumulators, to which kernels are zero-padded, and bytes of "k" in a group
+// int32のアキュムレータのベクトル1本の出力チャンネル数 (カーネルはこの倍数に0で埋める) と, "k"の1組のバイト数
+static const int QUANTIZED_N_ALIGN = 8;
+static const int QUANTIZED_K_GROUP = 4;
+
+// Rows and vectors of output channels of the tile kept in registers
+// レジスタ上に保持するタイルの行数と出力チャンネルのベクトル数
+static const int QUANTIZED_TILE_M = 4;
+static const int QUANTIZED_TILE_N = 2;
+
+// Bytes which the kernels may read past the last group of a row, which are multiplied by zero-padded kernels
+// カーネルが行の最後の組を越えて読みうるバイト数. 0で埋めたカーネルと掛けられる
+static const int QUANTIZED_READ_PADDING = QUANTIZED_K_GROUP;
+
+inline int quantized_padded_length(int n, int align) {
+    return (n + align - 1) / align * align;
+}
+
+// Group of 4 bytes, which may be unaligned
+// 4バイトの組. アラインされていないことがある
+inline int32_t quantized_load_group(const uint8_t *p) {
+    int32_t group;
+    std::memcpy(&group, p, sizeof(group));
+    return group;
+}
+
+// -----------------------------------------------------------------------------
+// Scalar fallback
+// -----------------------------------------------------------------------------
+
+inline void quantized_gemm_scalar(const uint8_t *a, const int32_t *rows, int m, const int32_t *offsets,
+                                  int n_groups, const int8_t *w, int n_out, int32_t *c, int ldc) {
+    const int N = QUANTIZED_N_ALIGN;
+    const int G = QUANTIZED_K_GROUP;
+    for (int i = 0; i < m; i++) {
+        const uint8_t *ai = a + rows[i];
+        for (int o = 0; o < n_out; o += N) {
+            const int8_t *wo = w + (size_t)(o / N) * n_groups * N * G;
+            int32_t acc[N] = {};
+            for (int g = 0; g < n_groups; g++) {
+                const uint8_t *ag = ai + offsets[g];
+                const int8_t *wg = wo + g * N * G;
+                for (int j = 0; j < N; j++) {
+                    for (int q = 0; q < G; q++) {
+                        acc[j] += (int32_t)ag[q] * (int32_t)wg[j * G + q];
+                    }
+                }
+            }
+            for (int j = 0; j < N; j++) {
+                c[(size_t)i * ldc + o + j] = acc[j];
+            }
+        }
+    }
+}
+
+inline float quantized_affine(int32_t c, int32_t correction, float multiplier, float bias) {
+    return std::fma(multiplier, (float)(c - correction), bias);
+}
+
+inline void quantized_requantize_scalar(const int32_t *c, int m, int n, const int32_t *corrections,
+                                        const float *multipliers, const float *bias, float inv_scale,
+                                        int zero_point, uint8_t *q) {
+    const float offset = zero_point + 0.5f;
+    for (int i = 0; i < m; i++) {
+        for (int o = 0; o < n; o++) {
+            const float y = quantized_affine(c[(size_t)i * n + o], corrections[o], multipliers[o], bias[o]);
+            const int v = (int)std::fma(y, inv_scale, offset);
+            q[(size_t)i * n + o] = (uint8_t)std::max(0, std::min(127, v));
+        }
+    }
+}
+
+#if defined(SIMD_X86)
+
+// -----------------------------------------------------------------------------
+// AVX2 and AVX-512 VNNI
+// -----------------------------------------------------------------------------
+
+/**
+ * Products of 4 activations broadcast to all the lanes and the kernels of 8 output channels, accumulated to
+ * int32 with "maddubs" and "madd" (AVX2) or directly with "dpbusd" (VNNI)
+ * 全レーンにブロードキャストした4つの活性値と8出力チャンネルのカーネルとの積. "maddubs"と"madd"で (AVX2),
+ * または"dpbusd"で直接 (VNNI) int32に累積する
+ */
+struct QuantizedDotAvx2 {
+    SIMD_TARGET_AVX2 static inline __m256i dot(__m256i acc, __m256i a, __m256i w) {
+        return _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_maddubs_epi16(a, w), _mm256_set1_epi16(1)));
+    }
+};
+
+struct QuantizedDotVnni {
+    SIMD_TARGET_VNNI static inline __m256i dot(__m256i acc, __m256i a, __m256i w) {
+        return _mm256_dpbusd_epi32(acc, a, w);
+    }
+};
+
+/**
+ * Tile of "MR" (up to 4) rows and "NR" (1 or 2) vectors of output channels, whose weights are loaded once for all
+ * the rows and whose accumulators hold the output channels in their lanes, so that no horizontal sum is needed.
+ * Accumulators are named variables rather than an array, which the compiler keeps in registers without unrolling
+ * loops.
+ * "MR" (4以下) 行と出力チャンネルの"NR" (1または2) ベクトル分のタイル. 重みは全ての行について一度だけ読み,
+ * アキュムレータの各レーンが出力チャンネルをもつので, 水平方向の和は不要である. アキュムレータは配列でなく
+ * 名前付きの変数とし, コンパイラがループを展開せずともレジスタに置けるようにする
+ */
+#define QUANTIZED_GEMM_TILE(TARGET, NAME)                                                                          \
+    template <typename Dot, int NR>                                                                                \
+    TARGET inline void NAME##_row(__m256i &c0, __m256i &c1, const uint8_t *a, __m256i w0, __m256i w1) {           \
+        const __m256i av = _mm256_set1_epi32(quantized_load_group(a));                                             \
+        c0 = Dot::dot(c0, av, w0);                                                                                 \
+        if (NR > 1) {                                                                                              \
+            c1 = Dot::dot(c1, av, w1);                                                                             \
+        }                                                                                                          \
+    }                                                                                                              \
+                                                                                                                   \
+    template <int NR>                                                                                              \
+    TARGET inline void NAME##_store(int32_t *c, __m256i c0, __m256i c1) {                                          \
+        _mm256_storeu_si256((__m256i *)c, c0);                                                                     \
+        if (NR > 1) {                                                                                              \
+            _mm256_storeu_si256((__m256i *)(c + QUANTIZED_N_ALIGN), c1);                                           \
+        }                                                                                                          \
+    }                                                                                                              \
+                                                                                                                   \
+    template <typename Dot, int MR, int NR>                                                                        \
+    TARGET inline void NAME(const uint8_t *a, const int32_t *rows, const int32_t *offsets, int n_groups,           \
+                            const int8_t *w, int32_t *c, int ldc) {                                                \
+        static_assert(MR >= 1 && MR <= 4 && NR >= 1 && NR <= 2, "Unsupported tile size");                         \
+        const int N = QUANTIZED_N_ALIGN;                                                                           \
+        const int G = QUANTIZED_K_GROUP;                                                                           \
+        const uint8_t *a0 = a + rows[0];                                                                           \
+        const uint8_t *a1 = a + rows[MR > 1 ? 1 : 0];                                                              \
+        const uint8_t *a2 = a + rows[MR > 2 ? 2 : 0];                                                              \
+        const uint8_t *a3 = a + rows[MR > 3 ? 3 : 0];                                                              \
+        const int8_t *w1 = w + (size_t)n_groups * N * G;                                                           \
+        __m256i c00 = _mm256_setzero_si256(), c01 = c00, c10 = c00, c11 = c00;                                     \
+        __m256i c20 = c00, c21 = c00, c30 = c00, c31 = c00;                                                        \
+        for (int g = 0; g < n_groups; g++) {                                                                       \
+            const __m256i wv0 = _mm256_loadu_si256((const __m256i *)(w + g * N * G));                              \
+            const __m256i wv1 = NR > 1 ? _mm256_loadu_si256((const __m256i *)(w1 + g * N * G)) : wv0;              \
+            const int32_t offset = offsets[g];                                                                     \
+            NAME##_row<Dot, NR>(c00, c01, a0 + offset, wv0, wv1);                                                  \
+            if (MR > 1) {                                                                                          \
+                NAME##_row<Dot, NR>(c10, c11, a1 + offset, wv0, wv1);                                              \
+            }                                                                                                      \
+            if (MR > 2) {                                                                                          \
+                NAME##_row<Dot, NR>(c20, c21, a2 + offset, wv0, wv1);                                              \
+            }                                                                                                      \
+            if (MR > 3) {                                                                                          \
+                NAME##_row<Dot, NR>(c30, c31, a3 + offset, wv0, wv1);                                              \
+            }                                                                                                      \
+        }                                                                                                          \
+        NAME##_store<NR>(c, c00, c01);                                                                             \
+        if (MR > 1) {                                                                                              \
+            NAME##_store<NR>(c + ldc, c10, c11);                                                                   \
+        }                                                                                                          \
+        if (MR > 2) {                                                                                              \
+            NAME##_store<NR>(c + 2 * (size_t)ldc, c20, c21);                                                       \
+        }                                                                                                          \
+        if (MR > 3) {                                                                                              \
+            NAME##_store<NR>(c + 3 * (size_t)ldc, c30, c31);                                                       \
+        }                                                                                                          \
+    }
+
+QUANTIZED_GEMM_TILE(SIMD_TARGET_AVX2, quantized_gemm_tile_avx2)
+QUANTIZED_GEMM_TILE(SIMD_TARGET_VNNI, quantized_gemm_tile_vnni)
+
+#undef QUANTIZED_GEMM_TILE
+
+/**
+ * Run the tiles over the rows and the output channels, with smaller tiles at the edges
+ * 行と出力チャンネルについてタイルを実行する. 端ではより小さなタイルを使う
+ */
+#define QUANTIZED_GEMM(TARGET, NAME, TILE, DOT)                                                                    \
+    template <int MR>                                                                                              \
+    TARGET inline void NAME##_rows(const uint8_t *a, const int32_t *rows, const int32_t *offsets, int n_groups,    \
+                                   const int8_t *w, int n_out, int32_t *c, int ldc) {                              \
+        const int N = QUANTIZED_N_ALIGN;                                                                           \
+        const int NR = QUANTIZED_TILE_N;                                                                           \
+        const size_t panel = (size_t)n_groups * N * QUANTIZED_K_GROUP;                                             \
+        int o = 0;                                                                                                 \
+        for (; o + NR * N <= n_out; o += NR * N) {                                                                 \
+            TILE<DOT, MR, NR>(a, rows, offsets, n_groups, w + (o / N) * panel, c + o, ldc);                        \
+        }                                                                                                          \
+        for (; o < n_out; o += N) {                                                                                \
+            TILE<DOT, MR, 1>(a, rows, offsets, n_groups, w + (o / N) * panel, c + o, ldc);                         \
+        }                                                                                                          \
+    }                                                                                                              \
+                                                                                                                   \
+    TARGET inline void NAME(const uint8_t *a, const int32_t *rows, int m, const int32_t *offsets, int n_groups,    \
+                            const int8_t *w, int n_out, int32_t *c, int ldc) {                                     \
+        const int MR = QUANTIZED_TILE_M;                                                                           \
+        int i = 0;                                                                                                 \
+        for (; i + MR <= m; i += MR) {                                                                             \
+            NAME##_rows<MR>(a, rows + i, offsets, n_groups, w, n_out, c + (size_t)i * ldc, ldc);                   \
+        }                                                                                                          \
+        for (; i < m; i++) {                                                                                       \
+            NAME##_rows<1>(a, rows + i, offsets, n_groups, w, n_out, c + (size_t)i * ldc, ldc);                    \
+        }                                                                                                          \
+        _mm256_zeroupper();                                                                                        \
+    }
+
+QUANTIZED_GEMM(SIMD_TARGET_AVX2, quantized_gemm_avx2, quantized_gemm_tile_avx2, QuantizedDotAvx2)
+QUANTIZED_GEMM(SIMD_TARGET_VNNI, quantized_gemm_vnni, quantized_gemm_tile_vnni, QuantizedDotVnni)
+
+#undef QUANTIZED_GEMM
+
+SIMD_TARGET_AVX2 inline void quantized_requantize_avx2(const int32_t *c, int m, int n, const int32_t *corrections,
+                                                       const float *multipliers, const float *bias, float inv_scale,
+                                                       int zero_point, uint8_t *q) {
+    const __m256 scale = _mm256_set1_ps(inv_scale);
+    const __m256 offset = _mm256_set1_ps(zero_point + 0.5f);
+    const __m256i lo = _mm256_setzero_si256();
+    const __m256i hi = _mm256_set1_epi32(127);
+    for (int i = 0; i < m; i++) {
+        for (int o = 0; o < n; o += 8) {
+            const size_t at = (size_t)i * n + o;
+            const __m256i centered = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i *)(c + at)),
+                                                      _mm256_loadu_si256((const __m256i *)(corrections + o)));
+            const __m256 y = _mm256_fmadd_ps(_mm256_loadu_ps(multipliers + o), _mm256_cvtepi32_ps(centered),
+                                             _mm256_loadu_ps(bias + o));
+            __m256i v = _mm256_cvttps_epi32(_mm256_fmadd_ps(y, scale, offset));
+            v = _mm256_min_epi32(_mm256_max_epi32(v, lo), hi);
+            const __m128i v16 = _mm_packs_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+            _mm_storel_epi64((__m128i *)(q + at), _mm_packus_epi16(v16, v16));
+        }
+    }
+    _mm256_zeroupper();
+}
+
+#endif  // SIMD_X86
+
+// -----------------------------------------------------------------------------
+// Runtime dispatch
+// -----------------------------------------------------------------------------
+
+/**
+ * Select a kernel for the instruction set. All the kernels give exactly the same results.
+ * 命令セットに対応するカーネルを選ぶ. どのカーネルも全く同じ結果を返す
+ */
+inline QuantizedGemmKernel quantized_gemm_kernel() {
+#if defined(SIMD_X86)
+    if (simd_has_vnni()) {
+        return quantized_gemm_vnni;
+    }
+    if (simd_level() != SimdLevel::Scalar) {
+        return quantized_gemm_avx2;
+    }
+#endif
+    return quantized_gemm_scalar;
+}
+
+inline QuantizedRequantizeKernel quantized_requantize_kernel() {
+#if defined(SIMD_X86)
+    if (simd_level() != SimdLevel::Scalar) {
+        return quantized_requantize_avx2;
+    }
+#endif
+    return quantized_requantize_scalar;
+}
+
+#endif  // _QUANTIZED_KERNELS_H_
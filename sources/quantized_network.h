@@ -0,0 +1,682 @@
+#ifdef _MSC_VER
+#pragma once
+#endif
+
+#ifndef _QUANTIZED_NETWORK_H_
+#define _QUANTIZED_NETWORK_H_
+
+#include <cstdint>
+#include <cmath>
+#include <memory>
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+#include "parallel.h"
+#include "network.h"
+#include "activation.h"
+#include "convolution_layer.h"
+#include "fully_connected_layer.h"
+#include "max_pooling_layer.h"
+#include "average_pooling_layer.h"
+#include "quantized_kernels.h"
+
+// Largest value of quantized activations. Only 7 bits of uint8 are used so that "maddubs" never saturates.
+// 量子化された活性値の最大値. "maddubs"が飽和しないよう, uint8のうち7ビットのみを使う
+static const int QUANTIZED_MAX = 127;
+
+/**
+ * Affine quantization "x = scale * (q - zero_point)"
+ * アフィン量子化 "x = scale * (q - zero_point)"
+ */
+struct QuantParams {
+    float scale = 1.0f;
+    float inv_scale = 1.0f;
+    int zero_point = 0;
+
+    //! Parameters to cover [lo, hi], which is extended to contain zero so that zero is exactly representable
+    static QuantParams from_range(double lo, double hi) {
+        lo = std::min(lo, 0.0);
+        hi = std::max(hi, 0.0);
+
+        QuantParams params;
+        params.scale = hi > lo ? (float)((hi - lo) / QUANTIZED_MAX) : 1.0f;
+        params.inv_scale = 1.0f / params.scale;
+        params.zero_point = std::max(0, std::min(QUANTIZED_MAX, (int)std::floor(-lo / params.scale + 0.5)));
+        return params;
+    }
+
+    uint8_t quantize(float x) const {
+        // Truncation rounds to the nearest for non-negative values, and the others are clamped to zero anyway
+        // 非負の値は切り捨てで最近傍に丸められ, それ以外はいずれにせよ0に切り詰められる
+        const int q = (int)(x * inv_scale + (zero_point + 0.5f));
+        return (uint8_t)std::max(0, std::min(QUANTIZED_MAX, q));
+    }
+
+    float dequantize(uint8_t q) const {
+        return scale * ((int)q - zero_point);
+    }
+};
+
+/**
+ * Quantized activations of a batch, laid out as [rows][cols] with the same column order as "Matrix". The data is
+ * followed by "QUANTIZED_READ_PADDING" zeros, which the int8 kernels may read past the last row.
+ * バッチの量子化された活性値. "Matrix"と同じ列の順序で[行][列]の順に並ぶ. データの後にはint8のカーネルが
+ * 最後の行を越えて読みうる"QUANTIZED_READ_PADDING"個の0が続く
+ */
+struct QuantizedTensor {
+    std::vector<uint8_t> data = {};
+    int rows = 0;
+    int cols = 0;
+    QuantParams params = {};
+
+    void resize(int rows_, int cols_) {
+        rows = rows_;
+        cols = cols_;
+        data.resize((size_t)rows * cols + QUANTIZED_READ_PADDING);
+        std::fill(data.end() - QUANTIZED_READ_PADDING, data.end(), 0);
+    }
+};
+
+/**
+ * Base class for layers of the quantized inference network
+ * 量子化された推論用ネットワークのレイヤーの基底クラス
+ */
+class QuantizedLayer : private Uncopyable {
+public:
+    QuantizedLayer() {
+    }
+    virtual ~QuantizedLayer() {
+    }
+
+    virtual void forward(const QuantizedTensor &input, QuantizedTensor &output) const = 0;
+
+    //! Forward for the last quantized layer, whose output is passed to the floating-point layers
+    virtual void forward_dequantized(const QuantizedTensor &input, MatrixT<float> &output) const {
+        QuantizedTensor result;
+        forward(input, result);
+        output.resize(result.rows, result.cols);
+        for (int b = 0; b < result.rows; b++) {
+            for (int i = 0; i < result.cols; i++) {
+                output(b, i) = result.params.dequantize(result.data[(size_t)b * result.cols + i]);
+            }
+        }
+    }
+};
+
+/**
+ * Convolution with int8 kernels (per-output-channel scales) and int32 accumulation. The number of input
+ * channels is given by the kernel matrix, and a fully connected layer is handled as the convolution of a
+ * 1x1 image.
+ * int8のカーネル (出力チャンネル毎のスケール) とint32の累積による畳み込み. 入力チャンネル数はカーネルの
+ * 行列から決まり, 全結合層は1x1画像の畳み込みとして扱う
+ */
+class QuantizedConvolutionLayer : public QuantizedLayer {
+public:
+    template <typename Derived1, typename Derived2>
+    QuantizedConvolutionLayer(Size input_size, Size kernel_size, const Eigen::MatrixBase<Derived1> &W,
+                              const Eigen::MatrixBase<Derived2> &b, QuantParams input_params,
+                              QuantParams output_params)
+        : QuantizedLayer()
+        , input_size_(input_size)
+        , kernel_size_(kernel_size)
+        , output_size_()
+        , out_channels_((int)W.rows())
+        , input_params_(input_params)
+        , output_params_(output_params) {
+        output_size_.rows = input_size_.rows - kernel_size_.rows + 1;
+        output_size_.cols = input_size_.cols - kernel_size_.cols + 1;
+
+        // Symmetric quantization of kernels for each output channel. Sums of quantized weights times the zero
+        // point of the input are kept to subtract them after accumulation. Output channels of the padding have
+        // zero multipliers.
+        // 出力チャンネル毎にカーネルを対称に量子化する. 累積後に差し引くため, 量子化した重みの和と入力の
+        // ゼロ点との積を保持しておく. 余白の出力チャンネルの乗数は0とする
+        n_weights_ = (int)W.cols();
+        n_padded_ = quantized_padded_length(out_channels_, QUANTIZED_N_ALIGN);
+        std::vector<int> group_weights;
+        make_groups(group_weights);
+        n_groups_ = (int)offsets_.size();
+
+        std::vector<int8_t> quantized((size_t)out_channels_ * n_weights_);
+        corrections_.assign(n_padded_, 0);
+        multipliers_.assign(n_padded_, 0.0f);
+        bias_.assign(n_padded_, 0.0f);
+        for (int o = 0; o < out_channels_; o++) {
+            const double absmax = (double)W.row(o).cwiseAbs().maxCoeff();
+            const double w_scale = absmax > 0.0 ? absmax / 127.0 : 1.0;
+            for (int k = 0; k < n_weights_; k++) {
+                const int q = (int)std::floor((double)W(o, k) / w_scale + 0.5);
+                quantized[(size_t)o * n_weights_ + k] = (int8_t)std::max(-127, std::min(127, q));
+                corrections_[o] += input_params_.zero_point * quantized[(size_t)o * n_weights_ + k];
+            }
+            multipliers_[o] = (float)(input_params_.scale * w_scale);
+            bias_[o] = (float)b(0, o);
+        }
+
+        // Kernels are packed as [n_padded / 8][n_groups][8][4] for the GEMM kernel. Bytes of the groups which
+        // are out of the kernel and output channels of the padding stay zero.
+        // 行列積のカーネルのため, カーネルを[n_padded / 8][n_groups][8][4]の順に詰める. カーネル外にある組の
+        // バイトと余白の出力チャンネルは0のままにしておく
+        const int N = QUANTIZED_N_ALIGN;
+        const int G = QUANTIZED_K_GROUP;
+        weights_.assign((size_t)n_padded_ * n_groups_ * G, 0);
+        for (int o = 0; o < out_channels_; o++) {
+            int8_t *dst = &weights_[((size_t)(o / N) * n_groups_ * N + o % N) * G];
+            for (int g = 0; g < n_groups_; g++) {
+                for (int q = 0; q < G; q++) {
+                    const int k = group_weights[g * G + q];
+                    if (k >= 0) {
+                        dst[(size_t)g * N * G + q] = quantized[(size_t)o * n_weights_ + k];
+                    }
+                }
+            }
+        }
+
+        gemm_ = quantized_gemm_kernel();
+        requantize_ = quantized_requantize_kernel();
+    }
+
+    void forward(const QuantizedTensor &input, QuantizedTensor &output) const override {
+        output.resize(input.rows, output_size_.total() * out_channels_);
+        output.params = output_params_;
+        uint8_t *out = output.data.data();
+        const int cols = output.cols;
+        run(input, [&](int b, int p, int m, const int32_t *acc, uint8_t *q) {
+            // Sizes are copied to local variables, since otherwise they are reloaded after every store of uint8,
+            // which may alias with any object
+            // uint8の書き込みは任意のオブジェクトと別名になりうるため, サイズはローカル変数にコピーしておく.
+            // そうしないと書き込みの度に読み直される
+            const int n_pixels = output_size_.total();
+            const int n_out = out_channels_;
+            const int n_padded = n_padded_;
+
+            // Channels of each pixel are requantized together, and then copied to the planes of the channels for
+            // each run of pixels in the same sample
+            // 各画素のチャンネルをまとめて再量子化し, その後同じサンプルの画素の区間毎にチャンネルの平面にコピーする
+            requantize_(acc, m, n_padded, corrections_.data(), multipliers_.data(), bias_.data(),
+                        output_params_.inv_scale, output_params_.zero_point, q);
+            for (int i0 = 0; i0 < m;) {
+                const int n = std::min(m - i0, n_pixels - p);
+                uint8_t *dst = out + (size_t)b * cols + p;
+                const uint8_t *src = q + (size_t)i0 * n_padded;
+                for (int o = 0; o < n_out; o++) {
+                    for (int i = 0; i < n; i++) {
+                        dst[(size_t)o * n_pixels + i] = src[(size_t)i * n_padded + o];
+                    }
+                }
+                i0 += n;
+                p = 0;
+                b++;
+            }
+        });
+    }
+
+    void forward_dequantized(const QuantizedTensor &input, MatrixT<float> &output) const override {
+        output.resize(input.rows, output_size_.total() * out_channels_);
+        const int n_pixels = output_size_.total();
+        run(input, [&](int b, int p, int m, const int32_t *acc, uint8_t *) {
+            for (int i = 0; i < m; i++) {
+                const int32_t *acc_i = acc + (size_t)i * n_padded_;
+                for (int o = 0; o < out_channels_; o++) {
+                    output(b, o * n_pixels + p) =
+                        quantized_affine(acc_i[o], corrections_[o], multipliers_[o], bias_[o]);
+                }
+                if (++p == n_pixels) {
+                    p = 0;
+                    b++;
+                }
+            }
+        });
+    }
+
+private:
+    /**
+     * Split the kernel to groups of 4 bytes which are consecutive in the input. Groups run along each row of
+     * the kernel, unless the kernel covers the whole input (as a fully connected layer does) and is contiguous.
+     * The byte offsets of the groups from the first pixel of the patch go to "offsets_", and the indices of the
+     * weights for the bytes of the groups (-1 out of the kernel) go to "group_weights".
+     * カーネルを入力上で連続する4バイトの組に分ける. カーネルが (全結合層のように) 入力全体を覆って連続して
+     * いる場合を除き, 組はカーネルの各行に沿って並ぶ. パッチの最初の画素からの組のバイト単位のオフセットを
+     * "offsets_"に, 組の各バイトに対応する重みの番号 (カーネル外では-1) を"group_weights"に格納する
+     */
+    void make_groups(std::vector<int> &group_weights) {
+        const int G = QUANTIZED_K_GROUP;
+        offsets_.clear();
+        group_weights.clear();
+        if (kernel_size_.rows == input_size_.rows && kernel_size_.cols == input_size_.cols) {
+            for (int k0 = 0; k0 < n_weights_; k0 += G) {
+                offsets_.push_back(k0);
+                for (int q = 0; q < G; q++) {
+                    group_weights.push_back(k0 + q < n_weights_ ? k0 + q : -1);
+                }
+            }
+            return;
+        }
+
+        const int channels = n_weights_ / kernel_size_.total();
+        for (int c = 0; c < channels; c++) {
+            for (int ky = 0; ky < kernel_size_.rows; ky++) {
+                for (int kx0 = 0; kx0 < kernel_size_.cols; kx0 += G) {
+                    offsets_.push_back(c * input_size_.total() + ky * input_size_.cols + kx0);
+                    for (int q = 0; q < G; q++) {
+                        const int kx = kx0 + q;
+                        group_weights.push_back(kx < kernel_size_.cols
+                                                    ? (c * kernel_size_.rows + ky) * kernel_size_.cols + kx
+                                                    : -1);
+                    }
+                }
+            }
+        }
+    }
+
+    /**
+     * Multiply the input with the kernels, and pass the int32 results to "epilogue(b, p, m, acc, q)" in chunks
+     * of "m" rows starting at the pixel "p" of the sample "b". The results are laid out as [m][n_padded] in "acc",
+     * and "q" is a buffer of the same number of bytes.
+     * 入力とカーネルの積を計算し, int32の結果を"m"行ずつ"epilogue(b, p, m, acc, q)"に渡す. 行はサンプル"b"の
+     * 画素"p"から始まる. 結果は"acc"に[m][n_padded]の順に並び, "q"は同じ個数のバイトのバッファである
+     */
+    template <typename Epilogue>
+    void run(const QuantizedTensor &input, Epilogue epilogue) const {
+        const int batchsize = input.rows;
+
+        // Pixels of all the samples are the rows of one GEMM, which reads the patches from the input directly.
+        // The rows of a task are processed in chunks so that the int32 results stay in the cache. A fully
+        // connected layer has one pixel for each sample, so its kernels are shared by the samples of a chunk.
+        // 全サンプルの画素を1つの行列積の行とし, パッチは入力から直接読む. int32の結果がキャッシュに収まるよう,
+        // タスクの行は一定数ずつ処理する. 全結合層はサンプル毎に1画素なので, カーネルはまとめて処理する
+        // サンプルの間で共有される
+        const int n_pixels = output_size_.total();
+        const int n_tasks = parallel_task_count(batchsize);
+        const int chunk = 64;
+        std::vector<int32_t> pixel_offsets(n_pixels);
+        for (int y = 0; y < output_size_.rows; y++) {
+            for (int x = 0; x < output_size_.cols; x++) {
+                pixel_offsets[y * output_size_.cols + x] = y * input_size_.cols + x;
+            }
+        }
+        std::vector<int32_t> row_buffer((size_t)n_tasks * chunk);
+        std::vector<int32_t> acc_buffer((size_t)n_tasks * chunk * n_padded_);
+        std::vector<uint8_t> q_buffer((size_t)n_tasks * chunk * n_padded_);
+
+        parallel_for(0, n_tasks, [&](int t) {
+            const int n_padded = n_padded_;
+            const int n_groups = n_groups_;
+            const int in_cols = input.cols;
+            const int8_t *weights = weights_.data();
+            const int32_t *offsets = offsets_.data();
+            const QuantizedGemmKernel gemm = gemm_;
+
+            int32_t *rows = &row_buffer[(size_t)t * chunk];
+            int32_t *acc = &acc_buffer[(size_t)t * chunk * n_padded];
+            uint8_t *q = &q_buffer[(size_t)t * chunk * n_padded];
+            const TaskRange range = task_range(t, n_tasks, batchsize);
+            int b = range.begin, p = 0;
+            while (b < range.end) {
+                // Offsets of the rows are relative to the first sample of the chunk
+                // 行のオフセットはまとめて処理する最初のサンプルからの相対位置とする
+                const int b0 = b, p0 = p;
+                int m = 0;
+                for (; m < chunk && b < range.end; m++) {
+                    rows[m] = (b - b0) * in_cols + pixel_offsets[p];
+                    if (++p == n_pixels) {
+                        p = 0;
+                        b++;
+                    }
+                }
+
+                gemm(&input.data[(size_t)b0 * in_cols], rows, m, offsets, n_groups, weights, n_padded, acc,
+                     n_padded);
+
+                epilogue(b0, p0, m, acc, q);
+            }
+        });
+    }
+
+    Size input_size_ = {};
+    Size kernel_size_ = {};
+    Size output_size_ = {};
+    int out_channels_ = 0;
+    int n_weights_ = 0;
+    int n_groups_ = 0;
+    int n_padded_ = 0;
+    QuantParams input_params_ = {};
+    QuantParams output_params_ = {};
+
+    std::vector<int8_t> weights_ = {};
+    std::vector<int32_t> offsets_ = {};
+    std::vector<int32_t> corrections_ = {};
+    std::vector<float> multipliers_ = {};
+    std::vector<float> bias_ = {};
+    QuantizedGemmKernel gemm_ = nullptr;
+    QuantizedRequantizeKernel requantize_ = nullptr;
+};
+
+/**
+ * Max pooling on quantized values, which is exact since quantization is monotonic
+ * 量子化された値に対する最大値プーリング. 量子化は単調なので厳密に計算できる
+ */
+class QuantizedMaxPoolingLayer : public QuantizedLayer {
+public:
+    template <typename Scalar>
+    QuantizedMaxPoolingLayer(const MaxPoolingLayerT<Scalar> &layer)
+        : QuantizedLayer()
+        , input_size_(layer.input_size())
+        , pool_size_(layer.pool_size())
+        , stride_(layer.stride())
+        , output_size_(layer.output_size())
+        , n_channels_(layer.channels()) {
+    }
+
+    void forward(const QuantizedTensor &input, QuantizedTensor &output) const override {
+        const int n_pixels = output_size_.total();
+        output.resize(input.rows, n_pixels * n_channels_);
+        output.params = input.params;
+        parallel_for(0, input.rows, [&](int b) {
+            const uint8_t *in = &input.data[(size_t)b * input.cols];
+            uint8_t *out = &output.data[(size_t)b * output.cols];
+            // Sizes are copied to local variables, since otherwise they are reloaded after every store of uint8
+            // uint8の書き込みの度に読み直されないよう, サイズはローカル変数にコピーしておく
+            const int in_total = input_size_.total();
+            const int in_cols = input_size_.cols;
+            const int out_rows = output_size_.rows;
+            const int out_cols = output_size_.cols;
+            const int pool_rows = pool_size_.rows;
+            const int pool_cols = pool_size_.cols;
+            const int stride_rows = stride_.rows;
+            const int stride_cols = stride_.cols;
+            const int n_channels = n_channels_;
+            for (int c = 0; c < n_channels; c++) {
+                for (int y = 0; y < out_rows; y++) {
+                    const uint8_t *row = in + c * in_total + y * stride_rows * in_cols;
+                    uint8_t *dst = out + c * n_pixels + y * out_cols;
+                    for (int x = 0; x < out_cols; x++) {
+                        const uint8_t *window = row + x * stride_cols;
+                        uint8_t maxval = 0;
+                        for (int dy = 0; dy < pool_rows; dy++) {
+                            for (int dx = 0; dx < pool_cols; dx++) {
+                                maxval = std::max(maxval, window[dy * in_cols + dx]);
+                            }
+                        }
+                        dst[x] = maxval;
+                    }
+                }
+            }
+        });
+    }
+
+private:
+    Size input_size_ = {};
+    Size pool_size_ = {};
+    Size stride_ = {};
+    Size output_size_ = {};
+    int n_channels_ = 0;
+};
+
+/**
+ * Average pooling on quantized values. Averages are rounded to the nearest quantized value.
+ * 量子化された値に対する平均値プーリング. 平均は最も近い量子化された値に丸める
+ */
+class QuantizedAveragePoolingLayer : public QuantizedLayer {
+public:
+    template <typename Scalar>
+    QuantizedAveragePoolingLayer(const AveragePoolingLayerT<Scalar> &layer)
+        : QuantizedLayer()
+        , input_size_(layer.input_size())
+        , pool_size_(layer.pool_size())
+        , stride_(layer.stride())
+        , output_size_(layer.output_size())
+        , n_channels_(layer.channels()) {
+    }
+
+    void forward(const QuantizedTensor &input, QuantizedTensor &output) const override {
+        const int n_pixels = output_size_.total();
+        const int n_pool = pool_size_.total();
+        output.resize(input.rows, n_pixels * n_channels_);
+        output.params = input.params;
+        parallel_for(0, input.rows, [&](int b) {
+            const uint8_t *in = &input.data[(size_t)b * input.cols];
+            uint8_t *out = &output.data[(size_t)b * output.cols];
+            for (int c = 0; c < n_channels_; c++) {
+                for (int p = 0; p < n_pixels; p++) {
+                    const uint8_t *window = in + c * input_size_.total() +
+                                            (p / output_size_.cols) * stride_.rows * input_size_.cols +
+                                            (p % output_size_.cols) * stride_.cols;
+                    int sum = 0;
+                    for (int dy = 0; dy < pool_size_.rows; dy++) {
+                        for (int dx = 0; dx < pool_size_.cols; dx++) {
+                            sum += window[dy * input_size_.cols + dx];
+                        }
+                    }
+                    out[c * n_pixels + p] = (uint8_t)((sum + n_pool / 2) / n_pool);
+                }
+            }
+        });
+    }
+
+private:
+    Size input_size_ = {};
+    Size pool_size_ = {};
+    Size stride_ = {};
+    Size output_size_ = {};
+    int n_channels_ = 0;
+};
+
+/**
+ * ReLU on quantized values, which clamps them at the zero point
+ * 量子化された値に対するReLU. ゼロ点で値を切り詰める
+ */
+class QuantizedReLU : public QuantizedLayer {
+public:
+    QuantizedReLU()
+        : QuantizedLayer() {
+    }
+
+    void forward(const QuantizedTensor &input, QuantizedTensor &output) const override {
+        const uint8_t zero = (uint8_t)input.params.zero_point;
+        output.resize(input.rows, input.cols);
+        output.params = input.params;
+        parallel_for(0, input.rows * input.cols, 4096, [&](int i) {
+            output.data[i] = std::max(input.data[i], zero);
+        });
+    }
+};
+
+/**
+ * Post-training quantized inference network. The longest prefix of layers which have quantized versions
+ * (convolution, fully connected, pooling and ReLU) runs with int8 weights and uint8 activations, and
+ * the remaining layers (e.g., the final log-softmax) run in floating point. Ranges of activations are
+ * calibrated with the outputs of the trained network for a calibration batch.
+ * 学習後に量子化した推論用ネットワーク. 量子化版のあるレイヤー (畳み込み, 全結合, プーリング, ReLU) が
+ * 続く最長の先頭部分はint8の重みとuint8の活性値で計算し, 残りのレイヤー (最後の対数ソフトマックスなど) は
+ * 浮動小数で計算する. 活性値の範囲は, 校正用のバッチに対する学習済みネットワークの出力から決める
+ */
+template <typename Scalar>
+class QuantizedNetworkT : private Uncopyable {
+public:
+    using Matrix = MatrixT<Scalar>;
+    using Network = NetworkT<Scalar>;
+    using AbstractLayer = AbstractLayerT<Scalar>;
+    using ConvolutionLayer = ConvolutionLayerT<Scalar>;
+    using FusedConvolutionLayer = FusedConvolutionLayerT<Scalar>;
+    using FullyConnectedLayer = FullyConnectedLayerT<Scalar>;
+    using FusedFullyConnectedLayer = FusedFullyConnectedLayerT<Scalar>;
+    using MaxPoolingLayer = MaxPoolingLayerT<Scalar>;
+    using AveragePoolingLayer = AveragePoolingLayerT<Scalar>;
+    using ReLU = ReLUT<Scalar>;
+
+    QuantizedNetworkT(Network &network, const Matrix &calibration) {
+        network.forward(calibration);
+        const ValueRange range = value_range(calibration);
+        input_params_ = QuantParams::from_range(range.first, range.second);
+
+        const auto &layers = network.layers();
+        const int n_layers = (int)layers.size();
+        QuantParams params = input_params_;
+        int i = 0;
+        for (; i < n_layers; i++) {
+            AbstractLayer *layer = layers[i].get();
+            if (auto fused = dynamic_cast<FusedConvolutionLayer *>(layer)) {
+                // Fused layers are split into the quantized versions of their parts
+                // 融合したレイヤーは各部分の量子化版に分ける
+                if (fused->activation() == Activation::Sigmoid) {
+                    break;
+                }
+                const QuantParams out_params = calibrate_output(network, i);
+                layers_.emplace_back(new QuantizedConvolutionLayer(fused->input_size(), fused->kernel_size(),
+                                                                   fused->weights(), fused->bias(), params,
+                                                                   out_params));
+                if (fused->pooling()) {
+                    layers_.emplace_back(new QuantizedMaxPoolingLayer(*fused->pooling()));
+                }
+                if (fused->activation() == Activation::ReLU) {
+                    layers_.emplace_back(new QuantizedReLU());
+                }
+                params = out_params;
+            } else if (auto fused = dynamic_cast<FusedFullyConnectedLayer *>(layer)) {
+                if (fused->activation() == Activation::Sigmoid) {
+                    break;
+                }
+                const QuantParams out_params = calibrate_output(network, i);
+                layers_.emplace_back(new QuantizedConvolutionLayer(Size(1, 1), Size(1, 1), fused->weights(),
+                                                                   fused->bias(), params, out_params));
+                if (fused->activation() == Activation::ReLU) {
+                    layers_.emplace_back(new QuantizedReLU());
+                }
+                params = out_params;
+            } else if (auto conv = dynamic_cast<ConvolutionLayer *>(layer)) {
+                const QuantParams out_params = calibrate_output(network, i);
+                layers_.emplace_back(new QuantizedConvolutionLayer(conv->input_size(), conv->kernel_size(),
+                                                                   conv->weights(), conv->bias(), params, out_params));
+                params = out_params;
+            } else if (auto fc = dynamic_cast<FullyConnectedLayer *>(layer)) {
+                const QuantParams out_params = calibrate_output(network, i);
+                layers_.emplace_back(new QuantizedConvolutionLayer(Size(1, 1), Size(1, 1), fc->weights(), fc->bias(),
+                                                                   params, out_params));
+                params = out_params;
+            } else if (auto max_pool = dynamic_cast<MaxPoolingLayer *>(layer)) {
+                layers_.emplace_back(new QuantizedMaxPoolingLayer(*max_pool));
+            } else if (auto avg_pool = dynamic_cast<AveragePoolingLayer *>(layer)) {
+                layers_.emplace_back(new QuantizedAveragePoolingLayer(*avg_pool));
+            } else if (dynamic_cast<ReLU *>(layer)) {
+                layers_.emplace_back(new QuantizedReLU());
+            } else {
+                break;
+            }
+        }
+
+        for (; i < n_layers; i++) {
+            float_layers_.push_back(layers[i]);
+        }
+    }
+
+    Matrix predict(const Matrix &input) {
+        Matrix output;
+        if (layers_.empty()) {
+            output = input;
+        } else {
+            QuantizedTensor current, next;
+            current.resize((int)input.rows(), (int)input.cols());
+            current.params = input_params_;
+
+            // The input is column-major, so each task quantizes a block of samples column by column to read
+            // contiguous values
+            // 入力は列優先なので, 連続した値を読むよう, 各タスクはサンプルのブロックを列毎に量子化する
+            const int block_size = 64;
+            const int n_blocks = ((int)input.rows() + block_size - 1) / block_size;
+            parallel_for(0, n_blocks, [&](int k) {
+                const int begin = k * block_size;
+                const int end = std::min((int)input.rows(), begin + block_size);
+                const int cols = (int)input.cols();
+                const QuantParams params = input_params_;
+                uint8_t *data = current.data.data();
+                for (int i = 0; i < cols; i++) {
+                    const Scalar *column = input.col(i).data();
+                    for (int b = begin; b < end; b++) {
+                        data[(size_t)b * cols + i] = params.quantize((float)column[b]);
+                    }
+                }
+            });
+
+            const int n_quantized = (int)layers_.size();
+            for (int i = 0; i < n_quantized - 1; i++) {
+                layers_[i]->forward(current, next);
+                std::swap(current, next);
+            }
+            MatrixT<float> dequantized;
+            layers_[n_quantized - 1]->forward_dequantized(current, dequantized);
+            output = dequantized.cast<Scalar>();
+        }
+
+        for (const auto &layer : float_layers_) {
+            output = layer->forward(output);
+        }
+        return output;
+    }
+
+    int quantized_layer_count() const {
+        return (int)layers_.size();
+    }
+
+private:
+    /**
+     * Quantization of the output of the "i"-th layer. If the output only goes through max pooling and ReLU
+     * before the next layer with weights, negative values are clamped anyway, and only [0, max] is covered.
+     * "i"番目のレイヤーの出力の量子化. 次の重みをもつレイヤーまでに最大値プーリングとReLUしか通らない場合,
+     * 負の値はいずれ切り詰められるので, [0, 最大値]の範囲のみを扱う
+     */
+    static QuantParams calibrate_output(const Network &network, int i) {
+        const auto &layers = network.layers();
+        bool clamped = fused_activation(layers[i].get()) == Activation::ReLU;
+        for (int j = i + 1; j < (int)layers.size(); j++) {
+            if (dynamic_cast<ReLU *>(layers[j].get())) {
+                clamped = true;
+            } else if (!dynamic_cast<MaxPoolingLayer *>(layers[j].get())) {
+                break;
+            }
+        }
+
+        const ValueRange range = value_range(layers[i]->output());
+        return QuantParams::from_range(clamped ? 0.0 : range.first, range.second);
+    }
+
+    // Minimum and maximum of the values of a matrix, which are reduced over its columns in parallel
+    // 行列の値の最小値と最大値. 列について並列に集約する
+    using ValueRange = std::pair<double, double>;
+
+    static ValueRange value_range(const MatrixRefT<Scalar> &values) {
+        return parallel_reduce(
+            0, (int)values.cols(), 1, ValueRange(INFTY, -INFTY),
+            [&](int begin, int end) {
+                const auto block = values.middleCols(begin, end - begin);
+                return ValueRange((double)block.minCoeff(), (double)block.maxCoeff());
+            },
+            [](const ValueRange &x, const ValueRange &y) {
+                return ValueRange(std::min(x.first, y.first), std::max(x.second, y.second));
+            });
+    }
+
+    /**
+     * Activation at the end of a fused layer. For a fused layer, the range is calibrated with its output after
+     * pooling, which is enough since the values below the smallest maximum of the windows are never pooled.
+     * 融合したレイヤーの最後の活性化関数. 融合したレイヤーの範囲はプーリング後の出力で決めるが,
+     * 窓の最大値のうち最小のものより小さな値はプーリングで選ばれないので, これで十分である
+     */
+    static Activation fused_activation(const AbstractLayer *layer) {
+        if (auto fused = dynamic_cast<const FusedConvolutionLayer *>(layer)) {
+            return fused->activation();
+        } else if (auto fused = dynamic_cast<const FusedFullyConnectedLayer *>(layer)) {
+            return fused->activation();
+        }
+        return Activation::Identity;
+    }
+
+    QuantParams input_params_ = {};
+    std::vector<std::shared_ptr<QuantizedLayer>> layers_ = {};
+    std::vector<std::shared_ptr<AbstractLayer>> float_layers_ = {};
+};
+
+using QuantizedNetwork = QuantizedNetworkT<ScalarType>;
+
+#endif  // _QUANTIZED_NETWORK_H_
@@ -6,63 +6,310 @@
 #define _RANDOM_H_
 
 #include <cmath>
-#include <ctime>
+#include <cstdint>
+#include <atomic>
+#include <vector>
 #include <algorithm>
 
 #include "common.h"
+#include "parallel.h"
 
 /**
- * Random number generator with XOR shift.
+ * Stream of random numbers from the counter-based generator Philox4x32-10. The "i"-th number of a stream is a
+ * pure function of the seed, the stream key and "i", so that numbers can be generated in any order and in
+ * parallel, and the results do not depend on the number of threads. Each 128-bit counter (block index and
+ * stream key) is encrypted with the seed as the key to four 32-bit words.
+ * カウンタベースの生成器Philox4x32-10による乱数列. 列の"i"番目の数はシードと列のキーと"i"のみの関数
+ * なので, 任意の順序で並列に生成でき, 結果はスレッド数に依存しない. 128ビットのカウンタ (ブロック番号と
+ * 列のキー) をシードを鍵として暗号化し, 4つの32ビットの語を得る
  */
-class Random : private Uncopyable {
+class RandomStream {
 public:
-    static Random &getInstance() {
-        static Random instance((unsigned int)time(0));
-        return instance;
+    RandomStream(uint64_t seed = 0, uint64_t stream = 0)
+        : seed_(seed)
+        , stream_(stream) {
     }
 
-    ~Random() {
+    /**
+     * Independent stream derived from this stream and "id", e.g., for each epoch of a shuffle
+     * この列と"id"から導く独立した列. 例えばシャッフルのエポック毎に用いる
+     */
+    RandomStream split(uint64_t id) const {
+        uint32_t words[4];
+        philox((uint32_t)id, (uint32_t)(id >> 32), (uint32_t)stream_, (uint32_t)(stream_ >> 32),
+               (uint32_t)seed_ ^ split_key, (uint32_t)(seed_ >> 32), words);
+        return RandomStream(seed_, (uint64_t)words[0] | ((uint64_t)words[1] << 32));
     }
 
-    unsigned int nextInt() {
-        const unsigned int t = seed_[0] ^ (seed_[0] << 11);
-        seed_[0] = seed_[1];
-        seed_[1] = seed_[2];
-        seed_[2] = seed_[3];
-        return seed_[3] = (seed_[3] ^ (seed_[3] >> 19)) ^ (t ^ (t >> 8));
+    // "index"-th 32-bit word of the stream
+    // 列の"index"番目の32ビットの語
+    uint32_t bits(uint64_t index) const {
+        uint32_t words[4];
+        block(index / 4, words);
+        return words[index % 4];
     }
 
-    //! Sample integer from [a, b]
-    unsigned int nextInt(unsigned int a, unsigned int b) {
-        unsigned int v = (unsigned int)(nextReal() * (b - a + 1) + a);
-        return std::min(v, b);
+    // "index"-th uniform number in (0, 1)
+    // "index"番目の(0, 1)の一様乱数
+    double uniform(uint64_t index) const {
+        return to_uniform(bits(index));
     }
 
-    //! Sample number from [0, 1]
-    double nextReal() {
-        return (double)nextInt() * coefficient_;
+    // "index"-th integer in [0, bound), which is the high word of the product with the bound
+    // "index"番目の[0, bound)の整数. 上限との積の上位の語とする
+    uint32_t below(uint64_t index, uint32_t bound) const {
+        return (uint32_t)(((uint64_t)bits(index) * bound) >> 32);
     }
 
-    double normal() {
-        const double r1 = nextReal();
-        const double r2 = nextReal();
-        return sqrt(-2.0 * log(r1)) * sin(2.0 * PI * r2);
+    // "index"-th standard normal number. Each block gives four numbers with the Box-Muller transform.
+    // "index"番目の標準正規乱数. 各ブロックからBox-Muller変換で4つの数を得る
+    double normal(uint64_t index) const {
+        uint32_t words[4];
+        double values[4];
+        block(index / 4, words);
+        to_normal(words, values);
+        return values[index % 4];
+    }
+
+    /**
+     * Fill "values" with the uniform numbers [offset, offset + n) of the stream in parallel
+     * "values"を列の[offset, offset + n)番目の一様乱数で並列に埋める
+     */
+    template <typename Scalar>
+    void fill_uniform(Scalar *values, int64_t n, uint64_t offset = 0) const {
+        fill(values, n, offset, [](const uint32_t words[4], double out[4]) {
+            for (int k = 0; k < 4; k++) {
+                out[k] = to_uniform(words[k]);
+            }
+        });
+    }
+
+    /**
+     * Fill "values" with the standard normal numbers [offset, offset + n) of the stream in parallel
+     * "values"を列の[offset, offset + n)番目の標準正規乱数で並列に埋める
+     */
+    template <typename Scalar>
+    void fill_normal(Scalar *values, int64_t n, uint64_t offset = 0) const {
+        fill(values, n, offset, to_normal);
+    }
+
+    uint64_t seed() const {
+        return seed_;
+    }
+    uint64_t stream() const {
+        return stream_;
     }
 
 private:
-    Random(unsigned int seed)
-        : seed_{}
-        , coefficient_(1.0f / UINT_MAX)
-        , coefficient2_(1.0f / 16777216.0f) {
-        unsigned int s = seed;
-        for (int i = 1; i <= 4; i++) {
-            seed_[i - 1] = s = 1812433253U * (s ^ (s >> 30)) + i;
+    // Blocks generated together by "fill", whose rounds are computed lane by lane to be vectorized
+    // "fill"がまとめて生成するブロック数. 各ラウンドはベクトル化されるようレーン毎に計算する
+    static const int lanes = 16;
+    static const uint32_t split_key = 0x5bd1e995;
+
+    void block(uint64_t index, uint32_t words[4]) const {
+        philox((uint32_t)index, (uint32_t)(index >> 32), (uint32_t)stream_, (uint32_t)(stream_ >> 32),
+               (uint32_t)seed_, (uint32_t)(seed_ >> 32), words);
+    }
+
+    /**
+     * Philox4x32-10 of the counter (c0, c1, c2, c3) with the key (k0, k1). Each round multiplies two words of
+     * the counter and mixes the high and low halves of the products with the others and the key.
+     * カウンタ(c0, c1, c2, c3)の鍵(k0, k1)によるPhilox4x32-10. 各ラウンドはカウンタの2語を乗算し,
+     * 積の上位と下位の半分を他の語と鍵に混ぜる
+     */
+    static void philox(uint32_t c0, uint32_t c1, uint32_t c2, uint32_t c3, uint32_t k0, uint32_t k1,
+                       uint32_t words[4]) {
+        for (int round = 0; round < 10; round++) {
+            const uint64_t p0 = (uint64_t)0xD2511F53 * c0;
+            const uint64_t p1 = (uint64_t)0xCD9E8D57 * c2;
+            c0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+            c2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+            c1 = (uint32_t)p1;
+            c3 = (uint32_t)p0;
+            k0 += 0x9E3779B9;
+            k1 += 0xBB67AE85;
+        }
+        words[0] = c0;
+        words[1] = c1;
+        words[2] = c2;
+        words[3] = c3;
+    }
+
+    // Same as "philox" for "lanes" consecutive blocks from "first", laid out as words[k][lane]
+    // "first"から連続する"lanes"個のブロックに対する"philox". words[k][lane]として並べる
+    void philox_lanes(uint64_t first, uint32_t words[4][lanes]) const {
+        uint32_t c0[lanes], c1[lanes], c2[lanes], c3[lanes];
+        for (int l = 0; l < lanes; l++) {
+            c0[l] = (uint32_t)(first + l);
+            c1[l] = (uint32_t)((first + l) >> 32);
+            c2[l] = (uint32_t)stream_;
+            c3[l] = (uint32_t)(stream_ >> 32);
+        }
+
+        uint32_t k0 = (uint32_t)seed_;
+        uint32_t k1 = (uint32_t)(seed_ >> 32);
+        for (int round = 0; round < 10; round++) {
+            for (int l = 0; l < lanes; l++) {
+                const uint64_t p0 = (uint64_t)0xD2511F53 * c0[l];
+                const uint64_t p1 = (uint64_t)0xCD9E8D57 * c2[l];
+                c0[l] = (uint32_t)(p1 >> 32) ^ c1[l] ^ k0;
+                c2[l] = (uint32_t)(p0 >> 32) ^ c3[l] ^ k1;
+                c1[l] = (uint32_t)p1;
+                c3[l] = (uint32_t)p0;
+            }
+            k0 += 0x9E3779B9;
+            k1 += 0xBB67AE85;
+        }
+
+        for (int l = 0; l < lanes; l++) {
+            words[0][l] = c0[l];
+            words[1][l] = c1[l];
+            words[2][l] = c2[l];
+            words[3][l] = c3[l];
+        }
+    }
+
+    template <typename Scalar, typename Transform>
+    void fill(Scalar *values, int64_t n, uint64_t offset, Transform transform) const {
+        const uint64_t first = offset / 4;
+        const uint64_t last = (offset + n + 3) / 4;
+        const int n_groups = (int)((last - first + lanes - 1) / lanes);
+        parallel_for(0, n_groups, 64, [&](int g) {
+            uint32_t words[4][lanes];
+            const uint64_t b0 = first + (uint64_t)g * lanes;
+            philox_lanes(b0, words);
+
+            const int count = (int)std::min<uint64_t>((uint64_t)lanes, last - b0);
+            for (int l = 0; l < count; l++) {
+                const uint32_t block[4] = { words[0][l], words[1][l], words[2][l], words[3][l] };
+                double out[4];
+                transform(block, out);
+                for (int k = 0; k < 4; k++) {
+                    const uint64_t index = (b0 + l) * 4 + k;
+                    if (index >= offset && index < offset + n) {
+                        values[index - offset] = (Scalar)out[k];
+                    }
+                }
+            }
+        });
+    }
+
+    static double to_uniform(uint32_t word) {
+        return ((double)word + 0.5) * (1.0 / 4294967296.0);
+    }
+
+    static void to_normal(const uint32_t words[4], double out[4]) {
+        for (int k = 0; k < 4; k += 2) {
+            const double radius = std::sqrt(-2.0 * std::log(to_uniform(words[k])));
+            const double theta = 2.0 * PI * to_uniform(words[k + 1]);
+            out[k] = radius * std::cos(theta);
+            out[k + 1] = radius * std::sin(theta);
         }
     }
 
-    unsigned int seed_[4];
-    const float coefficient_;
-    const float coefficient2_;
+    uint64_t seed_ = 0;
+    uint64_t stream_ = 0;
 };
 
+/**
+ * Seed of the streams given by "next_random_stream". It is fixed unless it is set, so that runs are
+ * reproducible by default.
+ * "next_random_stream"が与える列のシード. 設定しなければ固定なので, 既定で実行は再現する
+ */
+inline std::atomic<uint64_t> &random_seed() {
+    static std::atomic<uint64_t> seed(0);
+    return seed;
+}
+
+inline std::atomic<uint64_t> &random_stream_count() {
+    static std::atomic<uint64_t> count(0);
+    return count;
+}
+
+/**
+ * Set the seed and restart the stream keys, which should be done before creating layers and loaders
+ * シードを設定し, 列のキーを最初から振り直す. レイヤーやローダーを作る前に行う
+ */
+inline void set_random_seed(uint64_t seed) {
+    random_seed() = seed;
+    random_stream_count() = 0;
+}
+
+/**
+ * New stream with the next key. Keys are given in the order of the calls, e.g., to the layers in the order of
+ * their construction, so that a program creating them in a fixed order is reproducible.
+ * 次のキーをもつ新しい列. キーは呼び出し順に与えるので (例えばレイヤーには生成順), それらを固定の順序で
+ * 作るプログラムは再現する
+ */
+inline RandomStream next_random_stream() {
+    return RandomStream(random_seed().load(), random_stream_count()++);
+}
+
+/**
+ * Shuffle "values" uniformly with "rng" in parallel. Each value is sent to one of a fixed number of buckets
+ * drawn at random, the buckets are gathered in order, and each bucket is shuffled with Fisher-Yates, which
+ * gives a uniform permutation. Chunks and buckets do not depend on the number of threads, and neither does the
+ * result. "scratch" holds a copy of the values, which can be kept by the caller to avoid allocations.
+ * "rng"で"values"を並列に一様にシャッフルする. 各値をランダムに選んだ固定数のバケットの1つに送り,
+ * バケットを順に集めて, 各バケットをFisher-Yatesでシャッフルすると一様な置換が得られる. チャンクとバケットは
+ * スレッド数に依存しないので, 結果も依存しない. "scratch"は値のコピーを保持し, 呼び出し側で保持すれば
+ * メモリの確保を避けられる
+ */
+template <typename T>
+void parallel_shuffle(T *values, int n, const RandomStream &rng, std::vector<T> &scratch) {
+    static const int n_buckets = 64;
+    static const int n_chunks = 64;
+    static const int min_parallel = 1 << 15;
+
+    // Small arrays are shuffled serially
+    // 小さな配列は逐次シャッフルする
+    if (n < min_parallel) {
+        for (int i = n - 1; i > 0; i--) {
+            std::swap(values[i], values[rng.below((uint64_t)i, (uint32_t)(i + 1))]);
+        }
+        return;
+    }
+
+    // Count the values of each chunk sent to each bucket, and turn the counts into the positions to write
+    // 各チャンクから各バケットに送る値を数え, 数を書き込む位置に変える
+    const RandomStream buckets = rng.split(0);
+    const RandomStream within = rng.split(1);
+    int offsets[n_chunks][n_buckets];
+    parallel_for(0, n_chunks, [&](int c) {
+        std::fill(offsets[c], offsets[c] + n_buckets, 0);
+        const TaskRange range = task_range(c, n_chunks, n);
+        for (int i = range.begin; i < range.end; i++) {
+            offsets[c][buckets.below((uint64_t)i, n_buckets)]++;
+        }
+    });
+
+    int begins[n_buckets + 1];
+    int position = 0;
+    for (int b = 0; b < n_buckets; b++) {
+        begins[b] = position;
+        for (int c = 0; c < n_chunks; c++) {
+            const int count = offsets[c][b];
+            offsets[c][b] = position;
+            position += count;
+        }
+    }
+    begins[n_buckets] = n;
+
+    scratch.resize(n);
+    parallel_for(0, n_chunks, [&](int c) {
+        const TaskRange range = task_range(c, n_chunks, n);
+        for (int i = range.begin; i < range.end; i++) {
+            scratch[offsets[c][buckets.below((uint64_t)i, n_buckets)]++] = values[i];
+        }
+    });
+
+    parallel_for(0, n_buckets, [&](int b) {
+        T *bucket = &scratch[begins[b]];
+        for (int i = begins[b + 1] - begins[b] - 1; i > 0; i--) {
+            std::swap(bucket[i], bucket[within.below((uint64_t)(begins[b] + i), (uint32_t)(i + 1))]);
+        }
+        std::copy(bucket, bucket + begins[b + 1] - begins[b], values + begins[b]);
+    });
+}
+
 #endif  // _RANDOM_H_
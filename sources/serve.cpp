@@ -0,0 +1,495 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+#include "models.h"
+#include "inference_server.h"
+
+#if !defined(_WIN32) && !defined(__WIN32__)
+#define EDUCNN_HAS_SERVER 1
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#endif
+
+/**
+ * Local inference server of the digit classifier. Images are posted over HTTP/1.1 on the loopback interface or
+ * on a Unix domain socket, and are classified in dynamic batches (see "DynamicBatcherT"):
+ *   POST /predict  body of 784 raw pixels (uint8, row-major) -> {"label": ..., "probabilities": [...]}
+ *   GET  /stats    latency percentiles, throughput and mean batch size of the served requests
+ * With "--bench", clients on their own connections post the test images to the server in the same process,
+ * and the latency, the throughput and the accuracy are reported.
+ * 数字の分類器のローカル推論サーバー. 画像はループバックインターフェースまたはUnixドメインソケット上の
+ * HTTP/1.1で送られ, 動的なバッチで分類される ("DynamicBatcherT"を参照):
+ *   POST /predict  784個の生の画素 (uint8, 行優先) の本文 -> {"label": ..., "probabilities": [...]}
+ *   GET  /stats    処理したリクエストのレイテンシの百分位数, スループット, 平均バッチサイズ
+ * "--bench"の場合, それぞれの接続をもつクライアントが同じプロセス内のサーバーにテスト画像を送り,
+ * レイテンシ, スループット, 精度を報告する
+ */
+
+struct ServeOptions {
+    bool cnn = false;
+    bool fuse = false;
+    bool float32 = false;
+    // Checkpoint of the trained network (untrained parameters if empty)
+    // 学習済みネットワークのチェックポイント (空の場合は学習していないパラメータ)
+    std::string load_file;
+    // Loopback port, or path of a Unix domain socket used instead if not empty
+    // ループバックのポート. 空でなければ代わりにUnixドメインソケットのパスを用いる
+    int port = 8080;
+    std::string socket_path;
+    // Maximum batch size, time for which the oldest request waits for its batch to fill up, and maximum
+    // number of queued requests
+    // 最大のバッチサイズ, 最も古いリクエストがバッチが埋まるのを待つ時間, キューに入るリクエストの最大数
+    int max_batchsize = 64;
+    int max_wait_us = 1000;
+    int max_queued = 4096;
+    // Number of workers running batches at once on the shared network, each with its own execution context
+    // 共有するネットワーク上で同時にバッチを実行するワーカーの数. それぞれが実行コンテキストをもつ
+    int workers = 1;
+    // Number of clients and requests per client of the built-in benchmark (0 clients to serve only)
+    // 組み込みのベンチマークのクライアント数とクライアント毎のリクエスト数 (クライアント0の場合はサーバーのみ)
+    int bench_clients = 0;
+    int bench_requests = 1000;
+};
+
+#ifdef EDUCNN_HAS_SERVER
+
+// -----------------------------------------------------------------------------
+// HTTP messages
+// -----------------------------------------------------------------------------
+
+bool write_all(int fd, const char *data, size_t bytes) {
+    while (bytes > 0) {
+        const ssize_t n = ::send(fd, data, bytes, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        bytes -= (size_t)n;
+    }
+    return true;
+}
+
+/**
+ * HTTP message read from a connection. Bytes received after the message are left in "buffer" for the next one.
+ * 接続から読んだHTTPメッセージ. メッセージの後に受け取ったバイトは次のもののために"buffer"に残す
+ */
+struct HttpMessage {
+    std::string start_line;
+    std::string headers;  // in lower case
+    std::string body;
+
+    bool keep_alive() const {
+        return headers.find("connection: close") == std::string::npos;
+    }
+};
+
+bool read_message(int fd, std::string &buffer, HttpMessage &message) {
+    char chunk[16384];
+    size_t head_end;
+    while ((head_end = buffer.find("\r\n\r\n")) == std::string::npos) {
+        const ssize_t n = ::recv(fd, chunk, sizeof(chunk), 0);
+        if (n <= 0 || buffer.size() > 65536) {
+            return false;
+        }
+        buffer.append(chunk, (size_t)n);
+    }
+
+    const size_t line_end = buffer.find("\r\n");
+    message.start_line = buffer.substr(0, line_end);
+    message.headers = buffer.substr(line_end + 2, head_end - line_end);
+    std::transform(message.headers.begin(), message.headers.end(), message.headers.begin(), ::tolower);
+
+    size_t content_length = 0;
+    const size_t field = message.headers.find("content-length:");
+    if (field != std::string::npos) {
+        content_length = (size_t)std::strtoull(message.headers.c_str() + field + 15, nullptr, 10);
+    }
+    if (content_length > (1 << 20)) {
+        return false;
+    }
+
+    const size_t message_bytes = head_end + 4 + content_length;
+    while (buffer.size() < message_bytes) {
+        const ssize_t n = ::recv(fd, chunk, sizeof(chunk), 0);
+        if (n <= 0) {
+            return false;
+        }
+        buffer.append(chunk, (size_t)n);
+    }
+    message.body = buffer.substr(head_end + 4, content_length);
+    buffer.erase(0, message_bytes);
+    return true;
+}
+
+bool write_response(int fd, int status, const char *reason, const std::string &body) {
+    char head[256];
+    snprintf(head, sizeof(head),
+             "HTTP/1.1 %d %s\r\nContent-Type: application/json\r\nContent-Length: %zu\r\n\r\n", status, reason,
+             body.size());
+    std::string message(head);
+    message += body;
+    return write_all(fd, message.data(), message.size());
+}
+
+std::string stats_json(const LatencyStats::Summary &s) {
+    char json[512];
+    snprintf(json, sizeof(json),
+             "{\"requests\": %lld, \"batches\": %lld, \"mean_batchsize\": %.2f, \"p50_us\": %.1f, "
+             "\"p99_us\": %.1f, \"max_us\": %.1f, \"throughput\": %.1f}\n",
+             s.n_requests, s.n_batches, s.mean_batchsize, s.p50, s.p99, s.max, s.throughput);
+    return json;
+}
+
+// -----------------------------------------------------------------------------
+// Server
+// -----------------------------------------------------------------------------
+
+/**
+ * Serve the requests of a connection until the client closes it. Each connection has its own thread, which
+ * blocks in the batcher while the batch of its request runs.
+ * クライアントが閉じるまで接続のリクエストを処理する. 各接続は専用のスレッドをもち, リクエストのバッチが
+ * 計算される間はバッチャの中で待つ
+ */
+template <typename Scalar>
+void handle_connection(int fd, DynamicBatcherT<Scalar> &batcher, int n_features) {
+    std::string buffer;
+    HttpMessage request;
+    std::vector<Scalar> output((size_t)batcher.n_outputs());
+    bool open = true;
+    while (open && read_message(fd, buffer, request)) {
+        open = request.keep_alive();
+        if (request.start_line.compare(0, 14, "POST /predict ") == 0) {
+            if ((int)request.body.size() != n_features) {
+                const std::string error = "{\"error\": \"image must have " + std::to_string(n_features) + " bytes\"}\n";
+                open = write_response(fd, 400, "Bad Request", error) && open;
+                continue;
+            }
+            if (!batcher.infer((const uint8_t *)request.body.data(), output.data())) {
+                open = write_response(fd, 503, "Service Unavailable", "{\"error\": \"queue is full\"}\n") && open;
+                continue;
+            }
+
+            const int label = (int)(std::max_element(output.begin(), output.end()) - output.begin());
+            std::string json = "{\"label\": " + std::to_string(label) + ", \"probabilities\": [";
+            for (size_t j = 0; j < output.size(); j++) {
+                char value[32];
+                snprintf(value, sizeof(value), j == 0 ? "%.6f" : ", %.6f", std::exp((double)output[j]));
+                json += value;
+            }
+            json += "]}\n";
+            open = write_response(fd, 200, "OK", json) && open;
+        } else if (request.start_line.compare(0, 11, "GET /stats ") == 0) {
+            open = write_response(fd, 200, "OK", stats_json(batcher.stats().summary())) && open;
+        } else {
+            open = write_response(fd, 404, "Not Found", "{\"error\": \"not found\"}\n") && open;
+        }
+    }
+    close(fd);
+}
+
+// Listen on the Unix domain socket if its path is given, and otherwise on the loopback port
+// ソケットのパスが与えられればUnixドメインソケットで, そうでなければループバックのポートで待ち受ける
+int open_listener(const ServeOptions &options) {
+    int listener;
+    bool bound;
+    if (!options.socket_path.empty()) {
+        sockaddr_un address;
+        std::memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        std::strncpy(address.sun_path, options.socket_path.c_str(), sizeof(address.sun_path) - 1);
+        unlink(options.socket_path.c_str());
+        listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        bound = listener >= 0 && bind(listener, (sockaddr *)&address, sizeof(address)) == 0;
+    } else {
+        sockaddr_in address;
+        std::memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_port = htons((uint16_t)options.port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        listener = socket(AF_INET, SOCK_STREAM, 0);
+        if (listener >= 0) {
+            const int on = 1;
+            setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        }
+        bound = listener >= 0 && bind(listener, (sockaddr *)&address, sizeof(address)) == 0;
+    }
+    if (!bound || listen(listener, 128) != 0) {
+        fprintf(stderr, "Failed to listen on %s!\n",
+                options.socket_path.empty() ? std::to_string(options.port).c_str() : options.socket_path.c_str());
+        exit(1);
+    }
+    return listener;
+}
+
+int connect_to(const ServeOptions &options) {
+    int fd;
+    if (!options.socket_path.empty()) {
+        sockaddr_un address;
+        std::memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        std::strncpy(address.sun_path, options.socket_path.c_str(), sizeof(address.sun_path) - 1);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (connect(fd, (sockaddr *)&address, sizeof(address)) != 0) {
+            close(fd);
+            return -1;
+        }
+    } else {
+        sockaddr_in address;
+        std::memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_port = htons((uint16_t)options.port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(fd, (sockaddr *)&address, sizeof(address)) != 0) {
+            close(fd);
+            return -1;
+        }
+        const int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+    return fd;
+}
+
+/**
+ * Accept connections until "listener" is shut down, each served on its own thread. "n_open" counts the
+ * connections being served, which must reach zero before the batcher is destroyed.
+ * "listener"が閉じられるまで接続を受け付け, それぞれを専用のスレッドで処理する. "n_open"は処理中の接続を
+ * 数え, バッチャを破棄する前に0にならなければならない
+ */
+template <typename Scalar>
+void accept_connections(int listener, DynamicBatcherT<Scalar> &batcher, int n_features, std::atomic<int> &n_open) {
+    for (;;) {
+        const int fd = accept(listener, nullptr, nullptr);
+        if (fd < 0) {
+            return;
+        }
+        const int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        n_open++;
+        std::thread([fd, &batcher, n_features, &n_open] {
+            handle_connection(fd, batcher, n_features);
+            n_open--;
+        }).detach();
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Benchmark clients
+// -----------------------------------------------------------------------------
+
+/**
+ * Post the test images from "bench_clients" clients at once, each waiting for its response before posting
+ * the next image, and report the end-to-end latency, the throughput and the accuracy
+ * "bench_clients"個のクライアントから同時にテスト画像を送る. 各クライアントは応答を待ってから次の画像を
+ * 送る. 端から端までのレイテンシ, スループット, 精度を報告する
+ */
+void run_clients(const ServeOptions &options) {
+    const IdxDataset test_set = mnist::test_set();
+    const int n_clients = options.bench_clients;
+    const int n_requests = options.bench_requests;
+    std::vector<std::vector<double>> latencies((size_t)n_clients);
+    std::vector<int> n_correct((size_t)n_clients, 0);
+    std::vector<int> n_failed((size_t)n_clients, 0);
+
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> clients;
+    for (int c = 0; c < n_clients; c++) {
+        clients.emplace_back([&, c] {
+            latencies[c].reserve((size_t)n_requests);
+            const int fd = connect_to(options);
+            if (fd < 0) {
+                n_failed[c] = n_requests;
+                return;
+            }
+
+            char head[256];
+            std::string buffer;
+            HttpMessage response;
+            for (int r = 0; r < n_requests; r++) {
+                const int i = (c + r * n_clients) % test_set.size();
+                const int n_pixels = test_set.n_features();
+                snprintf(head, sizeof(head),
+                         "POST /predict HTTP/1.1\r\nHost: localhost\r\nContent-Type: application/octet-stream\r\n"
+                         "Content-Length: %d\r\n\r\n",
+                         n_pixels);
+                std::string request(head);
+                request.append((const char *)test_set.images().image(i), (size_t)n_pixels);
+
+                const auto sent = std::chrono::steady_clock::now();
+                if (!write_all(fd, request.data(), request.size()) || !read_message(fd, buffer, response)) {
+                    n_failed[c] += n_requests - r;
+                    break;
+                }
+                const auto received = std::chrono::steady_clock::now();
+
+                const size_t field = response.body.find("\"label\": ");
+                if (response.start_line.find(" 200 ") == std::string::npos || field == std::string::npos) {
+                    n_failed[c]++;
+                    continue;
+                }
+                latencies[c].push_back(std::chrono::duration<double, std::micro>(received - sent).count());
+                if (std::atoi(response.body.c_str() + field + 9) == test_set.labels().label(i)) {
+                    n_correct[c]++;
+                }
+            }
+            close(fd);
+        });
+    }
+    for (auto &client : clients) {
+        client.join();
+    }
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    int correct = 0, failed = 0;
+    std::vector<double> sorted;
+    for (int c = 0; c < n_clients; c++) {
+        correct += n_correct[c];
+        failed += n_failed[c];
+        sorted.insert(sorted.end(), latencies[c].begin(), latencies[c].end());
+    }
+    std::sort(sorted.begin(), sorted.end());
+    printf("Clients: %d x %d requests (%d failed)\n", n_clients, n_requests, failed);
+    if (!sorted.empty()) {
+        printf("End-to-end latency: p50 %.1f us, p99 %.1f us\n", LatencyStats::percentile(sorted, 0.50),
+               LatencyStats::percentile(sorted, 0.99));
+    }
+    printf("Throughput: %.1f requests/sec\n", sorted.size() / seconds);
+    printf("Accuracy: %.2f %%\n", 100.0 * correct / std::max((size_t)1, sorted.size()));
+}
+
+template <typename Scalar>
+void serve(const ServeOptions &options) {
+    CompileOptions compile_options;
+    compile_options.fuse = options.fuse;
+    compile_options.training = false;
+    auto network = (options.cnn ? cnn_builder<Scalar>() : mlp_builder<Scalar>()).build(compile_options);
+    if (!network) {
+        exit(1);
+    }
+    if (!options.load_file.empty()) {
+        if (!network->load(options.load_file)) {
+            exit(1);
+        }
+    } else {
+        printf("No checkpoint is loaded, and the parameters are untrained\n");
+    }
+
+    const int n_features = network->n_inputs();
+    DynamicBatcherT<Scalar> batcher(*network, n_features, options.max_batchsize, options.max_wait_us,
+                                    options.workers, options.max_queued);
+    const int listener = open_listener(options);
+    printf("Network: %s (%s)\n", options.cnn ? "CNN" : "MLP", options.float32 ? "float32" : "float64");
+    printf("Batching: up to %d requests, waiting up to %d us\n", batcher.max_batchsize(), options.max_wait_us);
+    printf("Workers: %d (%.2f MB of buffers each)\n", batcher.n_workers(),
+           batcher.context_bytes() / (1024.0 * 1024.0));
+    if (options.socket_path.empty()) {
+        printf("Listening on http://127.0.0.1:%d\n", options.port);
+    } else {
+        printf("Listening on %s\n", options.socket_path.c_str());
+    }
+    fflush(stdout);
+
+    std::atomic<int> n_open(0);
+    if (options.bench_clients <= 0) {
+        accept_connections(listener, batcher, n_features, n_open);
+        return;
+    }
+
+    std::thread server([&] { accept_connections(listener, batcher, n_features, n_open); });
+    run_clients(options);
+    shutdown(listener, SHUT_RDWR);
+    close(listener);
+    server.join();
+    while (n_open.load() > 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    if (!options.socket_path.empty()) {
+        unlink(options.socket_path.c_str());
+    }
+
+    const LatencyStats::Summary s = batcher.stats().summary();
+    printf("Server latency: p50 %.1f us, p99 %.1f us, max %.1f us\n", s.p50, s.p99, s.max);
+    printf("Batches: %lld (mean batch size %.2f)\n", s.n_batches, s.mean_batchsize);
+}
+
+#endif  // EDUCNN_HAS_SERVER
+
+int main(int argc, char **argv) {
+    ServeOptions options;
+    int threads = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--mlp") == 0) {
+            options.cnn = false;
+        } else if (strcmp(argv[i], "--cnn") == 0) {
+            options.cnn = true;
+        } else if (strcmp(argv[i], "--fuse") == 0) {
+            options.fuse = true;
+        } else if (strcmp(argv[i], "--float32") == 0) {
+            options.float32 = true;
+        } else if (strcmp(argv[i], "--load") == 0 && i + 1 < argc) {
+            options.load_file = argv[++i];
+        } else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            options.port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--socket") == 0 && i + 1 < argc) {
+            options.socket_path = argv[++i];
+        } else if (strcmp(argv[i], "--max-batch") == 0 && i + 1 < argc) {
+            options.max_batchsize = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--max-wait-us") == 0 && i + 1 < argc) {
+            options.max_wait_us = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--max-queued") == 0 && i + 1 < argc) {
+            options.max_queued = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            options.workers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc) {
+            options.bench_clients = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--requests") == 0 && i + 1 < argc) {
+            options.bench_requests = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "Unknown flag \"%s\" is specified!\n", argv[i]);
+            exit(1);
+        }
+    }
+
+    if (options.max_batchsize <= 0 || options.max_wait_us < 0 || options.max_queued <= 0 || options.workers <= 0) {
+        fprintf(stderr, "Batch size, queue length and workers must be positive, and waiting time must not be "
+                        "negative!\n");
+        exit(1);
+    }
+    if (options.bench_clients < 0 || options.bench_requests <= 0) {
+        fprintf(stderr, "Numbers of clients and requests must be positive!\n");
+        exit(1);
+    }
+    if (threads < 0) {
+        fprintf(stderr, "Number of threads must be positive!\n");
+        exit(1);
+    }
+    if (threads > 0) {
+        set_parallel_thread_count(threads);
+    }
+
+#ifdef EDUCNN_HAS_SERVER
+    if (options.float32) {
+        serve<float>(options);
+    } else {
+        serve<double>(options);
+    }
+#else
+    fprintf(stderr, "educnn_serve needs POSIX sockets!\n");
+    exit(1);
+#endif
+    return 0;
+}
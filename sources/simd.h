@@ -0,0 +1,151 @@
+#ifdef _MSC_VER
+#pragma once
+#endif
+
+#ifndef _SIMD_H_
+#define _SIMD_H_
+
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define SIMD_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+// Functions with these attributes can use AVX2/AVX-512 intrinsics regardless of the compiler flags.
+// They must be called only after the CPU support is checked with "simd_level()".
+// これらの属性をもつ関数ではコンパイルオプションに関係なくAVX2/AVX-512の組み込み関数を使える.
+// ただし, 呼び出す前に"simd_level()"でCPUの対応を確認すること
+#if defined(SIMD_X86) && (defined(__GNUC__) || defined(__clang__))
+#define SIMD_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define SIMD_TARGET_AVX512 __attribute__((target("avx512f")))
+#define SIMD_TARGET_VNNI __attribute__((target("avx2,avx512f,avx512vl,avx512vnni")))
+#else
+#define SIMD_TARGET_AVX2
+#define SIMD_TARGET_AVX512
+#define SIMD_TARGET_VNNI
+#endif
+
+/**
+ * Instruction sets available for hand-vectorized kernels
+ * 手動でベクトル化したカーネルで利用できる命令セット
+ */
+enum class SimdLevel {
+    Scalar = 0,
+    AVX2,
+    AVX512,
+};
+
+inline const char *simd_level_name(SimdLevel level) {
+    switch (level) {
+    case SimdLevel::AVX2:
+        return "avx2";
+    case SimdLevel::AVX512:
+        return "avx512";
+    default:
+        return "scalar";
+    }
+}
+
+/**
+ * Detect instruction sets supported by both of CPU and OS
+ * CPUとOSの両方が対応している命令セットを調べる
+ */
+inline SimdLevel detect_simd_level() {
+#if defined(SIMD_X86) && defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    const int n_ids = info[0];
+    if (n_ids < 7) {
+        return SimdLevel::Scalar;
+    }
+
+    __cpuid(info, 1);
+    const bool osxsave = (info[2] & (1 << 27)) != 0;
+    const bool fma = (info[2] & (1 << 12)) != 0;
+    if (!osxsave) {
+        return SimdLevel::Scalar;
+    }
+
+    const unsigned long long xcr0 = _xgetbv(0);
+    __cpuidex(info, 7, 0);
+    const bool avx2 = (info[1] & (1 << 5)) != 0;
+    const bool avx512f = (info[1] & (1 << 16)) != 0;
+    if (avx512f && (xcr0 & 0xe6) == 0xe6) {
+        return SimdLevel::AVX512;
+    }
+    if (avx2 && fma && (xcr0 & 0x6) == 0x6) {
+        return SimdLevel::AVX2;
+    }
+    return SimdLevel::Scalar;
+#elif defined(SIMD_X86) && (defined(__GNUC__) || defined(__clang__))
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        return SimdLevel::AVX512;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return SimdLevel::AVX2;
+    }
+    return SimdLevel::Scalar;
+#else
+    return SimdLevel::Scalar;
+#endif
+}
+
+/**
+ * Instruction set used by the kernels. It can be lowered with the environment variable
+ * "EDUCNN_SIMD" (= scalar, avx2 or avx512), e.g., to compare with the scalar fallback.
+ * カーネルで使用する命令セット. 環境変数"EDUCNN_SIMD" (= scalar, avx2, avx512) で
+ * 下位の命令セットを指定でき, スカラー実装との比較などに使える
+ */
+inline SimdLevel simd_level() {
+    static const SimdLevel level = []() {
+        SimdLevel supported = detect_simd_level();
+        const char *env = std::getenv("EDUCNN_SIMD");
+        if (env != nullptr) {
+            SimdLevel requested = supported;
+            if (std::strcmp(env, "scalar") == 0) {
+                requested = SimdLevel::Scalar;
+            } else if (std::strcmp(env, "avx2") == 0) {
+                requested = SimdLevel::AVX2;
+            } else if (std::strcmp(env, "avx512") == 0) {
+                requested = SimdLevel::AVX512;
+            }
+            if ((int)requested < (int)supported) {
+                supported = requested;
+            }
+        }
+        return supported;
+    }();
+    return level;
+}
+
+/**
+ * Check if AVX-512 VNNI instructions (with 256-bit vectors) can be used in addition to "simd_level()".
+ * "simd_level()"に加えてAVX-512 VNNI命令 (256ビットのベクトル) が使えるかを調べる
+ */
+inline bool simd_has_vnni() {
+    static const bool vnni = []() {
+        if (simd_level() != SimdLevel::AVX512) {
+            return false;
+        }
+#if defined(SIMD_X86) && defined(_MSC_VER)
+        int info[4];
+        __cpuidex(info, 7, 0);
+        const bool avx512vl = (info[1] & (1 << 31)) != 0;
+        const bool avx512vnni = (info[2] & (1 << 11)) != 0;
+        return avx512vl && avx512vnni;
+#elif defined(SIMD_X86) && (defined(__GNUC__) || defined(__clang__))
+        return __builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("avx512vnni");
+#else
+        return false;
+#endif
+    }();
+    return vnni;
+}
+
+#endif  // _SIMD_H_
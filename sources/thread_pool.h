@@ -0,0 +1,330 @@
+#ifdef _MSC_VER
+#pragma once
+#endif
+
+#ifndef _THREAD_POOL_H_
+#define _THREAD_POOL_H_
+
+#include <cstdlib>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <condition_variable>
+
+#include "common.h"
+
+/**
+ * Persistent work-stealing thread pool, on which the parallel loops of the layers run (see "parallel.h").
+ * The pool has "n_threads - 1" workers, and the thread submitting a job works as the remaining one. Each
+ * worker has a deque of tasks, from whose back it pops its own tasks while idle workers steal from the front
+ * of the others. Threads outside the pool have no deque of their own, and spread the tasks of their jobs over
+ * all the deques (including one more for them) in turn. A thread waiting for its job executes or steals other
+ * tasks meanwhile, so that nested jobs never deadlock. Jobs and tasks live on the stack and the deques have a
+ * fixed capacity, hence submitting a job does not allocate. Workers and waiting threads sleep when there is
+ * no task for a while, so that they do not take cores from the others. With a single thread, there are no
+ * workers and jobs run inline.
+ * レイヤーの並列ループを実行する常駐型のワークスティーリング・スレッドプール ("parallel.h"を参照).
+ * プールは"n_threads - 1"個のワーカーをもち, ジョブを投入したスレッドが残りの1つとして働く. 各ワーカーは
+ * タスクの両端キューをもち, 自身のタスクは末尾から取り出し, 手の空いたワーカーは他のキューの先頭から盗む.
+ * プール外のスレッドは自身のキューをもたず, ジョブのタスクを (それらのためのもう1つを含む) 全てのキューに
+ * 順に分配する. ジョブを待つスレッドはその間に他のタスクを実行または盗むので, 入れ子のジョブでも
+ * デッドロックしない. ジョブとタスクはスタック上に置き, キューの容量は固定なので, ジョブの投入でメモリを
+ * 確保することはない. ワーカーと待機中のスレッドはしばらくタスクがなければ眠り, 他のスレッドのコアを
+ * 奪わない. スレッドが1つであればワーカーはなく, ジョブはその場で実行する
+ */
+class ThreadPool : private Uncopyable {
+public:
+    // Function running the "index"-th task of a job on "context"
+    // "context"に対してジョブの"index"番目のタスクを実行する関数
+    using TaskFunction = void (*)(const void *context, int index);
+
+    explicit ThreadPool(int n_threads)
+        : n_threads_(std::max(1, n_threads))
+        , queues_(n_threads_) {
+        for (int i = 1; i < n_threads_; i++) {
+            workers_.emplace_back(&ThreadPool::work, this, i);
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex_);
+            stop_ = true;
+        }
+        wake_.notify_all();
+        for (auto &worker : workers_) {
+            worker.join();
+        }
+    }
+
+    /**
+     * Run "n_tasks" tasks of "function" on "context" and wait for all of them. The calling thread runs the
+     * first task itself, and the others are left to be stolen.
+     * "context"に対して"function"の"n_tasks"個のタスクを実行し, その全てを待つ. 呼び出したスレッドは
+     * 最初のタスクを自ら実行し, 他のタスクは盗まれるよう残しておく
+     */
+    void run(TaskFunction function, const void *context, int n_tasks) {
+        if (n_tasks <= 0) {
+            return;
+        }
+
+        Job job;
+        job.remaining.store(n_tasks);
+        const int queue = queue_index();
+        const bool external = queue == 0;
+        const int first = external ? (int)(next_external_queue_.fetch_add(n_tasks - 1) % (unsigned)n_threads_) : 0;
+        for (int t = 1; t < n_tasks; t++) {
+            submit(external ? (first + t - 1) % n_threads_ : queue, Task(function, context, t, &job));
+        }
+        execute(Task(function, context, 0, &job));
+        wait(job, queue);
+    }
+
+    int n_threads() const {
+        return n_threads_;
+    }
+
+    /**
+     * Pool shared by the whole program. The number of threads is taken from the environment variable
+     * "EDUCNN_NUM_THREADS" if it is set, and otherwise from the hardware.
+     * プログラム全体で共有するプール. スレッド数は環境変数"EDUCNN_NUM_THREADS"があればその値,
+     * なければハードウェアから決める
+     */
+    static ThreadPool &global() {
+        return *global_pool();
+    }
+
+    /**
+     * Replace the shared pool with one of "n_threads" threads. This must not be called while jobs are running.
+     * 共有するプールを"n_threads"スレッドのものに置き換える. ジョブの実行中に呼んではならない
+     */
+    static void reset_global(int n_threads) {
+        std::unique_ptr<ThreadPool> &pool = global_pool();
+        if (pool->n_threads() != std::max(1, n_threads)) {
+            pool.reset();
+            pool.reset(new ThreadPool(n_threads));
+        }
+    }
+
+private:
+    // Tasks of a job which have not finished yet
+    // ジョブのうちまだ終わっていないタスクの数
+    struct Job {
+        std::atomic<int> remaining{ 0 };
+    };
+
+    struct Task {
+        Task() = default;
+        Task(TaskFunction function, const void *context, int index, Job *job)
+            : function(function)
+            , context(context)
+            , index(index)
+            , job(job) {
+        }
+
+        TaskFunction function = nullptr;
+        const void *context = nullptr;
+        int index = 0;
+        Job *job = nullptr;
+    };
+
+    /**
+     * Double-ended queue of tasks in a ring buffer of a fixed capacity. Operations are short and are
+     * guarded by a mutex.
+     * 固定容量のリングバッファ上のタスクの両端キュー. 操作は短いのでミューテックスで保護する
+     */
+    class TaskQueue : private Uncopyable {
+    public:
+        TaskQueue()
+            : tasks_((size_t)capacity) {
+        }
+
+        bool push_back(const Task &task) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (tail_ - head_ == capacity) {
+                return false;
+            }
+            tasks_[tail_++ % capacity] = task;
+            return true;
+        }
+
+        bool pop_back(Task &task) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (head_ == tail_) {
+                return false;
+            }
+            task = tasks_[--tail_ % capacity];
+            return true;
+        }
+
+        bool pop_front(Task &task) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (head_ == tail_) {
+                return false;
+            }
+            task = tasks_[head_++ % capacity];
+            return true;
+        }
+
+    private:
+        static const size_t capacity = 1024;
+
+        std::mutex mutex_;
+        std::vector<Task> tasks_;
+        size_t head_ = 0;
+        size_t tail_ = 0;
+    };
+
+    // Worker of the pool running on the current thread, if any
+    // 現在のスレッドで動くプールのワーカー (あれば)
+    struct WorkerIdentity {
+        const ThreadPool *pool = nullptr;
+        int index = 0;
+    };
+
+    static WorkerIdentity &identity() {
+        static thread_local WorkerIdentity worker;
+        return worker;
+    }
+
+    static std::unique_ptr<ThreadPool> &global_pool() {
+        static std::unique_ptr<ThreadPool> pool(new ThreadPool(default_thread_count()));
+        return pool;
+    }
+
+    static int default_thread_count() {
+        const char *env = std::getenv("EDUCNN_NUM_THREADS");
+        if (env != nullptr && std::atoi(env) > 0) {
+            return std::atoi(env);
+        }
+        return std::max(1, (int)std::thread::hardware_concurrency());
+    }
+
+    // Deque of the current thread: its own one for workers, and the one for outside threads (0) for the others,
+    // from which they take tasks first while waiting
+    // 現在のスレッドのキュー: ワーカーは自身のもの, それ以外はプール外のスレッドのもの (0). 後者は待機中に
+    // まずここからタスクを取る
+    int queue_index() const {
+        const WorkerIdentity &worker = identity();
+        return worker.pool == this ? worker.index : 0;
+    }
+
+    void submit(int queue, const Task &task) {
+        if (n_threads_ == 1 || !queues_[queue].push_back(task)) {
+            execute(task);
+            return;
+        }
+
+        // Either a sleeping worker sees the new task in its wait condition, or it is counted here and woken up
+        // 眠るワーカーは待機条件で新しいタスクを見るか, ここで数えられて起こされるかのいずれか
+        n_queued_++;
+        if (n_sleeping_.load() > 0) {
+            std::lock_guard<std::mutex> lock(sleep_mutex_);
+            wake_.notify_all();
+        }
+    }
+
+    // Pop a task of the own deque, or steal one from the front of the others
+    // 自身のキューからタスクを取り出すか, 他のキューの先頭から盗む
+    bool take(int queue, Task &task) {
+        if (queues_[queue].pop_back(task)) {
+            n_queued_--;
+            return true;
+        }
+        for (int i = 1; i < n_threads_; i++) {
+            if (queues_[(queue + i) % n_threads_].pop_front(task)) {
+                n_queued_--;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // The job may be destroyed by its waiting thread as soon as its last task is counted down, so that only
+    // the pool is touched afterwards to wake up the thread if it sleeps
+    // 最後のタスクが数え終わると, ジョブは待っているスレッドによって直ちに破棄されうるので, その後は
+    // スレッドが眠っていれば起こすためにプールにのみ触れる
+    void execute(const Task &task) {
+        task.function(task.context, task.index);
+        if (task.job->remaining.fetch_sub(1) == 1 && n_sleeping_.load() > 0) {
+            std::lock_guard<std::mutex> lock(sleep_mutex_);
+            wake_.notify_all();
+        }
+    }
+
+    /**
+     * Execute or steal tasks until the job finishes. Once no task is found for a while, the thread sleeps
+     * as the workers do until either the job finishes or a task is submitted.
+     * ジョブが終わるまでタスクを実行または盗む. しばらくタスクが見つからなければ, ワーカーと同様に
+     * ジョブが終わるかタスクが投入されるまで眠る
+     */
+    void wait(const Job &job, int queue) {
+        Task task;
+        int spin = 0;
+        while (job.remaining.load() > 0) {
+            if (take(queue, task)) {
+                execute(task);
+                spin = 0;
+            } else if (++spin < spin_count) {
+                std::this_thread::yield();
+            } else {
+                std::unique_lock<std::mutex> lock(sleep_mutex_);
+                n_sleeping_++;
+                wake_.wait(lock, [&] { return job.remaining.load() == 0 || n_queued_.load() > 0; });
+                n_sleeping_--;
+                spin = 0;
+            }
+        }
+    }
+
+    void work(int index) {
+        identity().pool = this;
+        identity().index = index;
+
+        Task task;
+        for (;;) {
+            // Spin for a while before sleeping, since jobs of the layers come one after another
+            // レイヤーのジョブは次々に来るので, 眠る前にしばらく待つ
+            bool found = false;
+            for (int spin = 0; spin < spin_count && !found; spin++) {
+                found = take(index, task);
+                if (!found) {
+                    std::this_thread::yield();
+                }
+            }
+            if (found) {
+                execute(task);
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(sleep_mutex_);
+            n_sleeping_++;
+            wake_.wait(lock, [this] { return stop_ || n_queued_.load() > 0; });
+            n_sleeping_--;
+            if (stop_) {
+                return;
+            }
+        }
+    }
+
+    static const int spin_count = 256;
+
+    int n_threads_ = 1;
+    std::vector<TaskQueue> queues_;
+    std::vector<std::thread> workers_;
+
+    // Deque to which threads outside the pool push their next task
+    // プール外のスレッドが次のタスクを入れるキュー
+    std::atomic<unsigned> next_external_queue_{ 0 };
+
+    std::atomic<int> n_queued_{ 0 };
+    std::atomic<int> n_sleeping_{ 0 };
+    std::mutex sleep_mutex_;
+    std::condition_variable wake_;
+    bool stop_ = false;
+};
+
+#endif  // _THREAD_POOL_H_
@@ -7,12 +7,14 @@
 
 #if __cplusplus > 199711L
 #include <chrono>
-typedef std::chrono::time_point<std::chrono::system_clock> time_type;
+// Monotonic clock, which is not affected by adjustments of the system time, with the full resolution of the clock
+// システム時刻の調整の影響を受けない単調な時計. 時計の分解能をそのまま用いる
+typedef std::chrono::time_point<std::chrono::steady_clock> time_type;
 inline time_type tick() {
-    return std::chrono::system_clock::now();
+    return std::chrono::steady_clock::now();
 }
 inline double to_duration(time_type start, time_type end) {
-    return std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() / 1000.0;
+    return std::chrono::duration<double>(end - start).count();
 }
 #else
 #include <ctime>
@@ -0,0 +1,412 @@
+#ifdef _MSC_VER
+#pragma once
+#endif
+
+#ifndef _TRANSPORT_H_
+#define _TRANSPORT_H_
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <iostream>
+
+#include "common.h"
+
+#if !defined(_WIN32) && !defined(__WIN32__)
+#define EDUCNN_HAS_TRANSPORT 1
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#endif
+
+/**
+ * @brief: Base class for transports connecting the processes of a ring. Each rank sends messages to the next
+ * rank and receives them from the previous one, in order. Messages of up to "message_bytes" are buffered, so
+ * that every rank can send one before receiving without a deadlock.
+ * リングをなすプロセスを結ぶ通信路の基底クラス. 各ランクは次のランクにメッセージを送り, 前のランクから順に
+ * 受け取る. "message_bytes"以下のメッセージはバッファされるので, 全ランクが受信前に1つ送ってもデッドロック
+ * しない
+ */
+class AbstractTransport : private Uncopyable {
+public:
+    static const size_t message_bytes = 16384;
+    // Time to wait for the other ranks to start and connect
+    // 他のランクが起動して接続するのを待つ時間
+    static std::chrono::milliseconds connect_timeout() {
+        return connect_timeout_value();
+    }
+    static void set_connect_timeout(std::chrono::milliseconds timeout) {
+        connect_timeout_value() = timeout;
+    }
+
+    AbstractTransport(int rank, int n_ranks)
+        : rank_(rank)
+        , n_ranks_(n_ranks) {
+        Assertion(0 <= rank && rank < n_ranks, "invalid rank!!");
+    }
+    virtual ~AbstractTransport() {
+    }
+
+    /**
+     * Send "bytes" bytes to the next rank, and receive them from the previous rank. Returns false if the
+     * connection is lost.
+     * 次のランクに"bytes"バイト送る, または前のランクから受け取る. 接続が失われた場合はfalseを返す
+     */
+    virtual bool send(const void *data, size_t bytes) = 0;
+    virtual bool recv(void *data, size_t bytes) = 0;
+
+    int rank() const {
+        return rank_;
+    }
+    int n_ranks() const {
+        return n_ranks_;
+    }
+    int next_rank() const {
+        return (rank_ + 1) % n_ranks_;
+    }
+    int previous_rank() const {
+        return (rank_ + n_ranks_ - 1) % n_ranks_;
+    }
+
+protected:
+    int rank_ = 0;
+    int n_ranks_ = 1;
+
+private:
+    static std::chrono::milliseconds &connect_timeout_value() {
+        static std::chrono::milliseconds timeout(60000);
+        return timeout;
+    }
+};
+
+#if defined(EDUCNN_HAS_TRANSPORT)
+
+/**
+ * Transport over POSIX shared memory for the processes on one host. Each rank creates an inbox named after
+ * "key" and its rank, which is a single-producer single-consumer ring buffer written by the previous rank.
+ * Waiting ranks spin and yield the CPU. Since shared memory tells nothing when a peer dies, the channels hold
+ * the process IDs of both ends, and waiting ranks periodically check that their peers are still alive.
+ * 同じホスト上のプロセスのためのPOSIX共有メモリによる通信路. 各ランクは"key"とランクから名付けた受信箱を作る.
+ * 受信箱は前のランクが書き込む単一生産者・単一消費者のリングバッファである. 待機中のランクはスピンして
+ * CPUを譲る. 共有メモリは相手の終了を知らせないので, 通信路は両端のプロセスIDをもち, 待機中のランクは
+ * 定期的に相手がまだ生きているかを確かめる
+ */
+class SharedMemoryTransport : public AbstractTransport {
+public:
+    SharedMemoryTransport(int rank, int n_ranks, const std::string &key)
+        : AbstractTransport(rank, n_ranks) {
+        if (n_ranks == 1) {
+            return;
+        }
+
+        // Remove an inbox left by a crashed run before creating a new one
+        // 異常終了した実行が残した受信箱を削除してから新しく作る
+        const std::string inbox_name = channel_name(key, rank);
+        shm_unlink(inbox_name.c_str());
+        const int fd = shm_open(inbox_name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd < 0 || ftruncate(fd, sizeof(Channel)) != 0) {
+            std::cerr << "Failed to create shared memory: " << inbox_name << std::endl;
+            exit(1);
+        }
+        inbox_ = map(fd);
+        new (inbox_) Channel();
+        inbox_->reader.store((int32_t)getpid(), std::memory_order_relaxed);
+        inbox_->ready.store(Channel::magic, std::memory_order_release);
+
+        // Wait until the next rank has created its inbox
+        // 次のランクが受信箱を作るまで待つ
+        const std::string outbox_name = channel_name(key, next_rank());
+        const auto deadline = std::chrono::steady_clock::now() + connect_timeout();
+        for (;;) {
+            const int out_fd = shm_open(outbox_name.c_str(), O_RDWR, 0600);
+            struct stat st;
+            if (out_fd >= 0 && fstat(out_fd, &st) == 0 && st.st_size == (off_t)sizeof(Channel)) {
+                outbox_ = map(out_fd);
+                if (outbox_->ready.load(std::memory_order_acquire) == Channel::magic) {
+                    break;
+                }
+                munmap(outbox_, sizeof(Channel));
+                outbox_ = nullptr;
+            } else if (out_fd >= 0) {
+                close(out_fd);
+            }
+            if (std::chrono::steady_clock::now() > deadline) {
+                std::cerr << "Failed to connect to rank " << next_rank() << std::endl;
+                shm_unlink(inbox_name.c_str());
+                exit(1);
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        outbox_->writer.store((int32_t)getpid(), std::memory_order_release);
+
+        // Once the previous rank has sent a message, it has mapped the inbox, whose name is no longer needed.
+        // Removing it now leaves nothing behind even if the process crashes.
+        // 前のランクがメッセージを送ったら受信箱はマップ済みなので, その名前はもう不要である. ここで削除
+        // すれば, プロセスが異常終了しても何も残らない
+        uint8_t hello = 0;
+        const bool connected = send(&hello, 1) && recv(&hello, 1);
+        shm_unlink(inbox_name.c_str());
+        if (!connected) {
+            std::cerr << "Failed to connect to rank " << previous_rank() << std::endl;
+            exit(1);
+        }
+    }
+
+    ~SharedMemoryTransport() {
+        if (outbox_) {
+            munmap(outbox_, sizeof(Channel));
+        }
+        if (inbox_) {
+            munmap(inbox_, sizeof(Channel));
+        }
+    }
+
+    bool send(const void *data, size_t bytes) override {
+        const uint8_t *src = (const uint8_t *)data;
+        while (bytes > 0) {
+            const uint64_t head = outbox_->head.load(std::memory_order_relaxed);
+            auto space = [&] {
+                return Channel::capacity - (size_t)(head - outbox_->tail.load(std::memory_order_acquire));
+            };
+            if (!wait(outbox_->reader, [&] { return space() > 0; })) {
+                return false;
+            }
+            const size_t n = std::min(space(), bytes);
+            copy_in(outbox_, head, src, n);
+            outbox_->head.store(head + n, std::memory_order_release);
+            src += n;
+            bytes -= n;
+        }
+        return true;
+    }
+
+    bool recv(void *data, size_t bytes) override {
+        uint8_t *dst = (uint8_t *)data;
+        while (bytes > 0) {
+            const uint64_t tail = inbox_->tail.load(std::memory_order_relaxed);
+            auto available = [&] { return (size_t)(inbox_->head.load(std::memory_order_acquire) - tail); };
+            if (!wait(inbox_->writer, [&] { return available() > 0; })) {
+                return false;
+            }
+            const size_t n = std::min(available(), bytes);
+            copy_out(inbox_, tail, dst, n);
+            inbox_->tail.store(tail + n, std::memory_order_release);
+            dst += n;
+            bytes -= n;
+        }
+        return true;
+    }
+
+private:
+    struct Channel {
+        static const uint32_t magic = 0x45444343;
+        static const size_t capacity = 4 * message_bytes;
+
+        std::atomic<uint32_t> ready{ 0 };
+        // Process IDs of the rank reading the channel and of the one writing it (0 until it is mapped)
+        // 通信路を読むランクと書き込むランクのプロセスID (マップされるまでは0)
+        std::atomic<int32_t> reader{ 0 };
+        std::atomic<int32_t> writer{ 0 };
+        // Total bytes written by the previous rank and read by this rank, on separate cache lines
+        // 前のランクが書き込んだ, およびこのランクが読んだ総バイト数. 別々のキャッシュラインに置く
+        alignas(64) std::atomic<uint64_t> head{ 0 };
+        alignas(64) std::atomic<uint64_t> tail{ 0 };
+        alignas(64) uint8_t data[capacity];
+    };
+
+    /**
+     * Spin until "ready()" holds, checking every 100 ms that process "peer" is alive. A peer which has not
+     * mapped the channel yet is waited for up to "connect_timeout()". Returns false if the peer is lost.
+     * "ready()"が成り立つまでスピンし, 100ミリ秒毎にプロセス"peer"が生きているかを確かめる. まだ通信路を
+     * マップしていない相手は最大"connect_timeout()"まで待つ. 相手が失われた場合はfalseを返す
+     */
+    template <typename Ready>
+    static bool wait(const std::atomic<int32_t> &peer, Ready &&ready) {
+        using Clock = std::chrono::steady_clock;
+        const Clock::time_point start = Clock::now();
+        Clock::time_point checked = start;
+        while (!ready()) {
+            std::this_thread::yield();
+            const Clock::time_point now = Clock::now();
+            if (now - checked < std::chrono::milliseconds(100)) {
+                continue;
+            }
+            checked = now;
+
+            // The peer may have written its last message just before exiting, which is checked once more
+            // 相手が終了直前に最後のメッセージを書いたことがあるので, もう一度確かめる
+            const pid_t pid = (pid_t)peer.load(std::memory_order_acquire);
+            const bool alive = pid == 0 ? now - start < connect_timeout()
+                                        : kill(pid, 0) == 0 || errno == EPERM;
+            if (!alive) {
+                return ready();
+            }
+        }
+        return true;
+    }
+
+    static std::string channel_name(const std::string &key, int rank) {
+        return "/educnn-" + key + "-" + std::to_string(rank);
+    }
+
+    static Channel *map(int fd) {
+        void *ptr = mmap(nullptr, sizeof(Channel), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (ptr == MAP_FAILED) {
+            std::cerr << "Failed to map shared memory" << std::endl;
+            exit(1);
+        }
+        return (Channel *)ptr;
+    }
+
+    static void copy_in(Channel *channel, uint64_t position, const uint8_t *src, size_t n) {
+        const size_t offset = (size_t)(position % Channel::capacity);
+        const size_t first = std::min(n, Channel::capacity - offset);
+        std::memcpy(channel->data + offset, src, first);
+        std::memcpy(channel->data, src + first, n - first);
+    }
+
+    static void copy_out(const Channel *channel, uint64_t position, uint8_t *dst, size_t n) {
+        const size_t offset = (size_t)(position % Channel::capacity);
+        const size_t first = std::min(n, Channel::capacity - offset);
+        std::memcpy(dst, channel->data + offset, first);
+        std::memcpy(dst + first, channel->data, n - first);
+    }
+
+    Channel *inbox_ = nullptr;
+    Channel *outbox_ = nullptr;
+};
+
+/**
+ * Transport over TCP sockets on the loopback interface, as a stand-in for a network. Rank "r" listens on
+ * port "port + r", connects to the next rank and accepts the previous one.
+ * ネットワークの代わりとなるループバックインターフェース上のTCPソケットによる通信路. ランク"r"はポート
+ * "port + r"で待ち受け, 次のランクに接続し, 前のランクからの接続を受け付ける
+ */
+class SocketTransport : public AbstractTransport {
+public:
+    SocketTransport(int rank, int n_ranks, int port)
+        : AbstractTransport(rank, n_ranks) {
+        if (n_ranks == 1) {
+            return;
+        }
+
+        const int listener = socket(AF_INET, SOCK_STREAM, 0);
+        const int on = 1;
+        sockaddr_in address = loopback(port + rank);
+        if (listener < 0 || setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0 ||
+            bind(listener, (sockaddr *)&address, sizeof(address)) != 0 || listen(listener, 1) != 0) {
+            std::cerr << "Failed to listen on port " << port + rank << std::endl;
+            exit(1);
+        }
+
+        // The next rank may not be listening yet, so that connecting is retried until "connect_timeout()".
+        // Connections are queued by the listener, and hence accepted after connecting without a deadlock.
+        // 次のランクはまだ待ち受けていないことがあるので"connect_timeout()"まで接続を再試行する. 接続は
+        // 待ち受け側でキューに入るので, 接続後に受け付けてもデッドロックしない
+        using Clock = std::chrono::steady_clock;
+        const Clock::time_point deadline = Clock::now() + connect_timeout();
+        address = loopback(port + next_rank());
+        for (;;) {
+            next_ = socket(AF_INET, SOCK_STREAM, 0);
+            if (next_ >= 0 && connect(next_, (sockaddr *)&address, sizeof(address)) == 0) {
+                break;
+            }
+            if (next_ >= 0) {
+                close(next_);
+                next_ = -1;
+            }
+            if (Clock::now() > deadline) {
+                std::cerr << "Failed to connect to rank " << next_rank() << " on port " << port + next_rank()
+                          << std::endl;
+                close(listener);
+                exit(1);
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+
+        // Wait for the previous rank up to the same deadline
+        // 前のランクを同じ期限まで待つ
+        pollfd request = { listener, POLLIN, 0 };
+        int ready = 0;
+        do {
+            const auto remaining =
+                std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now()).count();
+            ready = poll(&request, 1, (int)std::max<long long>(remaining, 0));
+        } while (ready < 0 && errno == EINTR);
+        previous_ = ready > 0 ? accept(listener, nullptr, nullptr) : -1;
+        close(listener);
+        if (previous_ < 0) {
+            std::cerr << "Failed to accept rank " << previous_rank() << " on port " << port + rank << std::endl;
+            exit(1);
+        }
+
+        // Messages are sent as soon as they are written
+        // メッセージは書き込んだらすぐに送る
+        setsockopt(next_, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+
+    ~SocketTransport() {
+        if (next_ >= 0) {
+            close(next_);
+        }
+        if (previous_ >= 0) {
+            close(previous_);
+        }
+    }
+
+    bool send(const void *data, size_t bytes) override {
+        const char *src = (const char *)data;
+        while (bytes > 0) {
+            const ssize_t n = ::send(next_, src, bytes, MSG_NOSIGNAL);
+            if (n <= 0) {
+                return false;
+            }
+            src += n;
+            bytes -= (size_t)n;
+        }
+        return true;
+    }
+
+    bool recv(void *data, size_t bytes) override {
+        char *dst = (char *)data;
+        while (bytes > 0) {
+            const ssize_t n = ::recv(previous_, dst, bytes, 0);
+            if (n <= 0) {
+                return false;
+            }
+            dst += n;
+            bytes -= (size_t)n;
+        }
+        return true;
+    }
+
+private:
+    static sockaddr_in loopback(int port) {
+        sockaddr_in address;
+        std::memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_port = htons((uint16_t)port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        return address;
+    }
+
+    int next_ = -1;
+    int previous_ = -1;
+};
+
+#endif  // EDUCNN_HAS_TRANSPORT
+
+#endif  // _TRANSPORT_H_
@@ -0,0 +1,339 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <random>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "educnn.h"
+
+#if !defined(_WIN32) && !defined(__WIN32__)
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+/**
+ * Multi-process test of the transports and of "DistributedTrainerT". For N = 2, 3 and 4 ranks, forked
+ * processes are connected in a ring and check
+ *   - the sum of "ring_all_reduce" and the values of "ring_broadcast", over several messages;
+ *   - that training a network for some steps leaves all the ranks with identical parameters, which match
+ *     those of a single network trained on the combined batch;
+ *   - that "send" and "recv" fail instead of hanging after the peer has exited;
+ *   - that connecting fails instead of hanging when a peer never starts.
+ * Each check runs over both the shared memory and the TCP transports. Exits with 0 if all of them pass.
+ * 通信路と"DistributedTrainerT"の複数プロセスのテスト. N = 2, 3, 4ランクについて, forkしたプロセスを
+ * リングに結び, 以下を確かめる.
+ *   - 複数のメッセージにわたる"ring_all_reduce"の和と"ring_broadcast"の値
+ *   - ネットワークを何ステップか学習した後, 全ランクのパラメータが一致し, それが全バッチで学習した
+ *     単一のネットワークのパラメータと一致すること
+ *   - 相手が終了した後に"send"と"recv"が停止せずに失敗すること
+ *   - 相手が起動しない場合に接続が停止せずに失敗すること
+ * それぞれを共有メモリとTCPの両方の通信路で行う. 全て通れば0で終了する
+ */
+
+using Scalar = double;
+using Matrix = MatrixT<Scalar>;
+
+static const int n_features = 784;
+static const int n_classes = 10;
+static const int batchsize = 8;
+static const int n_steps = 3;
+
+// Parameters differing from the reference by more than this fail the test
+// 基準との差がこれを超えるパラメータはテストを失敗させる
+static const double tolerance = 1e-12;
+
+// Capacity of the parameters of each rank in the shared memory, which the flat parameters must fit in
+// 共有メモリ上の各ランクのパラメータの容量. 平坦なパラメータはこれに収まらなければならない
+static const size_t max_params = 1 << 18;
+
+struct TestOptions {
+    std::string transport;
+    int n_ranks = 0;
+    int port = 0;
+};
+
+static std::unique_ptr<AbstractTransport> connect(const TestOptions &options, int rank) {
+    if (options.transport == "shm") {
+        return std::unique_ptr<AbstractTransport>(
+            new SharedMemoryTransport(rank, options.n_ranks, "test" + std::to_string(options.port)));
+    }
+    return std::unique_ptr<AbstractTransport>(new SocketTransport(rank, options.n_ranks, options.port));
+}
+
+// Synthetic batch of rank "rank" at step "step", which the reference regenerates
+// ランク"rank"のステップ"step"における合成バッチ. 基準の計算でも同じものを生成する
+static void make_batch(int rank, int step, Matrix &data, Matrix &labels) {
+    std::mt19937 engine(1000 * step + rank);
+    std::uniform_real_distribution<Scalar> pixel(0.0, 1.0);
+    std::uniform_int_distribution<int> label(0, n_classes - 1);
+    data.resize(batchsize, n_features);
+    labels.setZero(batchsize, n_classes);
+    for (int i = 0; i < batchsize; i++) {
+        for (int j = 0; j < n_features; j++) {
+            data(i, j) = pixel(engine);
+        }
+        labels(i, label(engine)) = 1.0;
+    }
+}
+
+/**
+ * Run "body" in "n_ranks" forked processes, and return how many of them exit with 0. The parent never
+ * runs Eigen nor the thread pool, so that every child starts without threads.
+ * "body"を"n_ranks"個のforkしたプロセスで実行し, 0で終了した数を返す. 親はEigenもスレッド
+ * プールも使わないので, 各子はスレッドのない状態から始まる
+ */
+template <typename Body>
+static int count_passing_ranks(int n_ranks, Body body) {
+    std::vector<pid_t> pids;
+    for (int rank = 0; rank < n_ranks; rank++) {
+        const pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            return 0;
+        }
+        if (pid == 0) {
+            _exit(body(rank) ? 0 : 1);
+        }
+        pids.push_back(pid);
+    }
+
+    // Reap the children in the order of exiting, so that an exited rank does not remain as a zombie, which
+    // would look alive to its peers
+    // 終了した順に子を回収する. 終了したランクがゾンビとして残ると, 相手からは生きているように見える
+    int n_passed = 0;
+    for (size_t i = 0; i < pids.size(); i++) {
+        int status = 0;
+        if (waitpid(-1, &status, 0) >= 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+            n_passed++;
+        }
+    }
+    return n_passed;
+}
+
+template <typename Body>
+static bool run_ranks(int n_ranks, Body body) {
+    return count_passing_ranks(n_ranks, body) == n_ranks;
+}
+
+static bool test_collectives(const TestOptions &options, int rank) {
+    auto transport = connect(options, rank);
+
+    // More values than a message holds, so that the pieces and the ring buffer wrap around
+    // メッセージに収まるより多くの値. 分割とリングバッファの折り返しが起こる
+    const int n = 3 * (int)(AbstractTransport::message_bytes / sizeof(Scalar)) + 7;
+    std::vector<Scalar> data(n), scratch(AbstractTransport::message_bytes / sizeof(Scalar));
+    for (int i = 0; i < n; i++) {
+        data[i] = (Scalar)(rank + 1) + i;
+    }
+    if (!ring_all_reduce(*transport, data.data(), n, scratch.data())) {
+        fprintf(stderr, "rank %d: all-reduce failed\n", rank);
+        return false;
+    }
+    const int N = options.n_ranks;
+    for (int i = 0; i < n; i++) {
+        if (data[i] != (Scalar)(N * (N + 1) / 2) + (Scalar)N * i) {
+            fprintf(stderr, "rank %d: all-reduce gives %g at %d\n", rank, data[i], i);
+            return false;
+        }
+    }
+
+    for (int i = 0; i < n; i++) {
+        data[i] = rank == 0 ? (Scalar)i : -1.0;
+    }
+    if (!ring_broadcast(*transport, data.data(), n)) {
+        fprintf(stderr, "rank %d: broadcast failed\n", rank);
+        return false;
+    }
+    for (int i = 0; i < n; i++) {
+        if (data[i] != (Scalar)i) {
+            fprintf(stderr, "rank %d: broadcast gives %g at %d\n", rank, data[i], i);
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Train the network of "mlp_builder" for "n_steps" steps on the batch of rank "rank", whose rank 0 writes the
+ * initial parameters to "initial". If "rank" is negative, the batches of all the ranks are trained at once
+ * from "initial" as the reference. The final parameters are written to the slot of the rank in "final",
+ * where the reference takes the last one.
+ * "mlp_builder"のネットワークをランク"rank"のバッチで"n_steps"ステップ学習する. ランク0は初期の
+ * パラメータを"initial"に書き込む. "rank"が負の場合は基準として全ランクのバッチを"initial"から一度に
+ * 学習する. 最後のパラメータを"final"のランクの位置に書き込む. 基準は最後の位置を使う
+ */
+static bool train(const TestOptions &options, int rank, Scalar *initial, Scalar *final) {
+    set_parallel_thread_count(1);
+    auto network = mlp_builder<Scalar>().build();
+    if (!network) {
+        return false;
+    }
+    NLLLossT<Scalar> criterion;
+    MomentumSGDT<Scalar, Scalar> optimizer(0.01, 0.9);
+    Matrix data, labels;
+
+    if (rank >= 0) {
+        auto transport = connect(options, rank);
+        DistributedTrainerT<Scalar> trainer(*network, criterion, optimizer, *transport);
+        trainer.plan(batchsize, n_features);
+        const auto &flat = network->flat_parameters();
+        if ((size_t)flat.size() > max_params) {
+            fprintf(stderr, "rank %d: %zu parameters do not fit in the shared memory\n", rank, (size_t)flat.size());
+            return false;
+        }
+        if (rank == 0) {
+            std::copy_n(flat.values->data(), flat.size(), initial);
+        }
+        for (int step = 0; step < n_steps; step++) {
+            make_batch(rank, step, data, labels);
+            trainer.step(data, labels);
+        }
+        std::copy_n(flat.values->data(), flat.size(), final + rank * max_params);
+        return true;
+    }
+
+    const int N = options.n_ranks;
+    network->plan(N * batchsize, n_features, &criterion);
+    const auto &flat = network->flat_parameters();
+    std::copy_n(initial, flat.size(), flat.values->data());
+    optimizer.attach(flat);
+    Matrix all_data(N * batchsize, n_features), all_labels(N * batchsize, n_classes);
+    for (int step = 0; step < n_steps; step++) {
+        for (int r = 0; r < N; r++) {
+            make_batch(r, step, data, labels);
+            all_data.middleRows(r * batchsize, batchsize) = data;
+            all_labels.middleRows(r * batchsize, batchsize) = labels;
+        }
+        criterion.forward(network->forward(all_data), all_labels);
+        network->backward(criterion.backward());
+        optimizer.step();
+    }
+    std::copy_n(flat.values->data(), flat.size(), final + N * max_params);
+    return true;
+}
+
+static bool test_training(const TestOptions &options) {
+    // Initial parameters and the final ones of the ranks and of the reference in memory shared with the
+    // children, which are zero-filled, so that the unused tail of each slot compares equal
+    // 子と共有するメモリ上の, 初期のパラメータと各ランクおよび基準の最後のパラメータ. ゼロで埋められて
+    // いるので, 各位置の使われない末尾は等しくなる
+    const size_t n_params = max_params;
+    const size_t count = n_params * (options.n_ranks + 2);
+    void *shared = mmap(nullptr, count * sizeof(Scalar), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        perror("mmap");
+        return false;
+    }
+    Scalar *initial = (Scalar *)shared;
+    Scalar *final = initial + n_params;
+
+    bool ok = run_ranks(options.n_ranks, [&](int rank) { return train(options, rank, initial, final); }) &&
+              run_ranks(1, [&](int) { return train(options, -1, initial, final); });
+    for (int rank = 0; ok && rank < options.n_ranks; rank++) {
+        double error = 0.0;
+        for (size_t i = 0; i < n_params; i++) {
+            error = std::max(error, std::abs(final[rank * n_params + i] - final[options.n_ranks * n_params + i]));
+            if (final[rank * n_params + i] != final[i]) {
+                fprintf(stderr, "rank %d: parameter %zu differs from rank 0\n", rank, i);
+                ok = false;
+                break;
+            }
+        }
+        if (error > tolerance) {
+            fprintf(stderr, "rank %d: parameters differ from the reference by %g\n", rank, error);
+            ok = false;
+        }
+    }
+    munmap(shared, count * sizeof(Scalar));
+    return ok;
+}
+
+/**
+ * Rank 1 exits right after connecting, and rank 0 must see "recv" fail, and "send" fail once the buffer of
+ * rank 1 is full
+ * ランク1は接続直後に終了し, ランク0では"recv"が失敗し, ランク1のバッファが一杯になると"send"が失敗
+ * しなければならない
+ */
+static bool test_lost_peer(const TestOptions &options, int rank) {
+    auto transport = connect(options, rank);
+    if (rank != 0) {
+        return true;
+    }
+    std::vector<uint8_t> message(AbstractTransport::message_bytes);
+    if (transport->recv(message.data(), message.size())) {
+        fprintf(stderr, "recv from a lost peer succeeded\n");
+        return false;
+    }
+    for (int i = 0; i < 1024; i++) {
+        if (!transport->send(message.data(), message.size())) {
+            return true;
+        }
+    }
+    fprintf(stderr, "send to a lost peer succeeded\n");
+    return false;
+}
+
+/**
+ * Ranks 0 and 1 of a ring of 3 start without rank 2. Rank 1 cannot connect to rank 2, and rank 0 is never
+ * accepted by it, so that both of them must exit with an error after the connection timeout instead of hanging.
+ * 3ランクのリングのうちランク0と1だけがランク2なしで起動する. ランク1はランク2に接続できず, ランク0は
+ * ランク2から接続されないので, どちらも停止せずに接続のタイムアウト後にエラーで終了しなければならない
+ */
+static bool test_missing_peer(const TestOptions &options) {
+    return count_passing_ranks(options.n_ranks - 1, [&](int rank) {
+               AbstractTransport::set_connect_timeout(std::chrono::milliseconds(500));
+               connect(options, rank);
+               fprintf(stderr, "rank %d: connected without rank %d\n", rank, options.n_ranks - 1);
+               return true;
+           }) == 0;
+}
+
+static bool run(const TestOptions &options, const char *name, bool ok) {
+    printf("%-4s N = %d  %-12s %s\n", options.transport.c_str(), options.n_ranks, name, ok ? "OK" : "FAILED");
+    fflush(stdout);
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    std::vector<std::string> transports = { "shm", "tcp" };
+    if (argc > 1) {
+        transports = { argv[1] };
+    }
+    // Ports are shifted by the process ID, so that concurrent runs do not collide
+    // 同時の実行が衝突しないよう, ポートはプロセスIDでずらす
+    int port = 20000 + (int)(getpid() % 2000) * 16;
+    bool ok = true;
+    for (const std::string &transport : transports) {
+        for (int n_ranks = 2; n_ranks <= 4; n_ranks++) {
+            TestOptions options;
+            options.transport = transport;
+            options.n_ranks = n_ranks;
+            options.port = port++;
+            ok &= run(options, "collective",
+                      run_ranks(n_ranks, [&](int rank) { return test_collectives(options, rank); }));
+            options.port = port++;
+            ok &= run(options, "training", test_training(options));
+        }
+        TestOptions options;
+        options.transport = transport;
+        options.n_ranks = 2;
+        options.port = port++;
+        ok &= run(options, "lost peer", run_ranks(2, [&](int rank) { return test_lost_peer(options, rank); }));
+        options.n_ranks = 3;
+        options.port = port++;
+        ok &= run(options, "missing peer", test_missing_peer(options));
+    }
+    return ok ? 0 : 1;
+}
+
+#else
+
+int main() {
+    printf("Transports are not supported on this platform\n");
+    return 0;
+}
+
+#endif
@@ -0,0 +1,338 @@
+#ifdef _MSC_VER
+#pragma once
+#endif
+
+#ifndef _WORKSPACE_H_
+#define _WORKSPACE_H_
+
+#include <new>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <algorithm>
+
+#include "common.h"
+
+// -----------------------------------------------------------------------------
+// Heap allocation counter
+// -----------------------------------------------------------------------------
+
+/**
+ * Counter of heap allocations. A program counts allocations by calling "count_heap_allocation" from its
+ * replacements of the allocation functions (see "main.cpp").
+ * ヒープ確保の回数のカウンタ. プログラムは置き換えたメモリ確保関数から"count_heap_allocation"を呼んで
+ * 確保を数える ("main.cpp"を参照)
+ */
+inline std::atomic<long long> &heap_allocation_counter() {
+    static std::atomic<long long> counter(0);
+    return counter;
+}
+
+inline void count_heap_allocation() {
+    heap_allocation_counter().fetch_add(1, std::memory_order_relaxed);
+}
+
+inline long long heap_allocation_count() {
+    return heap_allocation_counter().load(std::memory_order_relaxed);
+}
+
+// -----------------------------------------------------------------------------
+// Buffer
+// -----------------------------------------------------------------------------
+
+/**
+ * Matrix view whose storage is either a slice of a workspace arena or owned by the buffer. Resizing within
+ * the capacity only changes the shape, and owned storage is grown only when it is too small.
+ * The largest size ever requested is recorded, so that a dry run tells the size of the slice to place.
+ * 作業領域のアリーナの一部, またはバッファ自身が所有する領域を参照する行列のビュー. 容量内のリサイズは
+ * 形状を変えるだけで, 所有する領域は不足した場合にのみ拡張する.
+ * 要求された最大の大きさを記録するので, 試行により配置すべき領域の大きさがわかる
+ */
+template <typename Scalar>
+class BufferT : public Eigen::Map<MatrixT<Scalar>>, private Uncopyable {
+public:
+    using Matrix = MatrixT<Scalar>;
+    using Map = Eigen::Map<Matrix>;
+    using Vector = Eigen::Matrix<Scalar, Eigen::Dynamic, 1>;
+
+    BufferT()
+        : Map(nullptr, 0, 0) {
+    }
+
+    /**
+     * Shape the buffer as a "rows x cols" matrix. Contents are not initialized.
+     * バッファを"rows x cols"の行列とする. 中身は初期化されない
+     */
+    void resize(Eigen::Index rows, Eigen::Index cols) {
+        const Eigen::Index size = rows * cols;
+        peak_ = std::max(peak_, size);
+        if (size > capacity_) {
+            arena_.reset();
+            owned_.resize(size);
+            storage_ = owned_.data();
+            capacity_ = size;
+        }
+        new (static_cast<Map *>(this)) Map(storage_, rows, cols);
+    }
+
+    template <typename Derived>
+    BufferT &operator=(const Eigen::MatrixBase<Derived> &other) {
+        resize(other.rows(), other.cols());
+        Map::operator=(other);
+        return *this;
+    }
+
+    /**
+     * Use "capacity" elements from "offset" of "arena" as the storage. Owned storage is released.
+     * "arena"の"offset"から"capacity"個の要素を領域として使う. 所有していた領域は解放する
+     */
+    void bind(const std::shared_ptr<Vector> &arena, Eigen::Index offset, Eigen::Index capacity) {
+        arena_ = arena;
+        owned_ = Vector();
+        storage_ = arena->data() + offset;
+        capacity_ = capacity;
+        new (static_cast<Map *>(this)) Map(storage_, 0, 0);
+    }
+
+    /**
+     * View the storage of "other" instead, so that a layer can compute its output in place of its input.
+     * The buffer does not own nor record the size of the storage, and the next "resize" returns to its own.
+     * 代わりに"other"の領域を参照し, レイヤーが入力の場所で出力を計算できるようにする. バッファは領域を
+     * 所有せず大きさも記録しない. 次の"resize"で自身の領域に戻る
+     */
+    void share(Map &other) {
+        new (static_cast<Map *>(this)) Map(other.data(), other.rows(), other.cols());
+    }
+
+    Eigen::Index peak() const {
+        return peak_;
+    }
+
+    /**
+     * Forget the sizes requested so far, so that the next dry run alone tells the size of the slice
+     * これまでに要求された大きさを忘れ, 次の試行だけで区間の大きさが決まるようにする
+     */
+    void reset_peak() {
+        peak_ = 0;
+    }
+
+private:
+    std::shared_ptr<Vector> arena_ = nullptr;
+    Vector owned_ = {};
+    Scalar *storage_ = nullptr;
+    Eigen::Index capacity_ = 0;
+    Eigen::Index peak_ = 0;
+};
+
+/**
+ * Place "buffers" in a single arena, giving each of them a slice as large as its peak size. Slices start
+ * at cache line boundaries. Returns the size of the arena in bytes.
+ * "buffers"を1つのアリーナに配置し, それぞれに最大の大きさの区間を割り当てる. 区間はキャッシュラインの
+ * 境界から始まる. アリーナのバイト数を返す
+ */
+template <typename Scalar>
+inline size_t place_in_arena(const std::vector<BufferT<Scalar> *> &buffers) {
+    using Vector = typename BufferT<Scalar>::Vector;
+    const Eigen::Index align = std::max<Eigen::Index>(1, 64 / (Eigen::Index)sizeof(Scalar));
+
+    std::vector<Eigen::Index> offsets(buffers.size());
+    Eigen::Index total = 0;
+    for (size_t i = 0; i < buffers.size(); i++) {
+        offsets[i] = total;
+        total += (buffers[i]->peak() + align - 1) / align * align;
+    }
+
+    auto arena = std::make_shared<Vector>(Vector::Zero(std::max<Eigen::Index>(total, 1)));
+    for (size_t i = 0; i < buffers.size(); i++) {
+        buffers[i]->bind(arena, offsets[i], buffers[i]->peak());
+    }
+    return (size_t)total * sizeof(Scalar);
+}
+
+// -----------------------------------------------------------------------------
+// Parameter
+// -----------------------------------------------------------------------------
+
+/**
+ * Matrix view of a trainable parameter, whose storage is either owned by the parameter, shared with another
+ * parameter, or external memory (e.g., a memory-mapped checkpoint). The storage is kept alive by a shared
+ * pointer. Copies own their storage as "Matrix".
+ * 学習可能なパラメータの行列のビュー. 領域はパラメータ自身が所有するか, 他のパラメータと共有するか, 外部の
+ * メモリ (メモリマップしたチェックポイントなど) である. 領域は共有ポインタにより保持する. コピーは"Matrix"と
+ * 同様に領域を所有する
+ */
+template <typename Scalar>
+class ParameterT : public Eigen::Map<MatrixT<Scalar>> {
+public:
+    using Matrix = MatrixT<Scalar>;
+    using Map = Eigen::Map<Matrix>;
+    using Vector = Eigen::Matrix<Scalar, Eigen::Dynamic, 1>;
+
+    ParameterT()
+        : Map(nullptr, 0, 0) {
+    }
+
+    ParameterT(Eigen::Index rows, Eigen::Index cols)
+        : Map(nullptr, 0, 0) {
+        resize(rows, cols);
+    }
+
+    ParameterT(const ParameterT &other)
+        : Map(nullptr, 0, 0) {
+        *this = other;
+    }
+
+    ParameterT &operator=(const ParameterT &other) {
+        resize(other.rows(), other.cols());
+        Map::operator=(other);
+        return *this;
+    }
+
+    template <typename Derived>
+    ParameterT &operator=(const Eigen::MatrixBase<Derived> &other) {
+        resize(other.rows(), other.cols());
+        Map::operator=(other);
+        return *this;
+    }
+
+    /**
+     * Shape the parameter as a "rows x cols" matrix. The storage is kept if the size is the same, and is
+     * replaced with owned storage otherwise. Contents are not initialized.
+     * パラメータを"rows x cols"の行列とする. 大きさが同じであれば領域はそのままで, そうでなければ所有する
+     * 領域に置き換える. 中身は初期化されない
+     */
+    void resize(Eigen::Index rows, Eigen::Index cols) {
+        Scalar *data = this->data();
+        if (rows * cols != this->size()) {
+            auto owned = std::make_shared<Vector>(rows * cols);
+            data = owned->data();
+            storage_ = owned;
+            external_ = false;
+        }
+        new (static_cast<Map *>(this)) Map(data, rows, cols);
+    }
+
+    /**
+     * Use external "data" as the storage, which stays valid while "keeper" is alive
+     * 外部の"data"を領域として使う. "keeper"が存在する間"data"は有効である
+     */
+    void bind(Scalar *data, Eigen::Index rows, Eigen::Index cols, const std::shared_ptr<const void> &keeper) {
+        storage_ = keeper;
+        external_ = true;
+        new (static_cast<Map *>(this)) Map(data, rows, cols);
+    }
+
+    /**
+     * Use the storage of "other", so that updates of either parameter are seen by both
+     * "other"の領域を使う. どちらのパラメータの更新も両方から見える
+     */
+    void share(ParameterT &other) {
+        bind(other.data(), other.rows(), other.cols(), other.storage_);
+    }
+
+    bool external() const {
+        return external_;
+    }
+
+private:
+    std::shared_ptr<const void> storage_ = nullptr;
+    bool external_ = false;
+};
+
+/**
+ * Parameter with its gradient and its name in checkpoints, listed by the layers
+ * レイヤーが列挙する, 勾配とチェックポイントでの名前をもつパラメータ
+ */
+template <typename Scalar>
+struct NamedParameterT {
+    const char *name;
+    ParameterT<Scalar> *value;
+    ParameterT<Scalar> *gradient;
+};
+
+/**
+ * Flat buffers holding the values and the gradients of all the parameters of a network contiguously, so that
+ * optimizers and all-reduces make a single pass over them. Each parameter starts at the same cache line
+ * boundary offset in both buffers, and the padding in between stays zero.
+ * ネットワークの全パラメータの値と勾配を連続して保持する平坦なバッファ. 最適化手法やall-reduceはこれを
+ * 1回で走査する. 各パラメータは両方のバッファで同じキャッシュライン境界のオフセットから始まり, 間の
+ * 詰め物はゼロのままである
+ */
+template <typename Scalar>
+struct FlatParametersT {
+    using Vector = typename ParameterT<Scalar>::Vector;
+
+    std::shared_ptr<Vector> values = nullptr;
+    std::shared_ptr<Vector> gradients = nullptr;
+
+    Eigen::Index size() const {
+        return values ? values->size() : 0;
+    }
+    //! Offset of a parameter placed in the buffers
+    Eigen::Index offset(const ParameterT<Scalar> &param) const {
+        return (Eigen::Index)(param.data() - values->data());
+    }
+};
+
+/**
+ * Move the values and the gradients of "params" to flat buffers, and bind the parameters to them. The values
+ * are copied, and the gradients are initialized with zeros.
+ * "params"の値と勾配を平坦なバッファに移し, パラメータをそれに結び付ける. 値はコピーし, 勾配はゼロで
+ * 初期化する
+ */
+template <typename Scalar>
+inline FlatParametersT<Scalar> place_parameters(const std::vector<NamedParameterT<Scalar>> &params) {
+    using Vector = typename FlatParametersT<Scalar>::Vector;
+    const Eigen::Index align = std::max<Eigen::Index>(1, 64 / (Eigen::Index)sizeof(Scalar));
+
+    std::vector<Eigen::Index> offsets(params.size());
+    Eigen::Index total = 0;
+    for (size_t i = 0; i < params.size(); i++) {
+        offsets[i] = total;
+        total += (params[i].value->size() + align - 1) / align * align;
+    }
+
+    FlatParametersT<Scalar> flat;
+    flat.values = std::make_shared<Vector>(Vector::Zero(total));
+    flat.gradients = std::make_shared<Vector>(Vector::Zero(total));
+    for (size_t i = 0; i < params.size(); i++) {
+        ParameterT<Scalar> &value = *params[i].value;
+        ParameterT<Scalar> &gradient = *params[i].gradient;
+        Assertion(gradient.rows() == value.rows() && gradient.cols() == value.cols(),
+                  "gradient shape mismatch!!");
+        const Eigen::Index rows = value.rows();
+        const Eigen::Index cols = value.cols();
+        Scalar *data = flat.values->data() + offsets[i];
+        Eigen::Map<MatrixT<Scalar>>(data, rows, cols) = value;
+        value.bind(data, rows, cols, flat.values);
+        gradient.bind(flat.gradients->data() + offsets[i], rows, cols, flat.gradients);
+    }
+    return flat;
+}
+
+// -----------------------------------------------------------------------------
+// View
+// -----------------------------------------------------------------------------
+
+/**
+ * Non-owning read-only view of a matrix, e.g., the output of the previous layer. The viewed matrix must stay
+ * alive and unchanged while the view is used.
+ * 行列 (前のレイヤーの出力など) を所有せずに参照する読み出し専用のビュー. 参照している行列は, ビューを
+ * 使う間は存在し, かつ変更されないままでなければならない
+ */
+template <typename Scalar>
+class ViewT : public Eigen::Map<const MatrixT<Scalar>, 0, Eigen::OuterStride<>> {
+public:
+    using Map = Eigen::Map<const MatrixT<Scalar>, 0, Eigen::OuterStride<>>;
+
+    ViewT()
+        : Map(nullptr, 0, 0, Eigen::OuterStride<>(0)) {
+    }
+
+    void bind(const MatrixRefT<Scalar> &matrix) {
+        new (static_cast<Map *>(this)) Map(matrix.data(), matrix.rows(), matrix.cols(),
+                                           Eigen::OuterStride<>(matrix.outerStride()));
+    }
+};
+
+#endif  // _WORKSPACE_H_